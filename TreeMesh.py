@@ -1,8 +1,7 @@
 from discretize.TensorMesh import BaseTensorMesh
 from discretize.InnerProducts import InnerProducts
-from tree_ext import _TreeMesh
+from tree_ext import _TreeMesh, read_mesh_file
 import numpy as np
-from scipy.spatial import Delaunay
 import scipy.sparse as sp
 from discretize import utils
 
@@ -84,6 +83,15 @@ class TreeMesh(_TreeMesh, BaseTensorMesh, InnerProducts):
 
         return self._cellGradStencil
 
+    def _clear_cache(self):
+        # The operators built here go stale along with the ones in _TreeMesh
+        _TreeMesh._clear_cache(self)
+        for name in ['_cellGradStencil', '_cellGrad', '_cellGradScale',
+                     '_cellGradx', '_cellGrady', '_cellGradz',
+                     '_faceDivx', '_faceDivy', '_faceDivz',
+                     '_aveCC2Fx', '_aveCC2Fy', '_aveCC2Fz']:
+            setattr(self, name, None)
+
     @property
     def cellGrad(self):
         """
@@ -120,6 +128,28 @@ class TreeMesh(_TreeMesh, BaseTensorMesh, InnerProducts):
 
         return self._cellGrad
 
+    def apply(self, name, x, transpose=False):
+        """
+        Applies an operator to x without building its matrix, see
+        _TreeMesh.apply. cellGrad is applied as in cellGrad, through the
+        transpose of faceDiv, keeping only the diagonal of -Pi * MfI.
+        """
+        if name != 'cellGrad':
+            return _TreeMesh.apply(self, name, x, transpose)
+        if getattr(self, '_cellGradScale', None) is None:
+            indBoundary = np.ones(self.nC, dtype=float)
+            aves = ['aveFx2CC', 'aveFy2CC'] + (['aveFz2CC'] if self.dim == 3 else [])
+            Pi = np.concatenate([
+                self.apply_transpose(ave, indBoundary) >= 1 for ave in aves
+            ])
+            MfI = self.getFaceInnerProduct(invMat=True)
+            self._cellGradScale = -(Pi * MfI.diagonal())
+        x = np.asarray(x, dtype=float)
+        scale = self._cellGradScale
+        if transpose:
+            return (self.vol * _TreeMesh.apply(self, 'faceDiv', (scale * x.T).T).T).T
+        return (scale * _TreeMesh.apply(self, 'faceDiv', (self.vol * x.T).T, True).T).T
+
     @property
     def cellGradx(self):
         """
@@ -220,74 +250,14 @@ class TreeMesh(_TreeMesh, BaseTensorMesh, InnerProducts):
     def aveCC2Fx(self):
         "Construct the averaging operator on cell centers to cell x-faces."
         if getattr(self, '_aveCC2Fx', None) is None:
-            tri = Delaunay(self.gridCC)
-            gridF = self.gridFx
-            simplexes = tri.find_simplex(gridF)
-            nd = self.dim
-            ns = nd+1
-            nf = self.nFx
-            I = np.zeros(nf*ns, dtype=np.int64)
-            J = np.zeros(nf*ns, dtype=np.int64)
-            V = np.zeros(nf*ns, dtype=np.float64)
-
-            simp = tri.simplices[simplexes]
-            trans = tri.transform[simplexes]
-            shift = gridF-trans[:, nd]
-            bs = np.einsum('ikj,ij->ik', trans[:, :nd], shift)
-            bs = np.c_[bs, 1-bs.sum(axis=1)]
-
-            I = np.zeros(nf*ns, dtype=np.int64)
-            J = np.zeros(nf*ns, dtype=np.int64)
-            V = np.zeros(nf*ns, dtype=np.float64)
-            for i in range(nf):
-                I[ns*i: ns*i+ns] = i
-                if simplexes[i] == -1:
-                    # Extrapolating.... from nearest cell
-                    ic = self._get_containing_cell_index(gridF[i])
-                    J[ns*i] = ic
-                    V[ns*i] = 1.0
-                    # rest are zeros from definition of J and V
-                else:
-                    J[ns*i:ns*i+ns] = simp[i]
-                    V[ns*i:ns*i+ns] = bs[i]
-            self._aveCC2Fx = sp.csr_matrix((V, (I, J)))
+            self._aveCC2Fx = self.getInterpolationMat(self.gridFx, 'CC')
         return self._aveCC2Fx
 
     @property
     def aveCC2Fy(self):
         "Construct the averaging operator on cell centers to cell y-faces."
         if getattr(self, '_aveCC2Fy', None) is None:
-            tri = Delaunay(self.gridCC)
-            gridF = self.gridFy
-            simplexes = tri.find_simplex(gridF)
-            nd = self.dim
-            ns = nd+1
-            nf = self.nFy
-            I = np.zeros(nf*ns, dtype=np.int64)
-            J = np.zeros(nf*ns, dtype=np.int64)
-            V = np.zeros(nf*ns, dtype=np.float64)
-
-            simp = tri.simplices[simplexes]
-            trans = tri.transform[simplexes]
-            shift = gridF-trans[:, nd]
-            bs = np.einsum('ikj,ij->ik', trans[:, :nd], shift)
-            bs = np.c_[bs, 1-bs.sum(axis=1)]
-
-            I = np.zeros(nf*ns, dtype=np.int64)
-            J = np.zeros(nf*ns, dtype=np.int64)
-            V = np.zeros(nf*ns, dtype=np.float64)
-            for i in range(nf):
-                I[ns*i: ns*i+ns] = i
-                if simplexes[i] == -1:
-                    # Extrapolating.... from nearest cell
-                    ic = self._get_containing_cell_index(gridF[i])
-                    J[ns*i] = ic
-                    V[ns*i] = 1.0
-                    # rest are zeros from definition of J and V
-                else:
-                    J[ns*i:ns*i+ns] = simp[i]
-                    V[ns*i:ns*i+ns] = bs[i]
-            self._aveCC2Fy = sp.csr_matrix((V, (I, J)))
+            self._aveCC2Fy = self.getInterpolationMat(self.gridFy, 'CC')
         return self._aveCC2Fy
 
     @property
@@ -296,47 +266,12 @@ class TreeMesh(_TreeMesh, BaseTensorMesh, InnerProducts):
         if self.dim == 2:
             raise Exception('TreeMesh has no z-faces in 2D')
         if getattr(self, '_aveCC2Fz', None) is None:
-            tri = Delaunay(self.gridCC)
-            gridF = self.gridFz
-            simplexes = tri.find_simplex(gridF)
-            nd = self.dim
-            ns = nd+1
-            nf = self.nFz
-            I = np.zeros(nf*ns, dtype=np.int64)
-            J = np.zeros(nf*ns, dtype=np.int64)
-            V = np.zeros(nf*ns, dtype=np.float64)
-
-            simp = tri.simplices[simplexes]
-
-            trans = tri.transform[simplexes]
-            shift = gridF-trans[:, nd]
-            bs = np.einsum('ikj,ij->ik', trans[:, :nd], shift)
-            bs = np.c_[bs, 1-bs.sum(axis=1)]
-
-            I = np.zeros(nf*ns, dtype=np.int64)
-            J = np.zeros(nf*ns, dtype=np.int64)
-            V = np.zeros(nf*ns, dtype=np.float64)
-            for i in range(nf):
-                I[ns*i: ns*i+ns] = i
-                if simplexes[i] == -1:
-                    # Extrapolating.... from nearest cell
-                    ic = self._get_containing_cell_index(gridF[i])
-                    J[ns*i] = ic
-                    V[ns*i] = 1.0
-                    # rest are zeros from definition of J and V
-                else:
-                    J[ns*i:ns*i+ns] = simp[i]
-                    V[ns*i:ns*i+ns] = bs[i]
-            self._aveCC2Fz = sp.csr_matrix((V, (I, J)))
+            self._aveCC2Fz = self.getInterpolationMat(self.gridFz, 'CC')
         return self._aveCC2Fz
 
     def point2index(self, locs):
         locs = utils.asArray_N_x_Dim(locs, self.dim)
-
-        inds = np.empty(locs.shape[0], dtype=np.int64)
-        for ind, loc in enumerate(locs):
-            inds[ind] = self._get_containing_cell_index(loc)
-        return inds
+        return self._get_containing_cell_indexes(locs)
 
     @classmethod
     def readUBC(self, meshFile):
@@ -346,48 +281,62 @@ class TreeMesh(_TreeMesh, BaseTensorMesh, InnerProducts):
         :rtype: discretize.TreeMesh
         :return: The octree mesh
         """
-        fileLines = np.genfromtxt(meshFile, dtype=str,
-                                  delimiter='\n', comments='!')
-        nCunderMesh = np.array(fileLines[0].split('!')[0].split(), dtype=int)
-        nCunderMesh = nCunderMesh[0:3]
-
-        tswCorn = np.array(
-            fileLines[1].split('!')[0].split(),
-            dtype=float
-        )
-        smallCell = np.array(
-            fileLines[2].split('!')[0].split(),
-            dtype=float
-        )
-        # Read the index array
-        indArr = np.genfromtxt((line.encode('utf8') for line in fileLines[4::]),
-                               dtype=np.int)
+        # Only the header is read here, the cells are streamed into the tree
+        header = []
+        with open(meshFile) as f:
+            for line in f:
+                line = line.split('!')[0].split()
+                if line:
+                    header.append(line)
+                if len(header) == 3:
+                    break
+        nCunderMesh = np.array(header[0], dtype=int)[0:3]
+        tswCorn = np.array(header[1], dtype=float)
+        smallCell = np.array(header[2], dtype=float)
 
         h1, h2, h3 = [np.ones(nr)*sz for nr, sz in zip(nCunderMesh, smallCell)]
         x0 = tswCorn - np.array([0, 0, np.sum(h3)])
 
         max_level = int(np.log2(nCunderMesh[0]))
         mesh = TreeMesh([h1, h2, h3], x0=x0, levels=max_level)
+        mesh._read_ubc_cells(meshFile)
+        mesh.number()
+        return mesh
 
-        # Convert indArr to points in coordinates of underlying cpp tree
-        # indArr is ix, iy, iz(top-down) need it in ix, iy, iz (bottom-up)
-        indArr[:, :-1] -= 1 #shift by 1....
-        indArr[:, :-1] = 2*indArr[:, :-1] + indArr[:, -1, None]
-        indArr[:, 2] = (2<<max_level) - indArr[:, 2]
-
-        indArr[:, -1] = max_level-np.log2(indArr[:, -1])
-
-        #convert indArr to list of points
-        levels = indArr[:, -1]
-
-        xs, ys, zs = mesh._get_xs()
-
-        points = np.column_stack((xs[indArr[:,0]], ys[indArr[:,1]], zs[indArr[:,2]]))
-
-        mesh._insert_cells(points, levels)
+    @classmethod
+    def readBinary(self, fileName):
+        """Read a mesh written by writeBinary
+
+        The tree is rebuilt from the leaves in the file. When it was written
+        with tables (by a build with the same key order), the geometry and
+        connectivity arrays (gridCC, cell_nodes, ...) are then read straight
+        from the memory mapped file instead of being gathered from the
+        tree, until the mesh changes. The operators are still built from the
+        tree.
+        :param str fileName: path to the binary mesh file
+        :rtype: discretize.TreeMesh
+        :return: The tree mesh
+        """
+        header, sections = read_mesh_file(fileName)
+        grids = [sections[name] for name in ['xs', 'ys', 'zs'][:header['n_dim']]]
+        # the grids are in half cells, every other value is a node
+        h = [np.diff(grid[::2]) for grid in grids]
+        x0 = np.array([grid[0] for grid in grids])
+
+        mesh = TreeMesh(h, x0=x0, levels=header['max_level'])
+        mesh._build_from_leaves(sections['leaf_codes'], sections['leaf_levels'])
         mesh.number()
+        mesh._use_tables(header, sections)
         return mesh
 
+    def writeBinary(mesh, fileName, tables=True):
+        """Write the mesh to a binary file that can be memory mapped
+        :param str fileName: File to write to
+        :param bool tables: also write the numbered node, edge and face tables
+        """
+        mesh.number()
+        mesh._write_mesh_file(fileName, tables)
+
     def readModelUBC(mesh, fileName):
         """Read UBC OcTree model and get vector
         :param string fileName: path to the UBC GIF model file to read
@@ -426,11 +375,6 @@ class TreeMesh(_TreeMesh, BaseTensorMesh, InnerProducts):
         smallCell = np.array([h.min() for h in mesh.h])
         nrCells = mesh.nC
 
-        indArr = mesh._ubc_indArr
-        ubc_order = mesh._ubc_order
-
-        indArr = indArr[ubc_order]
-
         # Write the UBC octree mesh file
         head = (
             '{:.0f} {:.0f} {:.0f}\n'.format(
@@ -442,16 +386,17 @@ class TreeMesh(_TreeMesh, BaseTensorMesh, InnerProducts):
             '{:.3f} {:.3f} {:.3f}\n'.format(
                 smallCell[0], smallCell[1], smallCell[2]
             ) +
-            '{:.0f}'.format(nrCells)
+            '{:.0f}\n'.format(nrCells)
         )
-        np.savetxt(fileName, indArr, fmt='%i', header=head, comments='')
+        mesh._write_ubc_cells(fileName, head)
 
         # Print the models
         # Assign the model('s) to the object
         if models is not None:
-            for item in six.iteritems(models):
+            ubc_order = mesh._ubc_order
+            for item in models.items():
                 # Save the data
-                np.savetxt(item[0], item[1][ubcReorder], fmt='%3.5e')
+                np.savetxt(item[0], item[1][ubc_order], fmt='%3.5e')
 
 
     def writeVTK(self, fileName, models=None):
@@ -0,0 +1,300 @@
+"""Builds and runs tree_bench over synthetic meshes and thread counts.
+
+Every (dimension, mesh, thread count) runs in a process of its own, so the
+peak RSS reported is that of one mesh. The results are printed as a table,
+with the speedup of each phase over the smallest thread count, and can be
+written out as JSON, saved as a baseline, or checked against one:
+
+    python benchmarks/run_benchmarks.py --quick
+    python benchmarks/run_benchmarks.py --save-baseline
+    python benchmarks/run_benchmarks.py --check
+
+A phase regresses when it is more than --tolerance slower (or its peak RSS
+larger) than in the baseline. Phases under --min-seconds in both are too
+short to time reliably and are left out of the check. Baselines only mean
+something on the machine they were taken on, and runs on more threads than
+that machine had cores are left out too: they were oversubscribed when the
+baseline was taken, so they say nothing about how the threads scale. Take
+the baseline on a machine with as many cores as the thread counts checked.
+
+With --scaling it instead times the refinement of the sphere meshes on 1, 2,
+4, ... threads up to all cores, once with the cheap refinement function and
+once with one made --test-work cosines per cell more expensive, and prints
+the speedup and parallel efficiency of each. These are C++ functions tested
+a level at a time, as RefineCriteria are; Python functions always run on one
+thread:
+
+    python benchmarks/run_benchmarks.py --scaling --min-speedup 2
+"""
+from __future__ import print_function
+import argparse
+import json
+import multiprocessing
+import os
+import platform
+import subprocess
+import sys
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+ROOT = os.path.dirname(HERE)
+SOURCES = [os.path.join(HERE, 'tree_bench.cpp')] + [
+    os.path.join(ROOT, name) for name in
+    ['tree.cpp', 'refine.cpp', 'linear_tree.cpp', 'operators.cpp', 'stats.cpp']]
+HEADERS = [os.path.join(ROOT, name) for name in
+           ['tree.h', 'refine.h', 'linear_tree.h', 'operators.h', 'parallel.h',
+            'key_map.h', 'pool.h', 'morton.h', 'stats.h']]
+BINARY = os.path.join(HERE, 'build', 'tree_bench')
+DEFAULT_BASELINE = os.path.join(HERE, 'baselines', 'baseline.json')
+
+MESHES = ['uniform', 'sphere', 'surface', 'graded']
+# Levels giving a few hundred thousand cells per mesh, and fewer with --quick
+LEVELS = {
+    2: {'uniform': 9, 'sphere': 10, 'surface': 13, 'graded': 9},
+    3: {'uniform': 6, 'sphere': 7, 'surface': 8, 'graded': 6},
+}
+QUICK_LEVELS = {
+    2: {'uniform': 7, 'sphere': 8, 'surface': 10, 'graded': 7},
+    3: {'uniform': 5, 'sphere': 5, 'surface': 6, 'graded': 5},
+}
+
+
+def build(cxx, flags, morton_keys):
+    """Compiles tree_bench if it is missing or older than its sources"""
+    if os.path.exists(BINARY):
+        built = os.path.getmtime(BINARY)
+        if all(os.path.getmtime(f) < built for f in SOURCES+HEADERS):
+            return
+    if not os.path.isdir(os.path.dirname(BINARY)):
+        os.makedirs(os.path.dirname(BINARY))
+    command = [cxx] + flags.split() + ['-std=c++11', '-pthread', '-I', ROOT]
+    if morton_keys:
+        command.append('-DMORTON_KEYS')
+    command += SOURCES + ['-o', BINARY]
+    print(' '.join(command), file=sys.stderr)
+    subprocess.check_call(command)
+
+
+def run(dim, mesh, level, threads, repeat, n_points, test_work=None):
+    """The phases of one run of tree_bench, as dicts (only the refinement if
+    test_work is given)"""
+    command = [BINARY, str(dim), mesh, str(level), str(threads), str(repeat), str(n_points)]
+    if test_work is not None:
+        command.append(str(test_work))
+    output = subprocess.check_output(command)
+    return [json.loads(line) for line in output.decode().splitlines()
+            if line.startswith('{')]
+
+
+def key(result):
+    return '{dim}D {mesh} L{level} t{threads} {phase}'.format(**result)
+
+
+def print_table(results):
+    # speedup over the fewest threads each phase was run with
+    first = {}
+    for r in results:
+        k = (r['dim'], r['mesh'], r['level'], r['phase'])
+        if k not in first or r['threads'] < first[k]['threads']:
+            first[k] = r
+    print('{0:<4} {1:<8} {2:>8} {3:>3} {4:<32} {5:>10} {6:>12} {7:>7} {8:>9}'.format(
+        'dim', 'mesh', 'cells', 't', 'phase', 'seconds', 'rate', 'speedup', 'rss MB'))
+    for r in results:
+        base = first[(r['dim'], r['mesh'], r['level'], r['phase'])]
+        speedup = base['seconds']/r['seconds'] if r['seconds'] > 0 else 0.0
+        print('{0:<4} {1:<8} {2:>8} {3:>3} {4:<32} {5:>10.4g} {6:>12.4g} {7:>7.2f} {8:>9.1f}'.format(
+            r['dim'], r['mesh'], r['cells'], r['threads'], r['phase'], r['seconds'],
+            r['rate'], speedup, r['peak_rss_kb']/1024.0))
+
+
+def scaling_threads(n_cores):
+    """1, 2, 4, ... up to n_cores, and n_cores itself"""
+    threads = [1]
+    while threads[-1]*2 <= n_cores:
+        threads.append(threads[-1]*2)
+    return sorted(set(threads+[n_cores]))
+
+
+def print_scaling(results):
+    """Speedup and efficiency of each run over the one on a single thread"""
+    single = dict(((r['dim'], r['test_work']), r['seconds'])
+                  for r in results if r['threads'] == 1)
+    print('{0:<4} {1:<8} {2:>8} {3:>10} {4:>3} {5:>10} {6:>8} {7:>10}'.format(
+        'dim', 'mesh', 'cells', 'test_work', 't', 'seconds', 'speedup', 'efficiency'))
+    for r in results:
+        speedup = single[(r['dim'], r['test_work'])]/r['seconds'] if r['seconds'] > 0 else 0.0
+        print('{0:<4} {1:<8} {2:>8} {3:>10} {4:>3} {5:>10.4g} {6:>8.2f} {7:>10.2f}'.format(
+            r['dim'], r['mesh'], r['cells'], r['test_work'], r['threads'], r['seconds'],
+            speedup, speedup/r['threads']))
+
+
+def check_scaling(results, min_speedup):
+    """Lines describing the costly refinements that sped up less than
+    min_speedup on the most threads"""
+    slow = []
+    for dim in sorted(set(r['dim'] for r in results)):
+        runs = [r for r in results if r['dim'] == dim and r['test_work'] > 0]
+        first = min(runs, key=lambda r: r['threads'])
+        last = max(runs, key=lambda r: r['threads'])
+        speedup = first['seconds']/last['seconds'] if last['seconds'] > 0 else 0.0
+        if speedup < min_speedup:
+            slow.append('{0}D refinement on {1} threads: {2:.2f}x, below {3:.2f}x'.format(
+                dim, last['threads'], speedup, min_speedup))
+    return slow
+
+
+def check(results, baseline, tolerance, min_seconds):
+    """Lines describing the phases that got slower or larger than baseline,
+    the number of results compared, and the number left out for having more
+    threads than the baseline machine had cores"""
+    old = dict((key(r), r) for r in baseline['results'])
+    n_cores = baseline['machine']['cpu_count']
+    regressions = []
+    compared = skipped = 0
+    for r in results:
+        b = old.get(key(r))
+        if b is None:
+            continue
+        if r['threads'] > n_cores:
+            skipped += 1
+            continue
+        compared += 1
+        if (max(r['seconds'], b['seconds']) >= min_seconds
+                and r['seconds'] > b['seconds']*(1+tolerance)):
+            regressions.append('{0}: {1:.4g} s, was {2:.4g} s'.format(
+                key(r), r['seconds'], b['seconds']))
+        if r['peak_rss_kb'] > b['peak_rss_kb']*(1+tolerance):
+            regressions.append('{0}: peak RSS {1} kB, was {2} kB'.format(
+                key(r), r['peak_rss_kb'], b['peak_rss_kb']))
+    return regressions, compared, skipped
+
+
+def describe_baseline(machine):
+    return ('taken on {0} core(s) ({1}, {2}); results on more threads than that '
+            'are not checked against it'.format(
+                machine['cpu_count'], machine['machine'], machine['compiler']))
+
+
+def describe_machine(cxx):
+    try:
+        compiler = subprocess.check_output([cxx, '--version']).decode().splitlines()[0]
+    except (OSError, subprocess.CalledProcessError):
+        compiler = cxx
+    try:
+        revision = subprocess.check_output(
+            ['git', 'rev-parse', 'HEAD'], cwd=ROOT).decode().strip()
+    except (OSError, subprocess.CalledProcessError):
+        revision = None
+    return {'system': platform.system(), 'machine': platform.machine(),
+            'processor': platform.processor(), 'cpu_count': multiprocessing.cpu_count(),
+            'compiler': compiler, 'revision': revision}
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument('--dims', type=int, nargs='+', default=[2, 3])
+    parser.add_argument('--meshes', nargs='+', default=MESHES, choices=MESHES)
+    parser.add_argument('--threads', type=int, nargs='+',
+                        help='thread counts, 1 and all cores by default')
+    parser.add_argument('--quick', action='store_true', help='smaller meshes')
+    parser.add_argument('--repeat', type=int, default=3, help='best of this many')
+    parser.add_argument('--points', type=int, default=1000000,
+                        help='points to locate (interpolation takes up to 100000)')
+    parser.add_argument('--cxx', default=os.environ.get('CXX', 'c++'))
+    parser.add_argument('--flags', default='-O2')
+    parser.add_argument('--morton-keys', action='store_true',
+                        help='build with MORTON_KEYS, as TREE_MORTON_KEYS=1 does')
+    parser.add_argument('--output', help='write the results here as JSON')
+    parser.add_argument('--baseline', default=DEFAULT_BASELINE)
+    parser.add_argument('--save-baseline', action='store_true')
+    parser.add_argument('--check', action='store_true',
+                        help='exit with 1 if a phase regressed against the baseline')
+    parser.add_argument('--tolerance', type=float, default=0.5)
+    parser.add_argument('--min-seconds', type=float, default=0.005)
+    parser.add_argument('--scaling', action='store_true',
+                        help='time the threaded refinement instead, see above')
+    parser.add_argument('--test-work', type=int, default=10000,
+                        help='cost of the expensive refinement function, in cosines per cell')
+    parser.add_argument('--min-speedup', type=float,
+                        help='with --scaling, exit with 1 if the expensive refinement on all '
+                        'threads is not this much faster than on one')
+    args = parser.parse_args()
+
+    levels = QUICK_LEVELS if args.quick else LEVELS
+    build(args.cxx, args.flags, args.morton_keys)
+    if args.scaling:
+        scaling(args, levels)
+        return
+    threads = args.threads or sorted(set([1, multiprocessing.cpu_count()]))
+
+    results = []
+    for dim in args.dims:
+        for mesh in args.meshes:
+            for n in threads:
+                print('{0}D {1} on {2} thread(s)'.format(dim, mesh, n), file=sys.stderr)
+                results += run(dim, mesh, levels[dim][mesh], n, args.repeat, args.points)
+    print_table(results)
+
+    report = {'machine': describe_machine(args.cxx), 'flags': args.flags,
+              'morton_keys': args.morton_keys, 'repeat': args.repeat,
+              'points': args.points, 'results': results}
+    if args.output:
+        with open(args.output, 'w') as f:
+            json.dump(report, f, indent=1)
+    if args.save_baseline:
+        report['note'] = describe_baseline(report['machine'])
+        if not os.path.isdir(os.path.dirname(args.baseline)):
+            os.makedirs(os.path.dirname(args.baseline))
+        with open(args.baseline, 'w') as f:
+            json.dump(report, f, indent=1)
+        print('saved baseline to', args.baseline, file=sys.stderr)
+    if args.check:
+        with open(args.baseline) as f:
+            baseline = json.load(f)
+        regressions, compared, skipped = check(results, baseline, args.tolerance,
+                                               args.min_seconds)
+        if not compared:
+            # e.g. --quick against a baseline of the full sizes
+            print('no result matches the baseline (dimension, mesh, level, threads and phase)',
+                  file=sys.stderr)
+            sys.exit(1)
+        if skipped:
+            print('{0} result(s) on more threads than the {1} core(s) of the baseline '
+                  'machine were not checked'.format(skipped, baseline['machine']['cpu_count']),
+                  file=sys.stderr)
+        for line in regressions:
+            print('regression:', line)
+        if regressions:
+            sys.exit(1)
+        print('no regressions in {0} result(s) against {1}'.format(compared, args.baseline),
+              file=sys.stderr)
+
+
+def scaling(args, levels):
+    n_cores = multiprocessing.cpu_count()
+    threads = args.threads or scaling_threads(n_cores)
+    results = []
+    for dim in args.dims:
+        for test_work in [0, args.test_work]:
+            for n in threads:
+                print('{0}D sphere, test_work {1}, on {2} thread(s)'.format(dim, test_work, n),
+                      file=sys.stderr)
+                results += run(dim, 'sphere', levels[dim]['sphere'], n, args.repeat,
+                               args.points, test_work)
+    print_scaling(results)
+    if args.output:
+        with open(args.output, 'w') as f:
+            json.dump({'machine': describe_machine(args.cxx), 'flags': args.flags,
+                       'repeat': args.repeat, 'results': results}, f, indent=1)
+    if args.min_speedup is not None:
+        if max(threads) < 2:
+            print('one thread only, the speedup is not checked', file=sys.stderr)
+            return
+        slow = check_scaling(results, args.min_speedup)
+        for line in slow:
+            print('too slow:', line)
+        if slow:
+            sys.exit(1)
+
+
+if __name__ == '__main__':
+    main()
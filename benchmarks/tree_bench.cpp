@@ -0,0 +1,303 @@
+// Timings of building, numbering, locating in and assembling the operators
+// of a Tree on a synthetic mesh, for one mesh and thread count per run so
+// that the peak RSS belongs to it. Each phase prints one JSON object on a
+// line of its own. run_benchmarks.py builds this and runs it over the
+// meshes and thread counts.
+//
+//   tree_bench dim mesh level threads [repeat [n_points [test_work]]]
+//
+// mesh is one of
+//   uniform  every cell at level
+//   sphere   level inside a ball in the middle, 2 outside
+//   surface  level along the surface of that ball, 2 elsewhere
+//   graded   a checkerboard of cells at level and level-1, which hangs as
+//            many faces and edges as the 2:1 balance allows
+//
+// test_work makes the refinement function that much more expensive (in
+// cosines per cell), standing in for criteria such as distances to a
+// surface, which are what the threaded refinement spreads over the cores.
+// When it is given (even as 0) only the refinement is timed.
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <chrono>
+#include <functional>
+#include <random>
+#include <string>
+#include <vector>
+#ifndef _WIN32
+#include <sys/resource.h>
+#endif
+#include "tree.h"
+#include "operators.h"
+
+enum{ MESH_UNIFORM, MESH_SPHERE, MESH_SURFACE, MESH_GRADED };
+static const char *mesh_names[] = {"uniform", "sphere", "surface", "graded"};
+
+class MeshSpec{
+  public:
+    int_t n_dim, level;
+    int kind, test_work;
+};
+
+static const double ball_center = 0.5, ball_radius = 0.3;
+
+// Target level of a cell of the unit square (cube)
+static int_t mesh_level(void *data, Cell *cell){
+    const MeshSpec& spec = *(MeshSpec *) data;
+    double work = 0.0;
+    for(int k=0; k<spec.test_work; ++k)
+        work += std::cos(cell->x0[0]+k);
+    if(work < -1e300)
+        return 0; // never, but keeps the loop
+    if(spec.kind==MESH_UNIFORM)
+        return spec.level;
+    if(spec.kind==MESH_GRADED){
+        if(cell->level<spec.level-1)
+            return spec.level-1;
+        int_t parity = 0;
+        for(int_t d=0; d<spec.n_dim; ++d)
+            parity += (int_t) std::floor(cell->center(d)/(cell->x1[d]-cell->x0[d]));
+        return (parity%2)? spec.level-1 : spec.level;
+    }
+    // nearest and furthest distances from the ball's center to the cell
+    double near = 0.0, far = 0.0;
+    for(int_t d=0; d<spec.n_dim; ++d){
+        double lo = cell->x0[d]-ball_center, hi = cell->x1[d]-ball_center;
+        double gap = (lo>0)? lo : (hi<0)? -hi : 0.0;
+        double reach = std::max(std::fabs(lo), std::fabs(hi));
+        near += gap*gap;
+        far += reach*reach;
+    }
+    double r2 = ball_radius*ball_radius;
+    if(spec.kind==MESH_SPHERE)
+        return (near<r2)? spec.level : 2;
+    return (near<=r2 && far>=r2)? spec.level : 2;
+}
+
+static double now(){
+    return std::chrono::duration<double>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Largest resident set of the process so far, in kB
+static long peak_rss_kb(){
+#ifdef _WIN32
+    return 0;
+#else
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+    return usage.ru_maxrss/1024;
+#else
+    return usage.ru_maxrss;
+#endif
+#endif
+}
+
+class Report{
+  public:
+    MeshSpec spec;
+    int_t n_threads, n_cells;
+
+    // seconds is the best of the repeats, items what one of them handled
+    void phase(const char *name, double seconds, double items, const char *unit){
+        printf("{\"dim\": %d, \"mesh\": \"%s\", \"level\": %d, \"threads\": %d, "
+               "\"test_work\": %d, \"cells\": %ld, \"phase\": \"%s\", \"seconds\": %.6g, "
+               "\"items\": %.0f, \"unit\": \"%s\", \"rate\": %.6g, \"peak_rss_kb\": %ld}\n",
+               (int) spec.n_dim, mesh_names[spec.kind], (int) spec.level, (int) n_threads,
+               (int) spec.test_work, (long) n_cells, name, seconds, items, unit,
+               (seconds>0)? items/seconds : 0.0, peak_rss_kb());
+        fflush(stdout);
+    };
+};
+
+// Best time of repeat calls of f, after set_up (not timed) before each
+template<class S, class F>
+static double best_of(int_t repeat, S set_up, F f){
+    double best = 0.0;
+    for(int_t i=0; i<repeat; ++i){
+        set_up();
+        double start = now();
+        f();
+        double seconds = now()-start;
+        if(i==0 || seconds<best)
+            best = seconds;
+    }
+    return best;
+}
+
+class Grid{
+  public:
+    std::vector<double> xs;
+
+    Grid(int_t level){
+        int_t n = 2<<level;
+        xs.resize(n+1);
+        for(int_t i=0; i<=n; ++i)
+            xs[i] = double(i)/n;
+    };
+    void set_up(Tree& tree, const MeshSpec& spec, int_t n_threads){
+        tree.set_dimension(spec.n_dim);
+        tree.set_level(spec.level);
+        tree.set_xs(&xs[0], &xs[0], &xs[0]);
+        tree.set_num_threads(n_threads);
+    };
+};
+
+int main(int argc, char **argv){
+    if(argc<5){
+        fprintf(stderr, "usage: %s dim mesh level threads [repeat [n_points [test_work]]]\n",
+                argv[0]);
+        return 2;
+    }
+    MeshSpec spec;
+    spec.n_dim = atoi(argv[1]);
+    spec.kind = -1;
+    for(int k=0; k<4; ++k){
+        if(strcmp(argv[2], mesh_names[k])==0)
+            spec.kind = k;
+    }
+    spec.level = atoi(argv[3]);
+    int_t n_threads = atoi(argv[4]);
+    int_t repeat = (argc>5)? atoi(argv[5]) : 3;
+    int_t n_points = (argc>6)? atoi(argv[6]) : 1000000;
+    spec.test_work = (argc>7)? atoi(argv[7]) : 0;
+    bool only_refine = argc>7;
+    if((spec.n_dim!=2 && spec.n_dim!=3) || spec.kind<0 || spec.level<3
+            || spec.level>max_key_level || n_threads<1 || repeat<1 || spec.test_work<0){
+        fprintf(stderr, "bad arguments\n");
+        return 2;
+    }
+
+    Grid grid(spec.level);
+    PyWrapper wrapper;
+    wrapper.set(&spec, mesh_level);
+    Report report;
+    report.spec = spec;
+    report.n_threads = n_threads;
+
+    Tree *tree = NULL;
+    double seconds = best_of(repeat,
+        [&](){
+            delete tree;
+            tree = new Tree();
+            grid.set_up(*tree, spec, n_threads);
+        },
+        [&](){ tree->build_tree_from_function(&wrapper, true);});
+    report.n_cells = tree->cells.size();
+    report.phase("build_tree_from_function", seconds, report.n_cells, "cells");
+    if(only_refine){
+        delete tree;
+        return 0;
+    }
+
+    seconds = best_of(repeat, [](){}, [&](){ tree->number();});
+    report.phase("number", seconds, report.n_cells, "cells");
+
+    std::mt19937 rng(0);
+    std::uniform_real_distribution<double> uniform(0.0, 1.0);
+    std::vector<double> points(spec.n_dim*n_points);
+    for(std::size_t i=0; i<points.size(); ++i)
+        points[i] = uniform(rng);
+    std::vector<int_t> found(n_points);
+    seconds = best_of(repeat, [](){},
+        [&](){ tree->containing_cells(&points[0], n_points, &found[0]);});
+    report.phase("containing_cells", seconds, n_points, "points");
+
+    seconds = best_of(repeat,
+        [&](){ tree->arrays.clear();},
+        [&](){
+            tree->arrays.build(*tree, MeshArrays::CELLS|MeshArrays::NODES|MeshArrays::EDGES
+                               |MeshArrays::FACES|MeshArrays::PARENTS);
+        });
+    report.phase("mesh_arrays", seconds, report.n_cells, "cells");
+
+    // Each operator, from the arrays above, by the entries it builds
+    CSRMatrix matrix;
+    auto assembled = [&](const char *name, std::function<void(CSRMatrix&)> build){
+        double took = best_of(repeat, [&](){ matrix = CSRMatrix();}, [&](){ build(matrix);});
+        report.phase(name, took, matrix.nnz(), "nnz");
+    };
+    Tree& t = *tree;
+    assembled("face_divergence", [&](CSRMatrix& out){ face_divergence(t, out);});
+    if(spec.n_dim==3)
+        assembled("edge_curl", [&](CSRMatrix& out){ edge_curl(t, out);});
+    assembled("nodal_gradient", [&](CSRMatrix& out){ nodal_gradient(t, out);});
+    assembled("average_nodes_to_cells", [&](CSRMatrix& out){ average_nodes_to_cells(t, out);});
+    assembled("average_edges_to_cells",
+              [&](CSRMatrix& out){ average_edges_to_cells(t, ALL_DIRECTIONS, out);});
+    assembled("average_faces_to_cells",
+              [&](CSRMatrix& out){ average_faces_to_cells(t, ALL_DIRECTIONS, out);});
+    assembled("cell_gradient_stencil", [&](CSRMatrix& out){ cell_gradient_stencil(t, 0, out);});
+    assembled("hanging_projection_faces",
+              [&](CSRMatrix& out){ hanging_projection(t, AT_FACES, 0, out);});
+    int_t n_interp = std::min(n_points, (int_t) 100000);
+    assembled("interpolation_nodes", [&](CSRMatrix& out){
+        interpolation_matrix(t, &points[0], n_interp, AT_NODES, 0, false, out);});
+    // (not from cells: a point in a coarse cell averages every leaf of the
+    // neighbors of that cell's size, which runs to millions of entries next
+    // to the refined parts of these meshes)
+    assembled("interpolation_faces", [&](CSRMatrix& out){
+        interpolation_matrix(t, &points[0], n_interp, AT_FACES, 0, false, out);});
+
+    int_t n_tensor = 3*(spec.n_dim-1);
+    std::vector<double> prop(n_tensor*report.n_cells);
+    for(std::size_t i=0; i<prop.size(); ++i)
+        prop[i] = (i<std::size_t(spec.n_dim*report.n_cells))? 1.0+uniform(rng) : 0.1*uniform(rng);
+    assembled("inner_product_faces_lumped", [&](CSRMatrix& out){
+        inner_product(t, AT_FACES, &prop[0], 1, false, true, false, out);});
+    assembled("inner_product_edges_tensor", [&](CSRMatrix& out){
+        inner_product(t, AT_EDGES, &prop[0], n_tensor, false, false, false, out);});
+
+    // Matrix free products with the face divergence, by its rows
+    int_t n_rows, n_cols;
+    operator_shape(t, OP_FACE_DIVERGENCE, 0, n_rows, n_cols);
+    std::vector<double> x(n_cols, 1.0), y(n_rows);
+    seconds = best_of(repeat, [](){},
+        [&](){ apply_operator(t, OP_FACE_DIVERGENCE, 0, false, &x[0], &y[0]);});
+    report.phase("apply_face_divergence", seconds, n_rows, "rows");
+    seconds = best_of(repeat, [](){},
+        [&](){ apply_operator(t, OP_FACE_DIVERGENCE, 0, true, &y[0], &x[0]);});
+    report.phase("apply_face_divergence_transpose", seconds, n_rows, "rows");
+
+    // The same leaves loaded in bulk, then linked up, with the first tree
+    // gone so that it does not add to the peak RSS
+    std::vector<int_t> inds(spec.n_dim*report.n_cells), levels(report.n_cells);
+    for(int_t i=0; i<report.n_cells; ++i){
+        Cell *cell = tree->cells[i];
+        for(int_t d=0; d<spec.n_dim; ++d)
+            inds[spec.n_dim*i+d] = cell->location_ind[d];
+        levels[i] = cell->level;
+    }
+    delete tree;
+    tree = NULL;
+    double insert = 0.0, finalize = 0.0;
+    best_of(repeat,
+        [&](){
+            delete tree;
+            tree = new Tree();
+            grid.set_up(*tree, spec, n_threads);
+        },
+        [&](){
+            double start = now();
+            tree->insert_cells(&inds[0], &levels[0], report.n_cells);
+            double middle = now();
+            tree->finalize_lists();
+            double end = now();
+            if(insert==0.0 || middle-start<insert)
+                insert = middle-start;
+            if(finalize==0.0 || end-middle<finalize)
+                finalize = end-middle;
+        });
+    report.phase("insert_cells", insert, report.n_cells, "cells");
+    report.phase("finalize_lists", finalize, report.n_cells, "cells");
+    if((int_t) tree->cells.size()!=report.n_cells){
+        fprintf(stderr, "bulk load gave %ld cells, not %ld\n", (long) tree->cells.size(),
+                (long) report.n_cells);
+        return 1;
+    }
+    delete tree;
+    return 0;
+}
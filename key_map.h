@@ -0,0 +1,204 @@
+#ifndef __KEY_MAP_H
+#define __KEY_MAP_H
+
+#include <vector>
+#include <utility>
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+
+// Open addressing hash table keyed by the integer keys produced by key_func.
+// Entries live densely in insertion order so that iteration is a linear walk
+// over contiguous memory. sort() puts them in ascending key order, which is
+// the order Tree::number() relies on. Only the entries added (or erased)
+// since the last sort() are sorted again and merged into the rest.
+template<class T>
+class KeyMap{
+  public:
+    typedef std::size_t key_type;
+    typedef std::pair<key_type, T> value_type;
+    typedef typename std::vector<value_type>::iterator iterator;
+
+  private:
+    struct Slot{
+        key_type key;
+        key_type index; // position in items plus one, 0 marks an empty slot
+    };
+    std::vector<value_type> items;
+    std::vector<Slot> slots;
+    key_type mask;
+    key_type n_sorted; // the leading items that are in key order
+    key_type n_erased; // items left in place by erase() until the next sort()
+    std::atomic<unsigned long long> *probes; // slots visited, if counted
+
+    static inline key_type hash(key_type key){
+        // splitmix64 finalizer, the pairing keys are far from uniform
+        unsigned long long h = key;
+        h = (h^(h>>30))*0xbf58476d1ce4e5b9ULL;
+        h = (h^(h>>27))*0x94d049bb133111ebULL;
+        return (key_type) (h^(h>>31));
+    };
+
+    inline Slot* probe(key_type key){
+        key_type i = hash(key)&mask, n = 1;
+        while(slots[i].index!=0 && slots[i].key!=key){
+            i = (i+1)&mask;
+            ++n;
+        }
+        if(probes!=NULL)
+            probes->fetch_add(n, std::memory_order_relaxed);
+        return &slots[i];
+    };
+
+    static const key_type erased_key = ~(key_type) 0;
+
+    // keys are unique, so the values never need comparing
+    static bool key_less(const value_type& a, const value_type& b){
+        return a.first<b.first;
+    };
+
+    void rehash(key_type n_slots){
+        slots.assign(n_slots, Slot());
+        mask = n_slots-1;
+        for(key_type i=0; i<items.size(); ++i){
+            if(items[i].first==erased_key)
+                continue;
+            Slot *slot = probe(items[i].first);
+            slot->key = items[i].first;
+            slot->index = i+1;
+        }
+    };
+
+    // Sets the slot of every item from first on
+    void reindex(key_type first){
+        for(key_type i=first; i<items.size(); ++i)
+            probe(items[i].first)->index = i+1;
+    };
+
+  public:
+    KeyMap(){
+        mask = 0;
+        n_sorted = 0;
+        n_erased = 0;
+        probes = NULL;
+        rehash(16);
+    };
+
+    // Adds the slots each lookup visits to counter from now on, or stops
+    // with NULL (see TreeStats)
+    void count_probes(std::atomic<unsigned long long> *counter){
+        probes = counter;
+    };
+
+    // Returns a reference to the value stored at key, inserting a
+    // value-initialized one if it was not present. One probe either way.
+    T& operator[](key_type key){
+        Slot *slot = probe(key);
+        if(slot->index==0){
+            if(2*(items.size()+1) > slots.size()){
+                rehash(2*slots.size());
+                slot = probe(key);
+            }
+            if(n_sorted==items.size() && (items.empty() || key > items.back().first))
+                ++n_sorted;
+            items.push_back(value_type(key, T()));
+            slot->key = key;
+            slot->index = items.size();
+        }
+        return items[slot->index-1].second;
+    };
+
+    iterator find(key_type key){
+        Slot *slot = probe(key);
+        if(slot->index==0)
+            return items.end();
+        return items.begin()+(slot->index-1);
+    };
+
+    key_type count(key_type key){
+        return probe(key)->index!=0;
+    };
+
+    void reserve(key_type n){
+        items.reserve(n);
+        key_type n_slots = slots.size();
+        while(n_slots < 2*n)
+            n_slots <<= 1;
+        if(n_slots != slots.size())
+            rehash(n_slots);
+    };
+
+    // Removes the entry at key, if there is one. Its place among the items
+    // is only taken back by the next sort(), so the map must be sorted
+    // before it is iterated over again.
+    void erase(key_type key){
+        Slot *slot = probe(key);
+        if(slot->index==0)
+            return;
+        key_type pos = slot->index-1;
+        // empty the slot and shift back the rest of its probe sequence
+        key_type i = slot-&slots[0], j = i;
+        slots[i].index = 0;
+        while(true){
+            j = (j+1)&mask;
+            if(slots[j].index==0)
+                break;
+            key_type home = hash(slots[j].key)&mask;
+            if(((j-home)&mask) >= ((j-i)&mask)){
+                slots[i] = slots[j];
+                slots[j].index = 0;
+                i = j;
+            }
+        }
+        items[pos] = value_type(erased_key, T());
+        ++n_erased;
+    };
+
+    // Orders the entries by ascending key, invalidates iterators
+    void sort(){
+        if(n_sorted==items.size() && n_erased==0)
+            return;
+        key_type first = n_sorted;
+        if(n_erased){
+            // drop the erased items, keeping the rest in order
+            key_type n = 0, n_kept_sorted = 0;
+            for(key_type i=0; i<items.size(); ++i){
+                if(items[i].first==erased_key){
+                    first = std::min(first, n);
+                    continue;
+                }
+                items[n++] = items[i];
+                if(i<n_sorted)
+                    n_kept_sorted = n;
+            }
+            first = std::min(first, n_kept_sorted);
+            n_sorted = n_kept_sorted;
+            items.resize(n);
+            n_erased = 0;
+        }
+        std::sort(items.begin()+n_sorted, items.end(), key_less);
+        if(n_sorted>0 && n_sorted<items.size()){
+            first = std::min(first, (key_type) (std::upper_bound(items.begin(), items.begin()+n_sorted,
+                                                                 items[n_sorted], key_less)-items.begin()));
+            std::inplace_merge(items.begin(), items.begin()+n_sorted, items.end(), key_less);
+        }
+        reindex(first);
+        n_sorted = items.size();
+    };
+
+    void clear(){
+        items.clear();
+        n_sorted = 0;
+        n_erased = 0;
+        rehash(16);
+    };
+
+    key_type size(){ return items.size()-n_erased;};
+    bool empty(){ return size()==0;};
+    iterator begin(){ return items.begin();};
+    iterator end(){ return items.end();};
+};
+
+template<class T>
+const typename KeyMap<T>::key_type KeyMap<T>::erased_key;
+#endif
@@ -0,0 +1,87 @@
+#include <vector>
+#include <algorithm>
+#include "linear_tree.h"
+#include "morton.h"
+
+LinearTree::LinearTree(){
+    n_dim = 0;
+    max_level = 0;
+}
+
+void LinearTree::build(const cell_vec_t& cells, int_t dim, int_t level){
+    n_dim = dim;
+    max_level = level;
+    codes.resize(cells.size());
+    levels.resize(cells.size());
+    for(cell_vec_t::size_type i=0; i<cells.size(); ++i){
+        // location_ind counts half cells of the finest level
+        unsigned int *ind = cells[i]->points()[0]->location_ind;
+        codes[i] = encode(ind[0]/2, ind[1]/2, ind[2]/2);
+        levels[i] = cells[i]->level;
+    }
+}
+
+void LinearTree::clear(){
+    codes.clear();
+    levels.clear();
+}
+
+LinearTree::code_t LinearTree::encode(int_t ix, int_t iy, int_t iz){
+    if(n_dim==3)
+        return morton_code(ix, iy, iz);
+    return morton_code(ix, iy);
+}
+
+void LinearTree::decode(code_t code, int_t ind[3]){
+    if(n_dim==3){
+        ind[0] = compact_bits_3(code);
+        ind[1] = compact_bits_3(code>>1);
+        ind[2] = compact_bits_3(code>>2);
+    }else{
+        ind[0] = compact_bits_2(code);
+        ind[1] = compact_bits_2(code>>1);
+        ind[2] = 0;
+    }
+}
+
+int_t LinearTree::find(int_t ix, int_t iy, int_t iz){
+    // Each leaf covers the codes from its own up to the next leaf's
+    code_t code = encode(ix, iy, iz);
+    return std::upper_bound(codes.begin(), codes.end(), code)-codes.begin()-1;
+}
+
+int_t LinearTree::face_neighbors(int_t i, int_t direction, int_t *out){
+    int_t dir = direction/2;
+    bool upper = direction&1;
+    int_t n_max = (int_t) 1<<max_level;
+    int_t w = width(i);
+    int_t ind[3];
+    anchor(i, ind);
+    if(upper? ind[dir]+w==n_max : ind[dir]==0)
+        return 0;
+    // Finest level cell just across the face, at the anchor's corner
+    int_t across[3] = {ind[0], ind[1], ind[2]};
+    across[dir] = upper? ind[dir]+w : ind[dir]-1;
+    int_t j = find(across[0], across[1], across[2]);
+    if(levels[j] <= levels[i]){
+        out[0] = j;
+        return 1;
+    }
+    // Finer neighbors, one per half of each dimension along the face.
+    int_t h = w/2;
+    int_t n_out = 0;
+    int_t d1 = (dir+1)%3, d2 = (dir+2)%3;
+    int_t n2 = (n_dim==3)? 2 : 1;
+    if(n_dim==2)
+        d1 = 1-dir;
+    for(int_t i2=0; i2<n2; ++i2){
+        for(int_t i1=0; i1<2; ++i1){
+            int_t p[3] = {across[0], across[1], across[2]};
+            p[d1] += i1*h;
+            if(n_dim==3)
+                p[d2] += i2*h;
+            out[n_out++] = find(p[0], p[1], p[2]);
+        }
+    }
+    return n_out;
+}
@@ -0,0 +1,50 @@
+#ifndef __LINEAR_TREE_H
+#define __LINEAR_TREE_H
+
+#include <vector>
+#include "tree.h"
+
+// Pointer free (linear) form of a tree: only its leaves, stored as the
+// Morton code of each leaf's lowest corner and its level, sorted by code.
+// Corners are counted in cells of the finest level, so a leaf at level l
+// spans 2^(max_level-l) of them per dimension. Everything else (centers,
+// neighbors, nodes) is computed from these on demand, which takes 9 bytes
+// per cell instead of a Cell and its pointers.
+//
+// This is a form to store and hand over a tree in, not a mesh of its own: a
+// Tree is exported to it (_TreeMesh._linear_octree and the mesh files) and
+// rebuilt from it (build_tree_from_leaves in mesh_file.h), and the lookups
+// below are for C++ callers. The mesh operators all work on the Tree.
+//
+// The tree is assumed to be 2:1 balanced, like every Tree.
+class LinearTree{
+  public:
+    typedef unsigned long long code_t;
+
+    int_t n_dim, max_level;
+    std::vector<code_t> codes;
+    std::vector<unsigned char> levels;
+
+    LinearTree();
+
+    // Leaves in the order of build_cell_vector (which is already Morton order)
+    void build(const cell_vec_t& cells, int_t dim, int_t max_level);
+    void clear();
+
+    int_t size(){ return codes.size();};
+    int_t width(int_t i){ return (int_t) 1<<(max_level-levels[i]);};
+
+    code_t encode(int_t ix, int_t iy, int_t iz);
+    void decode(code_t code, int_t ind[3]);
+    // Lowest corner of leaf i
+    void anchor(int_t i, int_t ind[3]){ decode(codes[i], ind);};
+
+    // Index of the leaf containing finest level cell (ix, iy, iz)
+    int_t find(int_t ix, int_t iy, int_t iz);
+
+    // Leaves sharing a face with leaf i in direction (-x,+x,-y,+y,-z,+z).
+    // Writes up to 2^(n_dim-1) of them to out and returns how many, 0 on
+    // the boundary of the mesh.
+    int_t face_neighbors(int_t i, int_t direction, int_t *out);
+};
+#endif
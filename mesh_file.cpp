@@ -0,0 +1,152 @@
+#include <vector>
+#include <cstdio>
+#include <cstring>
+#include "mesh_file.h"
+
+// A section and the values to write to it
+struct Section{
+    MeshFileSection info;
+    const void *data;
+    std::size_t item_size;
+};
+
+static void type_string(char kind, std::size_t size, char *out){
+    const unsigned short one = 1;
+    char order = (*(const char *) &one)? '<' : '>';
+    std::sprintf(out, "%c%c%d", (size==1)? '|' : order, kind, (int) size);
+}
+
+template<class T>
+static void add_section(std::vector<Section>& sections, const char *name, char kind,
+                        const T *data, std::size_t n, std::size_t n_cols){
+    Section s;
+    std::memset(&s.info, 0, sizeof(s.info));
+    std::strncpy(s.info.name, name, sizeof(s.info.name)-1);
+    type_string(kind, sizeof(T), s.info.type);
+    s.info.n_cols = n_cols;
+    s.info.n_rows = (n_cols>0)? n/n_cols : n;
+    s.data = data;
+    s.item_size = sizeof(T);
+    sections.push_back(s);
+}
+
+template<class T>
+static void add_section(std::vector<Section>& sections, const char *name, char kind,
+                        const std::vector<T>& values, std::size_t n_cols){
+    add_section(sections, name, kind, values.empty()? NULL : &values[0], values.size(), n_cols);
+}
+
+static std::size_t pad8(std::size_t n){
+    return (n+7)&~((std::size_t) 7);
+}
+
+bool write_mesh_file(Tree& tree, const char *path, bool tables){
+    int_t n_dim = tree.n_dim;
+    LinearTree linear;
+    linear.build(tree.cells, n_dim, tree.max_level);
+
+    std::vector<Section> sections;
+    const double *grids[3] = {tree.xs, tree.ys, tree.zs};
+    int_t n_grid[3] = {tree.nx+1, tree.ny+1, tree.nz+1};
+    const char *grid_names[3] = {"xs", "ys", "zs"};
+    for(int_t d=0; d<n_dim; ++d)
+        add_section(sections, grid_names[d], 'f', grids[d], n_grid[d], 0);
+    add_section(sections, "leaf_codes", 'u', linear.codes, 0);
+    add_section(sections, "leaf_levels", 'u', linear.levels, 0);
+
+    if(tables){
+        MeshArrays& a = tree.arrays;
+        a.build(tree, MeshArrays::CELLS|MeshArrays::NODES|MeshArrays::EDGES
+                      |MeshArrays::FACES|MeshArrays::PARENTS);
+        int_t n_points = 1<<n_dim, n_edges = (n_dim==3)? 12 : 4;
+        add_section(sections, "cell_centers", 'f', a.cell_centers, n_dim);
+        add_section(sections, "cell_widths", 'f', a.cell_widths, n_dim);
+        add_section(sections, "cell_volumes", 'f', a.cell_volumes, 0);
+        add_section(sections, "cell_nodes", 'i', a.cell_nodes, n_points);
+        add_section(sections, "cell_faces", 'i', a.cell_faces, 2*n_dim);
+        add_section(sections, "cell_edges", 'i', a.cell_edges, n_edges);
+        add_section(sections, "node_locations", 'f', a.node_locations, n_dim);
+        add_section(sections, "node_parents", 'i', a.node_parents, 4);
+        const char *suffix[3] = {"_x", "_y", "_z"};
+        char name[24];
+        for(int_t d=0; d<n_dim; ++d){
+            std::sprintf(name, "edge_locations%s", suffix[d]);
+            add_section(sections, name, 'f', a.edge_locations[d], n_dim);
+            std::sprintf(name, "edge_lengths%s", suffix[d]);
+            add_section(sections, name, 'f', a.edge_lengths[d], 0);
+            std::sprintf(name, "edge_nodes%s", suffix[d]);
+            add_section(sections, name, 'i', a.edge_nodes[d], 2);
+            std::sprintf(name, "edge_parents%s", suffix[d]);
+            add_section(sections, name, 'i', a.edge_parents[d], 2);
+        }
+        for(int_t d=0; d<3 && n_dim==3; ++d){
+            std::sprintf(name, "face_locations%s", suffix[d]);
+            add_section(sections, name, 'f', a.face_locations[d], n_dim);
+            std::sprintf(name, "face_areas%s", suffix[d]);
+            add_section(sections, name, 'f', a.face_areas[d], 0);
+            std::sprintf(name, "face_edges%s", suffix[d]);
+            add_section(sections, name, 'i', a.face_edges[d], 4);
+            std::sprintf(name, "face_parents%s", suffix[d]);
+            add_section(sections, name, 'i', a.face_parents[d], 0);
+        }
+    }
+
+    MeshFileHeader header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, "TREEMESH", 8);
+    header.version = mesh_file_version;
+    header.n_dim = n_dim;
+    header.max_level = tree.max_level;
+    header.flags |= mesh_file_key_order;
+    if(tables)
+        header.flags |= MESH_FILE_TABLES;
+    header.n_cells = tree.cells.size();
+    header.n_sections = sections.size();
+
+    std::size_t offset = pad8(sizeof(header)+sections.size()*sizeof(MeshFileSection));
+    for(std::size_t i=0; i<sections.size(); ++i){
+        MeshFileSection& info = sections[i].info;
+        info.offset = offset;
+        std::size_t n = info.n_rows*(info.n_cols? info.n_cols : 1);
+        offset = pad8(offset+n*sections[i].item_size);
+    }
+
+    FILE *file = std::fopen(path, "wb");
+    if(file==NULL)
+        return false;
+    bool ok = std::fwrite(&header, sizeof(header), 1, file)==1;
+    for(std::size_t i=0; i<sections.size() && ok; ++i)
+        ok = std::fwrite(&sections[i].info, sizeof(MeshFileSection), 1, file)==1;
+    const char zeros[8] = {0, 0, 0, 0, 0, 0, 0, 0};
+    std::size_t at = sizeof(header)+sections.size()*sizeof(MeshFileSection);
+    for(std::size_t i=0; i<sections.size() && ok; ++i){
+        MeshFileSection& info = sections[i].info;
+        if(info.offset>at)
+            ok = std::fwrite(zeros, 1, info.offset-at, file)==info.offset-at;
+        std::size_t n = info.n_rows*(info.n_cols? info.n_cols : 1);
+        if(ok && n>0)
+            ok = std::fwrite(sections[i].data, sections[i].item_size, n, file)==n;
+        at = info.offset+n*sections[i].item_size;
+    }
+    if(std::fclose(file)!=0)
+        ok = false;
+    return ok;
+}
+
+void build_tree_from_leaves(Tree& tree, const LinearTree::code_t *codes,
+                            const unsigned char *levels, int_t n){
+    int_t n_dim = tree.n_dim;
+    LinearTree linear;
+    linear.n_dim = n_dim;
+    linear.max_level = tree.max_level;
+    std::vector<int_t> cell_inds(n*n_dim), cell_levels(n);
+    for(int_t i=0; i<n; ++i){
+        // location_ind of the center, in half cells of the finest level
+        int_t ind[3], w = (int_t) 1<<(tree.max_level-levels[i]);
+        linear.decode(codes[i], ind);
+        for(int_t d=0; d<n_dim; ++d)
+            cell_inds[i*n_dim+d] = 2*ind[d]+w;
+        cell_levels[i] = levels[i];
+    }
+    tree.build_tree_from_cells(n? &cell_inds[0] : NULL, n? &cell_levels[0] : NULL, n);
+}
@@ -0,0 +1,60 @@
+#ifndef __MESH_FILE_H
+#define __MESH_FILE_H
+
+#include "tree.h"
+#include "linear_tree.h"
+
+// Binary mesh files. A file is a header, a table of sections and then the
+// sections themselves, each one starting on an 8 byte boundary so that it
+// can be used in place from a memory map. Everything is in the byte order
+// of the machine that wrote it (type tells which).
+//
+// Sections, n_rows x n_cols values each:
+//   xs, ys, zs               the grid of location_ind, 2^(max_level+1)+1
+//                            coordinates per dimension (zs in 3D only)
+//   leaf_codes, leaf_levels  the leaves as a LinearTree, Morton sorted,
+//                            which is also the cell order
+// and, when written with tables, the MeshArrays of the numbered tree under
+// their member names, with _x, _y and _z appended to those that are split by
+// direction (edge_nodes_x, ...). Their indices are only valid for the key
+// order in flags.
+//
+// Readers should check magic and version and look sections up by name.
+const int_t mesh_file_version = 1;
+
+struct MeshFileHeader{
+    char magic[8]; // "TREEMESH"
+    unsigned int version;
+    unsigned int n_dim;
+    unsigned int max_level;
+    unsigned int flags; // MESH_FILE_* below
+    unsigned long long n_cells;
+    unsigned long long n_sections;
+};
+
+enum{ MESH_FILE_MORTON_KEYS=1, MESH_FILE_TABLES=2 };
+
+// The key order flag of the files this build writes, whose tables are only
+// of use to a reader with the same key order
+#ifdef MORTON_KEYS
+const unsigned int mesh_file_key_order = MESH_FILE_MORTON_KEYS;
+#else
+const unsigned int mesh_file_key_order = 0;
+#endif
+
+struct MeshFileSection{
+    char name[24];
+    char type[8]; // numpy style type string, "<f8", "<i8", "<u8" or "|u1"
+    unsigned long long n_rows, n_cols;
+    unsigned long long offset; // from the start of the file
+};
+
+// Writes a numbered tree to path, with its MeshArrays when tables is set.
+// Returns false if the file could not be written.
+bool write_mesh_file(Tree& tree, const char *path, bool tables);
+
+// Builds a tree (which has its dimension, level and grid set) from the
+// leaves of a file, see LinearTree
+void build_tree_from_leaves(Tree& tree, const LinearTree::code_t *codes,
+                            const unsigned char *levels, int_t n);
+#endif
@@ -0,0 +1,59 @@
+#ifndef __MORTON_H
+#define __MORTON_H
+
+#include <cstddef>
+
+// Morton (Z-order) codes, built by interleaving the bits of integer grid
+// coordinates. Points that are close in space mostly get close codes.
+
+// Puts one zero bit between each of the low 32 bits of x
+inline unsigned long long spread_bits_2(unsigned long long x){
+    x &= 0xffffffffULL;
+    x = (x|(x<<16))&0x0000ffff0000ffffULL;
+    x = (x|(x<< 8))&0x00ff00ff00ff00ffULL;
+    x = (x|(x<< 4))&0x0f0f0f0f0f0f0f0fULL;
+    x = (x|(x<< 2))&0x3333333333333333ULL;
+    x = (x|(x<< 1))&0x5555555555555555ULL;
+    return x;
+}
+
+// Puts two zero bits between each of the low 21 bits of x
+inline unsigned long long spread_bits_3(unsigned long long x){
+    x &= 0x1fffffULL;
+    x = (x|(x<<32))&0x001f00000000ffffULL;
+    x = (x|(x<<16))&0x001f0000ff0000ffULL;
+    x = (x|(x<< 8))&0x100f00f00f00f00fULL;
+    x = (x|(x<< 4))&0x10c30c30c30c30c3ULL;
+    x = (x|(x<< 2))&0x1249249249249249ULL;
+    return x;
+}
+
+// Inverses of spread_bits_2 and spread_bits_3
+inline unsigned long long compact_bits_2(unsigned long long x){
+    x &= 0x5555555555555555ULL;
+    x = (x|(x>> 1))&0x3333333333333333ULL;
+    x = (x|(x>> 2))&0x0f0f0f0f0f0f0f0fULL;
+    x = (x|(x>> 4))&0x00ff00ff00ff00ffULL;
+    x = (x|(x>> 8))&0x0000ffff0000ffffULL;
+    x = (x|(x>>16))&0x00000000ffffffffULL;
+    return x;
+}
+
+inline unsigned long long compact_bits_3(unsigned long long x){
+    x &= 0x1249249249249249ULL;
+    x = (x|(x>> 2))&0x10c30c30c30c30c3ULL;
+    x = (x|(x>> 4))&0x100f00f00f00f00fULL;
+    x = (x|(x>> 8))&0x001f0000ff0000ffULL;
+    x = (x|(x>>16))&0x001f00000000ffffULL;
+    x = (x|(x>>32))&0x00000000001fffffULL;
+    return x;
+}
+
+inline unsigned long long morton_code(std::size_t x, std::size_t y){
+    return spread_bits_2(x)|(spread_bits_2(y)<<1);
+}
+
+inline unsigned long long morton_code(std::size_t x, std::size_t y, std::size_t z){
+    return spread_bits_3(x)|(spread_bits_3(y)<<1)|(spread_bits_3(z)<<2);
+}
+#endif
@@ -0,0 +1,1181 @@
+#include <vector>
+#include <algorithm>
+#include <limits>
+#include "operators.h"
+#include "parallel.h"
+
+CSRMatrix::CSRMatrix(){
+    n_rows = 0;
+    n_cols = 0;
+}
+
+// Entries of one row as they are added, see Row::compress
+class Row{
+  public:
+    std::vector<int_t> cols;
+    std::vector<double> vals;
+    // for summing the long rows by column, seen is cleared after each
+    int_t n_cols;
+    std::vector<double> sums;
+    std::vector<char> seen;
+
+    Row(int_t n_cols=0){
+        this->n_cols = n_cols;
+    };
+    void clear(){
+        cols.clear();
+        vals.clear();
+    };
+    void add(int_t col, double val){
+        cols.push_back(col);
+        vals.push_back(val);
+    };
+    // Sums the entries of a row by column, in the order they were added,
+    // keeping each column where it first appeared
+    void sum_by_column(){
+        if(sums.empty()){
+            sums.assign(n_cols, 0.0);
+            seen.assign(n_cols, 0);
+        }
+        std::size_t n = 0;
+        for(std::size_t i=0; i<cols.size(); ++i){
+            int_t col = cols[i];
+            if(seen[col]){
+                sums[col] += vals[i];
+                continue;
+            }
+            seen[col] = 1;
+            sums[col] = vals[i];
+            cols[n++] = col;
+        }
+        cols.resize(n);
+        vals.resize(n);
+        for(std::size_t i=0; i<n; ++i){
+            vals[i] = sums[cols[i]];
+            seen[cols[i]] = 0;
+        }
+    };
+    // Orders the entries by column, sums duplicates and drops the ones that
+    // add up to zero. Rows are mostly short, so this is an insertion sort,
+    // after summing the long ones by column (when n_cols is known) and a
+    // full sort of the ones that stay long.
+    void compress(){
+        if(cols.size()>32 && n_cols>0)
+            sum_by_column();
+        if(cols.size()>64){
+            std::vector<std::pair<int_t, double> > entries(cols.size());
+            for(std::size_t i=0; i<cols.size(); ++i)
+                entries[i] = std::make_pair(cols[i], vals[i]);
+            std::sort(entries.begin(), entries.end());
+            for(std::size_t i=0; i<cols.size(); ++i){
+                cols[i] = entries[i].first;
+                vals[i] = entries[i].second;
+            }
+        }
+        std::size_t n = 0;
+        for(std::size_t i=0; i<cols.size(); ++i){
+            int_t col = cols[i];
+            double val = vals[i];
+            std::size_t j = n;
+            while(j>0 && cols[j-1]>col)
+                --j;
+            if(j>0 && cols[j-1]==col){
+                vals[j-1] += val;
+                continue;
+            }
+            for(std::size_t k=n; k>j; --k){
+                cols[k] = cols[k-1];
+                vals[k] = vals[k-1];
+            }
+            cols[j] = col;
+            vals[j] = val;
+            ++n;
+        }
+        std::size_t n_kept = 0;
+        for(std::size_t i=0; i<n; ++i){
+            if(vals[i]!=0.0){
+                cols[n_kept] = cols[i];
+                vals[n_kept] = vals[i];
+                ++n_kept;
+            }
+        }
+        cols.resize(n_kept);
+        vals.resize(n_kept);
+    };
+};
+
+// Calls row_func(i, row) to fill each row. The rows are built once to count
+// their entries, which gives indptr, and then again to write them in place,
+// both times in parallel. Building a row is cheap next to gathering
+// triplets and sorting them, or buffering rows and copying them over.
+template<class F>
+static void assemble(int_t n_rows, int_t n_cols, int_t n_threads, F row_func, CSRMatrix& out){
+    out.n_rows = n_rows;
+    out.n_cols = n_cols;
+    out.indptr.assign(n_rows+1, 0);
+    parallel_for(n_rows, n_threads,
+        [&](std::size_t begin, std::size_t end){
+            Row row(n_cols);
+            for(std::size_t i=begin; i<end; ++i){
+                row.clear();
+                row_func(i, row);
+                row.compress();
+                out.indptr[i+1] = row.cols.size();
+            }
+        });
+    for(int_t i=0; i<n_rows; ++i)
+        out.indptr[i+1] += out.indptr[i];
+
+    out.indices.resize(out.indptr[n_rows]);
+    out.data.resize(out.indptr[n_rows]);
+    parallel_for(n_rows, n_threads,
+        [&](std::size_t begin, std::size_t end){
+            Row row(n_cols);
+            for(std::size_t i=begin; i<end; ++i){
+                row.clear();
+                row_func(i, row);
+                row.compress();
+                std::copy(row.cols.begin(), row.cols.end(), out.indices.begin()+out.indptr[i]);
+                std::copy(row.vals.begin(), row.vals.end(), out.data.begin()+out.indptr[i]);
+            }
+        });
+}
+
+// One kind of entity (nodes, or edges or faces of one direction) as
+// numbered in MeshArrays, where hanging ones are replaced by their parents
+class Entities{
+  public:
+    int_t n; // non hanging ones, the hanging ones follow
+    int_t n_all;
+    const ResolvedParents *resolved;
+
+    template<class S>
+    void add(S& row, int_t i, double value, int_t offset) const{
+        if(i<n)
+            row.add(i+offset, value);
+        else
+            add_parents(row, i, value, offset);
+    };
+    // apart from add, which is then small enough to be inlined
+    template<class S>
+    void add_parents(S& row, int_t i, double value, int_t offset) const{
+        const int_t *ptr = resolved->ptr.data()+(i-n);
+        const int_t *parents = resolved->parents.data();
+        const double *weights = resolved->weights.data();
+        for(int_t k=ptr[0]; k<ptr[1]; ++k)
+            row.add(parents[k]+offset, weights[k]*value);
+    };
+};
+
+static edge_map_t& edge_map(Tree& tree, int_t d){
+    return (d==0)? tree.edges_x : (d==1)? tree.edges_y : tree.edges_z;
+}
+
+static face_map_t& face_map(Tree& tree, int_t d){
+    return (d==0)? tree.faces_x : (d==1)? tree.faces_y : tree.faces_z;
+}
+
+static Entities nodes(Tree& tree){
+    Entities out;
+    out.n_all = tree.nodes.size();
+    out.n = out.n_all-tree.hanging_nodes.size();
+    out.resolved = &tree.arrays.node_resolved;
+    return out;
+}
+
+static Entities edges(Tree& tree, int_t d){
+    std::vector<Edge *>& hanging = (d==0)? tree.hanging_edges_x :
+                                   (d==1)? tree.hanging_edges_y : tree.hanging_edges_z;
+    Entities out;
+    out.n_all = edge_map(tree, d).size();
+    out.n = out.n_all-hanging.size();
+    out.resolved = &tree.arrays.edge_resolved[d];
+    return out;
+}
+
+// In 2D faces are edges, x faces the y edges and y faces the x edges
+static Entities faces(Tree& tree, int_t d){
+    if(tree.n_dim==2)
+        return edges(tree, 1-d);
+    std::vector<Face *>& hanging = (d==0)? tree.hanging_faces_x :
+                                   (d==1)? tree.hanging_faces_y : tree.hanging_faces_z;
+    Entities out;
+    out.n_all = face_map(tree, d).size();
+    out.n = out.n_all-hanging.size();
+    out.resolved = &tree.arrays.face_resolved[d];
+    return out;
+}
+
+static const double *face_areas(Tree& tree, int_t d){
+    if(tree.n_dim==2)
+        return tree.arrays.edge_lengths[1-d].data();
+    return tree.arrays.face_areas[d].data();
+}
+
+// The operators are written once as their rows, functors that pass each
+// entry of row i to row.add(column, value), so they can be either
+// assembled with a Row or applied with the sinks further down. Their
+// columns come in blocks, one per kind of entity and direction. Assembled
+// rows take the non hanging columns only, replacing each hanging entity by
+// its parents. Applied rows take every column as it is, hanging ones
+// included, and apply_rows works out the hanging values beforehand, which
+// keeps the rows free of branches.
+class Columns{
+  public:
+    int_t n_blocks;
+    Entities kept[3]; // the blocks as assembled
+    Entities column[3]; // as the rows take them
+    int_t offsets[4]; // of each block in the rows' columns
+    int_t n_cols; // as assembled
+
+    void set_columns(bool with_hanging){
+        offsets[0] = 0;
+        n_cols = 0;
+        for(int_t b=0; b<n_blocks; ++b){
+            column[b] = kept[b];
+            if(with_hanging)
+                column[b].n = column[b].n_all;
+            offsets[b+1] = offsets[b]+column[b].n;
+            n_cols += kept[b].n;
+        }
+    };
+};
+
+class FaceDivergenceRows : public Columns{
+  public:
+    int_t n_rows;
+    const MeshArrays *arrays;
+    const double *areas[3];
+
+    FaceDivergenceRows(Tree& tree, bool with_hanging=false){
+        tree.arrays.build(tree, MeshArrays::CELLS|MeshArrays::EDGES|MeshArrays::FACES|MeshArrays::PARENTS);
+        arrays = &tree.arrays;
+        n_blocks = tree.n_dim;
+        for(int_t d=0; d<n_blocks; ++d){
+            kept[d] = faces(tree, d);
+            areas[d] = face_areas(tree, d);
+        }
+        set_columns(with_hanging);
+        n_rows = tree.cells.size();
+    };
+    template<class S>
+    void operator()(int_t i, S& row) const{
+        const int_t *f = &arrays->cell_faces[2*n_blocks*i];
+        double volume = arrays->cell_volumes[i];
+        for(int_t d=0; d<n_blocks; ++d){
+            column[d].add(row, f[2*d], -(areas[d][f[2*d]]/volume), offsets[d]);
+            column[d].add(row, f[2*d+1], areas[d][f[2*d+1]]/volume, offsets[d]);
+        }
+    };
+};
+
+class EdgeCurlRows : public Columns{
+  public:
+    int_t n_rows;
+    const MeshArrays *arrays;
+    int_t face_offsets[4];
+
+    EdgeCurlRows(Tree& tree, bool with_hanging=false){
+        tree.arrays.build(tree, MeshArrays::EDGES|MeshArrays::FACES|MeshArrays::PARENTS);
+        arrays = &tree.arrays;
+        n_blocks = 3;
+        face_offsets[0] = 0;
+        for(int_t d=0; d<3; ++d){
+            kept[d] = edges(tree, d);
+            face_offsets[d+1] = face_offsets[d]+faces(tree, d).n;
+        }
+        set_columns(with_hanging);
+        n_rows = face_offsets[3];
+    };
+    template<class S>
+    void operator()(int_t i, S& row) const{
+        // edge directions and signs of Face::edges for x, y and z faces
+        static const int_t dirs[3][4] = {{2, 1, 2, 1}, {2, 0, 2, 0}, {1, 0, 1, 0}};
+        static const double signs[3][4] = {{-1., -1., 1., 1.}, {1., 1., -1., -1.}, {-1., -1., 1., 1.}};
+        int_t d = (i<face_offsets[1])? 0 : (i<face_offsets[2])? 1 : 2;
+        int_t f = i-face_offsets[d];
+        double area = arrays->face_areas[d][f];
+        const int_t *e = &arrays->face_edges[d][4*f];
+        for(int_t k=0; k<4; ++k){
+            int_t dir = dirs[d][k];
+            column[dir].add(row, e[k], arrays->edge_lengths[dir][e[k]]/area*signs[d][k],
+                            offsets[dir]);
+        }
+    };
+};
+
+class NodalGradientRows : public Columns{
+  public:
+    int_t n_rows;
+    const MeshArrays *arrays;
+    int_t edge_offsets[4];
+
+    NodalGradientRows(Tree& tree, bool with_hanging=false){
+        tree.arrays.build(tree, MeshArrays::EDGES|MeshArrays::PARENTS);
+        arrays = &tree.arrays;
+        n_blocks = 1;
+        kept[0] = nodes(tree);
+        set_columns(with_hanging);
+        edge_offsets[0] = edge_offsets[1] = edge_offsets[2] = edge_offsets[3] = 0;
+        for(int_t d=0; d<tree.n_dim; ++d)
+            edge_offsets[d+1] = edge_offsets[d]+edges(tree, d).n;
+        n_rows = edge_offsets[tree.n_dim];
+    };
+    template<class S>
+    void operator()(int_t i, S& row) const{
+        int_t d = 0;
+        while(i>=edge_offsets[d+1])
+            ++d;
+        int_t e = i-edge_offsets[d];
+        double inv_length = 1.0/arrays->edge_lengths[d][e];
+        column[0].add(row, arrays->edge_nodes[d][2*e], -inv_length, 0);
+        column[0].add(row, arrays->edge_nodes[d][2*e+1], inv_length, 0);
+    };
+};
+
+class NodeAverageRows : public Columns{
+  public:
+    int_t n_rows;
+    const MeshArrays *arrays;
+    int_t n_points;
+    double weight;
+
+    NodeAverageRows(Tree& tree, bool with_hanging=false){
+        tree.arrays.build(tree, MeshArrays::CELLS|MeshArrays::PARENTS);
+        arrays = &tree.arrays;
+        n_blocks = 1;
+        kept[0] = nodes(tree);
+        set_columns(with_hanging);
+        n_points = 1<<tree.n_dim;
+        weight = 1.0/n_points;
+        n_rows = tree.cells.size();
+    };
+    template<class S>
+    void operator()(int_t i, S& row) const{
+        for(int_t j=0; j<n_points; ++j)
+            column[0].add(row, arrays->cell_nodes[n_points*i+j], weight, 0);
+    };
+};
+
+// Averages of the edges of one direction, or with ALL_DIRECTIONS the mean
+// of those of every direction with their columns stacked
+class EdgeAverageRows : public Columns{
+  public:
+    int_t n_rows;
+    const MeshArrays *arrays;
+    int_t first, n_per, n_edges;
+    double weight;
+
+    EdgeAverageRows(Tree& tree, int_t direction, bool with_hanging=false){
+        tree.arrays.build(tree, MeshArrays::CELLS|MeshArrays::PARENTS);
+        arrays = &tree.arrays;
+        first = (direction==ALL_DIRECTIONS)? 0 : direction;
+        n_blocks = (direction==ALL_DIRECTIONS)? tree.n_dim : 1;
+        for(int_t b=0; b<n_blocks; ++b)
+            kept[b] = edges(tree, first+b);
+        set_columns(with_hanging);
+        // cell_edges holds 2 (2D) or 4 (3D) edges per direction
+        n_per = 2*(tree.n_dim-1);
+        n_edges = (tree.n_dim==3)? 12 : 4;
+        weight = 1.0/(n_per*n_blocks);
+        n_rows = tree.cells.size();
+    };
+    template<class S>
+    void operator()(int_t i, S& row) const{
+        for(int_t b=0; b<n_blocks; ++b){
+            const int_t *e = &arrays->cell_edges[n_edges*i+(first+b)*n_per];
+            for(int_t j=0; j<n_per; ++j)
+                column[b].add(row, e[j], weight, offsets[b]);
+        }
+    };
+};
+
+// As EdgeAverageRows, for faces
+class FaceAverageRows : public Columns{
+  public:
+    int_t n_rows;
+    const MeshArrays *arrays;
+    int_t first, n_faces;
+    double weight;
+
+    FaceAverageRows(Tree& tree, int_t direction, bool with_hanging=false){
+        tree.arrays.build(tree, MeshArrays::CELLS|MeshArrays::PARENTS);
+        arrays = &tree.arrays;
+        first = (direction==ALL_DIRECTIONS)? 0 : direction;
+        n_blocks = (direction==ALL_DIRECTIONS)? tree.n_dim : 1;
+        for(int_t b=0; b<n_blocks; ++b)
+            kept[b] = faces(tree, first+b);
+        set_columns(with_hanging);
+        n_faces = 2*tree.n_dim;
+        weight = 0.5/n_blocks;
+        n_rows = tree.cells.size();
+    };
+    template<class S>
+    void operator()(int_t i, S& row) const{
+        for(int_t b=0; b<n_blocks; ++b){
+            const int_t *f = &arrays->cell_faces[n_faces*i+2*(first+b)];
+            column[b].add(row, f[0], weight, offsets[b]);
+            column[b].add(row, f[1], weight, offsets[b]);
+        }
+    };
+};
+
+void face_divergence(Tree& tree, CSRMatrix& out){
+    FaceDivergenceRows rows(tree);
+    assemble(rows.n_rows, rows.n_cols, tree.n_threads, rows, out);
+}
+
+void edge_curl(Tree& tree, CSRMatrix& out){
+    EdgeCurlRows rows(tree);
+    assemble(rows.n_rows, rows.n_cols, tree.n_threads, rows, out);
+}
+
+void nodal_gradient(Tree& tree, CSRMatrix& out){
+    NodalGradientRows rows(tree);
+    assemble(rows.n_rows, rows.n_cols, tree.n_threads, rows, out);
+}
+
+void average_nodes_to_cells(Tree& tree, CSRMatrix& out){
+    NodeAverageRows rows(tree);
+    assemble(rows.n_rows, rows.n_cols, tree.n_threads, rows, out);
+}
+
+void average_edges_to_cells(Tree& tree, int_t direction, CSRMatrix& out){
+    EdgeAverageRows rows(tree, direction);
+    assemble(rows.n_rows, rows.n_cols, tree.n_threads, rows, out);
+}
+
+void average_faces_to_cells(Tree& tree, int_t direction, CSRMatrix& out){
+    FaceAverageRows rows(tree, direction);
+    assemble(rows.n_rows, rows.n_cols, tree.n_threads, rows, out);
+}
+
+// Sinks for rows that are applied: Product takes the dot product of a row
+// with x, Counter counts its entries and Writer copies them out
+class Product{
+  public:
+    const double *x;
+    double sum;
+
+    void add(int_t col, double val){
+        sum += val*x[col];
+    };
+};
+
+class Counter{
+  public:
+    int_t n;
+
+    void add(int_t, double){
+        ++n;
+    };
+};
+
+class Writer{
+  public:
+    int_t *cols;
+    double *vals;
+
+    void add(int_t col, double val){
+        *(cols++) = col;
+        *(vals++) = val;
+    };
+};
+
+// Values of all the columns of rows built with_hanging from those of the
+// non hanging ones, each hanging value the weighted sum of its parents'
+static void fill_hanging(const Columns& rows, int_t n_threads, const double *in, double *all){
+    for(int_t b=0; b<rows.n_blocks; ++b){
+        const Entities& kind = rows.kept[b];
+        const ResolvedParents& resolved = *kind.resolved;
+        const double *x = in;
+        double *y = all+rows.offsets[b];
+        std::copy(x, x+kind.n, y);
+        parallel_for(kind.n_all-kind.n, n_threads,
+            [&](std::size_t begin, std::size_t end){
+                for(std::size_t h=begin; h<end; ++h){
+                    double sum = 0.0;
+                    for(int_t k=resolved.ptr[h]; k<resolved.ptr[h+1]; ++k)
+                        sum += resolved.weights[k]*x[resolved.parents[k]];
+                    y[kind.n+h] = sum;
+                }
+            });
+        in += kind.n;
+    }
+}
+
+// The transpose of fill_hanging: out gets each column's value in all, and
+// each hanging one's value is spread over its parents
+static void gather_hanging(const Columns& rows, const double *all, double *out){
+    for(int_t b=0; b<rows.n_blocks; ++b){
+        const Entities& kind = rows.kept[b];
+        const ResolvedParents& resolved = *kind.resolved;
+        const double *y = all+rows.offsets[b];
+        std::copy(y, y+kind.n, out);
+        for(int_t h=0; h<kind.n_all-kind.n; ++h){
+            for(int_t k=resolved.ptr[h]; k<resolved.ptr[h+1]; ++k)
+                out[resolved.parents[k]] += resolved.weights[k]*y[kind.n+h];
+        }
+        out += kind.n;
+    }
+}
+
+// Sorts the entries of rows built with_hanging by column into table, with
+// the rows of each column in order. The rows are built in parallel, once to
+// count their entries and again to write them, and then bucketed.
+template<class F>
+static void transpose_rows(const F& rows, int_t n_threads, TransposedRows& table){
+    int_t n_all = rows.offsets[rows.n_blocks];
+    std::vector<int_t> row_ptr(rows.n_rows+1, 0);
+    parallel_for(rows.n_rows, n_threads,
+        [&](std::size_t begin, std::size_t end){
+            Counter row;
+            for(std::size_t i=begin; i<end; ++i){
+                row.n = 0;
+                rows(i, row);
+                row_ptr[i+1] = row.n;
+            }
+        });
+    for(int_t i=0; i<rows.n_rows; ++i)
+        row_ptr[i+1] += row_ptr[i];
+    int_t nnz = row_ptr[rows.n_rows];
+    std::vector<int_t> cols(nnz);
+    std::vector<double> vals(nnz);
+    parallel_for(rows.n_rows, n_threads,
+        [&](std::size_t begin, std::size_t end){
+            Writer row;
+            for(std::size_t i=begin; i<end; ++i){
+                row.cols = cols.data()+row_ptr[i];
+                row.vals = vals.data()+row_ptr[i];
+                rows(i, row);
+            }
+        });
+
+    table.ptr.assign(n_all+1, 0);
+    for(int_t k=0; k<nnz; ++k)
+        ++table.ptr[cols[k]+1];
+    for(int_t j=0; j<n_all; ++j)
+        table.ptr[j+1] += table.ptr[j];
+    table.rows.resize(nnz);
+    table.weights.resize(nnz);
+    std::vector<int_t> next(table.ptr.begin(), table.ptr.end()-1);
+    for(int_t i=0; i<rows.n_rows; ++i){
+        for(int_t k=row_ptr[i]; k<row_ptr[i+1]; ++k){
+            int_t at = next[cols[k]]++;
+            table.rows[at] = i;
+            table.weights[at] = vals[k];
+        }
+    }
+}
+
+// The table of op in direction from tree.arrays, made by transpose_rows the
+// first time it is asked for after the tree was numbered
+template<class F>
+static const TransposedRows& transposed(const F& rows, Tree& tree, int_t op, int_t direction){
+    std::vector<TransposedRows>& tables = tree.arrays.transposed;
+    for(std::size_t t=0; t<tables.size(); ++t){
+        if(tables[t].op==op && tables[t].direction==direction)
+            return tables[t];
+    }
+    tables.push_back(TransposedRows());
+    TransposedRows& table = tables.back();
+    table.op = op;
+    table.direction = direction;
+    transpose_rows(rows, tree.n_threads, table);
+    return table;
+}
+
+// out = A in, or with transpose out = A^T in, for rows built with_hanging,
+// with the values of every column in tree.arrays.scratch. The transpose
+// gathers each column from the rows it is in, so the columns are summed
+// in parallel, each in row order.
+template<class F>
+static void apply_rows(const F& rows, Tree& tree, int_t op, int_t direction, bool transpose,
+                       const double *in, double *out){
+    int_t n_threads = tree.n_threads;
+    int_t n_all = rows.offsets[rows.n_blocks];
+    std::vector<double>& all = tree.arrays.scratch;
+    all.resize(n_all);
+    if(!transpose){
+        fill_hanging(rows, n_threads, in, all.data());
+        parallel_for(rows.n_rows, n_threads,
+            [&](std::size_t begin, std::size_t end){
+                Product row;
+                row.x = all.data();
+                for(std::size_t i=begin; i<end; ++i){
+                    row.sum = 0.0;
+                    rows(i, row);
+                    out[i] = row.sum;
+                }
+            });
+        return;
+    }
+    const TransposedRows& table = transposed(rows, tree, op, direction);
+    parallel_for(n_all, n_threads,
+        [&](std::size_t begin, std::size_t end){
+            for(std::size_t j=begin; j<end; ++j){
+                double sum = 0.0;
+                for(int_t k=table.ptr[j]; k<table.ptr[j+1]; ++k)
+                    sum += table.weights[k]*in[table.rows[k]];
+                all[j] = sum;
+            }
+        });
+    gather_hanging(rows, all.data(), out);
+}
+
+template<class F>
+static void apply_or_shape(const F& rows, Tree& tree, int_t op, int_t direction, bool transpose,
+                           const double *in, double *out, int_t *shape){
+    if(shape!=NULL){
+        shape[0] = rows.n_rows;
+        shape[1] = rows.n_cols;
+        return;
+    }
+    apply_rows(rows, tree, op, direction, transpose, in, out);
+}
+
+static void apply_or_shape(Tree& tree, int_t op, int_t direction, bool transpose,
+                           const double *in, double *out, int_t *shape){
+    switch(op){
+        case OP_FACE_DIVERGENCE:
+            apply_or_shape(FaceDivergenceRows(tree, true), tree, op, direction,
+                           transpose, in, out, shape);
+            break;
+        case OP_EDGE_CURL:
+            apply_or_shape(EdgeCurlRows(tree, true), tree, op, direction,
+                           transpose, in, out, shape);
+            break;
+        case OP_NODAL_GRADIENT:
+            apply_or_shape(NodalGradientRows(tree, true), tree, op, direction,
+                           transpose, in, out, shape);
+            break;
+        case OP_AVERAGE_NODES:
+            apply_or_shape(NodeAverageRows(tree, true), tree, op, direction,
+                           transpose, in, out, shape);
+            break;
+        case OP_AVERAGE_EDGES:
+            apply_or_shape(EdgeAverageRows(tree, direction, true), tree, op, direction,
+                           transpose, in, out, shape);
+            break;
+        case OP_AVERAGE_FACES:
+            apply_or_shape(FaceAverageRows(tree, direction, true), tree, op, direction,
+                           transpose, in, out, shape);
+            break;
+    }
+}
+
+void operator_shape(Tree& tree, int_t op, int_t direction, int_t& n_rows, int_t& n_cols){
+    int_t shape[2] = {0, 0};
+    apply_or_shape(tree, op, direction, false, NULL, NULL, shape);
+    n_rows = shape[0];
+    n_cols = shape[1];
+}
+
+void apply_operator(Tree& tree, int_t op, int_t direction, bool transpose,
+                    const double *in, double *out){
+    apply_or_shape(tree, op, direction, transpose, in, out, NULL);
+}
+
+void hanging_projection(Tree& tree, int_t location, int_t direction, CSRMatrix& out){
+    tree.arrays.build(tree, MeshArrays::PARENTS);
+    Entities kind;
+    int_t n_rows;
+    if(location==AT_NODES){
+        kind = nodes(tree);
+        n_rows = tree.nodes.size();
+    }else if(location==AT_EDGES || tree.n_dim==2){
+        // 2D faces are the edges of the other direction
+        int_t d = (location==AT_EDGES)? direction : 1-direction;
+        kind = edges(tree, d);
+        n_rows = edge_map(tree, d).size();
+    }else{
+        kind = faces(tree, direction);
+        n_rows = face_map(tree, direction).size();
+    }
+    assemble(n_rows, kind.n, tree.n_threads,
+        [&](int_t i, Row& row){
+            kind.add(row, i, 1.0, 0);
+        }, out);
+}
+
+// Index of a cell's face on side (0 lower, 1 upper) in direction d, in 2D
+// an edge
+static int_t cell_face_index(Cell *cell, int_t d, int_t side){
+    if(cell->n_dim==3)
+        return cell->faces()[2*d+side]->index;
+    return cell->edges()[2*(1-d)+side]->index;
+}
+
+void cell_gradient_stencil(Tree& tree, int_t direction, CSRMatrix& out){
+    int_t n_dim = tree.n_dim;
+    int_t n_rows = (n_dim==3)? face_map(tree, direction).size() :
+                               edge_map(tree, 1-direction).size();
+    cell_vec_t& cells = tree.cells;
+    // Every face is reached once from the cell on its lower side, so each
+    // row has a fixed slot for its two entries.
+    std::vector<int_t> cols(2*n_rows);
+    std::vector<char> found(n_rows, 0);
+    // children of a cell on its lower side in this direction
+    int_t n_kids = 1<<(n_dim-1), n_children = 1<<n_dim;
+    int_t kids[4];
+    for(int_t i=0, k=0; i<n_children; ++i){
+        if(!(i>>direction&1))
+            kids[k++] = i;
+    }
+    parallel_for(cells.size(), tree.n_threads,
+        [&](std::size_t begin, std::size_t end){
+            for(std::size_t i=begin; i<end; ++i){
+                Cell *cell = cells[i];
+                Cell *next = cell->neighbors()[2*direction+1];
+                if(next==NULL)
+                    continue;
+                if(next->is_leaf()){
+                    int_t f = cell_face_index(cell, direction, 1);
+                    cols[2*f] = cell->index;
+                    cols[2*f+1] = next->index;
+                    found[f] = 1;
+                }else{
+                    for(int_t k=0; k<n_kids; ++k){
+                        Cell *child = next->children()[kids[k]];
+                        int_t f = cell_face_index(child, direction, 0);
+                        cols[2*f] = cell->index;
+                        cols[2*f+1] = child->index;
+                        found[f] = 1;
+                    }
+                }
+            }
+        });
+    assemble(n_rows, cells.size(), tree.n_threads,
+        [&](int_t i, Row& row){
+            if(found[i]){
+                row.add(cols[2*i], -1.0);
+                row.add(cols[2*i+1], 1.0);
+            }
+        }, out);
+}
+
+// Spreads weight evenly over the leaves of cell
+static void add_leaves(Row& row, Cell *cell, double weight){
+    if(cell->is_leaf()){
+        row.add(cell->index, weight);
+        return;
+    }
+    int_t n_children = 1<<cell->n_dim;
+    for(int_t i=0; i<n_children; ++i)
+        add_leaves(row, cell->children()[i], weight/n_children);
+}
+
+static double clip01(double x){
+    return std::min(std::max(x, 0.0), 1.0);
+}
+
+// Adds the weights of the cell center values at point p, in the cell holding
+// it: (bi/tri)linear between its center and the centers of the cells of its
+// size on the point's side. Finer cells there are averaged, and coarser ones
+// interpolated to the center in turn, so linear functions are reproduced.
+// Past the outermost centers values are held constant, unless extrapolate,
+// which takes the cells on the other side instead.
+static void add_cell_stencil(Row& row, Tree& tree, Cell *cell, const double *p, double weight,
+                             bool extrapolate){
+    int_t n_dim = tree.n_dim, n_corners = 1<<n_dim;
+    double *coords[3] = {tree.xs, tree.ys, tree.zs};
+    int_t width = cell->points()[n_corners-1]->location_ind[0]-cell->points()[0]->location_ind[0];
+    const unsigned int *c = cell->location_ind;
+    int_t next[3] = {c[0], c[1], c[2]};
+    double t[3] = {0.0, 0.0, 0.0};
+    for(int_t d=0; d<n_dim; ++d){
+        const double *x = coords[d];
+        bool has_below = c[d]>=width, has_above = c[d]+width<=tree.nx;
+        bool below = p[d]<cell->center(d);
+        if(below? !has_below : !has_above){
+            if(!extrapolate || !(below? has_above : has_below))
+                continue;
+            below = !below;
+        }
+        next[d] = below? c[d]-width : c[d]+width;
+        t[d] = (p[d]-x[c[d]])/(x[next[d]]-x[c[d]]);
+        if(!extrapolate)
+            t[d] = clip01(t[d]);
+    }
+    for(int_t j=0; j<n_corners; ++j){
+        double w = weight;
+        int_t ind[3] = {c[0], c[1], c[2]};
+        for(int_t d=0; d<n_dim; ++d){
+            w *= (j>>d&1)? t[d] : 1-t[d];
+            if(j>>d&1)
+                ind[d] = next[d];
+        }
+        if(w==0.0)
+            continue;
+        if(j==0){
+            row.add(cell->index, w);
+            continue;
+        }
+        Cell *other = tree.root;
+        while(!other->is_leaf() && other->level<cell->level){
+            int ix = ind[0]>other->location_ind[0];
+            int iy = ind[1]>other->location_ind[1];
+            int iz = n_dim>2 && ind[2]>other->location_ind[2];
+            other = other->children()[ix+2*iy+4*iz];
+        }
+        if(other->level==cell->level){
+            add_leaves(row, other, w);
+        }else{
+            double center[3] = {coords[0][ind[0]], coords[1][ind[1]], 0.0};
+            if(n_dim>2)
+                center[2] = coords[2][ind[2]];
+            add_cell_stencil(row, tree, other, center, w, true);
+        }
+    }
+}
+
+void interpolation_matrix(Tree& tree, const double *points, int_t n_points, int_t location,
+                          int_t direction, bool zeros_outside, CSRMatrix& out){
+    MeshArrays& arrays = tree.arrays;
+    arrays.build(tree, MeshArrays::CELLS|MeshArrays::PARENTS);
+    int_t n_dim = tree.n_dim, n_corners = 1<<n_dim;
+    int_t n_faces = 2*n_dim, n_edges = (n_dim==3)? 12 : 4, n_per_edge = n_edges/n_dim;
+    const double eps = 100*std::numeric_limits<double>::epsilon();
+
+    std::vector<int_t> containing(n_points);
+    if(n_points>0)
+        tree.containing_cells(points, n_points, &containing[0]);
+
+    Entities entities;
+    int_t n_cols = tree.cells.size(), offset = 0;
+    if(location==AT_NODES){
+        entities = nodes(tree);
+        n_cols = entities.n;
+    }else if(location==AT_EDGES || location==AT_FACES){
+        n_cols = 0;
+        for(int_t d=0; d<n_dim; ++d){
+            Entities kind = (location==AT_EDGES)? edges(tree, d) : faces(tree, d);
+            if(d==direction){
+                entities = kind;
+                offset = n_cols;
+            }
+            n_cols += kind.n;
+        }
+    }
+    // the other two directions, in Cell::edges order
+    int_t across[2];
+    across[0] = (direction==0)? 1 : 0;
+    across[1] = (direction==2)? 1 : 2;
+
+    assemble(n_points, n_cols, tree.n_threads,
+        [&](int_t i, Row& row){
+            const double *p = points+n_dim*i;
+            Cell *cell = tree.cells[containing[i]];
+            const double *lo = cell->x0, *hi = cell->x1;
+            // how far across the cell the point is in each direction
+            double t[3] = {0.0, 0.0, 0.0};
+            for(int_t d=0; d<n_dim; ++d){
+                t[d] = (p[d]-lo[d])/(hi[d]-lo[d]);
+                if(zeros_outside && (t[d]<-eps || t[d]>1+eps))
+                    return;
+                t[d] = clip01(t[d]);
+            }
+
+            if(location==AT_NODES){
+                for(int_t j=0; j<n_corners; ++j){
+                    double w = 1.0;
+                    for(int_t d=0; d<n_dim; ++d)
+                        w *= (j>>d&1)? t[d] : 1-t[d];
+                    entities.add(row, arrays.cell_nodes[n_corners*cell->index+j], w, 0);
+                }
+            }else if(location==AT_FACES){
+                const int_t *f = &arrays.cell_faces[n_faces*cell->index+2*direction];
+                entities.add(row, f[0], 1-t[direction], offset);
+                entities.add(row, f[1], t[direction], offset);
+            }else if(location==AT_EDGES){
+                const int_t *e = &arrays.cell_edges[n_edges*cell->index+n_per_edge*direction];
+                for(int_t j=0; j<n_per_edge; ++j){
+                    double w = (j&1)? t[across[0]] : 1-t[across[0]];
+                    if(n_dim==3)
+                        w *= (j&2)? t[across[1]] : 1-t[across[1]];
+                    entities.add(row, e[j], w, offset);
+                }
+            }else{
+                add_cell_stencil(row, tree, cell, p, 1.0, false);
+            }
+        }, out);
+}
+
+// The cells that each non hanging face (or edge) takes a value from, through
+// the hanging ones as well. Non hanging entity i, numbered across
+// directions, has cells/slots/weights[ptr[i]:ptr[i+1]] in cell order: the
+// cell, the entity's place in its cell_faces (cell_edges) row and the weight
+// of the entity in that place.
+class EntityCells{
+  public:
+    std::vector<int_t> ptr, cells, slots;
+    std::vector<double> weights;
+};
+
+// Rows of the face and edge inner products, see inner_product. Each cell
+// adds vol/2^n_dim v^T sigma v over its corners, v taking the entity of
+// each direction touching the corner, so a row goes over the cells of its
+// entity and, in each, over the corners that entity touches. Its own
+// direction adds the same at each of them, so only the off diagonal
+// terms of a full tensor need the corners.
+class InnerProductRows : public Columns{
+  public:
+    int_t n_rows;
+    const MeshArrays *arrays;
+    bool at_faces;
+    int_t n_dim, n_cells, n_slots, n_per;
+    const int_t *table; // cell_faces or cell_edges
+    // the corners each slot touches, and the slot of each direction at a corner
+    int_t n_touching, slot_corners[12][4], corner_slots[8][3];
+    EntityCells entity_cells;
+    const double *prop;
+    int_t n_prop;
+    bool invert_prop, lumped;
+    std::vector<double> tensors; // sigma of each cell, 3x3 each
+    double share; // of a cell that goes to each of its entities when lumped
+
+    InnerProductRows(Tree& tree, int_t location, const double *prop, int_t n_prop, bool invert_prop,
+                     bool lumped){
+        tree.arrays.build(tree, MeshArrays::CELLS|MeshArrays::PARENTS);
+        arrays = &tree.arrays;
+        n_dim = tree.n_dim;
+        n_cells = tree.cells.size();
+        n_blocks = n_dim;
+        for(int_t d=0; d<n_dim; ++d)
+            kept[d] = (location==AT_FACES)? faces(tree, d) : edges(tree, d);
+        set_columns(false);
+        n_rows = n_cols;
+        at_faces = (location==AT_FACES);
+        if(at_faces){
+            n_slots = 2*n_dim;
+            n_per = 2;
+            table = arrays->cell_faces.data();
+        }else{
+            n_slots = (n_dim==3)? 12 : 4;
+            n_per = n_slots/n_dim;
+            table = arrays->cell_edges.data();
+        }
+        share = 1.0/n_per;
+        int_t n_corners = 1<<n_dim;
+        for(int_t corner=0; corner<n_corners; ++corner){
+            for(int_t d=0; d<n_dim; ++d)
+                corner_slots[corner][d] = corner_slot(corner, d);
+        }
+        for(int_t s=0; s<n_slots; ++s){
+            n_touching = 0;
+            for(int_t corner=0; corner<n_corners; ++corner){
+                if(corner_slots[corner][s/n_per]==s)
+                    slot_corners[s][n_touching++] = corner;
+            }
+        }
+        this->prop = prop;
+        this->n_prop = n_prop;
+        this->invert_prop = invert_prop;
+        this->lumped = lumped;
+        // once per cell, in cell order, rather than from n_prop places for
+        // each of the cell's entities
+        if(prop!=NULL){
+            tensors.resize(9*n_cells);
+            parallel_for(n_cells, tree.n_threads,
+                [&](std::size_t begin, std::size_t end){
+                    for(std::size_t c=begin; c<end; ++c)
+                        cell_tensor(c, (double (*)[3]) &tensors[9*c]);
+                });
+        }
+        find_cells();
+    };
+
+    // Counts, then lists, the cells of every entity
+    void find_cells(){
+        EntityCells& out = entity_cells;
+        out.ptr.assign(n_rows+1, 0);
+        for(int_t pass=0; pass<2; ++pass){
+            if(pass==1){
+                for(int_t i=0; i<n_rows; ++i)
+                    out.ptr[i+1] += out.ptr[i];
+                out.cells.resize(out.ptr[n_rows]);
+                out.slots.resize(out.ptr[n_rows]);
+                out.weights.resize(out.ptr[n_rows]);
+            }
+            std::vector<int_t> next(out.ptr.begin(), out.ptr.end()-1);
+            auto found = [&](int_t row, int_t cell, int_t slot, double weight){
+                if(pass==0){
+                    ++out.ptr[row+1];
+                    return;
+                }
+                int_t k = next[row]++;
+                out.cells[k] = cell;
+                out.slots[k] = slot;
+                out.weights[k] = weight;
+            };
+            for(int_t c=0; c<n_cells; ++c){
+                for(int_t s=0; s<n_slots; ++s){
+                    int_t d = s/n_per, i = table[n_slots*c+s];
+                    const Entities& kind = kept[d];
+                    if(i<kind.n){
+                        found(offsets[d]+i, c, s, 1.0);
+                        continue;
+                    }
+                    const ResolvedParents& resolved = *kind.resolved;
+                    for(int_t k=resolved.ptr[i-kind.n]; k<resolved.ptr[i-kind.n+1]; ++k)
+                        found(offsets[d]+resolved.parents[k], c, s, resolved.weights[k]);
+                }
+            }
+        }
+    };
+
+    // Place in the cell's row of the entity in direction d touching corner
+    int_t corner_slot(int_t corner, int_t d) const{
+        if(at_faces)
+            return 2*d+(corner>>d&1);
+        // edges are ordered by the corner's place in the other directions
+        int_t k = 0, bit = 0;
+        for(int_t e=0; e<n_dim; ++e){
+            if(e!=d)
+                k |= (corner>>e&1)<<bit++;
+        }
+        return d*n_per+k;
+    };
+
+    // Which of the n_prop values of a cell gives sigma[d][e], -1 for none
+    int component(int_t d, int_t e) const{
+        if(n_prop==1)
+            return (d==e)? 0 : -1;
+        if(d==e)
+            return d;
+        if(n_prop==n_dim)
+            return -1;
+        if(n_dim==2)
+            return 2;
+        return (d+e==1)? 3 : (d+e==2)? 4 : 5;
+    };
+
+    void cell_tensor(int_t c, double sigma[3][3]) const{
+        for(int_t d=0; d<n_dim; ++d){
+            for(int_t e=0; e<n_dim; ++e){
+                int k = component(d, e);
+                sigma[d][e] = (k<0)? 0.0 : prop[c+k*n_cells];
+            }
+        }
+        if(!invert_prop)
+            return;
+        if(n_prop<=n_dim){
+            for(int_t d=0; d<n_dim; ++d)
+                sigma[d][d] = 1.0/sigma[d][d];
+            return;
+        }
+        double inv[3][3];
+        if(n_dim==2){
+            double det = sigma[0][0]*sigma[1][1]-sigma[0][1]*sigma[1][0];
+            inv[0][0] = sigma[1][1]/det;
+            inv[1][1] = sigma[0][0]/det;
+            inv[0][1] = inv[1][0] = -sigma[0][1]/det;
+        }else{
+            for(int_t d=0; d<3; ++d){
+                for(int_t e=0; e<3; ++e){
+                    int_t d1 = (e+1)%3, d2 = (e+2)%3, e1 = (d+1)%3, e2 = (d+2)%3;
+                    inv[d][e] = sigma[d1][e1]*sigma[d2][e2]-sigma[d1][e2]*sigma[d2][e1];
+                }
+            }
+            double det = sigma[0][0]*inv[0][0]+sigma[0][1]*inv[1][0]+sigma[0][2]*inv[2][0];
+            for(int_t d=0; d<3; ++d){
+                for(int_t e=0; e<3; ++e)
+                    inv[d][e] /= det;
+            }
+        }
+        for(int_t d=0; d<n_dim; ++d){
+            for(int_t e=0; e<n_dim; ++e)
+                sigma[d][e] = inv[d][e];
+        }
+    };
+
+    template<class S>
+    void operator()(int_t r, S& row) const{
+        const EntityCells& ec = entity_cells;
+        int_t n_corners = 1<<n_dim;
+        for(int_t k=ec.ptr[r]; k<ec.ptr[r+1]; ++k){
+            int_t c = ec.cells[k], s = ec.slots[k], d = s/n_per;
+            double weight = ec.weights[k]*arrays->cell_volumes[c];
+            const double (*sigma)[3] = (const double (*)[3]) &tensors[9*c];
+            if(lumped){
+                row.add(r, weight*share*sigma[d][d]);
+                continue;
+            }
+            // the entity itself, at each corner it touches
+            kept[d].add(row, table[n_slots*c+s], weight*share*sigma[d][d], offsets[d]);
+            if(n_prop<=n_dim)
+                continue;
+            weight /= n_corners;
+            for(int_t j=0; j<n_touching; ++j){
+                const int_t *slots = corner_slots[slot_corners[s][j]];
+                for(int_t e=0; e<n_dim; ++e){
+                    if(e!=d)
+                        kept[e].add(row, table[n_slots*c+slots[e]], weight*sigma[d][e], offsets[e]);
+                }
+            }
+        }
+    };
+};
+
+// Rows of the derivative of inner_product u with respect to the property,
+// which it depends on linearly
+class InnerProductDerivRows : public InnerProductRows{
+  public:
+    const double *u;
+
+    InnerProductDerivRows(Tree& tree, int_t location, const double *u, int_t n_prop, bool lumped)
+        : InnerProductRows(tree, location, NULL, n_prop, false, lumped){
+        this->u = u;
+        n_cols = n_prop*n_cells;
+    };
+
+    template<class S>
+    void operator()(int_t r, S& row) const{
+        const EntityCells& ec = entity_cells;
+        int_t n_corners = 1<<n_dim;
+        for(int_t k=ec.ptr[r]; k<ec.ptr[r+1]; ++k){
+            int_t c = ec.cells[k], s = ec.slots[k], d = s/n_per;
+            double weight = ec.weights[k]*arrays->cell_volumes[c];
+            if(lumped){
+                int_t col = c+((n_prop==1)? 0 : d*n_cells);
+                row.add(col, weight*share*((u!=NULL)? u[r] : 1.0));
+                continue;
+            }
+            // u at an entity, from its parents if it hangs
+            Product value;
+            value.x = u;
+            value.sum = 0.0;
+            kept[d].add(value, table[n_slots*c+s], 1.0, offsets[d]);
+            row.add(c+component(d, d)*n_cells, weight*share*value.sum);
+            if(n_prop<=n_dim)
+                continue;
+            weight /= n_corners;
+            for(int_t j=0; j<n_touching; ++j){
+                const int_t *slots = corner_slots[slot_corners[s][j]];
+                for(int_t e=0; e<n_dim; ++e){
+                    if(e==d)
+                        continue;
+                    value.sum = 0.0;
+                    kept[e].add(value, table[n_slots*c+slots[e]], 1.0, offsets[e]);
+                    row.add(c+component(d, e)*n_cells, weight*value.sum);
+                }
+            }
+        }
+    };
+};
+
+void inner_product(Tree& tree, int_t location, const double *prop, int_t n_prop,
+                   bool invert_prop, bool lumped, bool invert_matrix, CSRMatrix& out){
+    InnerProductRows rows(tree, location, prop, n_prop, invert_prop, lumped);
+    assemble(rows.n_rows, rows.n_cols, tree.n_threads, rows, out);
+    if(lumped && invert_matrix){
+        for(std::size_t k=0; k<out.data.size(); ++k)
+            out.data[k] = 1.0/out.data[k];
+    }
+}
+
+void inner_product_deriv(Tree& tree, int_t location, const double *u, int_t n_prop, bool lumped,
+                         CSRMatrix& out){
+    InnerProductDerivRows rows(tree, location, u, n_prop, lumped);
+    assemble(rows.n_rows, rows.n_cols, tree.n_threads, rows, out);
+}
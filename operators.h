@@ -0,0 +1,110 @@
+#ifndef __OPERATORS_H
+#define __OPERATORS_H
+
+#include <vector>
+#include "tree.h"
+
+// Sparse matrix in compressed sparse row form, laid out like
+// scipy.sparse.csr_matrix: row i holds indices/data[indptr[i]:indptr[i+1]],
+// with its columns sorted and unique.
+class CSRMatrix{
+  public:
+    int_t n_rows, n_cols;
+    std::vector<int_t> indptr, indices;
+    std::vector<double> data;
+
+    CSRMatrix();
+    int_t nnz(){ return indices.size();};
+};
+
+// Differential and averaging operators of a numbered tree, assembled
+// straight into CSR over n_threads threads. Node, edge and face values are
+// taken on the non hanging entities only: every hanging entity is replaced
+// by its parents while the rows are built, which gives the same matrices
+// as multiplying by the _deflate_* restrictions afterwards.
+//
+// As in MeshArrays, 2D faces are edges (x faces are y edges and the other
+// way around) and face/edge columns and rows are stacked by direction.
+
+// nC x nF
+void face_divergence(Tree& tree, CSRMatrix& out);
+// nF x nE, 3D only
+void edge_curl(Tree& tree, CSRMatrix& out);
+// nE x nN
+void nodal_gradient(Tree& tree, CSRMatrix& out);
+
+// nC x nN
+void average_nodes_to_cells(Tree& tree, CSRMatrix& out);
+// nC x nE in one direction, or all of them with ALL_DIRECTIONS (below)
+void average_edges_to_cells(Tree& tree, int_t direction, CSRMatrix& out);
+// nC x nF in one direction, or all of them with ALL_DIRECTIONS (below)
+void average_faces_to_cells(Tree& tree, int_t direction, CSRMatrix& out);
+
+// Operators that can be applied without assembling them
+enum{ OP_FACE_DIVERGENCE, OP_EDGE_CURL, OP_NODAL_GRADIENT,
+      OP_AVERAGE_NODES, OP_AVERAGE_EDGES, OP_AVERAGE_FACES };
+// Direction of the averages from edges or faces that takes the mean over all
+// directions, with their columns stacked (aveE2CC and aveF2CC)
+enum{ ALL_DIRECTIONS = 3 };
+
+// Shape of one of the operators above, direction is only used by averages
+void operator_shape(Tree& tree, int_t op, int_t direction, int_t& n_rows, int_t& n_cols);
+// out = A in, or with transpose out = A^T in, without building A: the rows
+// are worked out from MeshArrays again on every call, on n_threads threads.
+// The transpose needs A by column, which is kept in tree.arrays.transposed
+// from its first use until the tree is numbered again. The result matches
+// the product with the assembled matrix up to rounding, and is the same on
+// any number of threads.
+void apply_operator(Tree& tree, int_t op, int_t direction, bool transpose,
+                    const double *in, double *out);
+
+// Kinds of locations to interpolate from
+enum{ AT_NODES, AT_CELLS, AT_EDGES, AT_FACES };
+
+// Interpolation from values at one kind of location (edges and faces in one
+// direction) to n_points points of n_dim coordinates, n_points x (nN, nC,
+// nE or nF) with edge and face columns stacked as above. Points are located
+// with Tree::containing_cells, and weights come from the cell holding each
+// point:
+//   nodes  (bi/tri)linear between the cell's corners
+//   faces  linear between the cell's two faces in that direction
+//   edges  (bi)linear between the cell's edges in that direction, across
+//          the other directions
+//   cells  (bi/tri)linear between the cell's center and the centers of the
+//          cells of its size next to it on the point's side, finer cells
+//          there averaged and coarser ones interpolated to those centers
+// Points outside the mesh take the value at the nearest place on its
+// boundary, or get an empty row with zeros_outside. Cell values are also
+// held constant past the outermost cell centers.
+void interpolation_matrix(Tree& tree, const double *points, int_t n_points, int_t location,
+                          int_t direction, bool zeros_outside, CSRMatrix& out);
+
+// Projection of the non hanging entities of one kind (AT_NODES, AT_EDGES or
+// AT_FACES, edges and faces in one direction) onto all of them, hanging ones
+// included: each hanging row holds its final non hanging parents, followed
+// through any hanging ones, and their weights. ntN x nN, ntE x nE or ntF x nF
+void hanging_projection(Tree& tree, int_t location, int_t direction, CSRMatrix& out);
+
+// Inner product (mass) matrix of faces or edges (location AT_FACES or
+// AT_EDGES), nF x nF or nE x nE, for a property given in every cell by
+// n_prop values, each stored for all cells in turn: 1 (isotropic), n_dim
+// (anisotropic), or 3 (2D) or 6 (3D) for a full tensor, xx, yy, xy or xx,
+// yy, zz, xy, xz, yz. As in discretize, each cell adds vol/2^n_dim v^T sigma v
+// over its corners, v holding the entity of each direction that touches the
+// corner, hanging ones taken from their parents. invert_prop inverts sigma
+// in each cell first. lumped keeps only the diagonal: each entity gets its
+// share of the vol sigma of its cells in its direction, as discretize's fast
+// inner products do for isotropic and anisotropic properties, and
+// invert_matrix then inverts it.
+void inner_product(Tree& tree, int_t location, const double *prop, int_t n_prop,
+                   bool invert_prop, bool lumped, bool invert_matrix, CSRMatrix& out);
+// Derivative of inner_product(...) u with respect to the property, which
+// it is linear in, n x n_prop*nC. lumped gives that of the lumped matrix,
+// with u NULL taken as all ones.
+void inner_product_deriv(Tree& tree, int_t location, const double *u, int_t n_prop, bool lumped,
+                         CSRMatrix& out);
+
+// Difference of the two cells on either side of each face in one direction
+// (hanging faces included, rows of boundary faces are empty), ntF x nC
+void cell_gradient_stencil(Tree& tree, int_t direction, CSRMatrix& out);
+#endif
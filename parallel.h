@@ -0,0 +1,38 @@
+#ifndef __PARALLEL_H
+#define __PARALLEL_H
+
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <cstddef>
+
+// Runs body(begin, end) over [0, n) on n_threads threads. Work is handed out
+// in chunks from a shared counter so threads that finish early pick up the
+// remaining ranges. With n_threads<=1 (or too little work) the body is
+// called once on the calling thread.
+template<class F>
+void parallel_for(std::size_t n, std::size_t n_threads, F body, std::size_t chunk=0){
+    if(n==0)
+        return;
+    if(chunk==0)
+        chunk = n/(8*(n_threads? n_threads:1))+1;
+    if(n_threads<=1 || n<=chunk){
+        body(std::size_t(0), n);
+        return;
+    }
+    std::atomic<std::size_t> next(0);
+    auto worker = [&](){
+        std::size_t begin;
+        while((begin = next.fetch_add(chunk)) < n){
+            std::size_t end = (begin+chunk < n)? begin+chunk : n;
+            body(begin, end);
+        }
+    };
+    std::vector<std::thread> threads;
+    for(std::size_t i=1; i<n_threads; ++i)
+        threads.push_back(std::thread(worker));
+    worker();
+    for(std::size_t i=0; i<threads.size(); ++i)
+        threads[i].join();
+}
+#endif
@@ -0,0 +1,90 @@
+#ifndef __POOL_H
+#define __POOL_H
+
+#include <vector>
+#include <new>
+#include <cstddef>
+
+// Typed slab allocator. Objects are handed out from contiguous blocks of
+// block_size elements and never move, so raw pointers into the pool stay
+// valid for its whole lifetime. Objects handed back with free() are reused
+// by later allocations, and everything is released at once when the pool is
+// cleared or destroyed.
+//
+// alloc() returns uninitialized storage, construct into it with placement new:
+//     Node *node = new (pool.alloc()) Node(...);
+//
+// Objects may be larger than sizeof(T), for types that keep arrays past
+// their end (Cell), see set_item_size.
+template<class T, std::size_t block_size=4096>
+class Pool{
+    std::vector<T *> blocks;
+    std::vector<T *> released; // freed objects, ready to be handed out again
+    std::size_t n_used; // objects handed out from the last block
+    std::size_t item_size; // bytes per object
+
+    Pool(const Pool&);
+    Pool& operator=(const Pool&);
+
+    T* at(std::size_t ib, std::size_t i){
+        return reinterpret_cast<T *>(reinterpret_cast<char *>(blocks[ib])+i*item_size);
+    };
+
+  public:
+    Pool(){
+        n_used = block_size;
+        item_size = sizeof(T);
+    };
+
+    ~Pool(){
+        clear();
+    };
+
+    // Only while the pool is empty, size has to keep the alignment of T
+    void set_item_size(std::size_t size){
+        item_size = size;
+    };
+
+    void* alloc(){
+        if(!released.empty()){
+            T *item = released.back();
+            released.pop_back();
+            return item;
+        }
+        if(n_used==block_size){
+            blocks.push_back(static_cast<T *>(::operator new(block_size*item_size)));
+            n_used = 0;
+        }
+        return at(blocks.size()-1, n_used++);
+    };
+
+    // Hands an object back for reuse. It stays constructed (all of the
+    // pooled types are trivially destructible) until it is allocated again.
+    void free(T *item){
+        released.push_back(item);
+    };
+
+    // Objects in use
+    std::size_t size(){
+        if(blocks.empty())
+            return 0;
+        return (blocks.size()-1)*block_size+n_used-released.size();
+    };
+
+    T& operator[](std::size_t i){
+        return *at(i/block_size, i%block_size);
+    };
+
+    void clear(){
+        for(std::size_t ib=0; ib<blocks.size(); ++ib){
+            std::size_t n = (ib+1==blocks.size())? n_used : block_size;
+            for(std::size_t i=0; i<n; ++i)
+                at(ib, i)->~T();
+            ::operator delete(blocks[ib]);
+        }
+        blocks.clear();
+        released.clear();
+        n_used = block_size;
+    };
+};
+#endif
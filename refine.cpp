@@ -0,0 +1,256 @@
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include "refine.h"
+
+// Leaves hold at most this many primitives
+static const int_t leaf_size = 8;
+
+class CenterLess{
+    const double *lo, *hi;
+    int_t dim;
+  public:
+    CenterLess(const double *l, const double *h, int_t d){
+        lo = l;
+        hi = h;
+        dim = d;
+    };
+    bool operator()(int_t a, int_t b) const{
+        return lo[3*a+dim]+hi[3*a+dim] < lo[3*b+dim]+hi[3*b+dim];
+    };
+};
+
+void BoxTree::build(const double *lo, const double *hi, int_t n){
+    node_lo.clear();
+    node_hi.clear();
+    node_start.clear();
+    node_count.clear();
+    node_right.clear();
+    order.resize(n);
+    for(int_t i=0; i<n; ++i)
+        order[i] = i;
+    if(n>0)
+        build_node(lo, hi, 0, n, 0);
+}
+
+int_t BoxTree::build_node(const double *lo, const double *hi, int_t start, int_t count, int_t depth){
+    int_t node = node_start.size();
+    node_start.push_back(start);
+    node_count.push_back(0);
+    node_right.push_back(0);
+    for(int_t i=0; i<3; ++i){
+        node_lo.push_back(lo[3*order[start]+i]);
+        node_hi.push_back(hi[3*order[start]+i]);
+    }
+    for(int_t ip=start; ip<start+count; ++ip){
+        for(int_t i=0; i<3; ++i){
+            node_lo[3*node+i] = std::min(node_lo[3*node+i], lo[3*order[ip]+i]);
+            node_hi[3*node+i] = std::max(node_hi[3*node+i], hi[3*order[ip]+i]);
+        }
+    }
+    if(count<=leaf_size || depth>=60){
+        node_count[node] = count;
+        return node;
+    }
+    // split at the median along the longest side
+    int_t split_dim = 0;
+    for(int_t i=1; i<3; ++i){
+        if(node_hi[3*node+i]-node_lo[3*node+i] > node_hi[3*node+split_dim]-node_lo[3*node+split_dim])
+            split_dim = i;
+    }
+    int_t half = count/2;
+    std::nth_element(order.begin()+start, order.begin()+start+half, order.begin()+start+count,
+                     CenterLess(lo, hi, split_dim));
+    build_node(lo, hi, start, half, depth+1);
+    int_t right = build_node(lo, hi, start+half, count-half, depth+1);
+    node_right[node] = right;
+    return node;
+}
+
+class PointNear{
+    const double *points, *x0, *x1;
+    double dist_sq;
+  public:
+    PointNear(const double *pts, const double *lo, const double *hi, double d){
+        points = pts;
+        x0 = lo;
+        x1 = hi;
+        dist_sq = d*d;
+    };
+    bool operator()(int_t i){
+        const double *p = points+3*i;
+        return box_distance_sq(x0, x1, p, p) <= dist_sq;
+    };
+};
+
+PointsRegion::PointsRegion(const double *pts, int_t n, double dist, int_t lev){
+    points.assign(pts, pts+3*n);
+    distance = dist;
+    level = lev;
+    tree.build(&points[0], &points[0], n);
+}
+
+bool PointsRegion::intersects(const double *x0, const double *x1) const{
+    if(points.empty())
+        return false;
+    PointNear near(&points[0], x0, x1, distance);
+    return tree.any(x0, x1, distance, near);
+}
+
+static inline void sub(const double *a, const double *b, double *out){
+    out[0] = a[0]-b[0];
+    out[1] = a[1]-b[1];
+    out[2] = a[2]-b[2];
+}
+
+static inline void cross(const double *a, const double *b, double *out){
+    out[0] = a[1]*b[2]-a[2]*b[1];
+    out[1] = a[2]*b[0]-a[0]*b[2];
+    out[2] = a[0]*b[1]-a[1]*b[0];
+}
+
+static inline double dot(const double *a, const double *b){
+    return a[0]*b[0]+a[1]*b[1]+a[2]*b[2];
+}
+
+// Separating axis test between a simplex (segment or triangle) already
+// shifted to the box center and a box with half widths h. Returns true if
+// the axis separates them.
+static inline bool separates(const double *axis, const double *v, int_t n_per, const double *h){
+    double r = h[0]*std::fabs(axis[0])+h[1]*std::fabs(axis[1])+h[2]*std::fabs(axis[2]);
+    double p_min = dot(axis, v), p_max = p_min;
+    for(int_t i=1; i<n_per; ++i){
+        double p = dot(axis, v+3*i);
+        p_min = std::min(p_min, p);
+        p_max = std::max(p_max, p);
+    }
+    return p_min > r || p_max < -r;
+}
+
+static bool simplex_box_overlap(const double *corners, int_t n_per, const double *x0, const double *x1){
+    double c[3], h[3], v[9], e[9], axis[3];
+    for(int_t i=0; i<3; ++i){
+        c[i] = 0.5*(x0[i]+x1[i]);
+        h[i] = 0.5*(x1[i]-x0[i]);
+    }
+    for(int_t i=0; i<n_per; ++i)
+        sub(corners+3*i, c, v+3*i);
+
+    // box face normals
+    for(int_t i=0; i<3; ++i){
+        axis[0] = axis[1] = axis[2] = 0.0;
+        axis[i] = 1.0;
+        if(separates(axis, v, n_per, h))
+            return false;
+    }
+    int_t n_edges = (n_per==3)? 3 : 1;
+    for(int_t i=0; i<n_edges; ++i)
+        sub(v+3*((i+1)%n_per), v+3*i, e+3*i);
+    // triangle normal
+    if(n_per==3){
+        cross(e, e+3, axis);
+        if(separates(axis, v, n_per, h))
+            return false;
+    }
+    // edge x box axis cross products
+    for(int_t i=0; i<n_edges; ++i){
+        for(int_t j=0; j<3; ++j){
+            double unit[3] = {0.0, 0.0, 0.0};
+            unit[j] = 1.0;
+            cross(e+3*i, unit, axis);
+            if(separates(axis, v, n_per, h))
+                return false;
+        }
+    }
+    return true;
+}
+
+class SimplexNear{
+    const double *simplices, *x0, *x1;
+    int_t n_per;
+  public:
+    SimplexNear(const double *s, int_t n, const double *lo, const double *hi){
+        simplices = s;
+        n_per = n;
+        x0 = lo;
+        x1 = hi;
+    };
+    bool operator()(int_t i){
+        return simplex_box_overlap(simplices+3*n_per*i, n_per, x0, x1);
+    };
+};
+
+SurfaceRegion::SurfaceRegion(const double *corners, int_t n, int_t n_corners, double dist, int_t lev){
+    simplices.assign(corners, corners+3*n_corners*n);
+    n_per = n_corners;
+    distance = dist;
+    level = lev;
+    std::vector<double> lo(3*n), hi(3*n);
+    for(int_t i=0; i<n; ++i){
+        for(int_t j=0; j<3; ++j){
+            lo[3*i+j] = hi[3*i+j] = simplices[3*n_per*i+j];
+            for(int_t k=1; k<n_per; ++k){
+                lo[3*i+j] = std::min(lo[3*i+j], simplices[3*n_per*i+3*k+j]);
+                hi[3*i+j] = std::max(hi[3*i+j], simplices[3*n_per*i+3*k+j]);
+            }
+        }
+    }
+    if(n>0)
+        tree.build(&lo[0], &hi[0], n);
+}
+
+bool SurfaceRegion::intersects(const double *x0, const double *x1) const{
+    // Cells within distance of the surface are found by growing the cell's
+    // box by distance, so near corners this reaches slightly further.
+    if(simplices.empty())
+        return false;
+    double y0[3], y1[3];
+    for(int_t i=0; i<3; ++i){
+        y0[i] = x0[i]-distance;
+        y1[i] = x1[i]+distance;
+    }
+    SimplexNear near(&simplices[0], n_per, y0, y1);
+    return tree.any(y0, y1, 0.0, near);
+}
+
+RefineCriteria::RefineCriteria(){
+    min_level = 0;
+}
+
+void RefineCriteria::add_ball(double *center, double radius, int_t level){
+    BallRegion ball;
+    for(int_t i=0; i<3; ++i)
+        ball.center[i] = center[i];
+    ball.radius = radius;
+    ball.level = level;
+    balls.push_back(ball);
+}
+
+void RefineCriteria::add_box(double *x0, double *x1, int_t level){
+    BoxRegion box;
+    for(int_t i=0; i<3; ++i){
+        box.lo[i] = std::min(x0[i], x1[i]);
+        box.hi[i] = std::max(x0[i], x1[i]);
+    }
+    box.level = level;
+    boxes.push_back(box);
+}
+
+void RefineCriteria::add_half_space(double *origin, double *normal, int_t level){
+    HalfSpaceRegion half_space;
+    for(int_t i=0; i<3; ++i){
+        half_space.origin[i] = origin[i];
+        half_space.normal[i] = normal[i];
+    }
+    half_space.level = level;
+    half_spaces.push_back(half_space);
+}
+
+void RefineCriteria::add_points(double *points, int_t n_points, double distance, int_t level){
+    point_sets.push_back(PointsRegion(points, n_points, distance, level));
+}
+
+void RefineCriteria::add_surface(double *corners, int_t n_simplices, int_t n_per,
+                                 double distance, int_t level){
+    surfaces.push_back(SurfaceRegion(corners, n_simplices, n_per, distance, level));
+}
@@ -0,0 +1,174 @@
+#ifndef __REFINE_H
+#define __REFINE_H
+
+#include <vector>
+#include "tree.h"
+
+// Built in refinement criteria that are evaluated entirely in C++.
+// Every region is tested against the cell's bounding box [x0, x1] and asks
+// for a level. All coordinates are stored in 3D, 2D meshes use z=0
+// throughout, which makes the z terms vanish.
+
+inline double box_distance_sq(const double *a0, const double *a1,
+                              const double *b0, const double *b1){
+    // Squared distance between two axis aligned boxes (0 if they overlap)
+    double d = 0.0;
+    for(int_t i=0; i<3; ++i){
+        double gap = a0[i]-b1[i];
+        if(b0[i]-a1[i] > gap)
+            gap = b0[i]-a1[i];
+        if(gap > 0)
+            d += gap*gap;
+    }
+    return d;
+}
+
+// Bounding volume hierarchy over a set of axis aligned boxes, used to find
+// the points or surface simplices near a cell without scanning all of them.
+class BoxTree{
+  public:
+    std::vector<double> node_lo, node_hi; // 3 per node
+    std::vector<int_t> node_start, node_count, node_right;
+    std::vector<int_t> order; // primitive indices, grouped by leaf
+
+    void build(const double *lo, const double *hi, int_t n);
+
+    // Calls test(prim) for each primitive whose box is within pad of
+    // [x0, x1], until one of them returns true.
+    template<class F>
+    bool any(const double *x0, const double *x1, double pad, F& test) const{
+        if(node_start.empty())
+            return false;
+        double pad_sq = pad*pad;
+        int_t stack[64];
+        int_t n_stack = 0;
+        stack[n_stack++] = 0;
+        while(n_stack){
+            int_t node = stack[--n_stack];
+            if(box_distance_sq(x0, x1, &node_lo[3*node], &node_hi[3*node]) > pad_sq)
+                continue;
+            if(node_count[node]){
+                for(int_t i=node_start[node]; i<node_start[node]+node_count[node]; ++i){
+                    if(test(order[i]))
+                        return true;
+                }
+            }else{
+                stack[n_stack++] = node_right[node];
+                stack[n_stack++] = node+1;
+            }
+        }
+        return false;
+    };
+
+  private:
+    int_t build_node(const double *lo, const double *hi, int_t start, int_t count, int_t depth);
+};
+
+class BallRegion{
+  public:
+    double center[3], radius;
+    int_t level;
+
+    inline bool intersects(const double *x0, const double *x1) const{
+        return box_distance_sq(x0, x1, center, center) < radius*radius;
+    };
+};
+
+class BoxRegion{
+  public:
+    double lo[3], hi[3];
+    int_t level;
+
+    inline bool intersects(const double *x0, const double *x1) const{
+        for(int_t i=0; i<3; ++i){
+            if(x1[i] < lo[i] || x0[i] > hi[i])
+                return false;
+        }
+        return true;
+    };
+};
+
+class HalfSpaceRegion{
+  public:
+    // Everything on the side of the plane that the normal points away from
+    double origin[3], normal[3];
+    int_t level;
+
+    inline bool intersects(const double *x0, const double *x1) const{
+        double d = 0.0;
+        for(int_t i=0; i<3; ++i)
+            d += normal[i]*((normal[i] > 0? x0[i] : x1[i])-origin[i]);
+        return d <= 0.0;
+    };
+};
+
+class PointsRegion{
+  public:
+    std::vector<double> points; // 3 per point
+    BoxTree tree;
+    double distance;
+    int_t level;
+
+    PointsRegion(const double *pts, int_t n, double dist, int_t lev);
+    bool intersects(const double *x0, const double *x1) const;
+};
+
+class SurfaceRegion{
+  public:
+    // Triangles (or line segments in 2D) stored as n_per corner points each
+    std::vector<double> simplices;
+    int_t n_per;
+    BoxTree tree;
+    double distance;
+    int_t level;
+
+    SurfaceRegion(const double *corners, int_t n, int_t n_per, double dist, int_t lev);
+    bool intersects(const double *x0, const double *x1) const;
+};
+
+class RefineCriteria{
+  public:
+    int_t min_level;
+    std::vector<BallRegion> balls;
+    std::vector<BoxRegion> boxes;
+    std::vector<HalfSpaceRegion> half_spaces;
+    std::vector<PointsRegion> point_sets;
+    std::vector<SurfaceRegion> surfaces;
+
+    RefineCriteria();
+
+    void add_ball(double *center, double radius, int_t level);
+    void add_box(double *x0, double *x1, int_t level);
+    void add_half_space(double *origin, double *normal, int_t level);
+    void add_points(double *points, int_t n_points, double distance, int_t level);
+    void add_surface(double *corners, int_t n_simplices, int_t n_per, double distance, int_t level);
+
+    // The highest level asked for by any region the box [x0, x1] touches,
+    // regions at or below current_level are not tested.
+    template<class R>
+    inline void max_level(const std::vector<R>& regions, const double *x0, const double *x1,
+                          int_t current_level, int_t& target) const{
+        for(typename std::vector<R>::size_type i=0; i<regions.size(); ++i){
+            const R& region = regions[i];
+            if(region.level > target && region.level > current_level
+                    && region.intersects(x0, x1))
+                target = region.level;
+        }
+    };
+
+    inline int_t operator()(Cell *cell) const{
+        double x0[3], x1[3];
+        for(int_t i=0; i<3; ++i){
+            x0[i] = (i<cell->n_dim)? cell->x0[i] : 0.0;
+            x1[i] = (i<cell->n_dim)? cell->x1[i] : 0.0;
+        }
+        int_t target = min_level;
+        max_level(balls, x0, x1, cell->level, target);
+        max_level(boxes, x0, x1, cell->level, target);
+        max_level(half_spaces, x0, x1, cell->level, target);
+        max_level(point_sets, x0, x1, cell->level, target);
+        max_level(surfaces, x0, x1, cell->level, target);
+        return target;
+    };
+};
+#endif
@@ -1,11 +1,19 @@
 from distutils.core import setup, Extension
 from Cython.Build import cythonize
 import numpy as np
+import os
+
+# Set TREE_MORTON_KEYS=1 to order entities by Morton keys (see tree.h)
+macros = []
+if os.environ.get("TREE_MORTON_KEYS", "0") != "0":
+    macros.append(("MORTON_KEYS", None))
 
 setup(
     ext_modules=cythonize(Extension(
         "tree_ext",
-        sources=["tree_ext.pyx", "tree.cpp"],
+        sources=["tree_ext.pyx", "tree.cpp", "refine.cpp", "linear_tree.cpp",
+                 "operators.cpp", "mesh_file.cpp", "ubc_file.cpp", "stats.cpp"],
         language="c++",
         include_dirs=[np.get_include()],
+        define_macros=macros,
     )))
@@ -0,0 +1,76 @@
+#include <chrono>
+#include <cstring>
+#include "stats.h"
+
+TreeStats::TreeStats() : map_probes(0){
+    enabled = false;
+    trace = NULL;
+    trace_start = 0.0;
+    first_event = true;
+    clear();
+}
+
+TreeStats::~TreeStats(){
+    close_trace();
+}
+
+void TreeStats::clear(){
+    phases.clear();
+    test_calls = 0;
+    test_seconds = 0.0;
+    cells_spawned = 0;
+    forced_splits = 0;
+    map_probes = 0;
+}
+
+double TreeStats::now(){
+    return std::chrono::duration<double>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void TreeStats::add_phase(const char *name, double start, double seconds){
+    // few names, so a linear search
+    std::size_t i = 0;
+    while(i<phases.size() && std::strcmp(phases[i].name, name)!=0)
+        ++i;
+    if(i==phases.size()){
+        Phase phase;
+        phase.name = name;
+        phase.seconds = 0.0;
+        phase.calls = 0;
+        phases.push_back(phase);
+    }
+    phases[i].seconds += seconds;
+    phases[i].calls += 1;
+
+    if(trace==NULL)
+        return;
+    fprintf(trace, "%s\n{\"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": 1, "
+            "\"ts\": %.3f, \"dur\": %.3f, \"args\": {\"test_calls\": %llu, "
+            "\"cells_spawned\": %llu, \"forced_splits\": %llu, \"map_probes\": %llu}}",
+            first_event? "" : ",", name, 1e6*(start-trace_start), 1e6*seconds,
+            test_calls, cells_spawned, forced_splits, map_probes.load());
+    fflush(trace);
+    first_event = false;
+}
+
+bool TreeStats::set_trace(const std::string& path){
+    close_trace();
+    if(path.empty())
+        return true;
+    trace = fopen(path.c_str(), "w");
+    if(trace==NULL)
+        return false;
+    fprintf(trace, "[");
+    trace_start = now();
+    first_event = true;
+    return true;
+}
+
+void TreeStats::close_trace(){
+    if(trace==NULL)
+        return;
+    fprintf(trace, "\n]\n");
+    fclose(trace);
+    trace = NULL;
+}
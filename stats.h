@@ -0,0 +1,74 @@
+#ifndef __STATS_H
+#define __STATS_H
+
+#include <vector>
+#include <string>
+#include <atomic>
+#include <cstdio>
+
+// Where the time of a Tree goes: the wall time of its phases and counters
+// of the work in them. Nothing is recorded unless enabled, and then only
+// once per phase, per test_func call and per hash table probe, so leaving
+// it compiled in costs a branch in each of those places.
+//
+// Phases nest (finalize_lists runs inside build_tree, ...) and are summed by
+// name. With a trace file, each phase is also written to it as it ends, as
+// a Chrome trace event ("ph": "X", times in microseconds), which
+// chrome://tracing and Perfetto show as a timeline.
+class TreeStats{
+  public:
+    class Phase{
+      public:
+        const char *name;
+        double seconds;
+        unsigned long long calls;
+    };
+
+    bool enabled;
+    std::vector<Phase> phases;
+    unsigned long long test_calls; // of the refinement function, per cell
+    double test_seconds;
+    unsigned long long cells_spawned;
+    unsigned long long forced_splits; // of neighbors, for the 2:1 balance
+    std::atomic<unsigned long long> map_probes; // slots visited in the KeyMaps
+
+    TreeStats();
+    ~TreeStats();
+    void clear();
+    // Starts writing the phases to path (closing any earlier trace), or
+    // stops with an empty path. Returns false if it cannot be opened.
+    bool set_trace(const std::string& path);
+    // Seconds from an arbitrary start
+    static double now();
+    void add_phase(const char *name, double start, double seconds);
+
+  private:
+    FILE *trace;
+    double trace_start;
+    bool first_event;
+    void close_trace();
+};
+
+// Times the scope it lives in as a phase of stats, if they are enabled
+class PhaseTimer{
+  public:
+    PhaseTimer(TreeStats& stats, const char *name){
+        this->stats = stats.enabled? &stats : NULL;
+        this->name = name;
+        if(this->stats)
+            start = TreeStats::now();
+    };
+    ~PhaseTimer(){
+        if(stats)
+            stats->add_phase(name, start, TreeStats::now()-start);
+    };
+
+  private:
+    TreeStats *stats;
+    const char *name;
+    double start;
+
+    PhaseTimer(const PhaseTimer&);
+    PhaseTimer& operator=(const PhaseTimer&);
+};
+#endif
@@ -0,0 +1,62 @@
+import zlib
+import numpy as np
+from tree_ext import RefineCriteria
+from test_updates import make_mesh, differences
+
+# Refining a level at a time has to give the same tree as the depth first
+# recursion, whichever way the targets are found: RefineCriteria over any
+# number of threads, and a batch function against the same function called
+# per cell
+
+
+def random_criteria(dim, level, rs):
+    extent = np.array([2**level*(1+0.1*d) for d in range(dim)])
+    criteria = RefineCriteria()
+    for i in range(3):
+        criteria.add_ball(rs.rand(dim)*extent, rs.rand()*extent[0]/4, rs.randint(1, level+1))
+    criteria.add_points(rs.rand(20, dim)*extent, 0.5, rs.randint(1, level+1))
+    x0 = rs.rand(dim)*extent
+    criteria.add_box(x0, x0+rs.rand(dim)*extent/4, rs.randint(1, level+1))
+    return criteria
+
+
+def random_targets(level, seed):
+    # a target level for each cell that jumps around between neighbors and
+    # levels, so it depends on nothing but the cell
+    def target(center, width):
+        key = np.floor(2*center/width).astype(np.int64)
+        return zlib.crc32(key.tobytes(), seed) % (level+1)
+    return target
+
+
+def compare(dim, level, seed):
+    rs = np.random.RandomState(seed)
+    criteria = random_criteria(dim, level, rs)
+    meshes = []
+    for n_threads in [1, 2, 3]:
+        mesh = make_mesh(dim, level)
+        mesh.num_threads = n_threads
+        mesh.refine(criteria)
+        meshes.append(mesh)
+        bad = differences(mesh, meshes[0])
+        assert not bad, 'RefineCriteria {0:d}D level {1:d} seed {2:d} on {3:d} threads: {4}'.format(
+            dim, level, seed, n_threads, bad)
+
+    target = random_targets(level, seed)
+    per_cell = make_mesh(dim, level)
+    per_cell.refine(lambda cell: target(cell.center, cell.h))
+    batch = make_mesh(dim, level)
+    batch.refine(lambda centers, widths, levels: np.array(
+        [target(c, w) for c, w in zip(centers, widths)]), batch=True)
+    bad = differences(batch, per_cell)
+    assert not bad, 'batch {0:d}D level {1:d} seed {2:d}: {3}'.format(dim, level, seed, bad)
+    return meshes[0].nC, batch.nC
+
+
+if __name__ == '__main__':
+    n_cells = []
+    for dim, levels, seeds in ((2, range(2, 9), 20), (3, range(2, 6), 6)):
+        for level in levels:
+            for seed in range(seeds):
+                n_cells.append(compare(dim, level, seed))
+    print(len(n_cells), 'cases the same, up to', np.max(n_cells, axis=0), 'cells')
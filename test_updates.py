@@ -0,0 +1,215 @@
+import numpy as np
+from TreeMesh import TreeMesh as Tree
+
+# Meshes updated in place have to match a mesh built from scratch with the
+# same cells, entity for entity
+
+
+def make_mesh(dim, level):
+    h = [np.ones(2**level)*(1+0.1*d) for d in range(dim)]
+    return Tree(h, levels=level)
+
+
+def cell_levels(mesh):
+    return np.array([mesh[i]._level for i in range(mesh.nC)], dtype=np.int_)
+
+
+def rebuild(mesh, level):
+    fresh = make_mesh(mesh.dim, level)
+    fresh._insert_cells(np.array(mesh.gridCC), cell_levels(mesh))
+    fresh.number()
+    return fresh
+
+
+def _sparse(mat):
+    mat = mat.tocsr()
+    mat.sort_indices()
+    mat.eliminate_zeros()
+    return (mat.shape, mat.indptr.copy(), mat.indices.copy(), mat.data.copy())
+
+
+def describe(mesh):
+    # Everything the mesh hands out about its cells, nodes, edges and faces
+    dim = mesh.dim
+    names = ['nC', 'ntN', 'nhN', 'ntEx', 'nhEx', 'ntEy', 'nhEy',
+             'gridCC', 'h_gridded', 'gridN', 'gridhN', 'gridEx', 'gridEy',
+             'gridhEx', 'gridhEy', 'cell_nodes', 'cell_faces', 'cell_edges',
+             'faceDiv', 'nodalGrad', 'cellGradStencil']
+    if dim == 3:
+        names += ['ntEz', 'nhEz', 'ntFx', 'nhFx', 'ntFy', 'nhFy', 'ntFz', 'nhFz',
+                  'gridEz', 'gridFx', 'gridFy', 'gridFz',
+                  'gridhEz', 'gridhFx', 'gridhFy', 'gridhFz', 'edgeCurl']
+    out = {}
+    for name in names:
+        value = getattr(mesh, name)
+        out[name] = _sparse(value) if hasattr(value, 'tocsr') else np.array(value)
+    for d in range(dim):
+        out['edge_nodes%d' % d] = np.array(mesh._edge_nodes(d))
+        if dim == 3:
+            out['face_edges%d' % d] = np.array(mesh._face_edges(d))
+    deflate = ['_deflate_nodes', '_deflate_edges_x', '_deflate_edges_y']
+    if dim == 3:
+        deflate += ['_deflate_edges_z', '_deflate_faces']
+    for name in deflate:
+        out[name] = _sparse(getattr(mesh, name)())
+    return out
+
+
+def differences(a, b):
+    da, db = describe(a), describe(b)
+    bad = []
+    for name in da:
+        x, y = da[name], db[name]
+        if isinstance(x, tuple):
+            same = x[0] == y[0] and all(
+                np.array_equal(p, q) for p, q in zip(x[1:], y[1:]))
+        else:
+            same = x.shape == y.shape and np.array_equal(x, y)
+        if not same:
+            bad.append(name)
+    return bad
+
+
+def check_maps(split, old_cc, old_h, new_cc, old_to_new, new_to_old):
+    # every new cell lies in the old cell new_to_old names, kept cells map
+    # back and forth, and the picked cells above the finest level are split
+    inside = np.all(np.abs(new_cc-old_cc[new_to_old]) <= old_h[new_to_old]/2, axis=1)
+    kept = old_to_new >= 0
+    assert inside.all(), 'new cells outside their old cell'
+    assert np.array_equal(new_cc[old_to_new[kept]], old_cc[kept]), 'kept cells moved'
+    assert np.array_equal(new_to_old[old_to_new[kept]], np.nonzero(kept)[0]), \
+        'old_to_new and new_to_old disagree'
+    assert not kept[split].any(), 'picked cells were not split'
+
+
+def ball_mesh(dim, level):
+    mesh = make_mesh(dim, level)
+    center = 0.4*2**level
+    mesh.refine(lambda cell: level-1 if np.linalg.norm(cell.center-center) < center/2 else level-3)
+    return mesh
+
+
+def scattered_mesh(dim, level, rs, n=40):
+    mesh = make_mesh(dim, level)
+    points = rs.rand(n, dim)*2**level
+    mesh._insert_cells(points, rs.randint(1, level, n).astype(np.int_))
+    mesh.number()
+    return mesh
+
+
+def refine_random(mesh, level, rs):
+    dim = mesh.dim
+    for step in range(5):
+        old_cc = np.array(mesh.gridCC)
+        old_h = np.array(mesh.h_gridded)
+        old_levels = cell_levels(mesh)
+        pick = rs.choice(mesh.nC, max(1, mesh.nC//20), replace=False)
+        old_to_new, new_to_old = mesh.refine_cells(pick)
+        split = pick[old_levels[pick] < level]
+        check_maps(split, old_cc, old_h, np.array(mesh.gridCC), old_to_new, new_to_old)
+        fresh = rebuild(mesh, level)
+        bad = differences(mesh, fresh)
+        assert not bad, 'refine_cells {0:d}D step {1:d}: {2}'.format(dim, step, bad)
+        check_links(mesh, fresh)
+    print('refine_cells', dim, 'D ok,', mesh.nC, 'cells')
+
+
+def check_links(mesh, fresh):
+    # reference counts, what the pools hold (so nothing released is lost or
+    # still in use), neighbor pointers and the 2:1 balance across them
+    refs, fresh_refs = mesh._references(), fresh._references()
+    for name in refs:
+        assert refs[name] == fresh_refs[name], 'references of {0} differ'.format(name)
+    keys, neighbors = mesh._neighbor_keys()
+    fresh_keys, fresh_neighbors = fresh._neighbor_keys()
+    assert np.array_equal(keys, fresh_keys), 'cells differ'
+    assert np.array_equal(neighbors, fresh_neighbors), 'neighbors differ'
+    levels = dict(zip(keys, cell_levels(mesh)))
+    for key, level, near in zip(keys, cell_levels(mesh), neighbors):
+        for other in near:
+            assert levels.get(other, level) >= level-1, 'unbalanced at {0:d}'.format(key)
+
+
+def coarsen_random(mesh, level, rs):
+    # coarsens the cells in randomly picked blocks of a coarse grid one
+    # level at a time, siblings share their block
+    dim = mesh.dim
+    n_block = 4
+    width = np.array([2**level*(1+0.1*d) for d in range(dim)])/n_block
+    for step in range(4):
+        picked = rs.rand(*([n_block]*dim)) < 0.4
+        def coarser(cell):
+            block = tuple(np.minimum((cell.center/width).astype(int), n_block-1))
+            return cell._level-1 if picked[block] else cell._level
+        old_cc = np.array(mesh.gridCC)
+        old_h = np.array(mesh.h_gridded)
+        old_to_new, new_to_old = mesh.coarsen(coarser)
+        new_cc = np.array(mesh.gridCC)
+        new_h = np.array(mesh.h_gridded)
+        # every old cell lies in the new cell old_to_new names, and cells
+        # that were not merged map back and forth
+        inside = np.all(np.abs(old_cc-new_cc[old_to_new]) <= new_h[old_to_new]/2, axis=1)
+        assert inside.all(), 'old cells outside their new cell'
+        kept = new_to_old >= 0
+        assert np.array_equal(old_cc[new_to_old[kept]], new_cc[kept]), 'kept cells moved'
+        assert np.array_equal(old_to_new[new_to_old[kept]], np.nonzero(kept)[0]), \
+            'old_to_new and new_to_old disagree'
+        merged = ~kept[old_to_new]
+        assert np.all(new_h[old_to_new[merged]] > 1.5*old_h[merged]), \
+            'merged cells are not larger than the ones they hold'
+        fresh = rebuild(mesh, level)
+        bad = differences(mesh, fresh)
+        assert not bad, 'coarsen {0:d}D step {1:d}: {2}'.format(dim, step, bad)
+        check_links(mesh, fresh)
+    print('coarsen', dim, 'D ok,', mesh.nC, 'cells')
+
+
+def test_refine_cells(dim, level, seed):
+    rs = np.random.RandomState(seed)
+    for mesh in [ball_mesh(dim, level), scattered_mesh(dim, level, rs)]:
+        refine_random(mesh, level, rs)
+
+
+def test_coarsen(dim, level, seed):
+    rs = np.random.RandomState(seed)
+    mesh = make_mesh(dim, level)
+    mesh.refine(level-1)
+    coarsen_random(mesh, level, rs)
+    mesh = ball_mesh(dim, level)
+    refine_random(mesh, level, rs)
+    coarsen_random(mesh, level, rs)
+
+
+def test_threads(dim, level, seed):
+    # finalize_lists, with add_leaf_entities and the hanging lists, has to
+    # come out the same however many threads build it, and so do the
+    # updates on top of it
+    rs = np.random.RandomState(seed)
+    points = rs.rand(60, dim)*2**level
+    levels = rs.randint(1, level+1, 60).astype(np.int_)
+    meshes = []
+    for n_threads in [1, 2, 3, 4]:
+        mesh = make_mesh(dim, level)
+        mesh.num_threads = n_threads
+        mesh._insert_cells(points, levels)
+        mesh.number()
+        bad = differences(mesh, meshes[0]) if meshes else []
+        assert not bad, '{0:d}D with {1:d} threads: {2}'.format(dim, n_threads, bad)
+        meshes.append(mesh)
+    for mesh in meshes:
+        refine_random(mesh, level, np.random.RandomState(seed))
+        coarsen_random(mesh, level, np.random.RandomState(seed))
+        bad = differences(mesh, meshes[0])
+        assert not bad, '{0:d}D updates with {1:d} threads: {2}'.format(
+            dim, mesh.num_threads, bad)
+        check_links(mesh, meshes[0])
+    print('threads', dim, 'D ok,', meshes[0].nC, 'cells')
+
+
+if __name__ == '__main__':
+    test_refine_cells(2, 6, 0)
+    test_refine_cells(3, 5, 1)
+    test_coarsen(2, 6, 2)
+    test_coarsen(3, 5, 3)
+    test_threads(2, 6, 4)
+    test_threads(3, 5, 5)
@@ -1,234 +1,171 @@
 #include <vector>
-#include <map>
+#include <algorithm>
 #include "tree.h"
+#include "refine.h"
+#include "parallel.h"
+#include "morton.h"
 #include <iostream>
 
+// The sizes of the entities with 64 bit pointers, so that growing one is a
+// deliberate change (all of them are allocated once per mesh entity)
+static_assert(sizeof(void *)!=8 || (sizeof(Node)==20 && sizeof(Edge)==40 &&
+                                    sizeof(Face)==56 && sizeof(Cell)==80),
+              "the size of a mesh entity changed");
+
 Node::Node(){
     location_ind[0] = 0;
     location_ind[1] = 0;
     location_ind[2] = 0;
-    location[0] = 0;
-    location[1] = 0;
-    location[2] = 0;
-    key = 0;
     reference = 0;
     index = 0;
     hanging = false;
-    parents[0] = NULL;
-    parents[1] = NULL;
-    parents[2] = NULL;
-    parents[3] = NULL;
+    hanging_refs = 0;
 };
 
-Node::Node(int_t ix, int_t iy, int_t iz, double* xs, double *ys, double *zs){
+Node::Node(int_t ix, int_t iy, int_t iz){
     location_ind[0] = ix;
     location_ind[1] = iy;
     location_ind[2] = iz;
-    location[0] = xs[ix];
-    location[1] = ys[iy];
-    location[2] = zs[iz];
-    key = key_func(ix, iy, iz);
     reference = 0;
+    index = 0;
     hanging = false;
-    parents[0] = NULL;
-    parents[1] = NULL;
-    parents[2] = NULL;
-    parents[3] = NULL;
+    hanging_refs = 0;
 };
 
 Edge::Edge(){
     location_ind[0] = 0;
     location_ind[1] = 0;
     location_ind[2] = 0;
-    location[0] = 0;
-    location[1] = 0;
-    location[2] = 0;
-    key = 0;
     index = 0;
     reference = 0;
     hanging = false;
+    hanging_refs = 0;
     points[0] = NULL;
     points[1] = NULL;
-    parents[0] = NULL;
-    parents[1] = NULL;
 };
 
 Edge::Edge(Node& p1, Node& p2){
       points[0] = &p1;
       points[1] = &p2;
-      int_t ix, iy, iz;
-      ix = (p1.location_ind[0]+p2.location_ind[0])/2;
-      iy = (p1.location_ind[1]+p2.location_ind[1])/2;
-      iz = (p1.location_ind[2]+p2.location_ind[2])/2;
-      key = key_func(ix, iy, iz);
-      location_ind[0] = ix;
-      location_ind[1] = iy;
-      location_ind[2] = iz;
-
-      location[0] = (p1[0]+p2[0])*0.5;
-      location[1] = (p1[1]+p2[1])*0.5;
-      location[2] = (p1[2]+p2[2])*0.5;
-      length = (p2[0]-p1[0])
-                +(p2[1]-p1[1])
-                +(p2[2]-p1[2]);
+      location_ind[0] = (p1.location_ind[0]+p2.location_ind[0])/2;
+      location_ind[1] = (p1.location_ind[1]+p2.location_ind[1])/2;
+      location_ind[2] = (p1.location_ind[2]+p2.location_ind[2])/2;
+      index = 0;
       reference = 0;
       hanging = false;
-      parents[0] = NULL;
-      parents[1] = NULL;
+      hanging_refs = 0;
 }
 
 Face::Face(){
     location_ind[0] = 0;
     location_ind[1] = 0;
     location_ind[2] = 0;
-    key = 0;
     reference = 0;
     index = 0;
-    area = 0;
     hanging = false;
-    points[0] = NULL;
-    points[1] = NULL;
-    points[2] = NULL;
-    points[3] = NULL;
     edges[0] = NULL;
     edges[1] = NULL;
     edges[2] = NULL;
     edges[3] = NULL;
-    parent = NULL;
 }
 
 Face::Face(Node& p1, Node& p2, Node& p3, Node& p4){
-    points[0]= &p1;
-    points[1]= &p2;
-    points[2]= &p3;
-    points[3]= &p4;
-    int_t ix, iy, iz;
-    ix = (p1.location_ind[0]+p2.location_ind[0]+p3.location_ind[0]+p4.location_ind[0])/4;
-    iy = (p1.location_ind[1]+p2.location_ind[1]+p3.location_ind[1]+p4.location_ind[1])/4;
-    iz = (p1.location_ind[2]+p2.location_ind[2]+p3.location_ind[2]+p4.location_ind[2])/4;
-    key = key_func(ix, iy, iz);
-    location_ind[0] = ix;
-    location_ind[1] = iy;
-    location_ind[2] = iz;
-
-    location[0] = (p1[0]+p2[0]+p3[0]+p4[0])*0.25;
-    location[1] = (p1[1]+p2[1]+p3[1]+p4[1])*0.25;
-    location[2] = (p1[2]+p2[2]+p3[2]+p4[2])*0.25;
-    area = ((p2[0]-p1[0])+(p2[1]-p1[1])+(p2[2]-p1[2]))*
-           ((p3[0]-p1[0])+(p3[1]-p1[1])+(p3[2]-p1[2]));
+    location_ind[0] = (p1.location_ind[0]+p2.location_ind[0]+p3.location_ind[0]+p4.location_ind[0])/4;
+    location_ind[1] = (p1.location_ind[1]+p2.location_ind[1]+p3.location_ind[1]+p4.location_ind[1])/4;
+    location_ind[2] = (p1.location_ind[2]+p2.location_ind[2]+p3.location_ind[2]+p4.location_ind[2])/4;
+    index = 0;
     reference = 0;
     hanging = false;
-    parent = NULL;
     edges[0] = NULL;
     edges[1] = NULL;
     edges[2] = NULL;
     edges[3] = NULL;
 }
 
-Node * set_default_node(node_map_t& nodes, int_t x, int_t y, int_t z,
-                        double *xs, double *ys, double *zs){
-  int_t key = key_func(x, y, z);
-  Node * point;
-  if(nodes.count(key)==0){
-    point = new Node(x, y, z, xs, ys, zs);
-    nodes[key] = point;
-  }
-  else{
-    point = nodes[key];
+Node * set_default_node(node_map_t& nodes, node_pool_t& pool, int_t x, int_t y, int_t z){
+  Node *&point = nodes[key_func(x, y, z)];
+  if(point==NULL){
+    point = new (pool.alloc()) Node(x, y, z);
   }
   return point;
 }
 
-Edge * set_default_edge(edge_map_t& edges, Node& p1, Node& p2){
+Edge * set_default_edge(edge_map_t& edges, edge_pool_t& pool, Node& p1, Node& p2){
   int_t xC = (p1.location_ind[0]+p2.location_ind[0])/2;
   int_t yC = (p1.location_ind[1]+p2.location_ind[1])/2;
   int_t zC = (p1.location_ind[2]+p2.location_ind[2])/2;
-  int_t key = key_func(xC, yC, zC);
-  Edge * edge;
-  if(edges.count(key)==0){
-    edge = new Edge(p1, p2);
-    edges[key] = edge;
-  }
-  else{
-    edge = edges[key];
+  Edge *&edge = edges[key_func(xC, yC, zC)];
+  if(edge==NULL){
+    edge = new (pool.alloc()) Edge(p1, p2);
   }
   return edge;
 };
 
-Face * set_default_face(face_map_t& faces, Node& p1, Node& p2, Node& p3, Node& p4){
+Face * set_default_face(face_map_t& faces, face_pool_t& pool,
+                        Node& p1, Node& p2, Node& p3, Node& p4){
     int_t x, y, z, key;
     x = (p1.location_ind[0]+p2.location_ind[0]+p3.location_ind[0]+p4.location_ind[0])/4;
     y = (p1.location_ind[1]+p2.location_ind[1]+p3.location_ind[1]+p4.location_ind[1])/4;
     z = (p1.location_ind[2]+p2.location_ind[2]+p3.location_ind[2]+p4.location_ind[2])/4;
     key = key_func(x, y, z);
-    Face * face;
-    if(faces.count(key)==0){
-        face = new Face(p1, p2, p3, p4);
-        faces[key] = face;
-    }
-    else{
-        face = faces[key];
+    Face *&face = faces[key];
+    if(face==NULL){
+        face = new (pool.alloc()) Face(p1, p2, p3, p4);
     }
     return face;
 }
 
-Cell::Cell(Node *pts[8], int_t ndim, int_t maxlevel, function func){
+// Sets the geometry of a cell from its first and last points
+static void set_cell_geometry(Cell *cell, Node *p1, Node *p2, double *xs, double *ys, double *zs){
+    double *grids[3] = {xs, ys, zs};
+    for(int_t d=0; d<3; ++d){
+        cell->location_ind[d] = (p1->location_ind[d]+p2->location_ind[d])/2;
+        cell->x0[d] = grids[d][p1->location_ind[d]];
+        cell->x1[d] = grids[d][p2->location_ind[d]];
+    }
+}
+
+Cell::Cell(Node *pts[8], int_t ndim, int_t maxlevel, double *xs, double *ys, double *zs){
     n_dim = ndim;
     int_t n_points = 1<<n_dim;
     for(int_t i=0; i<n_points; ++i)
-        points[i] = pts[i];
+        points()[i] = pts[i];
     level = 0;
     max_level = maxlevel;
     parent = NULL;
-    test_func = func;
-    Node p1 = *pts[0];
-    Node p2 = *pts[n_points-1];
-    location_ind[0] = (p1.location_ind[0]+p2.location_ind[0])/2;
-    location_ind[1] = (p1.location_ind[1]+p2.location_ind[1])/2;
-    location_ind[2] = (p1.location_ind[2]+p2.location_ind[2])/2;
-    location[0] = (p1[0]+p2[0])*0.5;
-    location[1] = (p1[1]+p2[1])*0.5;
-    location[2] = (p1[2]+p2[2])*0.5;
-    volume = (p2[0]-p1[0])*(p2[1]-p1[1]);
-    if(n_dim==3)
-        volume *= (p2[2]-p1[2]);
-    key = key_func(location_ind[0],location_ind[1],location_ind[2]);
+    set_cell_geometry(this, pts[0], pts[n_points-1], xs, ys, zs);
     for(int_t i=0; i<n_points; ++i)
-        children[i] = NULL;
+        children()[i] = NULL;
     for(int_t i=0; i<2*n_dim; ++i)
-        neighbors[i] = NULL;
+        neighbors()[i] = NULL;
 };
 
-Cell::Cell(Node *pts[8], Cell *parent){
+Cell::Cell(Node *pts[8], Cell *parent, double *xs, double *ys, double *zs){
+    this->parent = parent;
     n_dim = parent->n_dim;
     int_t n_points = 1<<n_dim;
     for(int_t i=0; i<n_points; ++i)
-        points[i] = pts[i];
+        points()[i] = pts[i];
     level = parent->level+1;
     max_level = parent->max_level;
-    test_func = parent->test_func;
-    Node p1 = *pts[0];
-    Node p2 = *pts[n_points-1];
-    location_ind[0] = (p1.location_ind[0]+p2.location_ind[0])/2;
-    location_ind[1] = (p1.location_ind[1]+p2.location_ind[1])/2;
-    location_ind[2] = (p1.location_ind[2]+p2.location_ind[2])/2;
-    location[0] = (p1[0]+p2[0])*0.5;
-    location[1] = (p1[1]+p2[1])*0.5;
-    location[2] = (p1[2]+p2[2])*0.5;
-
-    volume = (p2[0]-p1[0])*(p2[1]-p1[1]);
-    if(n_dim==3)
-        volume *= (p2[2]-p1[2]);
-
-    key = key_func(location_ind[0], location_ind[1], location_ind[2]);
-
+    set_cell_geometry(this, pts[0], pts[n_points-1], xs, ys, zs);
     for(int_t i=0; i<n_points; ++i)
-        children[i] = NULL;
+        children()[i] = NULL;
     for(int_t i=0; i<2*n_dim; ++i)
-        neighbors[i] = NULL;
+        neighbors()[i] = NULL;
 };
 
-void Cell::spawn(node_map_t& nodes, Cell *kids[8], double *xs, double *ys, double *zs){
+void Cell::spawn(node_map_t& nodes, node_pool_t& node_pool, cell_pool_t& cell_pool,
+                 Cell *kids[8], double *xs, double *ys, double *zs){
+    if(n_dim==3)
+        spawn<3>(nodes, node_pool, cell_pool, kids, xs, ys, zs);
+    else
+        spawn<2>(nodes, node_pool, cell_pool, kids, xs, ys, zs);
+}
+
+template<int_t D>
+void Cell::spawn(node_map_t& nodes, node_pool_t& node_pool, cell_pool_t& cell_pool,
+                 Cell *kids[8], double *xs, double *ys, double *zs){
     /*      z0              z0+dz/2          z0+dz
         p03--p13--p04    p20--p21--p22   p07--p27--p08
         |     |    |     |     |    |    |     |    |
@@ -236,10 +173,10 @@ void Cell::spawn(node_map_t& nodes, Cell *kids[8], double *xs, double *ys, doubl
         |     |    |     |     |    |    |     |    |
         p01--p09--p02    p14--p15--p16   p05--p23--p06
     */
-    Node *p1 = points[0];
-    Node *p2 = points[1];
-    Node *p3 = points[2];
-    Node *p4 = points[3];
+    Node *p1 = points()[0];
+    Node *p2 = points()[1];
+    Node *p3 = points()[2];
+    Node *p4 = points()[3];
 
     int_t x0, y0, xC, yC, xF, yF, z0;
 
@@ -252,11 +189,11 @@ void Cell::spawn(node_map_t& nodes, Cell *kids[8], double *xs, double *ys, doubl
     yC = location_ind[1];
 
     Node *p9, *p10, *p11, *p12, *p13;
-    p9  = set_default_node(nodes, xC, y0, z0, xs, ys, zs);
-    p10 = set_default_node(nodes, x0, yC, z0, xs, ys, zs);
-    p11 = set_default_node(nodes, xC, yC, z0, xs, ys, zs);
-    p12 = set_default_node(nodes, xF, yC, z0, xs, ys, zs);
-    p13 = set_default_node(nodes, xC, yF, z0, xs, ys, zs);
+    p9  = set_default_node(nodes, node_pool, xC, y0, z0);
+    p10 = set_default_node(nodes, node_pool, x0, yC, z0);
+    p11 = set_default_node(nodes, node_pool, xC, yC, z0);
+    p12 = set_default_node(nodes, node_pool, xF, yC, z0);
+    p13 = set_default_node(nodes, node_pool, xC, yF, z0);
 
     //Increment node references for new nodes
     p9->reference += 2;
@@ -265,11 +202,11 @@ void Cell::spawn(node_map_t& nodes, Cell *kids[8], double *xs, double *ys, doubl
     p12->reference += 2;
     p13->reference += 2;
 
-    if(n_dim>2){
-        Node *p5 = points[4];
-        Node *p6 = points[5];
-        Node *p7 = points[6];
-        Node *p8 = points[7];
+    if(D==3){
+        Node *p5 = points()[4];
+        Node *p6 = points()[5];
+        Node *p7 = points()[6];
+        Node *p8 = points()[7];
 
         int_t zC, zF;
 
@@ -279,21 +216,21 @@ void Cell::spawn(node_map_t& nodes, Cell *kids[8], double *xs, double *ys, doubl
         Node *p14, *p15, *p16, *p17, *p18, *p19, *p20, *p21, *p22;
         Node *p23, *p24, *p25, *p26, *p27;
 
-        p14 = set_default_node(nodes, x0, y0, zC, xs, ys, zs);
-        p15 = set_default_node(nodes, xC, y0, zC, xs, ys, zs);
-        p16 = set_default_node(nodes, xF, y0, zC, xs, ys, zs);
-        p17 = set_default_node(nodes, x0, yC, zC, xs, ys, zs);
-        p18 = set_default_node(nodes, xC, yC, zC, xs, ys, zs);
-        p19 = set_default_node(nodes, xF, yC, zC, xs, ys, zs);
-        p20 = set_default_node(nodes, x0, yF, zC, xs, ys, zs);
-        p21 = set_default_node(nodes, xC, yF, zC, xs, ys, zs);
-        p22 = set_default_node(nodes, xF, yF, zC, xs, ys, zs);
-
-        p23 = set_default_node(nodes, xC, y0, zF, xs, ys, zs);
-        p24 = set_default_node(nodes, x0, yC, zF, xs, ys, zs);
-        p25 = set_default_node(nodes, xC, yC, zF, xs, ys, zs);
-        p26 = set_default_node(nodes, xF, yC, zF, xs, ys, zs);
-        p27 = set_default_node(nodes, xC, yF, zF, xs, ys, zs);
+        p14 = set_default_node(nodes, node_pool, x0, y0, zC);
+        p15 = set_default_node(nodes, node_pool, xC, y0, zC);
+        p16 = set_default_node(nodes, node_pool, xF, y0, zC);
+        p17 = set_default_node(nodes, node_pool, x0, yC, zC);
+        p18 = set_default_node(nodes, node_pool, xC, yC, zC);
+        p19 = set_default_node(nodes, node_pool, xF, yC, zC);
+        p20 = set_default_node(nodes, node_pool, x0, yF, zC);
+        p21 = set_default_node(nodes, node_pool, xC, yF, zC);
+        p22 = set_default_node(nodes, node_pool, xF, yF, zC);
+
+        p23 = set_default_node(nodes, node_pool, xC, y0, zF);
+        p24 = set_default_node(nodes, node_pool, x0, yC, zF);
+        p25 = set_default_node(nodes, node_pool, xC, yC, zF);
+        p26 = set_default_node(nodes, node_pool, xF, yC, zF);
+        p27 = set_default_node(nodes, node_pool, xC, yF, zF);
 
         //Increment node references
         p14->reference += 2;
@@ -321,24 +258,24 @@ void Cell::spawn(node_map_t& nodes, Cell *kids[8], double *xs, double *ys, doubl
         Node * pQC7[8] = {p17,p18,p20,p21,p24,p25,p7,p27};
         Node * pQC8[8] = {p18,p19,p21,p22,p25,p26,p27,p8};
 
-        kids[0] = new Cell(pQC1,this);
-        kids[1] = new Cell(pQC2,this);
-        kids[2] = new Cell(pQC3,this);
-        kids[3] = new Cell(pQC4,this);
-        kids[4] = new Cell(pQC5,this);
-        kids[5] = new Cell(pQC6,this);
-        kids[6] = new Cell(pQC7,this);
-        kids[7] = new Cell(pQC8,this);
+        kids[0] = new (cell_pool.alloc()) Cell(pQC1, this, xs, ys, zs);
+        kids[1] = new (cell_pool.alloc()) Cell(pQC2, this, xs, ys, zs);
+        kids[2] = new (cell_pool.alloc()) Cell(pQC3, this, xs, ys, zs);
+        kids[3] = new (cell_pool.alloc()) Cell(pQC4, this, xs, ys, zs);
+        kids[4] = new (cell_pool.alloc()) Cell(pQC5, this, xs, ys, zs);
+        kids[5] = new (cell_pool.alloc()) Cell(pQC6, this, xs, ys, zs);
+        kids[6] = new (cell_pool.alloc()) Cell(pQC7, this, xs, ys, zs);
+        kids[7] = new (cell_pool.alloc()) Cell(pQC8, this, xs, ys, zs);
     }
     else{
         Node * pQC1[8] = {p1,p9,p10,p11,NULL,NULL,NULL,NULL};
         Node * pQC2[8] = {p9,p2,p11,p12,NULL,NULL,NULL,NULL};
         Node * pQC3[8] = {p10,p11,p3,p13,NULL,NULL,NULL,NULL};
         Node * pQC4[8] = {p11,p12,p13,p4,NULL,NULL,NULL,NULL};
-        kids[0] = new Cell(pQC1,this);
-        kids[1] = new Cell(pQC2,this);
-        kids[2] = new Cell(pQC3,this);
-        kids[3] = new Cell(pQC4,this);
+        kids[0] = new (cell_pool.alloc()) Cell(pQC1, this, xs, ys, zs);
+        kids[1] = new (cell_pool.alloc()) Cell(pQC2, this, xs, ys, zs);
+        kids[2] = new (cell_pool.alloc()) Cell(pQC3, this, xs, ys, zs);
+        kids[3] = new (cell_pool.alloc()) Cell(pQC4, this, xs, ys, zs);
     }
 };
 
@@ -347,204 +284,318 @@ void Cell::set_neighbor(Cell * other, int_t position){
         return;
     }
     if(level != other->level){
-        neighbors[position] = other;
+        neighbors()[position] = other;
     }else{
-        neighbors[position] = other;
-        other->neighbors[position^1] = this;
+        neighbors()[position] = other;
+        other->neighbors()[position^1] = this;
     }
 };
 
-void Cell::insert_cell(node_map_t& nodes, double *new_cell, int_t p_level, double *xs, double *ys, double *zs){
+void Cell::insert_cell(node_map_t& nodes, node_pool_t& node_pool, cell_pool_t& cell_pool,
+                       double *new_cell, int_t p_level, double *xs, double *ys, double *zs){
+    if(n_dim==3)
+        insert_cell<3>(nodes, node_pool, cell_pool, new_cell, p_level, xs, ys, zs);
+    else
+        insert_cell<2>(nodes, node_pool, cell_pool, new_cell, p_level, xs, ys, zs);
+}
+
+template<int_t D>
+void Cell::insert_cell(node_map_t& nodes, node_pool_t& node_pool, cell_pool_t& cell_pool,
+                       double *new_cell, int_t p_level, double *xs, double *ys, double *zs){
     //Inserts a cell at max(max_level,p_level) that contains the given point
-    if(p_level>level){
+    Cell *cell = this;
+    while(p_level>cell->level){
         // Need to go look in children,
         // Need to spawn children if i don't have any...
-        if(is_leaf()){
-            divide(nodes, xs, ys, zs, true);
+        if(cell->is_leaf()){
+            cell->split<D>(nodes, node_pool, cell_pool, xs, ys, zs);
         }
-        int ix = new_cell[0] > location[0];
-        int iy = new_cell[1] > location[1];
-        int iz = n_dim>2 && new_cell[2]>location[2];
-        children[ix + 2*iy + 4*iz]->insert_cell(nodes, new_cell, p_level, xs, ys, zs);
+        int ix = new_cell[0] > cell->center(0);
+        int iy = new_cell[1] > cell->center(1);
+        int iz = D==3 && new_cell[2]>cell->center(2);
+        cell = cell->children()[ix + 2*iy + 4*iz];
     }
 };
 
-void Cell::divide(node_map_t& nodes, double* xs, double* ys, double* zs, bool force, bool balance){
-    bool do_splitting = false;
-    if(level==max_level){
-        do_splitting = false;
-    }else if(force){
-        do_splitting = true;
-    }else{
-        int_t test_level = (*test_func)(this);
-        if(test_level > level){
-            do_splitting = true;
-        }
+int_t Cell::split(node_map_t& nodes, node_pool_t& node_pool, cell_pool_t& cell_pool,
+                  double* xs, double* ys, double* zs, bool balance){
+    if(n_dim==3)
+        return split<3>(nodes, node_pool, cell_pool, xs, ys, zs, balance);
+    else
+        return split<2>(nodes, node_pool, cell_pool, xs, ys, zs, balance);
+}
+
+template<int_t D>
+int_t Cell::split(node_map_t& nodes, node_pool_t& node_pool, cell_pool_t& cell_pool,
+                  double* xs, double* ys, double* zs, bool balance){
+    //If i haven't already been split...
+    if(level==max_level || children()[0]!=NULL){
+        return 0;
     }
-    if(!do_splitting){
-        return;
+    spawn<D>(nodes, node_pool, cell_pool, children(), xs, ys, zs);
+    if(!balance){
+        link_children<D>();
+        return 1;
     }
-    //If i haven't already been split...
-    if(children[0]==NULL){
-        spawn(nodes, children, xs, ys, zs);
-
-        //If I need to be split, and my neighbor is below my level
-        //Then it needs to be split
-        //-x,+x,-y,+y,-z,+z
-        if(balance){
-            for(int_t i=0;i<2*n_dim;++i){
-                if(neighbors[i]!= NULL && neighbors[i]->level < level){
-                    neighbors[i]->divide(nodes, xs, ys, zs, true);
-                }
-            }
-        }
-
-        //Set children's neighbors (first do the easy ones)
-        // all of the children live next to each other
-        children[0]->set_neighbor(children[1],1);
-        children[0]->set_neighbor(children[2],3);
-        children[1]->set_neighbor(children[3],3);
-        children[2]->set_neighbor(children[3],1);
 
-        if(n_dim==3){
-            children[4]->set_neighbor(children[5],1);
-            children[4]->set_neighbor(children[6],3);
-            children[5]->set_neighbor(children[7],3);
-            children[6]->set_neighbor(children[7],1);
-
-            children[0]->set_neighbor(children[4],5);
-            children[1]->set_neighbor(children[5],5);
-            children[2]->set_neighbor(children[6],5);
-            children[3]->set_neighbor(children[7],5);
+    //If I need to be split, and my neighbor is below my level
+    //Then it needs to be split, before its children and mine are linked,
+    //and so on for its neighbors. That chain is followed with a stack of
+    //the cells waiting on their neighbors (from next on, -x,+x,-y,+y,-z,+z)
+    //in the order a recursive split would take. Levels drop along the chain,
+    //so it is never longer than max_key_level+1.
+    struct Waiting{
+        Cell *cell;
+        int_t next;
+    } stack[max_key_level+1];
+    int_t n = 1, n_split = 1;
+    stack[0].cell = this;
+    stack[0].next = 0;
+    while(n>0){
+        Waiting& top = stack[n-1];
+        Cell *cell = top.cell, *other = NULL;
+        while(top.next<2*D && other==NULL){
+            other = cell->neighbors()[top.next++];
+            if(other!=NULL && (other->level>=cell->level || other->children()[0]!=NULL))
+                other = NULL;
+        }
+        if(other!=NULL){
+            other->spawn<D>(nodes, node_pool, cell_pool, other->children(), xs, ys, zs);
+            stack[n].cell = other;
+            stack[n].next = 0;
+            ++n;
+            ++n_split;
+        }else{
+            cell->link_children<D>();
+            --n;
         }
+    }
+    return n_split;
+};
 
+template<int_t D>
+void Cell::link_children(){
+    //Set children's neighbors (first do the easy ones)
+    // all of the children live next to each other
+    children()[0]->set_neighbor(children()[1],1);
+    children()[0]->set_neighbor(children()[2],3);
+    children()[1]->set_neighbor(children()[3],3);
+    children()[2]->set_neighbor(children()[3],1);
+
+    if(D==3){
+        children()[4]->set_neighbor(children()[5],1);
+        children()[4]->set_neighbor(children()[6],3);
+        children()[5]->set_neighbor(children()[7],3);
+        children()[6]->set_neighbor(children()[7],1);
+
+        children()[0]->set_neighbor(children()[4],5);
+        children()[1]->set_neighbor(children()[5],5);
+        children()[2]->set_neighbor(children()[6],5);
+        children()[3]->set_neighbor(children()[7],5);
+    }
+
+    // -x direction
+    if(neighbors()[0] != NULL && !(neighbors()[0]->is_leaf())){
+        children()[0]->set_neighbor(neighbors()[0]->children()[1],0);
+        children()[2]->set_neighbor(neighbors()[0]->children()[3],0);
+    }
+    else{
+        children()[0]->set_neighbor(neighbors()[0],0);
+        children()[2]->set_neighbor(neighbors()[0],0);
+    }
+    // +x direction
+    if(neighbors()[1] != NULL && !neighbors()[1]->is_leaf()){
+        children()[1]->set_neighbor(neighbors()[1]->children()[0],1);
+        children()[3]->set_neighbor(neighbors()[1]->children()[2],1);
+    }else{
+        children()[1]->set_neighbor(neighbors()[1],1);
+        children()[3]->set_neighbor(neighbors()[1],1);
+    }
+    // -y direction
+    if(neighbors()[2] != NULL && !neighbors()[2]->is_leaf()){
+        children()[0]->set_neighbor(neighbors()[2]->children()[2],2);
+        children()[1]->set_neighbor(neighbors()[2]->children()[3],2);
+    }else{
+        children()[0]->set_neighbor(neighbors()[2],2);
+        children()[1]->set_neighbor(neighbors()[2],2);
+    }
+    // +y direction
+    if(neighbors()[3] != NULL && !neighbors()[3]->is_leaf()){
+        children()[2]->set_neighbor(neighbors()[3]->children()[0],3);
+        children()[3]->set_neighbor(neighbors()[3]->children()[1],3);
+    }else{
+        children()[2]->set_neighbor(neighbors()[3],3);
+        children()[3]->set_neighbor(neighbors()[3],3);
+    }
+    if(D==3){
         // -x direction
-        if(neighbors[0] != NULL && !(neighbors[0]->is_leaf())){
-            children[0]->set_neighbor(neighbors[0]->children[1],0);
-            children[2]->set_neighbor(neighbors[0]->children[3],0);
+        if(neighbors()[0] != NULL && !(neighbors()[0]->is_leaf())){
+            children()[4]->set_neighbor(neighbors()[0]->children()[5],0);
+            children()[6]->set_neighbor(neighbors()[0]->children()[7],0);
         }
         else{
-            children[0]->set_neighbor(neighbors[0],0);
-            children[2]->set_neighbor(neighbors[0],0);
+            children()[4]->set_neighbor(neighbors()[0],0);
+            children()[6]->set_neighbor(neighbors()[0],0);
         }
         // +x direction
-        if(neighbors[1] != NULL && !neighbors[1]->is_leaf()){
-            children[1]->set_neighbor(neighbors[1]->children[0],1);
-            children[3]->set_neighbor(neighbors[1]->children[2],1);
+        if(neighbors()[1] != NULL && !neighbors()[1]->is_leaf()){
+            children()[5]->set_neighbor(neighbors()[1]->children()[4],1);
+            children()[7]->set_neighbor(neighbors()[1]->children()[6],1);
         }else{
-            children[1]->set_neighbor(neighbors[1],1);
-            children[3]->set_neighbor(neighbors[1],1);
+            children()[5]->set_neighbor(neighbors()[1],1);
+            children()[7]->set_neighbor(neighbors()[1],1);
         }
         // -y direction
-        if(neighbors[2] != NULL && !neighbors[2]->is_leaf()){
-            children[0]->set_neighbor(neighbors[2]->children[2],2);
-            children[1]->set_neighbor(neighbors[2]->children[3],2);
+        if(neighbors()[2] != NULL && !neighbors()[2]->is_leaf()){
+            children()[4]->set_neighbor(neighbors()[2]->children()[6],2);
+            children()[5]->set_neighbor(neighbors()[2]->children()[7],2);
         }else{
-            children[0]->set_neighbor(neighbors[2],2);
-            children[1]->set_neighbor(neighbors[2],2);
+            children()[4]->set_neighbor(neighbors()[2],2);
+            children()[5]->set_neighbor(neighbors()[2],2);
         }
         // +y direction
-        if(neighbors[3] != NULL && !neighbors[3]->is_leaf()){
-            children[2]->set_neighbor(neighbors[3]->children[0],3);
-            children[3]->set_neighbor(neighbors[3]->children[1],3);
+        if(neighbors()[3] != NULL && !neighbors()[3]->is_leaf()){
+            children()[6]->set_neighbor(neighbors()[3]->children()[4],3);
+            children()[7]->set_neighbor(neighbors()[3]->children()[5],3);
         }else{
-            children[2]->set_neighbor(neighbors[3],3);
-            children[3]->set_neighbor(neighbors[3],3);
+            children()[6]->set_neighbor(neighbors()[3],3);
+            children()[7]->set_neighbor(neighbors()[3],3);
         }
-        if(n_dim==3){
-            // -x direction
-            if(neighbors[0] != NULL && !(neighbors[0]->is_leaf())){
-                children[4]->set_neighbor(neighbors[0]->children[5],0);
-                children[6]->set_neighbor(neighbors[0]->children[7],0);
-            }
-            else{
-                children[4]->set_neighbor(neighbors[0],0);
-                children[6]->set_neighbor(neighbors[0],0);
-            }
-            // +x direction
-            if(neighbors[1] != NULL && !neighbors[1]->is_leaf()){
-                children[5]->set_neighbor(neighbors[1]->children[4],1);
-                children[7]->set_neighbor(neighbors[1]->children[6],1);
-            }else{
-                children[5]->set_neighbor(neighbors[1],1);
-                children[7]->set_neighbor(neighbors[1],1);
-            }
-            // -y direction
-            if(neighbors[2] != NULL && !neighbors[2]->is_leaf()){
-                children[4]->set_neighbor(neighbors[2]->children[6],2);
-                children[5]->set_neighbor(neighbors[2]->children[7],2);
-            }else{
-                children[4]->set_neighbor(neighbors[2],2);
-                children[5]->set_neighbor(neighbors[2],2);
-            }
-            // +y direction
-            if(neighbors[3] != NULL && !neighbors[3]->is_leaf()){
-                children[6]->set_neighbor(neighbors[3]->children[4],3);
-                children[7]->set_neighbor(neighbors[3]->children[5],3);
-            }else{
-                children[6]->set_neighbor(neighbors[3],3);
-                children[7]->set_neighbor(neighbors[3],3);
-            }
-            // -z direction
-            if(neighbors[4] != NULL && !neighbors[4]->is_leaf()){
-                children[0]->set_neighbor(neighbors[4]->children[4],4);
-                children[1]->set_neighbor(neighbors[4]->children[5],4);
-                children[2]->set_neighbor(neighbors[4]->children[6],4);
-                children[3]->set_neighbor(neighbors[4]->children[7],4);
-            }else{
-                children[0]->set_neighbor(neighbors[4],4);
-                children[1]->set_neighbor(neighbors[4],4);
-                children[2]->set_neighbor(neighbors[4],4);
-                children[3]->set_neighbor(neighbors[4],4);
-            }
-            // +z direction
-            if(neighbors[5] != NULL && !neighbors[5]->is_leaf()){
-                children[4]->set_neighbor(neighbors[5]->children[0],5);
-                children[5]->set_neighbor(neighbors[5]->children[1],5);
-                children[6]->set_neighbor(neighbors[5]->children[2],5);
-                children[7]->set_neighbor(neighbors[5]->children[3],5);
-            }else{
-                children[4]->set_neighbor(neighbors[5],5);
-                children[5]->set_neighbor(neighbors[5],5);
-                children[6]->set_neighbor(neighbors[5],5);
-                children[7]->set_neighbor(neighbors[5],5);
-            }
+        // -z direction
+        if(neighbors()[4] != NULL && !neighbors()[4]->is_leaf()){
+            children()[0]->set_neighbor(neighbors()[4]->children()[4],4);
+            children()[1]->set_neighbor(neighbors()[4]->children()[5],4);
+            children()[2]->set_neighbor(neighbors()[4]->children()[6],4);
+            children()[3]->set_neighbor(neighbors()[4]->children()[7],4);
+        }else{
+            children()[0]->set_neighbor(neighbors()[4],4);
+            children()[1]->set_neighbor(neighbors()[4],4);
+            children()[2]->set_neighbor(neighbors()[4],4);
+            children()[3]->set_neighbor(neighbors()[4],4);
         }
-    }
-    if(!force){
-        for(int_t i=0;i<(1<<n_dim);++i){
-            children[i]->divide(nodes, xs, ys, zs);
+        // +z direction
+        if(neighbors()[5] != NULL && !neighbors()[5]->is_leaf()){
+            children()[4]->set_neighbor(neighbors()[5]->children()[0],5);
+            children()[5]->set_neighbor(neighbors()[5]->children()[1],5);
+            children()[6]->set_neighbor(neighbors()[5]->children()[2],5);
+            children()[7]->set_neighbor(neighbors()[5]->children()[3],5);
+        }else{
+            children()[4]->set_neighbor(neighbors()[5],5);
+            children()[5]->set_neighbor(neighbors()[5],5);
+            children()[6]->set_neighbor(neighbors()[5],5);
+            children()[7]->set_neighbor(neighbors()[5],5);
         }
     }
 };
 
-void Cell::build_cell_vector(cell_vec_t& cells){
-    if(this->is_leaf()){
-        cells.push_back(this);
-        return;
-    }
-    for(int_t i=0;i< 1ULL<<n_dim;++i){
-        children[i]->build_cell_vector(cells);
-    }
+template<class F>
+int_t Cell::divide(node_map_t& nodes, node_pool_t& node_pool, cell_pool_t& cell_pool,
+                   double* xs, double* ys, double* zs, F& test){
+    if(n_dim==3)
+        return divide<3>(nodes, node_pool, cell_pool, xs, ys, zs, test);
+    else
+        return divide<2>(nodes, node_pool, cell_pool, xs, ys, zs, test);
 }
 
-Cell* Cell::containing_cell(double x, double y, double z){
+template<int_t D, class F>
+int_t Cell::divide(node_map_t& nodes, node_pool_t& node_pool, cell_pool_t& cell_pool,
+                   double* xs, double* ys, double* zs, F& test){
+    int_t n_forced = 0;
+    auto visit = [&](Cell *cell){
+        if(cell->level==max_level || test(cell) <= cell->level)
+            return false;
+        int_t n_split = cell->split<D>(nodes, node_pool, cell_pool, xs, ys, zs);
+        n_forced += (n_split>1)? n_split-1 : 0;
+        return true;
+    };
+    walk_cells<D>(this, visit);
+    return n_forced;
+};
+
+bool Cell::coarsen(node_map_t& nodes, cell_vec_t& removed, std::vector<Node *>& released){
+    // Undoes split, merging the children (which have to be leaves) back into
+    // this cell. Nothing is merged if a child has a split neighbor, whose
+    // children would end up two levels finer than this cell. The children
+    // are only detached and handed back in removed, along with the nodes no
+    // cell has anymore in released, which are taken out of nodes.
     if(is_leaf()){
-      return this;
+        return false;
+    }
+    int_t n_kids = 1<<n_dim;
+    for(int_t k=0; k<n_kids; ++k){
+        if(!children()[k]->is_leaf())
+            return false;
+    }
+    for(int_t k=0; k<n_kids; ++k){
+        for(int_t i=0; i<2*n_dim; ++i){
+            Cell *other = children()[k]->neighbors()[i];
+            if(other!=NULL && other->level==level+1 && !other->is_leaf())
+                return false;
+        }
     }
-    int ix = x>location[0];
-    int iy = y>location[1];
-    int iz = n_dim>2 && z>location[2];
-    return children[ix + 2*iy + 4*iz]->containing_cell(x,y,z);
-};
 
-Cell::~Cell(){
-        if(is_leaf()){
-            return;
+    // Neighbors the size of my children, which pointed at them, now point at me
+    for(int_t k=0; k<n_kids; ++k){
+        for(int_t i=0; i<2*n_dim; ++i){
+            Cell *other = children()[k]->neighbors()[i];
+            if(other!=NULL && other->neighbors()[i^1]==children()[k])
+                other->neighbors()[i^1] = this;
         }
-        for(int_t i=0; i< (1<<n_dim);++i){
-            delete children[i];
+    }
+
+    // spawn counted each new node once for every child it is a corner of,
+    // which is every corner of child k but the k'th (that one is mine)
+    for(int_t k=0; k<n_kids; ++k){
+        for(int_t j=0; j<n_kids; ++j){
+            if(j==k)
+                continue;
+            Node *node = children()[k]->points()[j];
+            if(--node->reference==0){
+                nodes.erase(node->key());
+                released.push_back(node);
+            }
         }
+    }
+    for(int_t k=0; k<n_kids; ++k){
+        removed.push_back(children()[k]);
+        children()[k] = NULL;
+    }
+    return true;
+};
+
+void Cell::build_cell_vector(cell_vec_t& cells){
+    if(n_dim==3)
+        build_cell_vector<3>(cells);
+    else
+        build_cell_vector<2>(cells);
+}
+
+template<int_t D>
+void Cell::build_cell_vector(cell_vec_t& cells){
+    auto visit = [&](Cell *cell){
+        if(cell->is_leaf())
+            cells.push_back(cell);
+        return true;
+    };
+    walk_cells<D>(this, visit);
+}
+
+Cell* Cell::containing_cell(double x, double y, double z){
+    if(n_dim==3)
+        return containing_cell<3>(x, y, z);
+    return containing_cell<2>(x, y, z);
+}
+
+template<int_t D>
+Cell* Cell::containing_cell(double x, double y, double z){
+    Cell *cell = this;
+    while(!cell->is_leaf()){
+        int ix = x>cell->center(0);
+        int iy = y>cell->center(1);
+        int iz = D==3 && z>cell->center(2);
+        cell = cell->children()[ix + 2*iy + 4*iz];
+    }
+    return cell;
 };
 
 Tree::Tree(){
@@ -553,11 +604,13 @@ Tree::Tree(){
     nz = 0;
     n_dim = 0;
     max_level = 0;
+    n_threads = 1;
     root = NULL;
 };
 
 void Tree::set_dimension(int_t dim){
     n_dim = dim;
+    cell_pool.set_item_size(Cell::size(dim));
 }
 
 void Tree::set_level(int_t levels){
@@ -573,439 +626,1033 @@ void Tree::set_xs(double *x, double *y, double *z){
     zs = z;
 }
 
-void Tree::insert_cell(double *new_center, int_t p_level){
-    if(root == NULL){
-        Node* points[8];
-
-        points[0] = new Node( 0, 0, 0, xs, ys, zs);
-        points[1] = new Node(nx, 0, 0, xs, ys, zs);
-        points[2] = new Node( 0,ny, 0, xs, ys, zs);
-        points[3] = new Node(nx,ny, 0, xs, ys, zs);
-        if(n_dim==3){
-            points[4] = new Node( 0, 0,nz, xs, ys, zs);
-            points[5] = new Node(nx, 0,nz, xs, ys, zs);
-            points[6] = new Node( 0,ny,nz, xs, ys, zs);
-            points[7] = new Node(nx,ny,nz, xs, ys, zs);
-        }
-        for(int_t i=0;i< (1<<n_dim); ++i){
-            nodes[points[i]->key] = points[i];
-            points[i]->reference += 1;
-        }
-        root = new Cell(points, n_dim, max_level, NULL);
-    }
-    root->insert_cell(nodes, new_center, p_level, xs, ys, zs);
+void Tree::set_num_threads(int_t n){
+    n_threads = (n<1)? 1 : n;
 }
 
-void Tree::build_tree_from_function(function test_func){
+void Tree::set_stats(bool enabled){
+    stats.enabled = enabled;
+    std::atomic<unsigned long long> *probes = enabled? &stats.map_probes : NULL;
+    nodes.count_probes(probes);
+    edges_x.count_probes(probes);
+    edges_y.count_probes(probes);
+    edges_z.count_probes(probes);
+    faces_x.count_probes(probes);
+    faces_y.count_probes(probes);
+    faces_z.count_probes(probes);
+    node_parent_map.count_probes(probes);
+    edge_parent_map.count_probes(probes);
+    face_parent_map.count_probes(probes);
+}
 
+void Tree::make_root(){
     Node* points[8];
 
-    points[0] = new Node( 0,  0, 0, xs, ys, zs);
-    points[1] = new Node(nx,  0, 0, xs, ys, zs);
-    points[2] = new Node( 0, ny, 0, xs, ys, zs);
-    points[3] = new Node(nx, ny, 0, xs, ys, zs);
+    points[0] = new (node_pool.alloc()) Node( 0,0,0);
+    points[1] = new (node_pool.alloc()) Node(nx,0,0);
+    points[2] = new (node_pool.alloc()) Node( 0,ny,0);
+    points[3] = new (node_pool.alloc()) Node(nx,ny,0);
     if(n_dim==3){
-        points[4] = new Node( 0,  0, nz, xs, ys, zs);
-        points[5] = new Node(nx,  0, nz, xs, ys, zs);
-        points[6] = new Node( 0, ny, nz, xs, ys, zs);
-        points[7] = new Node(nx, ny, nz, xs, ys, zs);
+        points[4] = new (node_pool.alloc()) Node( 0,0,nz);
+        points[5] = new (node_pool.alloc()) Node(nx,0,nz);
+        points[6] = new (node_pool.alloc()) Node( 0,ny,nz);
+        points[7] = new (node_pool.alloc()) Node(nx,ny,nz);
     }
-    for(int_t i=0;i< (1<<n_dim); ++i){
-        nodes[points[i]->key] = points[i];
+    int_t n_points = 1<<n_dim;
+    for(int_t i=0; i<n_points; ++i){
+        nodes[points[i]->key()] = points[i];
         points[i]->reference += 1;
     }
-    root = new Cell(points, n_dim, max_level, test_func);
-    root->divide(nodes, xs, ys, zs);
-    finalize_lists();
-};
+    root = new (cell_pool.alloc()) Cell(points, n_dim, max_level, xs, ys, zs);
+}
 
-void Tree::finalize_lists(){
-    root->build_cell_vector(cells);
+void Tree::insert_cell(double *new_center, int_t p_level){
+    if(root == NULL)
+        make_root();
+    root->insert_cell(nodes, node_pool, cell_pool, new_center, p_level, xs, ys, zs);
+}
 
-    if(n_dim==3){
-        // Generate Faces and edges
-        for(std::vector<Cell *>::size_type i =0; i!= cells.size(); i++){
-            Cell *cell = cells[i];
-            Node *p[8];
-            for(int_t it=0; it<8; ++it)
-                p[it] = cell->points[it];
-
-            Edge *ex[4];
-            Edge *ey[4];
-            Edge *ez[4];
-
-            ex[0] = set_default_edge(edges_x, *p[0], *p[1]);
-            ex[1] = set_default_edge(edges_x, *p[2], *p[3]);
-            ex[2] = set_default_edge(edges_x, *p[4], *p[5]);
-            ex[3] = set_default_edge(edges_x, *p[6], *p[7]);
-
-            ey[0] = set_default_edge(edges_y, *p[0], *p[2]);
-            ey[1] = set_default_edge(edges_y, *p[1], *p[3]);
-            ey[2] = set_default_edge(edges_y, *p[4], *p[6]);
-            ey[3] = set_default_edge(edges_y, *p[5], *p[7]);
-
-            ez[0] = set_default_edge(edges_z, *p[0], *p[4]);
-            ez[1] = set_default_edge(edges_z, *p[1], *p[5]);
-            ez[2] = set_default_edge(edges_z, *p[2], *p[6]);
-            ez[3] = set_default_edge(edges_z, *p[3], *p[7]);
-
-            Face *fx1, *fx2, *fy1, *fy2, *fz1, *fz2;
-            fx1 = set_default_face(faces_x, *p[0], *p[2], *p[4], *p[6]);
-            fx2 = set_default_face(faces_x, *p[1], *p[3], *p[5], *p[7]);
-            fy1 = set_default_face(faces_y, *p[0], *p[1], *p[4], *p[5]);
-            fy2 = set_default_face(faces_y, *p[2], *p[3], *p[6], *p[7]);
-            fz1 = set_default_face(faces_z, *p[0], *p[1], *p[2], *p[3]);
-            fz2 = set_default_face(faces_z, *p[4], *p[5], *p[6], *p[7]);
-
-            fx1->edges[0] = ez[0];
-            fx1->edges[1] = ey[2];
-            fx1->edges[2] = ez[2];
-            fx1->edges[3] = ey[0];
-
-            fx2->edges[0] = ez[1];
-            fx2->edges[1] = ey[3];
-            fx2->edges[2] = ez[3];
-            fx2->edges[3] = ey[1];
-
-            fy1->edges[0] = ez[0];
-            fy1->edges[1] = ex[2];
-            fy1->edges[2] = ez[1];
-            fy1->edges[3] = ex[0];
-
-            fy2->edges[0] = ez[2];
-            fy2->edges[1] = ex[3];
-            fy2->edges[2] = ez[3];
-            fy2->edges[3] = ex[1];
-
-            fz1->edges[0] = ey[0];
-            fz1->edges[1] = ex[1];
-            fz1->edges[2] = ey[1];
-            fz1->edges[3] = ex[0];
-
-            fz2->edges[0] = ey[2];
-            fz2->edges[1] = ex[3];
-            fz2->edges[2] = ey[3];
-            fz2->edges[3] = ex[2];
-
-            cell->faces[0] = fx1;
-            cell->faces[1] = fx2;
-            cell->faces[2] = fy1;
-            cell->faces[3] = fy2;
-            cell->faces[4] = fz1;
-            cell->faces[5] = fz2;
-
-            for(int_t it=0; it<4; ++it){
-                cell->edges[it  ] = ex[it];
-                cell->edges[it+4] = ey[it];
-                cell->edges[it+8] = ez[it];
-            }
+template<class E>
+void Tree::refine_levels(E& evaluate){
+    // Breadth first version of root->divide(..., test).
+    // A cell is tested exactly when all of its ancestors asked to be split,
+    // whichever order the splits happen in, so the target levels for a whole
+    // level of cells are found at once by evaluate(cells, targets). The
+    // splits themselves (node creation, balancing and neighbor links) are
+    // then applied in the same cell order as the depth first recursion,
+    // which gives the same tree.
+    cell_vec_t level_cells(1, root), next_cells;
+    std::vector<int_t> targets;
+    int_t n_kids = 1<<n_dim, n_forced = 0;
+    while(!level_cells.empty() && level_cells[0]->level < max_level){
+        // every cell in level_cells is on the same level
+        targets.resize(level_cells.size());
+        if(stats.enabled){
+            double start = TreeStats::now();
+            evaluate(level_cells, targets);
+            stats.test_seconds += TreeStats::now()-start;
+            stats.test_calls += level_cells.size();
+        }else{
+            evaluate(level_cells, targets);
+        }
+        next_cells.clear();
+        for(std::size_t i=0; i<level_cells.size(); ++i){
+            Cell *cell = level_cells[i];
+            if(targets[i] <= cell->level)
+                continue;
+            int_t n_split = cell->split(nodes, node_pool, cell_pool, xs, ys, zs);
+            n_forced += (n_split>1)? n_split-1 : 0;
+            for(int_t j=0; j<n_kids; ++j)
+                next_cells.push_back(cell->children()[j]);
+        }
+        level_cells.swap(next_cells);
+    }
+    if(stats.enabled)
+        stats.forced_splits += n_forced;
+}
 
-            for(int_t it = 0; it<6; ++it)
-                cell->faces[it]->reference++;
-            for(int_t it = 0; it<12; ++it)
-                cell->edges[it]->reference++;
+template<class F>
+void Tree::refine_by_level(F& test){
+    // The test function for each cell on a level is evaluated in parallel
+    auto evaluate = [&](const cell_vec_t& cells, std::vector<int_t>& targets){
+        parallel_for(cells.size(), n_threads,
+            [&](std::size_t begin, std::size_t end){
+                for(std::size_t i=begin; i<end; ++i)
+                    targets[i] = test(cells[i]);
+            });
+    };
+    refine_levels(evaluate);
+}
 
-        }
+template<class F>
+void Tree::build_tree(F& test, bool by_level){
+    PhaseTimer timer(stats, "build_tree");
+    make_root();
+    std::size_t n_cells = cell_pool.size();
+    if(by_level){
+        refine_by_level(test);
+    }else if(stats.enabled){
+        // the test is timed per cell here, and per level in refine_levels
+        auto timed = [&](Cell *cell){
+            double start = TreeStats::now();
+            int_t target = test(cell);
+            stats.test_seconds += TreeStats::now()-start;
+            stats.test_calls += 1;
+            return target;
+        };
+        stats.forced_splits += root->divide(nodes, node_pool, cell_pool, xs, ys, zs, timed);
+    }else{
+        root->divide(nodes, node_pool, cell_pool, xs, ys, zs, test);
+    }
+    if(stats.enabled)
+        stats.cells_spawned += cell_pool.size()-n_cells;
+    finalize_lists();
+};
 
-        // Process hanging x faces
-        for(face_it_type it = faces_x.begin(); it!= faces_x.end(); ++it){
-            Face *face = it->second;
-            if(face->reference<2){
-                int_t x;
-                x = face->location_ind[0];
-                if( x==0 || x==nx) continue; // Face was on the outside, and is not hanging
-                if(nodes.count(face->key)) continue; // I will have children (there is a node at my center)
-                Node *node;
-
-                //Find Parent
-                int_t ip;
-                for(int_t i=0;i<4;++i){
-                    node = face->points[i];
-                    if(faces_x.count(node->key)){
-                        face->parent = faces_x[node->key];
-                        ip = i;
-                        break;
-                    }
-                }
-                //all of my edges are hanging, and most of my points
-                for(int_t i=0;i<4;++i){
-                    face->edges[i]->hanging = true;
-                    face->points[i]->hanging = true;
-                }
-                // the point oposite the parent node key should not be hanging
-                // and also label the edges' parents
-                if(face->points[ip^3]->reference!=6)
-                    face->points[ip^3]->hanging = false;
+void Tree::build_tree_from_function(function test_func, bool by_level){
+    build_tree(*test_func, by_level && n_threads>1);
+}
 
-                face->edges[0]->parents[0] = face->parent->edges[0];
-                face->edges[0]->parents[1] = face->parent->edges[((ip&1)^1)<<1]; //2020
+void Tree::build_tree_from_criteria(RefineCriteria *criteria){
+    build_tree(*criteria, n_threads>1);
+}
 
-                face->edges[1]->parents[0] = face->parent->edges[1];
-                face->edges[1]->parents[1] = face->parent->edges[ip>>1<<1^1]; //1133
+void Tree::build_tree_from_batch(batch_function test_func){
+    // The geometry of a whole level is gathered into flat arrays and handed
+    // to test_func in one call.
+    std::vector<double> centers, widths;
+    std::vector<int_t> levels;
+    auto evaluate = [&](const cell_vec_t& cells, std::vector<int_t>& targets){
+        int_t n = cells.size();
+        centers.resize(n*n_dim);
+        widths.resize(n*n_dim);
+        levels.resize(n);
+        parallel_for(n, n_threads,
+            [&](std::size_t begin, std::size_t end){
+                for(std::size_t i=begin; i<end; ++i){
+                    Cell *cell = cells[i];
+                    for(int_t j=0; j<n_dim; ++j){
+                        centers[i*n_dim+j] = cell->center(j);
+                        widths[i*n_dim+j] = 2*(cell->center(j)-cell->x0[j]);
+                    }
+                    levels[i] = cell->level;
+                }
+            });
+        (*test_func)(n, n_dim, &centers[0], &widths[0], &levels[0], &targets[0]);
+    };
+    PhaseTimer timer(stats, "build_tree");
+    make_root();
+    std::size_t n_cells = cell_pool.size();
+    refine_levels(evaluate);
+    if(stats.enabled)
+        stats.cells_spawned += cell_pool.size()-n_cells;
+    finalize_lists();
+}
 
-                face->edges[2]->parents[0] = face->parent->edges[((ip&1)^1)<<1]; //2020
-                face->edges[2]->parents[1] = face->parent->edges[2];
+void Tree::build_tree_from_cells(const int_t *cell_inds, const int_t *levels, int_t n){
+    PhaseTimer timer(stats, "build_tree");
+    insert_cells(cell_inds, levels, n);
+    finalize_lists();
+}
 
-                face->edges[3]->parents[0] = face->parent->edges[ip>>1<<1^1]; //1133
-                face->edges[3]->parents[1] = face->parent->edges[3];
+void Tree::insert_cells(const int_t *cell_inds, const int_t *levels, int_t n){
+    // The cells are visited in Morton order, which is the order the tree
+    // holds its leaves in, and each one is looked for from the previous one
+    // rather than from the root: only the part of the path that differs is
+    // walked, so the whole pass is linear in the size of the tree.
+    PhaseTimer timer(stats, "insert_cells");
+    std::vector<std::pair<unsigned long long, int_t> > order(n);
+    parallel_for(n, n_threads,
+        [&](std::size_t begin, std::size_t end){
+            for(std::size_t i=begin; i<end; ++i){
+                // the finest cell at (or just below) the center
+                const int_t *ind = cell_inds+i*n_dim;
+                unsigned long long code = (n_dim==3)?
+                    morton_code(ind[0]/2, ind[1]/2, ind[2]/2) : morton_code(ind[0]/2, ind[1]/2);
+                order[i] = std::make_pair(code, (int_t) i);
+            }
+        });
+    std::sort(order.begin(), order.end());
+
+    if(root==NULL)
+        make_root();
+    Cell *cell = root;
+    int_t n_points = 1<<n_dim, n_forced = 0;
+    std::size_t n_cells = cell_pool.size();
+    for(int_t i=0; i<n; ++i){
+        const int_t *ind = cell_inds+order[i].second*n_dim;
+        int_t level = std::min(levels[order[i].second], max_level);
+        while(cell->parent!=NULL){
+            bool inside = true;
+            for(int_t d=0; d<n_dim; ++d){
+                inside = inside && cell->points()[0]->location_ind[d] < ind[d]
+                                && ind[d] < cell->points()[n_points-1]->location_ind[d];
+            }
+            if(inside)
+                break;
+            cell = cell->parent;
+        }
+        while(cell->level < level){
+            if(cell->is_leaf()){
+                int_t n_split = cell->split(nodes, node_pool, cell_pool, xs, ys, zs);
+                n_forced += (n_split>1)? n_split-1 : 0;
+            }
+            int ix = ind[0] > cell->location_ind[0];
+            int iy = ind[1] > cell->location_ind[1];
+            int iz = n_dim>2 && ind[2] > cell->location_ind[2];
+            cell = cell->children()[ix + 2*iy + 4*iz];
+        }
+    }
+    if(stats.enabled){
+        stats.forced_splits += n_forced;
+        stats.cells_spawned += cell_pool.size()-n_cells;
+    }
+}
 
-                face->points[ip^1]->parents[0] = face->parent->points[(ip&1)^1]; //1010
-                face->points[ip^1]->parents[1] = face->parent->points[(ip&1)^3]; //3232
-                face->points[ip^1]->parents[2] = face->parent->points[(ip&1)^1]; //1010
-                face->points[ip^1]->parents[3] = face->parent->points[(ip&1)^3]; //3232
+// The corners of the edges of a cell, in Cell::edges order (2D, then 3D),
+// and of the faces, in Cell::faces order, with the edges of each face in
+// Face::edges order as positions in Cell::edges. The single face of a 2D
+// cell has the corners of a z face.
+static const int_t cell_edge_points[2][12][2] = {
+    {{0, 1}, {2, 3}, {0, 2}, {1, 3}},
+    {{0, 1}, {2, 3}, {4, 5}, {6, 7}, {0, 2}, {1, 3}, {4, 6}, {5, 7},
+     {0, 4}, {1, 5}, {2, 6}, {3, 7}}};
+static const int_t cell_face_points[6][4] = {
+    {0, 2, 4, 6}, {1, 3, 5, 7}, {0, 1, 4, 5}, {2, 3, 6, 7}, {0, 1, 2, 3}, {4, 5, 6, 7}};
+static const int_t cell_face_edges[6][4] = {
+    {8, 6, 10, 4}, {9, 7, 11, 5}, {8, 2, 9, 0}, {10, 3, 11, 1}, {4, 1, 5, 0}, {6, 3, 7, 2}};
+static const int_t cell_face_edges_2d[4] = {2, 1, 3, 0};
+
+void Tree::add_cell_entities(Cell *cell){
+    // Creates (or finds) the edges and faces of a leaf and counts the leaf
+    // in their references
+    edge_map_t *edge_maps[3] = {&edges_x, &edges_y, &edges_z};
+    face_map_t *face_maps[3] = {&faces_x, &faces_y, &faces_z};
+    Node **p = cell->points();
+    int_t n_edges = (n_dim==3)? 12 : 4;
+    for(int_t i=0; i<n_edges; ++i){
+        const int_t *ends = cell_edge_points[n_dim-2][i];
+        Edge *edge = set_default_edge(*edge_maps[i*n_dim/n_edges], edge_pool, *p[ends[0]], *p[ends[1]]);
+        cell->edges()[i] = edge;
+        edge->reference++;
+    }
+    if(n_dim==3){
+        for(int_t i=0; i<6; ++i){
+            const int_t *c = cell_face_points[i];
+            Face *face = set_default_face(*face_maps[i/2], face_pool, *p[c[0]], *p[c[1]], *p[c[2]], *p[c[3]]);
+            for(int_t j=0; j<4; ++j)
+                face->edges[j] = cell->edges()[cell_face_edges[i][j]];
+            cell->faces()[i] = face;
+            face->reference++;
+        }
+    }else{
+        // and 1 face for consistency
+        Face *face = set_default_face(faces_z, face_pool, *p[0], *p[1], *p[2], *p[3]);
+        for(int_t j=0; j<4; ++j)
+            face->edges[j] = cell->edges()[cell_face_edges_2d[j]];
+        face->hanging = false;
+    }
+}
 
-                face->points[ip^2]->parents[0] = face->parent->points[(ip>>1^1)<<1]; //2200
-                face->points[ip^2]->parents[1] = face->parent->points[(ip>>1^1)<<1^1]; //3311
-                face->points[ip^2]->parents[2] = face->parent->points[(ip>>1^1)<<1]; //2200
-                face->points[ip^2]->parents[3] = face->parent->points[(ip>>1^1)<<1^1]; //3311
+// An edge or face of a leaf: its key, and where it goes, as the leaf's index
+// in cells times the number of slots of a leaf plus its position there
+struct EntitySlot{
+    int_t key, slot;
+};
 
-                face->hanging = true;
-                hanging_faces_x.push_back(face);
-                for(int_t i=0; i<4; ++i)
-                    node->parents[i] = face->parent->points[i];
+// Sorts the slots by key, keeping slots with the same key in the order they
+// were in: a radix sort, 11 bits of the keys at a time, each pass counting
+// and then moving pieces of the slots in parallel. spare is only used for
+// space.
+static void sort_slots(std::vector<EntitySlot>& slots, std::vector<EntitySlot>& spare,
+                       int_t n_threads){
+    const int_t digit_bits = 11, n_digits = 1<<digit_bits;
+    int_t n = slots.size();
+    int_t n_pieces = 4*std::max(n_threads, (int_t) 1);
+    std::vector<int_t> maxima(n_pieces, 0);
+    parallel_for(n_pieces, n_threads,
+        [&](std::size_t b, std::size_t e){
+            for(std::size_t p=b; p<e; ++p){
+                for(int_t i=n*p/n_pieces; i<n*(p+1)/n_pieces; ++i)
+                    maxima[p] = std::max(maxima[p], slots[i].key);
+            }
+        }, 1);
+    int_t max_key = *std::max_element(maxima.begin(), maxima.end());
+
+    // counts[p*n_digits+k] is where piece p puts its next slot with digit k
+    std::vector<int_t> counts(n_pieces*n_digits);
+    spare.resize(n);
+    for(int_t shift=0; shift<64 && (max_key>>shift)>0; shift+=digit_bits){
+        std::fill(counts.begin(), counts.end(), 0);
+        parallel_for(n_pieces, n_threads,
+            [&](std::size_t b, std::size_t e){
+                for(std::size_t p=b; p<e; ++p){
+                    int_t *count = &counts[p*n_digits];
+                    for(int_t i=n*p/n_pieces; i<n*(p+1)/n_pieces; ++i)
+                        ++count[(slots[i].key>>shift)&(n_digits-1)];
+                }
+            }, 1);
+        int_t at = 0;
+        for(int_t k=0; k<n_digits; ++k){
+            for(int_t p=0; p<n_pieces; ++p){
+                int_t count = counts[p*n_digits+k];
+                counts[p*n_digits+k] = at;
+                at += count;
             }
         }
+        parallel_for(n_pieces, n_threads,
+            [&](std::size_t b, std::size_t e){
+                for(std::size_t p=b; p<e; ++p){
+                    int_t *next = &counts[p*n_digits];
+                    for(int_t i=n*p/n_pieces; i<n*(p+1)/n_pieces; ++i)
+                        spare[next[(slots[i].key>>shift)&(n_digits-1)]++] = slots[i];
+                }
+            }, 1);
+        slots.swap(spare);
+    }
+}
 
-        // Process hanging y faces
-        for(face_it_type it = faces_y.begin(); it!= faces_y.end(); ++it){
-            Face *face = it->second;
-            if(face->reference<2){
-                int_t y;
-                y = face->location_ind[1];
-                if( y==0 || y==ny){
-                    // Face was on the outside, and is not hanging
-                    continue;
+// The first of each run of slots with the same key, followed by the end
+static void find_runs(const std::vector<EntitySlot>& slots, int_t n_threads,
+                      std::vector<int_t>& starts){
+    int_t n = slots.size();
+    int_t n_pieces = 4*std::max(n_threads, (int_t) 1);
+    std::vector<int_t> counts(n_pieces+1, 0);
+    parallel_for(n_pieces, n_threads,
+        [&](std::size_t b, std::size_t e){
+            for(std::size_t p=b; p<e; ++p){
+                for(int_t i=n*p/n_pieces; i<n*(p+1)/n_pieces; ++i)
+                    counts[p+1] += (i==0 || slots[i].key!=slots[i-1].key);
+            }
+        }, 1);
+    for(int_t p=0; p<n_pieces; ++p)
+        counts[p+1] += counts[p];
+    starts.resize(counts[n_pieces]+1);
+    parallel_for(n_pieces, n_threads,
+        [&](std::size_t b, std::size_t e){
+            for(std::size_t p=b; p<e; ++p){
+                int_t at = counts[p];
+                for(int_t i=n*p/n_pieces; i<n*(p+1)/n_pieces; ++i){
+                    if(i==0 || slots[i].key!=slots[i-1].key)
+                        starts[at++] = i;
                 }
-                //check if I am a parent or a child
-                if(nodes.count(face->key)){
-                    // I will have children (there is a node at my center)
-                    continue;
+            }
+        }, 1);
+    starts.back() = n;
+}
+
+void Tree::add_leaf_entities(){
+    // Rather than looking up every edge and face of every leaf in the maps,
+    // the slots of each direction are listed by key (in parallel), so that
+    // each run of equal keys is one entity: it is made from the first leaf
+    // of the run, counts all of them and is handed to each. Only filling
+    // the maps is left to a single thread, one insert per entity, in key
+    // order. The entities are the same as add_cell_entities would make.
+    PhaseTimer timer(stats, "add_leaf_entities");
+    int_t n_cells = cells.size();
+    int_t n_edges = (n_dim==3)? 12 : 4;
+    edge_map_t *edge_maps[3] = {&edges_x, &edges_y, &edges_z};
+    face_map_t *face_maps[3] = {&faces_x, &faces_y, &faces_z};
+    std::vector<EntitySlot> slots, spare;
+    std::vector<int_t> starts;
+    std::vector<void *> storage;
+
+    int_t per_dim = n_edges/n_dim;
+    for(int_t d=0; d<n_dim; ++d){
+        slots.resize(n_cells*per_dim);
+        parallel_for(n_cells, n_threads,
+            [&](std::size_t begin, std::size_t end){
+                for(std::size_t i=begin; i<end; ++i){
+                    Node **p = cells[i]->points();
+                    for(int_t j=0; j<per_dim; ++j){
+                        int_t s = d*per_dim+j;
+                        const int_t *ends = cell_edge_points[n_dim-2][s];
+                        unsigned int *l0 = p[ends[0]]->location_ind, *l1 = p[ends[1]]->location_ind;
+                        slots[i*per_dim+j].key = key_func((l0[0]+l1[0])/2, (l0[1]+l1[1])/2,
+                                                          (l0[2]+l1[2])/2);
+                        slots[i*per_dim+j].slot = i*n_edges+s;
+                    }
+                }
+            });
+        sort_slots(slots, spare, n_threads);
+        find_runs(slots, n_threads, starts);
+        int_t n_runs = starts.size()-1;
+        storage.resize(n_runs);
+        for(int_t r=0; r<n_runs; ++r)
+            storage[r] = edge_pool.alloc();
+        parallel_for(n_runs, n_threads,
+            [&](std::size_t begin, std::size_t end){
+                for(std::size_t r=begin; r<end; ++r){
+                    int_t first = slots[starts[r]].slot;
+                    Node **p = cells[first/n_edges]->points();
+                    const int_t *ends = cell_edge_points[n_dim-2][first%n_edges];
+                    Edge *edge = new (storage[r]) Edge(*p[ends[0]], *p[ends[1]]);
+                    edge->reference = starts[r+1]-starts[r];
+                    for(int_t k=starts[r]; k<starts[r+1]; ++k)
+                        cells[slots[k].slot/n_edges]->edges()[slots[k].slot%n_edges] = edge;
                 }
-                Node *node;
-
-                //Find Parent
-                int_t ip;
-                for(int_t i=0;i<4;++i){
-                    node = face->points[i];
-                    if(faces_y.count(node->key)){
-                        face->parent = faces_y[node->key];
-                        ip = i;
-                        break;
+            });
+        edge_map_t& edges = *edge_maps[d];
+        edges.reserve(n_runs);
+        for(int_t r=0; r<n_runs; ++r)
+            edges[slots[starts[r]].key] = static_cast<Edge *>(storage[r]);
+    }
+
+    // 2D cells have a single (z) face, which is not counted
+    int_t n_faces = (n_dim==3)? 6 : 1;
+    per_dim = (n_dim==3)? 2 : 1;
+    for(int_t d=(n_dim==3)? 0 : 2; d<3; ++d){
+        slots.resize(n_cells*per_dim);
+        parallel_for(n_cells, n_threads,
+            [&](std::size_t begin, std::size_t end){
+                for(std::size_t i=begin; i<end; ++i){
+                    Node **p = cells[i]->points();
+                    for(int_t j=0; j<per_dim; ++j){
+                        int_t s = (n_dim==3)? d*per_dim+j : 0;
+                        const int_t *c = cell_face_points[(n_dim==3)? s : 4];
+                        int_t ind[3];
+                        for(int_t k=0; k<3; ++k)
+                            ind[k] = (p[c[0]]->location_ind[k]+p[c[1]]->location_ind[k]
+                                      +p[c[2]]->location_ind[k]+p[c[3]]->location_ind[k])/4;
+                        slots[i*per_dim+j].key = key_func(ind[0], ind[1], ind[2]);
+                        slots[i*per_dim+j].slot = i*n_faces+s;
                     }
                 }
-                //all of my edges are hanging, and most of my points
-                for(int_t i=0;i<4;++i){
-                    face->edges[i]->hanging = true;
-                    face->points[i]->hanging = true;
+            });
+        sort_slots(slots, spare, n_threads);
+        find_runs(slots, n_threads, starts);
+        int_t n_runs = starts.size()-1;
+        storage.resize(n_runs);
+        for(int_t r=0; r<n_runs; ++r)
+            storage[r] = face_pool.alloc();
+        parallel_for(n_runs, n_threads,
+            [&](std::size_t begin, std::size_t end){
+                for(std::size_t r=begin; r<end; ++r){
+                    int_t first = slots[starts[r]].slot;
+                    Cell *cell = cells[first/n_faces];
+                    Node **p = cell->points();
+                    int_t s = first%n_faces;
+                    const int_t *c = cell_face_points[(n_dim==3)? s : 4];
+                    const int_t *e = (n_dim==3)? cell_face_edges[s] : cell_face_edges_2d;
+                    Face *face = new (storage[r]) Face(*p[c[0]], *p[c[1]], *p[c[2]], *p[c[3]]);
+                    for(int_t j=0; j<4; ++j)
+                        face->edges[j] = cell->edges()[e[j]];
+                    if(n_dim==3){
+                        face->reference = starts[r+1]-starts[r];
+                        for(int_t k=starts[r]; k<starts[r+1]; ++k)
+                            cells[slots[k].slot/n_faces]->faces()[slots[k].slot%n_faces] = face;
+                    }
                 }
-                // the point oposite the parent node key should not be hanging
-                // and also label the edges' parents
-                if(face->points[ip^3]->reference!=6)
-                    face->points[ip^3]->hanging = false;
+            });
+        face_map_t& faces = *face_maps[d];
+        faces.reserve(n_runs);
+        for(int_t r=0; r<n_runs; ++r)
+            faces[slots[starts[r]].key] = static_cast<Face *>(storage[r]);
+    }
+}
 
-                face->edges[0]->parents[0] = face->parent->edges[0];
-                face->edges[0]->parents[1] = face->parent->edges[((ip&1)^1)<<1]; //2020
+static void hang_edge_on(edge_parent_map_t& parent_map, Edge *edge, Edge *p0, Edge *p1){
+    Edge **parents = parent_map[edge->key()].parents;
+    parents[0] = p0;
+    parents[1] = p1;
+    edge->hanging = true;
+    ++edge->hanging_refs;
+}
+
+static void hang_node_on(node_parent_map_t& parent_map, Node *node,
+                         Node *p0, Node *p1, Node *p2, Node *p3){
+    Node **parents = parent_map[node->key()].parents;
+    parents[0] = p0;
+    parents[1] = p1;
+    parents[2] = p2;
+    parents[3] = p3;
+    node->hanging = true;
+    ++node->hanging_refs;
+}
 
-                face->edges[1]->parents[0] = face->parent->edges[1];
-                face->edges[1]->parents[1] = face->parent->edges[ip>>1<<1^1]; //1133
+template<class T, class M>
+static void release_hanging(M& parent_map, T *item){
+    if(--item->hanging_refs==0){
+        item->hanging = false;
+        parent_map.erase(item->key());
+    }
+}
 
-                face->edges[2]->parents[0] = face->parent->edges[((ip&1)^1)<<1]; //2020
-                face->edges[2]->parents[1] = face->parent->edges[2];
+void Tree::hang_face(Face *face, face_map_t& faces, int_t direction){
+    // A face that only one leaf has, which is neither on the outside nor
+    // split (there would be a node at its center), lies in a face twice its
+    // size, whose center is one of its corners. It hangs on that face along
+    // with its edges and the nodes other than the corner it shares with it.
+    // Each hanging edge and node counts the faces it hangs on, so that
+    // faces can be hung and unhung in any order.
+    int_t ip;
+    Face *parent = find_face_parent(face, faces, direction, ip);
+    if(parent!=NULL)
+        hang_face_in(face, parent, ip);
+}
 
-                face->edges[3]->parents[0] = face->parent->edges[ip>>1<<1^1]; //1133
-                face->edges[3]->parents[1] = face->parent->edges[3];
+Face* Tree::find_face_parent(Face *face, face_map_t& faces, int_t direction, int_t& ip){
+    // Only looks things up, so it can run for many faces at once
+    int_t n_ind[3] = {nx, ny, nz};
+    int_t x = face->location_ind[direction];
+    if(face->reference>=2 || face->hanging)
+        return NULL;
+    if(x==0 || x==n_ind[direction])
+        return NULL; // Face was on the outside, and is not hanging
+    if(nodes.count(face->key()))
+        return NULL; // I will have children (there is a node at my center)
+
+    //Find Parent
+    for(ip=0; ip<4; ++ip){
+        face_it_type it = faces.find(face->point(ip)->key());
+        if(it != faces.end())
+            return it->second;
+    }
+    return NULL;
+}
 
-                face->points[ip^1]->parents[0] = face->parent->points[(ip&1)^1]; //1010
-                face->points[ip^1]->parents[1] = face->parent->points[(ip&1)^3]; //3232
-                face->points[ip^1]->parents[2] = face->parent->points[(ip&1)^1]; //1010
-                face->points[ip^1]->parents[3] = face->parent->points[(ip&1)^3]; //3232
+void Tree::hang_face_in(Face *face, Face *parent, int_t ip){
+    face_parent_map[face->key()] = parent;
+    face->hanging = true;
+
+    //all of my edges are hanging, and label their parents
+    Edge **edges = face->edges, **p_edges = parent->edges;
+    hang_edge_on(edge_parent_map, edges[0], p_edges[0], p_edges[((ip&1)^1)<<1]); //2020
+    hang_edge_on(edge_parent_map, edges[1], p_edges[1], p_edges[ip>>1<<1^1]); //1133
+    hang_edge_on(edge_parent_map, edges[2], p_edges[((ip&1)^1)<<1], p_edges[2]); //2020
+    hang_edge_on(edge_parent_map, edges[3], p_edges[ip>>1<<1^1], p_edges[3]); //1133
+
+    // so are my points, except the one oposite the parent's center
+    Node *p_points[4];
+    for(int_t i=0; i<4; ++i)
+        p_points[i] = parent->point(i);
+    hang_node_on(node_parent_map, face->point(ip^1), p_points[(ip&1)^1], p_points[(ip&1)^3],
+                 p_points[(ip&1)^1], p_points[(ip&1)^3]); //1010 3232
+    hang_node_on(node_parent_map, face->point(ip^2), p_points[(ip>>1^1)<<1], p_points[(ip>>1^1)<<1^1],
+                 p_points[(ip>>1^1)<<1], p_points[(ip>>1^1)<<1^1]); //2200 3311
+    hang_node_on(node_parent_map, face->point(ip), p_points[0], p_points[1], p_points[2], p_points[3]);
+}
 
-                face->points[ip^2]->parents[0] = face->parent->points[(ip>>1^1)<<1]; //2200
-                face->points[ip^2]->parents[1] = face->parent->points[(ip>>1^1)<<1^1]; //3311
-                face->points[ip^2]->parents[2] = face->parent->points[(ip>>1^1)<<1]; //2200
-                face->points[ip^2]->parents[3] = face->parent->points[(ip>>1^1)<<1^1]; //3311
+void Tree::unhang_face(Face *face){
+    if(!face->hanging)
+        return;
+    int_t ip = 0, key = parent_of(face)->key();
+    while(face->point(ip)->key() != key)
+        ++ip;
+    for(int_t i=0; i<4; ++i)
+        release_hanging(edge_parent_map, face->edges[i]);
+    release_hanging(node_parent_map, face->point(ip^1));
+    release_hanging(node_parent_map, face->point(ip^2));
+    release_hanging(node_parent_map, face->point(ip));
+    face->hanging = false;
+    face_parent_map.erase(face->key());
+}
 
-                face->hanging = true;
-                hanging_faces_y.push_back(face);
-                for(int_t i=0; i<4; ++i){
-                    node->parents[i] = face->parent->points[i];
+void Tree::hang_edge(Edge *edge, edge_map_t& edges, int_t direction){
+    // The 2D version of hang_face: a hanging edge lies in an edge twice its
+    // size, and the node at that edge's center hangs on its ends
+    Node *node;
+    Edge *parent = find_edge_parent(edge, edges, direction, node);
+    if(parent!=NULL)
+        hang_edge_in(edge, parent, node);
+}
+
+Edge* Tree::find_edge_parent(Edge *edge, edge_map_t& edges, int_t direction, Node*& node){
+    int_t y = edge->location_ind[1-direction];
+    int_t n_y = (direction==0)? ny : nx;
+    if(edge->reference>=2 || edge->hanging)
+        return NULL;
+    if(y==0 || y==n_y) return NULL; //I am on the boundary
+    if(nodes.count(edge->key())) return NULL; //I am a parent
+    //I am a hanging edge find my parent
+    node = edge->points[0];
+    edge_it_type parent = edges.find(node->key());
+    if(parent == edges.end()){
+        node = edge->points[1];
+        parent = edges.find(node->key());
+    }
+    if(parent == edges.end())
+        return NULL;
+    return parent->second;
+}
+
+void Tree::hang_edge_in(Edge *edge, Edge *parent, Node *node){
+    Edge **parents = edge_parent_map[edge->key()].parents;
+    parents[0] = parent;
+    parents[1] = parent;
+    edge->hanging = true;
+
+    Node **p_points = parent->points;
+    hang_node_on(node_parent_map, node, p_points[0], p_points[1], p_points[0], p_points[1]);
+}
+
+void Tree::unhang_edge(Edge *edge){
+    if(!edge->hanging)
+        return;
+    int_t key = parents_of(edge)[0]->key();
+    Node *node = edge->points[0];
+    if(node->key() != key)
+        node = edge->points[1];
+    release_hanging(node_parent_map, node);
+    edge->hanging = false;
+    edge_parent_map.erase(edge->key());
+}
+
+void Tree::location(Node *node, double out[3]){
+    out[0] = xs[node->location_ind[0]];
+    out[1] = ys[node->location_ind[1]];
+    out[2] = zs[node->location_ind[2]];
+}
+
+void Tree::location(Edge *edge, double out[3]){
+    double p1[3], p2[3];
+    location(edge->points[0], p1);
+    location(edge->points[1], p2);
+    for(int_t d=0; d<3; ++d)
+        out[d] = (p1[d]+p2[d])*0.5;
+}
+
+void Tree::location(Face *face, double out[3]){
+    double p[4][3];
+    for(int_t i=0; i<4; ++i)
+        location(face->point(i), p[i]);
+    for(int_t d=0; d<3; ++d)
+        out[d] = (p[0][d]+p[1][d]+p[2][d]+p[3][d])*0.25;
+}
+
+double Tree::length(Edge *edge){
+    double p1[3], p2[3];
+    location(edge->points[0], p1);
+    location(edge->points[1], p2);
+    return (p2[0]-p1[0])+(p2[1]-p1[1])+(p2[2]-p1[2]);
+}
+
+double Tree::area(Face *face){
+    return length(face->edges[3])*length(face->edges[0]);
+}
+
+Node** Tree::parents_of(Node *node){
+    node_parent_map_t::iterator it = node_parent_map.find(node->key());
+    return (it==node_parent_map.end())? NULL : it->second.parents;
+}
+
+Edge** Tree::parents_of(Edge *edge){
+    edge_parent_map_t::iterator it = edge_parent_map.find(edge->key());
+    return (it==edge_parent_map.end())? NULL : it->second.parents;
+}
+
+Face* Tree::parent_of(Face *face){
+    face_it_type it = face_parent_map.find(face->key());
+    return (it==face_parent_map.end())? NULL : it->second;
+}
+
+// Lists the hanging entities of map in hanging, in map order
+template<class M, class T>
+static void list_hanging_in(M& map, int_t n_threads, std::vector<T *>& hanging){
+    int_t n = map.size();
+    int_t n_pieces = 4*std::max(n_threads, (int_t) 1);
+    std::vector<int_t> counts(n_pieces+1, 0);
+    parallel_for(n_pieces, n_threads,
+        [&](std::size_t b, std::size_t e){
+            for(std::size_t p=b; p<e; ++p){
+                for(int_t i=n*p/n_pieces; i<n*(p+1)/n_pieces; ++i)
+                    counts[p+1] += (map.begin()+i)->second->hanging;
+            }
+        }, 1);
+    for(int_t p=0; p<n_pieces; ++p)
+        counts[p+1] += counts[p];
+    hanging.resize(counts[n_pieces]);
+    parallel_for(n_pieces, n_threads,
+        [&](std::size_t b, std::size_t e){
+            for(std::size_t p=b; p<e; ++p){
+                int_t at = counts[p];
+                for(int_t i=n*p/n_pieces; i<n*(p+1)/n_pieces; ++i){
+                    T *item = (map.begin()+i)->second;
+                    if(item->hanging)
+                        hanging[at++] = item;
                 }
             }
-        }
+        }, 1);
+}
 
-        // Process hanging z faces
-        for(face_it_type it = faces_z.begin(); it!= faces_z.end(); ++it){
-            Face *face = it->second;
-            if(face->reference<2){
-                int_t z;
-                z = face->location_ind[2];
-                if( z==0 || z==nz){
-                    // Face was on the outside, and is not hanging
-                    continue;
-                }
-                //check if I am a parent or a child
-                if(nodes.count(face->key)){
-                    // I will have children (there is a node at my center)
-                    continue;
-                }
-                Node *node;
-
-                //Find Parent
-                int_t ip;
-                for(int_t i=0;i<4;++i){
-                    node = face->points[i];
-                    if(faces_z.count(node->key)){
-                        face->parent = faces_z[node->key];
-                        ip = i;
-                        break;
-                    }
-                }
-                //all of my edges are hanging, and most of my points
-                for(int_t i=0;i<4;++i){
-                    face->edges[i]->hanging = true;
-                    face->points[i]->hanging = true;
-                }
-                // the point oposite the parent node key should not be hanging
-                // most of the time
-                // and also label the edges' parents
-                if(face->points[ip^3]->reference!=6)
-                    face->points[ip^3]->hanging = false;
-
-                face->edges[0]->parents[0] = face->parent->edges[0];
-                face->edges[0]->parents[1] = face->parent->edges[((ip&1)^1)<<1]; //2020
-
-                face->edges[1]->parents[0] = face->parent->edges[1];
-                face->edges[1]->parents[1] = face->parent->edges[ip>>1<<1^1]; //1133
-
-                face->edges[2]->parents[0] = face->parent->edges[((ip&1)^1)<<1]; //2020
-                face->edges[2]->parents[1] = face->parent->edges[2];
-
-                face->edges[3]->parents[0] = face->parent->edges[ip>>1<<1^1]; //1133
-                face->edges[3]->parents[1] = face->parent->edges[3];
-
-                face->points[ip^1]->parents[0] = face->parent->points[(ip&1)^1]; //1010
-                face->points[ip^1]->parents[1] = face->parent->points[(ip&1)^3]; //3232
-                face->points[ip^1]->parents[2] = face->parent->points[(ip&1)^1]; //1010
-                face->points[ip^1]->parents[3] = face->parent->points[(ip&1)^3]; //3232
-
-                face->points[ip^2]->parents[0] = face->parent->points[(ip>>1^1)<<1]; //2200
-                face->points[ip^2]->parents[1] = face->parent->points[(ip>>1^1)<<1^1]; //3311
-                face->points[ip^2]->parents[2] = face->parent->points[(ip>>1^1)<<1]; //2200
-                face->points[ip^2]->parents[3] = face->parent->points[(ip>>1^1)<<1^1]; //3311
-
-                face->hanging = true;
-                hanging_faces_z.push_back(face);
-                for(int_t i=0; i<4; ++i){
-                    node->parents[i] = face->parent->points[i];
-                }
+void Tree::list_hanging(){
+    // The hanging entities in key order
+    PhaseTimer timer(stats, "list_hanging");
+    nodes.sort();
+    edges_x.sort();
+    edges_y.sort();
+    edges_z.sort();
+    faces_x.sort();
+    faces_y.sort();
+    faces_z.sort();
+    node_parent_map.sort();
+    edge_parent_map.sort();
+    face_parent_map.sort();
+
+    face_map_t *face_maps[3] = {&faces_x, &faces_y, &faces_z};
+    std::vector<Face *> *hanging_faces[3] = {&hanging_faces_x, &hanging_faces_y, &hanging_faces_z};
+    edge_map_t *edge_maps[3] = {&edges_x, &edges_y, &edges_z};
+    std::vector<Edge *> *hanging_edges[3] = {&hanging_edges_x, &hanging_edges_y, &hanging_edges_z};
+    for(int_t d=0; d<3; ++d){
+        hanging_faces[d]->clear();
+        hanging_edges[d]->clear();
+        if(n_dim==3)
+            list_hanging_in(*face_maps[d], n_threads, *hanging_faces[d]);
+        if(d<n_dim)
+            list_hanging_in(*edge_maps[d], n_threads, *hanging_edges[d]);
+    }
+    list_hanging_in(nodes, n_threads, hanging_nodes);
+}
+
+void Tree::hang_all(){
+    // The parents of a whole map are looked up at once, then the ones found
+    // are hung in map order, as the hang_face loop would
+    PhaseTimer timer(stats, "hang_all");
+    std::vector<int_t> corners;
+    if(n_dim==3){
+        face_map_t *face_maps[3] = {&faces_x, &faces_y, &faces_z};
+        std::vector<Face *> parents;
+        for(int_t d=0; d<3; ++d){
+            face_map_t& faces = *face_maps[d];
+            parents.resize(faces.size());
+            corners.resize(faces.size());
+            parallel_for(faces.size(), n_threads,
+                [&](std::size_t begin, std::size_t end){
+                    for(std::size_t i=begin; i<end; ++i)
+                        parents[i] = find_face_parent((faces.begin()+i)->second, faces, d, corners[i]);
+                });
+            for(std::size_t i=0; i<parents.size(); ++i){
+                if(parents[i]!=NULL)
+                    hang_face_in((faces.begin()+i)->second, parents[i], corners[i]);
             }
         }
-    }
-    else{
-        //Generate Edges (and 1 face for consistency)
-        for(std::vector<Cell *>::size_type i=0; i!= cells.size(); i++){
-            Cell *cell = cells[i];
-            Node *p[4];
-            for(int_t i=0;i<4;++i)
-                p[i] = cell->points[i];
-            Edge *e[4];
-            e[0] = set_default_edge(edges_x, *p[0], *p[1]);
-            e[1] = set_default_edge(edges_x, *p[2], *p[3]);
-            e[2] = set_default_edge(edges_y, *p[0], *p[2]);
-            e[3] = set_default_edge(edges_y, *p[1], *p[3]);
-
-            Face *face = set_default_face(faces_z, *p[0], *p[1], *p[2], *p[3]);
-            for(int_t i=0;i<4;++i){
-                cell->edges[i] = e[i];
-                face->edges[i] = e[i];
-                e[i]->reference++;
+    }else{
+        edge_map_t *edge_maps[2] = {&edges_x, &edges_y};
+        std::vector<Edge *> parents;
+        std::vector<Node *> centers;
+        for(int_t d=0; d<2; ++d){
+            edge_map_t& edges = *edge_maps[d];
+            parents.resize(edges.size());
+            centers.resize(edges.size());
+            parallel_for(edges.size(), n_threads,
+                [&](std::size_t begin, std::size_t end){
+                    for(std::size_t i=begin; i<end; ++i)
+                        parents[i] = find_edge_parent((edges.begin()+i)->second, edges, d, centers[i]);
+                });
+            for(std::size_t i=0; i<parents.size(); ++i){
+                if(parents[i]!=NULL)
+                    hang_edge_in((edges.begin()+i)->second, parents[i], centers[i]);
             }
+        }
+    }
+}
+
+void Tree::finalize_lists(){
+    PhaseTimer timer(stats, "finalize_lists");
+    root->build_cell_vector(cells);
+
+    // Generate Faces and edges
+    if(edges_x.empty()){
+        add_leaf_entities();
+    }else{
+        for(std::vector<Cell *>::size_type i =0; i!= cells.size(); i++)
+            add_cell_entities(cells[i]);
+    }
+
+    // Process hanging faces (edges in 2D)
+    hang_all();
+    list_hanging();
+}
+
+void Tree::refine_cells(const int_t *indices, int_t n, std::vector<int_t>& old_to_new,
+                        std::vector<int_t>& new_to_old){
+    PhaseTimer timer(stats, "refine_cells");
+    std::size_t n_cells = cell_pool.size();
+    int_t n_forced = 0;
+    for(int_t i=0; i<n; ++i){
+        int_t n_split = cells[indices[i]]->split(nodes, node_pool, cell_pool, xs, ys, zs);
+        n_forced += (n_split>1)? n_split-1 : 0;
+    }
+    if(stats.enabled){
+        stats.forced_splits += n_forced;
+        stats.cells_spawned += cell_pool.size()-n_cells;
+    }
+    update_lists(old_to_new, new_to_old);
+}
 
-            face->hanging=false;
+template<class F>
+void Tree::coarsen(F& test, std::vector<int_t>& old_to_new, std::vector<int_t>& new_to_old){
+    // Level by level from the finest, every cell whose children are leaves
+    // that all test below their level is merged. Whether a merge keeps the
+    // balance only depends on the finer levels (see Cell::coarsen), so one
+    // pass finds them all, and the merged cells are tested again with the
+    // next level.
+    PhaseTimer timer(stats, "coarsen");
+    std::vector<cell_vec_t> leaves(max_level+1);
+    for(std::size_t i=0; i<cells.size(); ++i)
+        leaves[cells[i]->level].push_back(cells[i]);
+
+    cell_vec_t removed, parents, kids;
+    std::vector<Node *> released;
+    std::vector<int_t> targets;
+    int_t n_kids = 1<<n_dim;
+    for(int_t l=max_level; l>0; --l){
+        parents.clear();
+        kids.clear();
+        for(std::size_t i=0; i<leaves[l].size(); ++i){
+            Cell *parent = leaves[l][i]->parent;
+            if(parent->children()[0]!=leaves[l][i])
+                continue; // only look at each parent once
+            bool all_leaves = true;
+            for(int_t k=0; k<n_kids; ++k)
+                all_leaves = all_leaves && parent->children()[k]->is_leaf();
+            if(!all_leaves)
+                continue;
+            parents.push_back(parent);
+            kids.insert(kids.end(), parent->children(), parent->children()+n_kids);
+        }
+        targets.resize(kids.size());
+        double start = stats.enabled? TreeStats::now() : 0.0;
+        parallel_for(kids.size(), n_threads,
+            [&](std::size_t begin, std::size_t end){
+                for(std::size_t i=begin; i<end; ++i)
+                    targets[i] = test(kids[i]);
+            });
+        if(stats.enabled){
+            stats.test_seconds += TreeStats::now()-start;
+            stats.test_calls += kids.size();
         }
+        for(std::size_t i=0; i<parents.size(); ++i){
+            bool merge = true;
+            for(int_t k=0; k<n_kids; ++k)
+                merge = merge && targets[i*n_kids+k] < l;
+            if(merge && parents[i]->coarsen(nodes, removed, released))
+                leaves[l-1].push_back(parents[i]);
+        }
+    }
+    update_lists(old_to_new, new_to_old);
 
-        //Process hanging x edges
-        for(edge_it_type it = edges_x.begin(); it != edges_x.end(); ++it){
-            Edge *edge = it->second;
-            if(edge->reference <2){
-                int_t y = edge->location_ind[1];
-                if(y==0 || y==ny) continue; //I am on the boundary
-                if(nodes.count(edge->key)) continue; //I am a parent
-                //I am a hanging edge find my parent
-                Node *node;
-                if(edges_x.count(edge->points[0]->key)){
-                    node = edge->points[0];
-                }else{
-                    node = edge->points[1];
-                }
-                edge->parents[0] = edges_x[node->key];
-                edge->parents[1] = edge->parents[0];
+    for(std::size_t i=0; i<removed.size(); ++i)
+        cell_pool.free(removed[i]);
+    for(std::size_t i=0; i<released.size(); ++i)
+        node_pool.free(released[i]);
+}
+
+void Tree::coarsen_from_function(function test_func, std::vector<int_t>& old_to_new,
+                                 std::vector<int_t>& new_to_old){
+    coarsen(*test_func, old_to_new, new_to_old);
+}
 
-                node->hanging = true;
-                for(int_t i=0;i<4;++i)
-                    node->parents[i] = edge->parents[0]->points[i%2];
-                edge->hanging = true;
+template<class T>
+static void sort_unique(std::vector<T>& items){
+    std::sort(items.begin(), items.end());
+    items.erase(std::unique(items.begin(), items.end()), items.end());
+}
+
+void Tree::update_lists(std::vector<int_t>& old_to_new, std::vector<int_t>& new_to_old){
+    // Brings the lists of a numbered tree up to date after some of its
+    // leaves were split or merged, touching only the entities around those
+    // leaves. The new leaves take the place of the old ones in the cell
+    // list, which keeps it in the same (depth first) order as a full
+    // rebuild. Merged leaves have to be detached but not freed yet: they
+    // are the leaves whose parent is a leaf.
+    PhaseTimer timer(stats, "update_lists");
+    cell_vec_t old_cells, removed, added;
+    old_cells.swap(cells);
+    old_to_new.assign(old_cells.size(), (int_t) -1);
+    new_to_old.clear();
+    for(std::size_t i=0; i<old_cells.size(); ++i){
+        Cell *cell = old_cells[i];
+        if(cell->is_leaf()){
+            Cell *leaf = cell;
+            while(leaf->parent!=NULL && leaf->parent->is_leaf())
+                leaf = leaf->parent;
+            if(leaf!=cell){
+                removed.push_back(cell);
+                if(cells.empty() || cells.back()!=leaf){
+                    added.push_back(leaf);
+                    cells.push_back(leaf);
+                    new_to_old.push_back((int_t) -1);
+                }
+            }else{
+                cells.push_back(cell);
+                new_to_old.push_back(i);
             }
+            old_to_new[i] = cells.size()-1;
+            continue;
+        }
+        removed.push_back(cell);
+        std::size_t first = cells.size();
+        cell->build_cell_vector(cells);
+        for(std::size_t j=first; j<cells.size(); ++j){
+            added.push_back(cells[j]);
+            new_to_old.push_back(i);
         }
+    }
 
-        //Process hanging y edges
-        for(edge_it_type it = edges_y.begin(); it != edges_y.end(); ++it){
-            Edge *edge = it->second;
-            if(edge->reference <2){
-                int_t x = edge->location_ind[0];
-                if(x==0 || x==nx) continue; //I am on the boundary
-                if(nodes.count(edge->key)) continue; //I am a parent
-                //I am a hanging edge find my parent
-                Node *node;
-                if(edges_y.count(edge->points[0]->key)){
-                    node = edge->points[0];
+    // Only the faces (edges in 2D) of the removed and added leaves can start
+    // or stop hanging: every face whose parent appears or disappears is one
+    // of them. They are all unhung first and hung again once the leaves are
+    // swapped, and the entities only the removed leaves had are dropped.
+    int_t n_faces = 2*n_dim, n_edges = (n_dim==3)? 12 : 4, n_per_edge = n_edges/n_dim;
+    std::vector<Face *> faces[3];
+    std::vector<Edge *> edges[3];
+    for(std::size_t i=0; i<removed.size(); ++i){
+        Cell *cell = removed[i];
+        for(int_t j=0; j<n_faces && n_dim==3; ++j){
+            Face *face = cell->faces()[j];
+            unhang_face(face);
+            --face->reference;
+            faces[j/2].push_back(face);
+        }
+        for(int_t j=0; j<n_edges; ++j){
+            Edge *edge = cell->edges()[j];
+            if(n_dim==2)
+                unhang_edge(edge);
+            --edge->reference;
+            edges[j/n_per_edge].push_back(edge);
+        }
+        if(n_dim==2){
+            face_it_type it = faces_z.find(cell->key());
+            face_pool.free(it->second);
+            faces_z.erase(cell->key());
+        }
+    }
+    int_t n_kids = 1<<n_dim;
+    for(std::size_t i=0; i<added.size(); ++i){
+        Cell *cell = added[i];
+        add_cell_entities(cell);
+        for(int_t j=0; j<n_faces && n_dim==3; ++j){
+            unhang_face(cell->faces()[j]);
+            faces[j/2].push_back(cell->faces()[j]);
+        }
+        for(int_t j=0; j<n_edges; ++j){
+            if(n_dim==2)
+                unhang_edge(cell->edges()[j]);
+            edges[j/n_per_edge].push_back(cell->edges()[j]);
+        }
+    }
+    // A cell merged more than one level up also gets new faces against
+    // split neighbors, which the removed leaves did not touch
+    for(std::size_t i=0; i<added.size(); ++i){
+        Cell *cell = added[i];
+        for(int_t j=0; j<n_faces; ++j){
+            Cell *other = cell->neighbors()[j];
+            if(other==NULL || other->level!=cell->level || other->is_leaf())
+                continue;
+            for(int_t k=0; k<n_kids; ++k){
+                if(((k>>(j/2))&1) == (j&1))
+                    continue; // not against this cell
+                Cell *kid = other->children()[k];
+                if(!kid->is_leaf())
+                    continue;
+                if(n_dim==3){
+                    unhang_face(kid->faces()[j^1]);
+                    faces[j/2].push_back(kid->faces()[j^1]);
                 }else{
-                    node = edge->points[1];
+                    // 2D faces -x,+x,-y,+y are the edges 2,3,0,1
+                    Edge *edge = kid->edges()[(j^1)^2];
+                    unhang_edge(edge);
+                    edges[1-j/2].push_back(edge);
                 }
-                edge->parents[0] = edges_y[node->key];
-                edge->parents[1] = edge->parents[0];
-
-                node->hanging = true;
-                for(int_t i=0;i<4;++i)
-                    node->parents[i] = edge->parents[0]->points[i%2];
-                edge->hanging = true;
             }
         }
     }
-    //List hanging edges x
-    for(edge_it_type it = edges_x.begin(); it != edges_x.end(); ++it){
-        Edge *edge = it->second;
-        if(edge->hanging){
-            hanging_edges_x.push_back(edge);
+
+    // Unused entities leave the maps before the others are hung (so they
+    // are not taken as parents), and go back to the pools after
+    face_map_t *face_maps[3] = {&faces_x, &faces_y, &faces_z};
+    edge_map_t *edge_maps[3] = {&edges_x, &edges_y, &edges_z};
+    for(int_t d=0; d<n_dim; ++d){
+        sort_unique(faces[d]);
+        sort_unique(edges[d]);
+        for(std::size_t i=0; i<faces[d].size(); ++i){
+            if(faces[d][i]->reference==0)
+                face_maps[d]->erase(faces[d][i]->key());
         }
-    }
-    //List hanging edges y
-    for(edge_it_type it = edges_y.begin(); it != edges_y.end(); ++it){
-        Edge *edge = it->second;
-        if(edge->hanging){
-            hanging_edges_y.push_back(edge);
+        for(std::size_t i=0; i<edges[d].size(); ++i){
+            if(edges[d][i]->reference==0)
+                edge_maps[d]->erase(edges[d][i]->key());
         }
     }
-    if(n_dim==3){
-        //List hanging edges z
-        for(edge_it_type it = edges_z.begin(); it != edges_z.end(); ++it){
-            Edge *edge = it->second;
-            if(edge->hanging){
-                hanging_edges_z.push_back(edge);
+    for(int_t d=0; d<n_dim; ++d){
+        if(n_dim==3){
+            for(std::size_t i=0; i<faces[d].size(); ++i){
+                if(faces[d][i]->reference>0)
+                    hang_face(faces[d][i], *face_maps[d], d);
+            }
+        }else{
+            for(std::size_t i=0; i<edges[d].size(); ++i){
+                if(edges[d][i]->reference>0)
+                    hang_edge(edges[d][i], *edge_maps[d], d);
             }
         }
     }
-
-    //List hanging nodes
-    for(node_it_type it = nodes.begin(); it != nodes.end(); ++it){
-        Node *node = it->second;
-        if(node->hanging){
-            hanging_nodes.push_back(node);
+    for(int_t d=0; d<n_dim; ++d){
+        for(std::size_t i=0; i<faces[d].size(); ++i){
+            if(faces[d][i]->reference==0)
+                face_pool.free(faces[d][i]);
+        }
+        for(std::size_t i=0; i<edges[d].size(); ++i){
+            if(edges[d][i]->reference==0)
+                edge_pool.free(edges[d][i]);
         }
     }
+    list_hanging();
+    number();
 }
 
 void Tree::number(){
+    //Entities are numbered in ascending key order
+    PhaseTimer timer(stats, "number");
+    nodes.sort();
+    edges_x.sort();
+    edges_y.sort();
+    edges_z.sort();
+    faces_x.sort();
+    faces_y.sort();
+    faces_z.sort();
+
     //Number Nodes
     int_t ii, ih;
     ii = 0;
@@ -1110,37 +1757,251 @@ void Tree::number(){
     }else{
         //Ensure Fz and cells are numbered the same in 2D
         for(std::vector<Cell *>::size_type i =0; i!= cells.size(); ++i)
-            faces_z[cells[i]->key]->index = cells[i]->index;
+            faces_z[cells[i]->key()]->index = cells[i]->index;
     }
-
+    arrays.clear();
 };
 
-Tree::~Tree(){
-    if (root==NULL){
-        return;
-    }
-    delete root;
-    for(node_it_type it = nodes.begin(); it != nodes.end(); it++){
-        delete it->second;
-    }
-    for(face_it_type it = faces_x.begin(); it != faces_x.end(); it++){
-        delete it->second;
-    }
-    for(face_it_type it = faces_y.begin(); it != faces_y.end(); it++){
-        delete it->second;
+void ResolvedParents::clear(){
+    ptr.clear();
+    parents.clear();
+    weights.clear();
+}
+
+// Follows each of the n_hanging hanging entities, whose n_parents parents
+// (each weighted by weight) are in parents, depth first down to the non
+// hanging ones, below n. The rows are counted and then filled in parallel.
+static void resolve_parents(int_t n, int_t n_hanging, const std::vector<int_t>& parents,
+                            int_t n_parents, double weight, int_t n_threads,
+                            ResolvedParents& out){
+    // each step down leaves at most n_parents-1 parents waiting
+    const int_t max_waiting = 3*(max_key_level+1)+1;
+    auto follow = [&](int_t h, int_t *found, double *found_weights){
+        int_t stack[max_waiting];
+        double weights[max_waiting];
+        int_t n_waiting = 1, n_found = 0;
+        stack[0] = n+h;
+        weights[0] = 1.0;
+        while(n_waiting>0){
+            --n_waiting;
+            int_t i = stack[n_waiting];
+            double w = weights[n_waiting];
+            if(i<n){
+                if(found!=NULL){
+                    found[n_found] = i;
+                    found_weights[n_found] = w;
+                }
+                ++n_found;
+                continue;
+            }
+            const int_t *p = &parents[n_parents*(i-n)];
+            for(int_t j=n_parents; j>0; --j){
+                stack[n_waiting] = p[j-1];
+                weights[n_waiting] = weight*w;
+                ++n_waiting;
+            }
+        }
+        return n_found;
+    };
+    out.ptr.assign(n_hanging+1, 0);
+    parallel_for(n_hanging, n_threads,
+        [&](std::size_t begin, std::size_t end){
+            for(std::size_t h=begin; h<end; ++h)
+                out.ptr[h+1] = follow(h, NULL, NULL);
+        });
+    for(int_t h=0; h<n_hanging; ++h)
+        out.ptr[h+1] += out.ptr[h];
+    out.parents.resize(out.ptr[n_hanging]);
+    out.weights.resize(out.ptr[n_hanging]);
+    parallel_for(n_hanging, n_threads,
+        [&](std::size_t begin, std::size_t end){
+            for(std::size_t h=begin; h<end; ++h)
+                follow(h, &out.parents[out.ptr[h]], &out.weights[out.ptr[h]]);
+        });
+}
+
+MeshArrays::MeshArrays(){
+    built = 0;
+}
+
+template<class T>
+static void fill_locations(Tree& tree, T& map, std::vector<double>& locations){
+    int_t n_dim = tree.n_dim;
+    locations.resize(map.size()*n_dim);
+    parallel_for(map.size(), tree.n_threads,
+        [&](std::size_t begin, std::size_t end){
+            for(std::size_t i=begin; i<end; ++i){
+                typename T::value_type::second_type item = (map.begin()+i)->second;
+                double location[3];
+                tree.location(item, location);
+                for(int_t j=0; j<n_dim; ++j)
+                    locations[item->index*n_dim+j] = location[j];
+            }
+        });
+}
+
+void MeshArrays::build(Tree& tree, int_t parts){
+    int_t n_dim = tree.n_dim;
+    int_t n_threads = tree.n_threads;
+    parts &= ~built;
+    built |= parts;
+    PhaseTimer timer(tree.stats, "mesh_arrays");
+
+    if(parts&CELLS){
+        cell_vec_t& cells = tree.cells;
+        int_t n_cells = cells.size();
+        int_t n_points = 1<<n_dim, n_faces = 2*n_dim, n_edges = (n_dim==3)? 12 : 4;
+        cell_centers.resize(n_cells*n_dim);
+        cell_widths.resize(n_cells*n_dim);
+        cell_volumes.resize(n_cells);
+        cell_nodes.resize(n_cells*n_points);
+        cell_faces.resize(n_cells*n_faces);
+        cell_edges.resize(n_cells*n_edges);
+        parallel_for(n_cells, n_threads,
+            [&](std::size_t begin, std::size_t end){
+                for(std::size_t i=begin; i<end; ++i){
+                    Cell *cell = cells[i];
+                    for(int_t j=0; j<n_dim; ++j){
+                        cell_centers[i*n_dim+j] = cell->center(j);
+                        cell_widths[i*n_dim+j] = 2*(cell->center(j)-cell->x0[j]);
+                    }
+                    cell_volumes[i] = cell->volume();
+                    for(int_t j=0; j<n_points; ++j)
+                        cell_nodes[i*n_points+j] = cell->points()[j]->index;
+                    for(int_t j=0; j<n_edges; ++j)
+                        cell_edges[i*n_edges+j] = cell->edges()[j]->index;
+                    if(n_dim==3){
+                        for(int_t j=0; j<n_faces; ++j)
+                            cell_faces[i*n_faces+j] = cell->faces()[j]->index;
+                    }else{
+                        // x faces are y edges and y faces are x edges
+                        cell_faces[i*n_faces  ] = cell->edges()[2]->index;
+                        cell_faces[i*n_faces+1] = cell->edges()[3]->index;
+                        cell_faces[i*n_faces+2] = cell->edges()[0]->index;
+                        cell_faces[i*n_faces+3] = cell->edges()[1]->index;
+                    }
+                }
+            });
     }
-    for(face_it_type it = faces_z.begin(); it != faces_z.end(); it++){
-        delete it->second;
+
+    if(parts&NODES)
+        fill_locations(tree, tree.nodes, node_locations);
+
+    if(parts&EDGES){
+        edge_map_t *edge_maps[3] = {&tree.edges_x, &tree.edges_y, &tree.edges_z};
+        for(int_t d=0; d<n_dim; ++d){
+            edge_map_t& map = *edge_maps[d];
+            fill_locations(tree, map, edge_locations[d]);
+            edge_lengths[d].resize(map.size());
+            edge_nodes[d].resize(2*map.size());
+            parallel_for(map.size(), n_threads,
+                [&](std::size_t begin, std::size_t end){
+                    for(std::size_t i=begin; i<end; ++i){
+                        Edge *edge = (map.begin()+i)->second;
+                        edge_lengths[d][edge->index] = tree.length(edge);
+                        edge_nodes[d][2*edge->index  ] = edge->points[0]->index;
+                        edge_nodes[d][2*edge->index+1] = edge->points[1]->index;
+                    }
+                });
+        }
     }
-    for(edge_it_type it = edges_x.begin(); it != edges_x.end(); it++){
-        delete it->second;
+
+    if((parts&FACES) && n_dim==3){
+        face_map_t *face_maps[3] = {&tree.faces_x, &tree.faces_y, &tree.faces_z};
+        for(int_t d=0; d<3; ++d){
+            face_map_t& map = *face_maps[d];
+            fill_locations(tree, map, face_locations[d]);
+            face_areas[d].resize(map.size());
+            face_edges[d].resize(4*map.size());
+            parallel_for(map.size(), n_threads,
+                [&](std::size_t begin, std::size_t end){
+                    for(std::size_t i=begin; i<end; ++i){
+                        Face *face = (map.begin()+i)->second;
+                        face_areas[d][face->index] = tree.area(face);
+                        for(int_t j=0; j<4; ++j)
+                            face_edges[d][4*face->index+j] = face->edges[j]->index;
+                    }
+                });
+        }
     }
-    for(edge_it_type it = edges_y.begin(); it != edges_y.end(); it++){
-        delete it->second;
+
+    if(parts&PARENTS){
+        int_t n = tree.nodes.size()-tree.hanging_nodes.size();
+        node_parents.resize(4*tree.hanging_nodes.size());
+        for(std::size_t i=0; i<tree.hanging_nodes.size(); ++i){
+            Node *node = tree.hanging_nodes[i];
+            Node **parents = tree.parents_of(node);
+            for(int_t j=0; j<4; ++j)
+                node_parents[4*(node->index-n)+j] = parents[j]->index;
+        }
+        resolve_parents(n, tree.hanging_nodes.size(), node_parents, 4, 0.25, n_threads,
+                        node_resolved);
+        edge_map_t *edge_maps[3] = {&tree.edges_x, &tree.edges_y, &tree.edges_z};
+        std::vector<Edge *> *hanging_edges[3] = {&tree.hanging_edges_x, &tree.hanging_edges_y,
+                                                 &tree.hanging_edges_z};
+        for(int_t d=0; d<n_dim; ++d){
+            std::vector<Edge *>& hanging = *hanging_edges[d];
+            n = edge_maps[d]->size()-hanging.size();
+            edge_parents[d].resize(2*hanging.size());
+            for(std::size_t i=0; i<hanging.size(); ++i){
+                Edge *edge = hanging[i];
+                Edge **parents = tree.parents_of(edge);
+                edge_parents[d][2*(edge->index-n)  ] = parents[0]->index;
+                edge_parents[d][2*(edge->index-n)+1] = parents[1]->index;
+            }
+            resolve_parents(n, hanging.size(), edge_parents[d], 2, 0.5, n_threads,
+                            edge_resolved[d]);
+        }
+        face_map_t *face_maps[3] = {&tree.faces_x, &tree.faces_y, &tree.faces_z};
+        std::vector<Face *> *hanging_faces[3] = {&tree.hanging_faces_x, &tree.hanging_faces_y,
+                                                 &tree.hanging_faces_z};
+        for(int_t d=0; d<3 && n_dim==3; ++d){
+            std::vector<Face *>& hanging = *hanging_faces[d];
+            n = face_maps[d]->size()-hanging.size();
+            face_parents[d].resize(hanging.size());
+            for(std::size_t i=0; i<hanging.size(); ++i)
+                face_parents[d][hanging[i]->index-n] = tree.parent_of(hanging[i])->index;
+            resolve_parents(n, hanging.size(), face_parents[d], 1, 1.0, n_threads,
+                            face_resolved[d]);
+        }
     }
-    for(edge_it_type it = edges_z.begin(); it != edges_z.end(); it++){
-        delete it->second;
+}
+
+void MeshArrays::clear(){
+    built = 0;
+    cell_centers.clear();
+    cell_widths.clear();
+    cell_volumes.clear();
+    cell_nodes.clear();
+    cell_faces.clear();
+    cell_edges.clear();
+    node_locations.clear();
+    for(int_t d=0; d<3; ++d){
+        edge_locations[d].clear();
+        edge_lengths[d].clear();
+        edge_nodes[d].clear();
+        face_locations[d].clear();
+        face_areas[d].clear();
+        face_edges[d].clear();
+        edge_parents[d].clear();
+        face_parents[d].clear();
+        edge_resolved[d].clear();
+        face_resolved[d].clear();
     }
+    node_parents.clear();
+    node_resolved.clear();
+    transposed.clear();
+    scratch.clear();
+}
+
+void MeshArrays::swap(MeshArrays& other){
+    // moves every vector, which hands over its buffer as it is
+    std::swap(*this, other);
+}
+
+
+Tree::~Tree(){
+    // The pools own every entity and release them block by block
     cells.clear();
     nodes.clear();
     faces_x.clear();
@@ -1149,8 +2010,115 @@ Tree::~Tree(){
     edges_x.clear();
     edges_y.clear();
     edges_z.clear();
+    node_parent_map.clear();
+    edge_parent_map.clear();
+    face_parent_map.clear();
 };
 
+// The level of the cells whose edges are as long as edge
+static int_t edge_level(Edge *edge, int_t max_level){
+    unsigned int length = 0;
+    for(int_t d=0; d<3; ++d){
+        unsigned int a = edge->points[0]->location_ind[d], b = edge->points[1]->location_ind[d];
+        length += (a<b)? b-a : a-b;
+    }
+    // a cell on level l is 2<<(max_level-l) wide
+    int_t level = max_level+1;
+    while(length>1 && level>0){
+        length >>= 1;
+        --level;
+    }
+    return level;
+}
+
+void Tree::count_levels(std::vector<int_t>& n_cells, std::vector<int_t>& n_edges,
+                        std::vector<int_t>& n_faces, std::vector<int_t>& n_hanging_edges,
+                        std::vector<int_t>& n_hanging_faces){
+    n_cells.assign(max_level+1, 0);
+    n_edges.assign(max_level+1, 0);
+    n_faces.assign(max_level+1, 0);
+    n_hanging_edges.assign(max_level+1, 0);
+    n_hanging_faces.assign(max_level+1, 0);
+    for(std::size_t i=0; i<cells.size(); ++i)
+        n_cells[cells[i]->level] += 1;
+
+    edge_map_t *edge_maps[3] = {&edges_x, &edges_y, &edges_z};
+    face_map_t *face_maps[3] = {&faces_x, &faces_y, &faces_z};
+    for(int_t d=0; d<n_dim; ++d){
+        for(edge_it_type it=edge_maps[d]->begin(); it!=edge_maps[d]->end(); ++it){
+            int_t level = edge_level(it->second, max_level);
+            n_edges[level] += 1;
+            n_hanging_edges[level] += it->second->hanging;
+        }
+    }
+    for(int_t d=0; d<3 && n_dim==3; ++d){
+        for(face_it_type it=face_maps[d]->begin(); it!=face_maps[d]->end(); ++it){
+            int_t level = edge_level(it->second->edges[0], max_level);
+            n_faces[level] += 1;
+            n_hanging_faces[level] += it->second->hanging;
+        }
+    }
+}
+
 Cell* Tree::containing_cell(double x, double y, double z){
     return root->containing_cell(x,y,z);
 }
+
+// Tree size (in cells) above which containing_cells sorts its points first
+static const int_t sort_points_above = 1<<19;
+
+void Tree::containing_cells(const double *pts, int_t n, int_t *out){
+    // pts holds n points of n_dim coordinates, the index of the cell that
+    // contains each one is written to out.
+    // Once the tree is much larger than the caches, the points are first
+    // bucketed by a coarse Morton code, so consecutive lookups share most
+    // of their path and mostly touch the same small subtree. Smaller trees
+    // stay in cache anyway and are walked in input order.
+    PhaseTimer timer(stats, "containing_cells");
+    std::vector<int_t> order;
+    std::vector<double> sorted;
+    if(cells.size() > sort_points_above){
+        int_t bits = (n_dim==3)? 5 : 7;
+        int_t n_buckets = (int_t) 1<<(bits*n_dim);
+        double *grids[3] = {xs, ys, zs};
+        int_t n_grid[3] = {nx, ny, nz};
+        double lo[3], scale[3], max_ind = (1<<bits)-1;
+        for(int_t j=0; j<n_dim; ++j){
+            lo[j] = grids[j][0];
+            scale[j] = (1<<bits)/(grids[j][n_grid[j]]-lo[j]);
+        }
+        std::vector<int_t> codes(n), counts(n_buckets+1, 0);
+        for(int_t i=0; i<n; ++i){
+            int_t ind[3] = {0, 0, 0};
+            for(int_t j=0; j<n_dim; ++j){
+                double v = (pts[i*n_dim+j]-lo[j])*scale[j];
+                ind[j] = (v>0)? (int_t) std::min(v, max_ind) : 0;
+            }
+            codes[i] = (n_dim==3)? morton_code(ind[0], ind[1], ind[2])
+                                 : morton_code(ind[0], ind[1]);
+            ++counts[codes[i]+1];
+        }
+        for(int_t i=0; i<n_buckets; ++i)
+            counts[i+1] += counts[i];
+        order.resize(n);
+        sorted.resize(n*n_dim);
+        for(int_t i=0; i<n; ++i){
+            int_t k = counts[codes[i]]++;
+            order[k] = i;
+            for(int_t j=0; j<n_dim; ++j)
+                sorted[k*n_dim+j] = pts[i*n_dim+j];
+        }
+        pts = &sorted[0];
+    }
+    const int_t *ind = order.empty()? NULL : &order[0];
+    int_t dim = n_dim;
+    Cell *top = root;
+    parallel_for(n, n_threads,
+        [=](std::size_t begin, std::size_t end){
+            for(std::size_t i=begin; i<end; ++i){
+                const double *p = pts+i*dim;
+                Cell *cell = top->containing_cell(p[0], p[1], (dim==3)? p[2] : 0.0);
+                out[ind? ind[i] : i] = cell->index;
+            }
+        });
+}
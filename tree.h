@@ -1,158 +1,470 @@
-#ifndef __TREE_H
-#define __TREE_H
-
-#include <vector>
-#include <map>
-#include <iostream>
-
-typedef std::size_t int_t;
-
-inline int_t key_func(int_t x, int_t y){
-//Double Cantor pairing
-    return ((x+y)*(x+y+1))/2+y;
-}
-inline int_t key_func(int_t x, int_t y, int_t z){
-    return key_func(key_func(x,y), z);
-}
-class Node;
-class Edge;
-class Face;
-class Cell;
-class Tree;
-class PyWrapper;
-typedef PyWrapper* function;
-
-typedef std::map<int_t, Node *> node_map_t;
-typedef std::map<int_t, Edge *> edge_map_t;
-typedef std::map<int_t, Face *> face_map_t;
-typedef node_map_t::iterator node_it_type;
-typedef edge_map_t::iterator edge_it_type;
-typedef face_map_t::iterator face_it_type;
-typedef std::vector<Cell *> cell_vec_t;
-
-class PyWrapper{
-  public:
-    void *py_func;
-    int_t (*eval)(void *, Cell*);
-  PyWrapper(){
-    py_func = NULL;
-  };
-  void set(void* func, int_t (*wrapper)(void*, Cell*)){
-    py_func = func;
-    eval = wrapper;
-  };
-  int operator()(Cell * cell){
-    return eval(py_func, cell);
-  };
-};
-
-class Node{
-  public:
-    int_t location_ind[3];
-    double location[3];
-    int_t key;
-    int_t reference;
-    int_t index;
-    bool hanging;
-    Node *parents[4];
-    Node();
-    Node(int_t, int_t, int_t, double*, double*, double*);
-    double operator[](int_t index){
-      return location[index];
-    };
-};
-
-class Edge{
-  public:
-    int_t location_ind[3];
-    double location[3];
-    int_t key;
-    int_t reference;
-    int_t index;
-    double length;
-    bool hanging;
-    Node *points[2];
-    Edge *parents[2];
-    Edge();
-    Edge(Node& p1, Node&p2);
-};
-
-class Face{
-    public:
-        int_t location_ind[3];
-        double location[3];
-        int_t key;
-        int_t reference;
-        int_t index;
-        double area;
-        bool hanging;
-        Node *points[4];
-        Edge *edges[4];
-        Face *parent;
-        Face();
-        Face(Node& p1, Node& p2, Node& p3, Node& p4);
-};
-
-
-class Cell{
-  public:
-    int_t n_dim;
-    Cell *parent, *children[8], *neighbors[6];
-    Node *points[8];
-    Edge *edges[12];
-    Face *faces[6];
-
-    int_t location_ind[3], index, key, level, max_level;
-    double location[3];
-    double volume;
-    function test_func;
-
-    Cell();
-    Cell(Node *pts[4], int_t ndim, int_t maxlevel, function func);
-    Cell(Node *pts[4], Cell *parent);
-    ~Cell();
-
-    bool inline is_leaf(){ return children[0]==NULL;};
-    void spawn(node_map_t& nodes, Cell *kids[8], double* xs, double *ys, double *zs);
-    void divide(node_map_t& nodes, double* xs, double* ys, double* zs, bool force=false, bool balance=true);
-    void set_neighbor(Cell* other, int_t direction);
-    void build_cell_vector(cell_vec_t& cells);
-
-    void insert_cell(node_map_t &nodes, double *new_center, int_t p_level, double* xs, double *ys, double *zs);
-
-    Cell* containing_cell(double, double, double);
-};
-
-class Tree{
-  public:
-    int_t n_dim;
-    Cell *root;
-    function test_func;
-    int_t max_level, nx, ny, nz;
-    double *xs;
-    double *ys;
-    double *zs;
-
-    std::vector<Cell *> cells;
-    node_map_t nodes;
-    edge_map_t edges_x, edges_y, edges_z;
-    face_map_t faces_x, faces_y, faces_z;
-    std::vector<Node *> hanging_nodes;
-    std::vector<Edge *> hanging_edges_x, hanging_edges_y, hanging_edges_z;
-    std::vector<Face *> hanging_faces_x, hanging_faces_y, hanging_faces_z;
-
-    Tree();
-    ~Tree();
-
-    void set_dimension(int_t dim);
-    void set_level(int_t max_level);
-    void set_xs(double *x , double *y, double *z);
-    void build_tree_from_function(function test_func);
-    void number();
-    void finalize_lists();
-
-    void insert_cell(double *new_center, int_t p_level);
-
-    Cell* containing_cell(double, double, double);
-};
-#endif
+#ifndef __TREE_H
+#define __TREE_H
+
+#include <vector>
+#include <iostream>
+#include "key_map.h"
+#include "pool.h"
+#include "morton.h"
+#include "stats.h"
+
+typedef std::size_t int_t;
+
+// Every node, edge, face and cell is keyed by its location_ind, which lies
+// on a grid of 2^(max_level+1)+1 indices per dimension. number() orders each
+// type of entity by key.
+//
+// By default keys are the double Cantor pairing of the indices. Building
+// with MORTON_KEYS defined interleaves their bits instead (Morton order),
+// so that neighboring entities get nearby indices. Either way the keys have
+// to fit in 64 bits, which limits max_level to max_key_level.
+#ifdef MORTON_KEYS
+const int_t max_key_level = 19; // 21 bits per index
+
+inline int_t key_func(int_t x, int_t y){
+    return morton_code(x, y);
+}
+inline int_t key_func(int_t x, int_t y, int_t z){
+    return morton_code(x, y, z);
+}
+#else
+const int_t max_key_level = 14; // keys grow as 2*(2^(max_level+1))^4
+
+inline int_t key_func(int_t x, int_t y){
+//Double Cantor pairing
+    return ((x+y)*(x+y+1))/2+y;
+}
+inline int_t key_func(int_t x, int_t y, int_t z){
+    return key_func(key_func(x,y), z);
+}
+#endif
+class Node;
+class Edge;
+class Face;
+class Cell;
+class Tree;
+class PyWrapper;
+class PyBatchWrapper;
+class RefineCriteria;
+typedef PyWrapper* function;
+typedef PyBatchWrapper* batch_function;
+
+typedef KeyMap<Node *> node_map_t;
+typedef KeyMap<Edge *> edge_map_t;
+typedef KeyMap<Face *> face_map_t;
+typedef node_map_t::iterator node_it_type;
+typedef edge_map_t::iterator edge_it_type;
+typedef face_map_t::iterator face_it_type;
+typedef std::vector<Cell *> cell_vec_t;
+typedef Pool<Node> node_pool_t;
+typedef Pool<Edge> edge_pool_t;
+typedef Pool<Face> face_pool_t;
+typedef Pool<Cell> cell_pool_t;
+
+class PyWrapper{
+  public:
+    void *py_func;
+    int_t (*eval)(void *, Cell*);
+  PyWrapper(){
+    py_func = NULL;
+  };
+  void set(void* func, int_t (*wrapper)(void*, Cell*)){
+    py_func = func;
+    eval = wrapper;
+  };
+  int operator()(Cell * cell){
+    return eval(py_func, cell);
+  };
+};
+
+// Evaluates a whole level of cells in one call: n cells with n_dim
+// components of center and width each, their levels, and the target
+// levels to fill in.
+class PyBatchWrapper{
+  public:
+    void *py_func;
+    void (*eval)(void *, int_t, int_t, double*, double*, int_t*, int_t*);
+  PyBatchWrapper(){
+    py_func = NULL;
+  };
+  void set(void* func, void (*wrapper)(void*, int_t, int_t, double*, double*, int_t*, int_t*)){
+    py_func = func;
+    eval = wrapper;
+  };
+  void operator()(int_t n, int_t n_dim, double *centers, double *widths,
+                  int_t *levels, int_t *targets){
+    eval(py_func, n, n_dim, centers, widths, levels, targets);
+  };
+};
+
+// Nodes, edges and faces only keep what cannot be found from their
+// location_ind, which are the indices into the tree's xs, ys and zs: their
+// coordinates (see Tree::location) and keys are worked out on demand, and
+// the parents of the few that hang are kept in tables of the Tree. Indices
+// and counts are 32 bit, which is plenty below max_key_level.
+class Node{
+  public:
+    unsigned int location_ind[3];
+    unsigned int index;
+    unsigned short reference;
+    unsigned char hanging_refs; // hanging faces (edges in 2D) it hangs on
+    bool hanging;
+    Node();
+    Node(int_t ix, int_t iy, int_t iz);
+    int_t key() const{
+        return key_func(location_ind[0], location_ind[1], location_ind[2]);
+    };
+};
+
+class Edge{
+  public:
+    unsigned int location_ind[3];
+    unsigned int index;
+    unsigned short reference;
+    unsigned char hanging_refs; // hanging faces it hangs on (3D)
+    bool hanging;
+    Node *points[2];
+    Edge();
+    Edge(Node& p1, Node& p2);
+    int_t key() const{
+        return key_func(location_ind[0], location_ind[1], location_ind[2]);
+    };
+};
+
+// The edges of a face go around it: with corners p0, p1, p2, p3 (in
+// Cell::points order) they are p0-p2, p2-p3, p1-p3 and p0-p1.
+class Face{
+    public:
+        unsigned int location_ind[3];
+        unsigned int index;
+        unsigned short reference;
+        bool hanging;
+        Edge *edges[4];
+        Face();
+        Face(Node& p1, Node& p2, Node& p3, Node& p4);
+        int_t key() const{
+            return key_func(location_ind[0], location_ind[1], location_ind[2]);
+        };
+        Node* point(int_t i){
+            return edges[(i<2)? 3 : 1]->points[i&1];
+        };
+};
+
+// Parents of a hanging node or edge, see Tree::node_parent_map
+struct NodeParents{
+    Node *parents[4];
+};
+struct EdgeParents{
+    Edge *parents[2];
+};
+typedef KeyMap<NodeParents> node_parent_map_t;
+typedef KeyMap<EdgeParents> edge_parent_map_t;
+
+// Cells keep the locations of their first and last points, which the
+// refinement functions and interpolation read for every cell, and work out
+// the rest (center, widths, volume) from those. The small fields are packed
+// at the end.
+//
+// The links to children, neighbors, points, edges and faces follow the cell
+// in its pool slot, as many as its dimension has (cell_links), so a 2D cell
+// takes 208 bytes where a 3D one takes 400. Cells only live in a pool set up
+// with size(n_dim), never on their own.
+class Cell{
+  public:
+    Cell *parent;
+
+    double x0[3], x1[3]; // locations of the first and last points
+    unsigned int location_ind[3];
+    unsigned int index;
+    unsigned char n_dim, level, max_level;
+
+    static std::size_t size(int_t ndim){
+        return sizeof(Cell)+sizeof(void *)*cell_links(ndim);
+    };
+    // children (2^d), neighbors (2d), points (2^d), edges (4 or 12), faces
+    // (none in 2D, where the cell is its own face)
+    static int_t cell_links(int_t ndim){
+        return (ndim==3)? 8+6+8+12+6 : 4+4+4+4;
+    };
+    Cell** children(){ return reinterpret_cast<Cell **>(this+1);};
+    Cell** neighbors(){ return children()+(1<<n_dim);};
+    Node** points(){ return reinterpret_cast<Node **>(neighbors()+2*n_dim);};
+    Edge** edges(){ return reinterpret_cast<Edge **>(points()+(1<<n_dim));};
+    Face** faces(){ return reinterpret_cast<Face **>(edges()+((n_dim==3)? 12 : 4));};
+
+    Cell(Node *pts[4], int_t ndim, int_t maxlevel, double *xs, double *ys, double *zs);
+    Cell(Node *pts[4], Cell *parent, double *xs, double *ys, double *zs);
+
+    bool inline is_leaf(){ return children()[0]==NULL;};
+    int_t key() const{
+        return key_func(location_ind[0], location_ind[1], location_ind[2]);
+    };
+    double center(int_t d) const{ return (x0[d]+x1[d])*0.5;};
+    double volume() const{
+        double v = (x1[0]-x0[0])*(x1[1]-x0[1]);
+        return (n_dim==3)? v*(x1[2]-x0[2]) : v;
+    };
+    // The tree walks below check n_dim once and then run a version compiled
+    // for that dimension (the templates taking D), so they have no dimension
+    // branches and fixed length child loops. None of them recurse: they go
+    // down a single path, or use walk_cells or a stack of their own.
+    void spawn(node_map_t& nodes, node_pool_t& node_pool, cell_pool_t& cell_pool,
+               Cell *kids[8], double* xs, double *ys, double *zs);
+    template<int_t D>
+    void spawn(node_map_t& nodes, node_pool_t& node_pool, cell_pool_t& cell_pool,
+               Cell *kids[8], double* xs, double *ys, double *zs);
+    // Returns the cells it split: none if this one already was, else this
+    // one and the neighbors the 2:1 balance forced
+    int_t split(node_map_t& nodes, node_pool_t& node_pool, cell_pool_t& cell_pool,
+                double* xs, double* ys, double* zs, bool balance=true);
+    template<int_t D>
+    int_t split(node_map_t& nodes, node_pool_t& node_pool, cell_pool_t& cell_pool,
+                double* xs, double* ys, double* zs, bool balance=true);
+    // Points the new children at each other and at the neighbors' children
+    template<int_t D>
+    void link_children();
+    bool coarsen(node_map_t& nodes, cell_vec_t& removed, std::vector<Node *>& released);
+    // test is any callable taking a Cell* and returning the level it wants.
+    // Returns the splits the 2:1 balance forced beyond the ones test asked for.
+    template<class F>
+    int_t divide(node_map_t& nodes, node_pool_t& node_pool, cell_pool_t& cell_pool,
+                 double* xs, double* ys, double* zs, F& test);
+    template<int_t D, class F>
+    int_t divide(node_map_t& nodes, node_pool_t& node_pool, cell_pool_t& cell_pool,
+                 double* xs, double* ys, double* zs, F& test);
+    void set_neighbor(Cell* other, int_t direction);
+    void build_cell_vector(cell_vec_t& cells);
+    template<int_t D>
+    void build_cell_vector(cell_vec_t& cells);
+
+    void insert_cell(node_map_t &nodes, node_pool_t& node_pool, cell_pool_t& cell_pool,
+                     double *new_center, int_t p_level, double* xs, double *ys, double *zs);
+    template<int_t D>
+    void insert_cell(node_map_t &nodes, node_pool_t& node_pool, cell_pool_t& cell_pool,
+                     double *new_center, int_t p_level, double* xs, double *ys, double *zs);
+
+    Cell* containing_cell(double, double, double);
+    template<int_t D>
+    Cell* containing_cell(double, double, double);
+};
+
+// Visits the cells under (and including) cell depth first, parents before
+// their children and the children in order, like a recursive walk but with
+// an explicit stack. visit(cell) returns whether to go on into the cell's
+// children, and may split it first.
+template<int_t D, class V>
+void walk_cells(Cell *cell, V& visit){
+    // each level down leaves at most 2^D-1 siblings waiting
+    Cell *stack[((1<<D)-1)*(max_key_level+1)+1];
+    int_t n = 1;
+    stack[0] = cell;
+    while(n>0){
+        cell = stack[--n];
+        if(!visit(cell) || cell->is_leaf())
+            continue;
+        for(int i=(1<<D)-1; i>=0; --i)
+            stack[n++] = cell->children()[i];
+    }
+}
+
+// The non hanging entities the hanging ones take their values from, where
+// parents that hang are followed to their own parents. Those of hanging
+// entity i (counted from the first hanging index) are
+// parents[ptr[i]:ptr[i+1]], with their weights, in the order they are
+// reached depth first; one reached twice is listed twice.
+class ResolvedParents{
+  public:
+    std::vector<int_t> ptr, parents;
+    std::vector<double> weights;
+
+    void clear();
+};
+
+// The entries of an operator (op and direction as in operators.h) by
+// column: those of column j are the weights[k] of rows[k], for k in
+// [ptr[j], ptr[j+1]), in row order. See apply_operator.
+class TransposedRows{
+  public:
+    int_t op, direction;
+    std::vector<int_t> ptr, rows;
+    std::vector<double> weights;
+};
+
+// Flat (structure of arrays) copies of a numbered tree's geometry and
+// connectivity, built on demand in groups (cells, nodes, edges, faces,
+// parents) since
+// gathering them touches every entity. Every entity is stored at its index,
+// hanging ones after the others, and edges and faces are split by direction
+// (x, y, z). Faces are only stored in 3D, 2D faces are edges. Connectivity
+// tables hold indices within each entity's own direction:
+//   cell_nodes  2^n_dim per cell, in Cell::points order
+//   cell_faces  2*n_dim per cell (-x,+x,-y,+y,-z,+z), in 2D these are the
+//               y, y, x, x edges
+//   cell_edges  4 (2D) or 12 (3D) per cell, in Cell::edges order
+//   edge_nodes  2 per edge, face_edges 4 per face in Face::edges order
+// The parents of the hanging entities are stored from the first hanging
+// index on, so the ones of hanging node i are at node_parents[4*(i-nN)]:
+//   node_parents 4 per hanging node, edge_parents 2 per hanging edge and
+//   face_parents 1 per hanging face (3D), parents may hang themselves
+//   node_resolved, edge_resolved and face_resolved follow them down to the
+//   non hanging ones
+class MeshArrays{
+  public:
+    enum{ CELLS=1, NODES=2, EDGES=4, FACES=8, PARENTS=16 };
+    int_t built; // the groups above that are up to date
+
+    std::vector<double> cell_centers, cell_widths, cell_volumes;
+    std::vector<int_t> cell_nodes, cell_faces, cell_edges;
+    std::vector<double> node_locations;
+    std::vector<double> edge_locations[3], edge_lengths[3];
+    std::vector<int_t> edge_nodes[3];
+    std::vector<double> face_locations[3], face_areas[3];
+    std::vector<int_t> face_edges[3];
+    std::vector<int_t> node_parents, edge_parents[3], face_parents[3];
+    ResolvedParents node_resolved, edge_resolved[3], face_resolved[3];
+    // Kept for apply_operator: the operators it applied transposed, and
+    // room for a value at every node, edge or face, hanging ones included
+    std::vector<TransposedRows> transposed;
+    std::vector<double> scratch;
+
+    MeshArrays();
+    // Builds the groups in parts that are not built yet
+    void build(Tree& tree, int_t parts);
+    void clear();
+    // Trades everything with other. The vectors keep their buffers, so
+    // pointers into them stay valid, now into other.
+    void swap(MeshArrays& other);
+};
+
+class Tree{
+  public:
+    int_t n_dim;
+    Cell *root;
+    function test_func;
+    int_t max_level, nx, ny, nz;
+    // Threads for refining with criteria or batches, building the lists and
+    // the operators. A Python function is always called from one thread,
+    // see build_tree_from_function.
+    int_t n_threads;
+    double *xs;
+    double *ys;
+    double *zs;
+
+    std::vector<Cell *> cells;
+    node_map_t nodes;
+    edge_map_t edges_x, edges_y, edges_z;
+    face_map_t faces_x, faces_y, faces_z;
+    std::vector<Node *> hanging_nodes;
+    std::vector<Edge *> hanging_edges_x, hanging_edges_y, hanging_edges_z;
+    std::vector<Face *> hanging_faces_x, hanging_faces_y, hanging_faces_z;
+
+    // Parents of the hanging entities by key, only while they hang
+    node_parent_map_t node_parent_map;
+    edge_parent_map_t edge_parent_map;
+    face_map_t face_parent_map;
+
+    // Reset by number(), see MeshArrays::build
+    MeshArrays arrays;
+
+    // Own every Node, Edge, Face and Cell above
+    node_pool_t node_pool;
+    edge_pool_t edge_pool;
+    face_pool_t face_pool;
+    cell_pool_t cell_pool;
+
+    // Off unless set_stats(true)
+    TreeStats stats;
+
+    Tree();
+    ~Tree();
+
+    void set_dimension(int_t dim);
+    void set_level(int_t max_level);
+    void set_xs(double *x , double *y, double *z);
+    void set_num_threads(int_t n);
+    // Turns recording into stats on or off, it is kept either way
+    void set_stats(bool enabled);
+    // Leaves, edges and faces, and the hanging ones of the last two, at each
+    // level (the level of the cells their size belongs to). Each vector gets
+    // max_level+1 entries, the face ones stay zero in 2D.
+    void count_levels(std::vector<int_t>& n_cells, std::vector<int_t>& n_edges,
+                      std::vector<int_t>& n_faces, std::vector<int_t>& n_hanging_edges,
+                      std::vector<int_t>& n_hanging_faces);
+    // Calls test_func from one thread, depth first, unless by_level, when
+    // each level is tested over n_threads threads and test_func has to be
+    // thread safe. A Python function would only take turns on the GIL.
+    void build_tree_from_function(function test_func, bool by_level=false);
+    void build_tree_from_criteria(RefineCriteria *criteria);
+    void build_tree_from_batch(batch_function test_func);
+    // Builds the tree with a cell at each of n levels, centered on
+    // cell_inds (n_dim location_ind components per cell), like insert_cell
+    // for each one followed by finalize_lists
+    void build_tree_from_cells(const int_t *cell_inds, const int_t *levels, int_t n);
+    // The same without finalize_lists, so cells can be added in batches
+    void insert_cells(const int_t *cell_inds, const int_t *levels, int_t n);
+    void make_root();
+    // Refines from the root with test, a level at a time over n_threads
+    // threads if by_level, then finalize_lists
+    template<class F>
+    void build_tree(F& test, bool by_level);
+    template<class E>
+    void refine_levels(E& evaluate);
+    template<class F>
+    void refine_by_level(F& test);
+    void number();
+    void finalize_lists();
+
+    // Splits the leaves at indices once (and their coarser neighbors, to
+    // keep the 2:1 balance), then updates the lists and numbering in place.
+    // old_to_new gets the new index of each old cell, or -1 if it was
+    // split, and new_to_old the old cell holding each new one.
+    void refine_cells(const int_t *indices, int_t n, std::vector<int_t>& old_to_new,
+                      std::vector<int_t>& new_to_old);
+
+    // Merges the leaves that test below their level with their siblings,
+    // as far as the 2:1 balance allows, then frees what they had and updates
+    // the lists in place. old_to_new gets the new index of each old cell and
+    // new_to_old the old index of each new one, or -1 for merged cells.
+    void coarsen_from_function(function test_func, std::vector<int_t>& old_to_new,
+                               std::vector<int_t>& new_to_old);
+    template<class F>
+    void coarsen(F& test, std::vector<int_t>& old_to_new, std::vector<int_t>& new_to_old);
+
+    // Used by finalize_lists and the updates above
+    void add_cell_entities(Cell *cell);
+    // add_cell_entities for all of the cells, in parallel, while there are
+    // no edges or faces yet
+    void add_leaf_entities();
+    void hang_face(Face *face, face_map_t& faces, int_t direction);
+    // The two halves of hang_face: the first only looks up the parent (and
+    // which corner is its center), so it can run in parallel
+    Face* find_face_parent(Face *face, face_map_t& faces, int_t direction, int_t& ip);
+    void hang_face_in(Face *face, Face *parent, int_t ip);
+    void unhang_face(Face *face);
+    void hang_edge(Edge *edge, edge_map_t& edges, int_t direction);
+    Edge* find_edge_parent(Edge *edge, edge_map_t& edges, int_t direction, Node*& node);
+    void hang_edge_in(Edge *edge, Edge *parent, Node *node);
+    void unhang_edge(Edge *edge);
+    // hang_face (hang_edge in 2D) for every face, looking up the parents in
+    // parallel
+    void hang_all();
+    void list_hanging();
+    void update_lists(std::vector<int_t>& old_to_new, std::vector<int_t>& new_to_old);
+
+    void insert_cell(double *new_center, int_t p_level);
+
+    Cell* containing_cell(double, double, double);
+    void containing_cells(const double *pts, int_t n, int_t *out);
+
+    // Coordinates of entities, from the grid
+    void location(Node *node, double out[3]);
+    void location(Edge *edge, double out[3]);
+    void location(Face *face, double out[3]);
+    double length(Edge *edge);
+    double area(Face *face);
+    // Parents of hanging entities, NULL for the others
+    Node** parents_of(Node *node);
+    Edge** parents_of(Edge *edge);
+    Face* parent_of(Face *face);
+};
+#endif
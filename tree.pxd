@@ -1,75 +1,149 @@
 from libcpp cimport bool
 from libcpp.vector cimport vector
-from libcpp.map cimport map
+from libcpp.pair cimport pair
+from libcpp.string cimport string
 
 cdef extern from "tree.h":
     ctypedef int int_t
+    int_t max_key_level
+
+cdef extern from "refine.h":
+    cdef cppclass RefineCriteria:
+        int_t min_level
+        RefineCriteria()
+        void add_ball(double *, double, int_t)
+        void add_box(double *, double *, int_t)
+        void add_half_space(double *, double *, int_t)
+        void add_points(double *, int_t, double, int_t)
+        void add_surface(double *, int_t, int_t, double, int_t)
+
+cdef extern from "stats.h":
+    cdef cppclass TreeStatsPhase "TreeStats::Phase":
+        const char *name
+        double seconds
+        unsigned long long calls
+
+    cdef cppclass TreeStats:
+        bool enabled
+        vector[TreeStatsPhase] phases
+        unsigned long long test_calls
+        double test_seconds
+        unsigned long long cells_spawned
+        unsigned long long forced_splits
+        unsigned long long map_probes # a std::atomic, read as its value
+        void clear()
+        bool set_trace(string)
+
+cdef extern from "pool.h":
+    cdef cppclass Pool[T]:
+        size_t size()
+
+cdef extern from "tree.h":
 
     cdef cppclass Node:
-        int_t location_ind[3]
-        double location[3]
-        int_t key
-        int_t reference
-        int_t index
+        unsigned int location_ind[3]
+        unsigned int index
+        unsigned short reference
         bool hanging
-        Node *parents[4]
         Node()
-        Node(int_t, int_t, int_t, double, double, double)
-        int_t operator[](int_t)
+        Node(int_t, int_t, int_t)
+        int_t key()
 
     cdef cppclass Edge:
-        int_t location_ind[3]
-        double location[3]
-        int_t key
-        int_t reference
-        int_t index
-        double length
+        unsigned int location_ind[3]
+        unsigned int index
+        unsigned short reference
         bool hanging
         Node *points[2]
-        Edge *parents[2]
         Edge()
         Edge(Node& p1, Node& p2)
+        int_t key()
 
     cdef cppclass Face:
-        int_t location_ind[3]
-        double location[3]
-        int_t key
-        int_t reference
-        int_t index
-        double area
+        unsigned int location_ind[3]
+        unsigned int index
+        unsigned short reference
         bool hanging
-        Node *points[4]
         Edge *edges[4]
-        Face *parent
         Face()
         Face(Node& p1, Node& p2, Node& p3, Node& p4)
+        int_t key()
+        Node *point(int_t)
 
-    ctypedef map[int_t,Node *] node_map_t
-    ctypedef map[int_t,Edge *] edge_map_t
-    ctypedef map[int_t,Face *] face_map_t
+    cdef cppclass KeyMap[T]:
+        cppclass iterator:
+            pair[int_t, T]& operator*()
+            iterator operator++()
+            bint operator==(iterator)
+            bint operator!=(iterator)
+        iterator begin()
+        iterator end()
+        iterator find(int_t)
+        int_t count(int_t)
+        int_t size()
+        T& operator[](int_t)
+
+    ctypedef KeyMap[Node *] node_map_t
+    ctypedef KeyMap[Edge *] edge_map_t
+    ctypedef KeyMap[Face *] face_map_t
 
     cdef cppclass Cell:
-        int_t n_dim
         Cell *parent
-        Cell *children[8]
-        Cell *neighbors[6]
-        Node *points[8]
-        Edge *edges[12]
-        Face *faces[6]
-        int_t location_ind[3]
-        double location[3]
-        int_t index, key, level, max_level
-        double volume
+        double x0[3]
+        double x1[3]
+        unsigned int location_ind[3]
+        unsigned int index
+        unsigned char n_dim, level, max_level
+        Cell **children()
+        Cell **neighbors()
+        Node **points()
+        Edge **edges()
+        Face **faces()
         inline bool is_leaf()
+        int_t key()
+        double center(int_t)
+        double volume()
 
     cdef cppclass PyWrapper:
         PyWrapper()
         void set(void*, int_t(*)(void*, Cell*))
 
+    cdef cppclass PyBatchWrapper:
+        PyBatchWrapper()
+        void set(void*, void(*)(void*, int_t, int_t, double*, double*, int_t*, int_t*))
+
+    cdef cppclass Tree
+
+    # Groups of MeshArrays
+    enum:
+        MESH_CELLS "MeshArrays::CELLS"
+        MESH_NODES "MeshArrays::NODES"
+        MESH_EDGES "MeshArrays::EDGES"
+        MESH_FACES "MeshArrays::FACES"
+        MESH_PARENTS "MeshArrays::PARENTS"
+
+    cdef cppclass MeshArrays:
+        int_t built
+        vector[double] cell_centers, cell_widths, cell_volumes
+        vector[int_t] cell_nodes, cell_faces, cell_edges
+        vector[double] node_locations
+        vector[double] edge_locations[3]
+        vector[double] edge_lengths[3]
+        vector[int_t] edge_nodes[3]
+        vector[double] face_locations[3]
+        vector[double] face_areas[3]
+        vector[int_t] face_edges[3]
+        vector[int_t] node_parents
+        vector[int_t] edge_parents[3]
+        vector[int_t] face_parents[3]
+        void build(Tree&, int_t) nogil
+        void swap(MeshArrays&)
+
     cdef cppclass Tree:
         int_t n_dim
         Cell *root
         int_t max_level, nx, ny, nz
+        int_t n_threads
 
         vector[Cell *] cells
         node_map_t nodes
@@ -78,14 +152,101 @@ cdef extern from "tree.h":
         vector[Node *] hanging_nodes
         vector[Edge *] hanging_edges_x, hanging_edges_y, hanging_edges_z
         vector[Face *] hanging_faces_x, hanging_faces_y, hanging_faces_z
+        MeshArrays arrays
+        Pool[Node] node_pool
+        Pool[Edge] edge_pool
+        Pool[Face] face_pool
+        Pool[Cell] cell_pool
+        TreeStats stats
 
         Tree()
 
         void set_dimension(int_t)
         void set_level(int_t)
         void set_xs(double*, double*, double*)
-        void build_tree_from_function(PyWrapper *)
+        void set_num_threads(int_t)
+        void set_stats(bool)
+        void count_levels(vector[int_t]&, vector[int_t]&, vector[int_t]&, vector[int_t]&,
+                          vector[int_t]&)
+        void build_tree_from_function(PyWrapper *) nogil
+        void build_tree_from_criteria(RefineCriteria *) nogil
+        void build_tree_from_batch(PyBatchWrapper *) nogil
+        void build_tree_from_cells(int_t *, int_t *, int_t) nogil
         void number()
         void insert_cell(double *new_center, int_t p_level);
         void finalize_lists()
+        void refine_cells(int_t *, int_t, vector[int_t]&, vector[int_t]&) nogil
+        void coarsen_from_function(PyWrapper *, vector[int_t]&, vector[int_t]&) nogil
         Cell * containing_cell(double, double, double)
+        void location(Node *, double *)
+        void location(Edge *, double *)
+        void location(Face *, double *)
+        double length(Edge *)
+        double area(Face *)
+        Node ** parents_of(Node *)
+        Edge ** parents_of(Edge *)
+        Face * parent_of(Face *)
+        void containing_cells(double *, int_t, int_t *) nogil
+
+cdef extern from "linear_tree.h":
+    cdef cppclass LinearTree:
+        int_t n_dim, max_level
+        vector[unsigned long long] codes
+        vector[unsigned char] levels
+        LinearTree()
+        void build(vector[Cell *]&, int_t, int_t)
+        int_t size()
+
+cdef extern from "operators.h":
+    cdef cppclass CSRMatrix:
+        int_t n_rows, n_cols
+        vector[int_t] indptr, indices
+        vector[double] data
+        CSRMatrix()
+        int_t nnz()
+
+    void face_divergence(Tree&, CSRMatrix&) nogil
+    void edge_curl(Tree&, CSRMatrix&) nogil
+    void nodal_gradient(Tree&, CSRMatrix&) nogil
+    void average_nodes_to_cells(Tree&, CSRMatrix&) nogil
+    void average_edges_to_cells(Tree&, int_t, CSRMatrix&) nogil
+    void average_faces_to_cells(Tree&, int_t, CSRMatrix&) nogil
+    void cell_gradient_stencil(Tree&, int_t, CSRMatrix&) nogil
+    void hanging_projection(Tree&, int_t, int_t, CSRMatrix&) nogil
+
+    # Operators that can be applied without assembling them
+    enum:
+        OP_FACE_DIVERGENCE
+        OP_EDGE_CURL
+        OP_NODAL_GRADIENT
+        OP_AVERAGE_NODES
+        OP_AVERAGE_EDGES
+        OP_AVERAGE_FACES
+    enum:
+        ALL_DIRECTIONS
+
+    void operator_shape(Tree&, int_t, int_t, int_t&, int_t&) nogil
+    void apply_operator(Tree&, int_t, int_t, bint, double*, double*) nogil
+
+    # Kinds of locations to interpolate from
+    enum:
+        AT_NODES
+        AT_CELLS
+        AT_EDGES
+        AT_FACES
+
+    void interpolation_matrix(Tree&, double*, int_t, int_t, int_t, bint, CSRMatrix&) nogil
+    void inner_product(Tree&, int_t, double*, int_t, bint, bint, bint, CSRMatrix&) nogil
+    void inner_product_deriv(Tree&, int_t, double*, int_t, bint, CSRMatrix&) nogil
+
+cdef extern from "mesh_file.h":
+    enum:
+        MESH_FILE_MORTON_KEYS
+        MESH_FILE_TABLES
+    const unsigned int mesh_file_key_order
+    bool write_mesh_file(Tree&, char *, bool) nogil
+    void build_tree_from_leaves(Tree&, unsigned long long *, unsigned char *, int_t) nogil
+
+cdef extern from "ubc_file.h":
+    bool read_ubc_cells(Tree&, char *, int_t, int_t&, int_t&) nogil
+    bool write_ubc_cells(Tree&, char *, char *, int_t) nogil
@@ -2,11 +2,23 @@
 cimport cython
 cimport numpy as np
 from libc.math cimport sqrt, abs, cbrt
-
-from tree cimport int_t, Tree as c_Tree, PyWrapper, Node, Edge, Face, Cell as c_Cell
+from libcpp.vector cimport vector
+from cython.operator cimport dereference as deref, preincrement as inc
+
+from tree cimport int_t, Tree as c_Tree, PyWrapper, PyBatchWrapper, Node, Edge, Face, Cell as c_Cell
+from tree cimport node_map_t, edge_map_t, face_map_t
+from tree cimport RefineCriteria as c_RefineCriteria, max_key_level, LinearTree, MeshArrays, MESH_CELLS, MESH_NODES, MESH_EDGES, MESH_FACES
+from tree cimport CSRMatrix, face_divergence, edge_curl, nodal_gradient
+from tree cimport average_nodes_to_cells, average_edges_to_cells, average_faces_to_cells, cell_gradient_stencil
+from tree cimport hanging_projection, operator_shape, apply_operator, ALL_DIRECTIONS
+from tree cimport OP_FACE_DIVERGENCE, OP_EDGE_CURL, OP_NODAL_GRADIENT, OP_AVERAGE_NODES, OP_AVERAGE_EDGES, OP_AVERAGE_FACES
+from tree cimport interpolation_matrix, AT_NODES, AT_CELLS, AT_EDGES, AT_FACES
+from tree cimport inner_product, inner_product_deriv
+from tree cimport write_mesh_file, build_tree_from_leaves, read_ubc_cells, write_ubc_cells
+from tree cimport MESH_FILE_MORTON_KEYS, MESH_FILE_TABLES, mesh_file_key_order
+from tree cimport TreeStats
 
 import scipy.sparse as sp
-from scipy.spatial import Delaunay, cKDTree
 from six import integer_types
 import numpy as np
 
@@ -17,17 +29,17 @@ cdef class Cell:
     cdef void _set(self, c_Cell* cell):
         self._cell = cell
         self._dim = cell.n_dim
-        self._x = cell.location[0]
-        self._x0 = cell.points[0].location[0]
+        self._x = cell.center(0)
+        self._x0 = cell.x0[0]
 
-        self._y = cell.location[1]
-        self._y0 = cell.points[0].location[1]
+        self._y = cell.center(1)
+        self._y0 = cell.x0[1]
 
         self._wx = 2*(self._x-self._x0)
         self._wy = 2*(self._y-self._y0)
         if(self._dim>2):
-            self._z = cell.location[2]
-            self._z0 = cell.points[0].location[2]
+            self._z = cell.center(2)
+            self._z0 = cell.x0[2]
 
             self._wz = 2*(self._z-self._z0)
 
@@ -35,12 +47,12 @@ cdef class Cell:
     def nodes(self):
         cdef c_Cell* cell = self._cell
         if self._dim>2:
-            return tuple((cell.points[0].index, cell.points[1].index,
-                          cell.points[2].index, cell.points[3].index,
-                          cell.points[4].index, cell.points[5].index,
-                          cell.points[6].index, cell.points[7].index))
-        return tuple((cell.points[0].index, cell.points[1].index,
-                      cell.points[2].index, cell.points[3].index))
+            return tuple((cell.points()[0].index, cell.points()[1].index,
+                          cell.points()[2].index, cell.points()[3].index,
+                          cell.points()[4].index, cell.points()[5].index,
+                          cell.points()[6].index, cell.points()[7].index))
+        return tuple((cell.points()[0].index, cell.points()[1].index,
+                      cell.points()[2].index, cell.points()[3].index))
 
     @property
     def center(self):
@@ -81,12 +93,215 @@ cdef int_t _evaluate_func(void* function, c_Cell* cell) with gil:
     pycell._set(cell)
     return <int_t> func(pycell)
 
+cdef void _evaluate_batch(void* function, int_t n, int_t dim,
+                          double* centers, double* widths,
+                          int_t* levels, int_t* targets) with gil:
+    # function is a [callable, error] list. If the callable raises, or
+    # returns something that is not n levels, the error is kept there for
+    # refine to raise, and every cell from then on is left at its level so
+    # the refinement stops.
+    call = <list> function
+    cdef int_t i
+    cdef np.int64_t[:] level_view
+    if call[1] is None:
+        try:
+            xc = np.array(<double[:n, :dim]> centers)
+            h = np.array(<double[:n, :dim]> widths)
+            level = np.empty(n, dtype=np.int64)
+            level_view = level
+            for i in range(n):
+                level_view[i] = levels[i]
+            out = np.broadcast_to(np.asarray(call[0](xc, h, level), dtype=np.int64), (n,))
+            level_view = np.maximum(out, 0)
+            for i in range(n):
+                targets[i] = level_view[i]
+            return
+        except Exception as error:
+            call[1] = error
+    for i in range(n):
+        targets[i] = levels[i]
+
+np.import_array()
+
+cdef object _array_view(object owner, void *data, np.npy_intp n, np.npy_intp n_cols, int typenum,
+                        bint writeable=False):
+    #Array over memory owned by owner, which the array keeps alive
+    cdef np.npy_intp shape[2]
+    shape[0] = n
+    shape[1] = n_cols
+    if data == NULL:
+        return np.PyArray_ZEROS(2 if n_cols else 1, shape, typenum, 0)
+    arr = np.PyArray_SimpleNewFromData(2 if n_cols else 1, shape, typenum, data)
+    np.set_array_base(arr, owner)
+    if not writeable:
+        arr.flags.writeable = False
+    return arr
+
+# Operators _TreeMesh.apply works out on the fly, as (operator, direction)
+_applied_operators = {
+    'faceDiv': (OP_FACE_DIVERGENCE, 0),
+    'edgeCurl': (OP_EDGE_CURL, 0),
+    'nodalGrad': (OP_NODAL_GRADIENT, 0),
+    'aveN2CC': (OP_AVERAGE_NODES, 0),
+    'aveE2CC': (OP_AVERAGE_EDGES, ALL_DIRECTIONS),
+    'aveEx2CC': (OP_AVERAGE_EDGES, 0),
+    'aveEy2CC': (OP_AVERAGE_EDGES, 1),
+    'aveEz2CC': (OP_AVERAGE_EDGES, 2),
+    'aveF2CC': (OP_AVERAGE_FACES, ALL_DIRECTIONS),
+    'aveFx2CC': (OP_AVERAGE_FACES, 0),
+    'aveFy2CC': (OP_AVERAGE_FACES, 1),
+    'aveFz2CC': (OP_AVERAGE_FACES, 2),
+}
+
+cdef class _CSRBuffers:
+    #Owns a CSRMatrix assembled in C++, for the scipy matrix built over it
+    cdef CSRMatrix *mat
+
+    def __cinit__(self):
+        self.mat = new CSRMatrix()
+
+    def tocsr(self):
+        A = sp.csr_matrix((self.mat.n_rows, self.mat.n_cols), dtype=np.float64)
+        # Set directly so scipy keeps these arrays instead of copying them
+        # to a smaller index type
+        A.indptr = _array_view(self, self.mat.indptr.data(), self.mat.n_rows+1, 0, np.NPY_INTP, True)
+        A.indices = _array_view(self, self.mat.indices.data(), self.mat.nnz(), 0, np.NPY_INTP, True)
+        A.data = _array_view(self, self.mat.data.data(), self.mat.nnz(), 0, np.NPY_FLOAT64, True)
+        A.has_canonical_format = True
+        return A
+
+    def __dealloc__(self):
+        del self.mat
+
+cdef class _MeshArraysOwner:
+    #Owns the MeshArrays tables that arrays handed out by a _TreeMesh view,
+    #once the tree has dropped them for new ones
+    cdef MeshArrays *arrays
+
+    def __cinit__(self):
+        self.arrays = new MeshArrays()
+
+    def __dealloc__(self):
+        del self.arrays
+
 cdef inline int sign(double val):
     return (0<val)-(val<0)
 
+def _as_points(points):
+    #Points as a contiguous (n, 3) array, 2D points get z=0
+    points = np.atleast_2d(np.asarray(points, dtype=np.float64))
+    if points.shape[1]<3:
+        points = np.c_[points, np.zeros((points.shape[0], 3-points.shape[1]))]
+    return np.ascontiguousarray(points)
+
+# Layout of the binary mesh files, see mesh_file.h
+_MESH_FILE_VERSION = 1
+_mesh_file_header = np.dtype([('magic', 'S8'), ('version', 'u4'), ('n_dim', 'u4'),
+                              ('max_level', 'u4'), ('flags', 'u4'), ('n_cells', 'u8'),
+                              ('n_sections', 'u8')])
+_mesh_file_section = np.dtype([('name', 'S24'), ('type', 'S8'), ('n_rows', 'u8'),
+                               ('n_cols', 'u8'), ('offset', 'u8')])
+
+def read_mesh_file(fileName):
+    """Map a binary mesh file written by writeBinary
+
+    Returns a dict with the header fields (n_dim, max_level, n_cells,
+    flags, version) and a dict of read only arrays, one per section, backed
+    by a memory map of the file so that nothing is read until it is used.
+    """
+    data = np.memmap(fileName, dtype=np.uint8, mode='r')
+    header = data[:_mesh_file_header.itemsize].view(_mesh_file_header)[0]
+    if header['magic'] != b'TREEMESH':
+        raise IOError('{0} is not a mesh file'.format(fileName))
+    if header['version'] > _MESH_FILE_VERSION:
+        raise IOError('{0} has version {1:d}, only up to {2:d} can be read'.format(
+            fileName, header['version'], _MESH_FILE_VERSION))
+    info = {name: int(header[name]) for name in _mesh_file_header.names[1:]}
+    start = _mesh_file_header.itemsize
+    table = data[start:start+info['n_sections']*_mesh_file_section.itemsize]
+    sections = {}
+    for section in table.view(_mesh_file_section):
+        dtype = np.dtype(section['type'].decode())
+        shape = (int(section['n_rows']), int(section['n_cols'])) if section['n_cols'] else (int(section['n_rows']),)
+        n_bytes = int(np.prod(shape))*dtype.itemsize
+        offset = int(section['offset'])
+        sections[section['name'].decode()] = data[offset:offset+n_bytes].view(dtype).reshape(shape)
+    return info, sections
+
+cdef class RefineCriteria:
+    """Refinement criteria evaluated entirely in C++.
+
+    Each region added asks for a level, and a cell is refined to the highest
+    level of any region it touches (or min_level). Pass an instance to
+    TreeMesh.refine in place of a function; no Python is called while the
+    tree is built.
+    """
+    cdef c_RefineCriteria *criteria
+
+    def __cinit__(self, *args, **kwargs):
+        self.criteria = new c_RefineCriteria()
+
+    def __init__(self, min_level=0):
+        self.criteria.min_level = min_level
+
+    @property
+    def min_level(self):
+        return self.criteria.min_level
+
+    @min_level.setter
+    def min_level(self, level):
+        self.criteria.min_level = level
+
+    def add_ball(self, center, radius, level):
+        """Refine cells intersecting the ball to level"""
+        cdef double[:, ::1] c = _as_points(center)
+        self.criteria.add_ball(&c[0, 0], radius, level)
+
+    def add_box(self, x0, x1, level):
+        """Refine cells intersecting the box [x0, x1] to level"""
+        cdef double[:, ::1] lo = _as_points(x0)
+        cdef double[:, ::1] hi = _as_points(x1)
+        self.criteria.add_box(&lo[0, 0], &hi[0, 0], level)
+
+    def add_half_space(self, origin, normal, level):
+        """Refine cells touching the side of the plane through origin that
+        normal points away from to level"""
+        cdef double[:, ::1] o = _as_points(origin)
+        cdef double[:, ::1] n = _as_points(normal)
+        self.criteria.add_half_space(&o[0, 0], &n[0, 0], level)
+
+    def add_points(self, points, distance, level):
+        """Refine cells within distance of any of the points to level"""
+        cdef double[:, ::1] pts = _as_points(points)
+        if pts.shape[0]==0:
+            return
+        self.criteria.add_points(&pts[0, 0], pts.shape[0], distance, level)
+
+    def add_surface(self, vertices, simplices, distance, level):
+        """Refine cells within distance of a surface to level
+
+        The surface is given by vertices and the indices of its simplices,
+        triangles in 3D or line segments in 2D.
+        """
+        simplices = np.atleast_2d(np.asarray(simplices, dtype=np.int64))
+        vertices = _as_points(vertices)
+        cdef int_t n_per = simplices.shape[1]
+        cdef double[:, ::1] corners = np.ascontiguousarray(
+            vertices[simplices.reshape(-1)])
+        if corners.shape[0]==0:
+            return
+        self.criteria.add_surface(&corners[0, 0], simplices.shape[0], n_per,
+                                  distance, level)
+
+    def __dealloc__(self):
+        del self.criteria
+
+# _arrays_owner has to survive until __dealloc__ hands it the arrays
+@cython.no_gc_clear
 cdef class _TreeMesh:
     cdef c_Tree *tree
     cdef PyWrapper *wrapper
+    cdef PyBatchWrapper *batch_wrapper
     cdef int_t _nx, _ny, _nz, max_level
     cdef double[3] _xc, _xf
 
@@ -103,12 +318,17 @@ cdef class _TreeMesh:
     cdef object _edgeCurl, _nodalGrad
 
     cdef object __ubc_order, __ubc_indArr
+    cdef _MeshArraysOwner _arrays_owner
+    cdef object _tables
 
     def __cinit__(self, *args, **kwargs):
         self.wrapper = new PyWrapper()
+        self.batch_wrapper = new PyBatchWrapper()
         self.tree = new c_Tree()
 
     def __init__(self, max_level, x0, h):
+        if max_level > max_key_level:
+            raise Exception('max_level can be at most {0:d}'.format(max_key_level))
         self.max_level = max_level
         self._nx = 2<<max_level
         self._ny = 2<<max_level
@@ -137,6 +357,131 @@ cdef class _TreeMesh:
         self.tree.set_level(self.max_level)
         self.tree.set_xs(&self._xs[0], &self._ys[0], &self._zs[0])
 
+        self._clear_cache()
+
+    def refine(self, function, batch=False, **kwargs):
+        """Refine the mesh with function
+
+        function is called with each Cell and returns the level it should be
+        refined to. With batch=True it is instead called once per level as
+        function(centers, widths, levels) with arrays describing every cell
+        on that level, and returns an array of target levels. An error in
+        it stops the refinement and is raised from here.
+        function may also be a RefineCriteria or an integer level.
+        """
+        cdef c_RefineCriteria *criteria
+        if isinstance(function, RefineCriteria):
+            criteria = (<RefineCriteria> function).criteria
+            with nogil:
+                self.tree.build_tree_from_criteria(criteria)
+            self.number()
+            return
+
+        if batch:
+            call = [function, None]
+            self.batch_wrapper.set(<void *> call, _evaluate_batch)
+            with nogil:
+                self.tree.build_tree_from_batch(self.batch_wrapper)
+            self.number()
+            if call[1] is not None:
+                # the mesh holds the levels refined before the error
+                raise call[1]
+            return
+
+        if type(function) in integer_types:
+            level = function
+            function = lambda cell: level
+
+        #Wrapping function so it can be called in c++
+        cdef void * self_ptr
+        cdef void * func_ptr;
+        func_ptr = <void *> function;
+        self.wrapper.set(func_ptr, _evaluate_func)
+
+        #Then tell c++ to build the tree
+        with nogil:
+            self.tree.build_tree_from_function(self.wrapper)
+        self.number()
+
+    def _insert_cells(self, double[:, :] cells, long[:] levels):
+        # Each point goes to the finest cell holding it, taking the lower
+        # one on a boundary as insert_cell does
+        inds = np.empty((cells.shape[0], self.dim), dtype=np.intp)
+        for i, xs in enumerate(self._get_xs()[:self.dim]):
+            faces = xs[::2]
+            ind = np.searchsorted(faces, np.asarray(cells[:, i]), side='left')-1
+            inds[:, i] = 2*np.clip(ind, 0, faces.shape[0]-2)+1
+        self._build_from_cells(inds, levels)
+
+    def _build_from_cells(self, cell_inds, levels):
+        # Builds the tree in one pass from the location indices of cell
+        # centers and their levels
+        cdef np.intp_t[:, ::1] inds_view = np.ascontiguousarray(cell_inds, dtype=np.intp)
+        cdef np.intp_t[::1] levels_view = np.ascontiguousarray(levels, dtype=np.intp)
+        cdef int_t n = levels_view.shape[0]
+        if inds_view.shape[0] != n or inds_view.shape[1] != self.dim:
+            raise ValueError('cell_inds must be {0:d} x {1:d}'.format(n, self.dim))
+        if n == 0:
+            return
+        with nogil:
+            self.tree.build_tree_from_cells(<int_t *> &inds_view[0, 0],
+                                            <int_t *> &levels_view[0], n)
+
+    def _build_from_leaves(self, codes, levels):
+        # Builds the tree from its leaves in linear form (see _linear_octree)
+        cdef const np.uint64_t[::1] codes_view = np.ascontiguousarray(codes, dtype=np.uint64)
+        cdef const np.uint8_t[::1] levels_view = np.ascontiguousarray(levels, dtype=np.uint8)
+        cdef int_t n = codes_view.shape[0]
+        if levels_view.shape[0] != n:
+            raise ValueError('need a level for each code')
+        if n == 0:
+            return
+        with nogil:
+            build_tree_from_leaves(self.tree[0], <unsigned long long *> &codes_view[0],
+                                   &levels_view[0], n)
+
+    def _write_mesh_file(self, fileName, tables=True):
+        cdef bytes path = fileName.encode() if isinstance(fileName, str) else fileName
+        cdef char *c_path = path
+        cdef bint c_tables = tables
+        cdef bint ok
+        with nogil:
+            ok = write_mesh_file(self.tree[0], c_path, c_tables)
+        if not ok:
+            raise IOError('could not write {0}'.format(fileName))
+
+    def _read_ubc_cells(self, fileName, chunk_size=1<<24):
+        # Builds the tree from the cells of a UBC octree mesh file, chunk_size
+        # bytes at a time. The mesh must already match the file's header.
+        cdef bytes path = fileName.encode() if isinstance(fileName, str) else fileName
+        cdef char *c_path = path
+        cdef int_t c_chunk = chunk_size
+        cdef int_t n_read = 0, bad_line = 0
+        cdef bint ok
+        with nogil:
+            ok = read_ubc_cells(self.tree[0], c_path, c_chunk, n_read, bad_line)
+        if not ok:
+            if bad_line:
+                raise IOError('line {0:d} of {1} is not a cell of the mesh'.format(bad_line, fileName))
+            raise IOError('could not read {0}'.format(fileName))
+        return n_read
+
+    def _write_ubc_cells(self, fileName, header, chunk_size=1<<24):
+        # Writes header and then the cells in UBC order, chunk_size bytes at
+        # a time
+        cdef bytes path = fileName.encode() if isinstance(fileName, str) else fileName
+        cdef bytes head = header.encode() if isinstance(header, str) else header
+        cdef char *c_path = path
+        cdef char *c_head = head
+        cdef int_t c_chunk = chunk_size
+        cdef bint ok
+        with nogil:
+            ok = write_ubc_cells(self.tree[0], c_path, c_head, c_chunk)
+        if not ok:
+            raise IOError('could not write {0}'.format(fileName))
+
+    def _clear_cache(self):
+        # Drops everything computed from the cells, after they change
         self._gridCC = None
         self._gridN = None
         self._gridhN = None
@@ -181,33 +526,141 @@ cdef class _TreeMesh:
         self.__ubc_order = None
         self.__ubc_indArr = None
 
-    def refine(self, function, **kwargs):
+    def refine_cells(self, indices):
+        """Split the cells at indices once, updating the mesh in place
+
+        Coarser neighbors are split too where needed to keep the mesh
+        balanced. Only the cells, edges and faces around the split cells are
+        updated rather than rebuilding the whole mesh.
+
+        Returns old_to_new, the index of the new cell holding each old cell
+        (-1 for the cells that were split), and new_to_old, the index of the
+        old cell holding each new cell, so a cell model carries over as
+        model[new_to_old].
+        """
+        inds = np.unique(np.asarray(indices, dtype=np.int64).reshape(-1))
+        if inds.size and (inds[0] < 0 or inds[-1] >= self.nC):
+            raise IndexError('cell indices must be in [0, {0:d})'.format(self.nC))
+        cdef np.int64_t[:] inds_view = inds
+        cdef int_t n = inds.shape[0]
+        cdef int_t *c_inds = NULL
+        if n > 0:
+            c_inds = <int_t *> &inds_view[0]
+        cdef vector[int_t] old_to_new, new_to_old
+        self._release_arrays()
+        with nogil:
+            self.tree.refine_cells(c_inds, n, old_to_new, new_to_old)
+        self._clear_cache()
+        # copied out of the vectors, -1 comes back as the largest int_t
+        return (_array_view(self, old_to_new.data(), old_to_new.size(), 0, np.NPY_INTP).copy(),
+                _array_view(self, new_to_old.data(), new_to_old.size(), 0, np.NPY_INTP).copy())
+
+    def coarsen(self, function):
+        """Coarsen the mesh with function, updating it in place
+
+        function is called with cells and returns the level they should
+        have, as in refine, or is an integer level. Sibling cells that all
+        ask for a level below their own are merged back into their parent,
+        repeatedly, as long as the mesh stays balanced.
+
+        Returns old_to_new, the index of the new cell holding each old cell,
+        and new_to_old, the index of each new cell in the old mesh (-1 for
+        merged cells, which hold old cells old_to_new points to).
+        """
         if type(function) in integer_types:
             level = function
             function = lambda cell: level
 
-        #Wrapping function so it can be called in c++
-        cdef void * self_ptr
-        cdef void * func_ptr;
-        func_ptr = <void *> function;
+        cdef void * func_ptr = <void *> function
         self.wrapper.set(func_ptr, _evaluate_func)
-
-        #Then tell c++ to build the tree
-        self.tree.build_tree_from_function(self.wrapper)
-        self.number()
-
-    def _insert_cells(self, double[:, :] cells, long[:] levels):
-        cdef int_t i
-        for i in range(levels.shape[0]):
-            self.tree.insert_cell(&cells[i, 0], levels[i])
-        self.tree.finalize_lists()
+        cdef vector[int_t] old_to_new, new_to_old
+        self._release_arrays()
+        with nogil:
+            self.tree.coarsen_from_function(self.wrapper, old_to_new, new_to_old)
+        self._clear_cache()
+        return (_array_view(self, old_to_new.data(), old_to_new.size(), 0, np.NPY_INTP).copy(),
+                _array_view(self, new_to_old.data(), new_to_old.size(), 0, np.NPY_INTP).copy())
 
     def _get_xs(self):
         return np.array(self._xs), np.array(self._ys), np.array(self._zs)
 
     def number(self):
+        self._release_arrays()
         self.tree.number()
 
+    @property
+    def num_threads(self):
+        """
+        Number of threads used to refine the tree with a RefineCriteria, and
+        to build its lists and operators. A refinement function is always
+        called from one thread, and a batch function once per level.
+        """
+        return self.tree.n_threads
+
+    @num_threads.setter
+    def num_threads(self, n):
+        self.tree.set_num_threads(n)
+
+    @property
+    def collect_stats(self):
+        """
+        Whether the tree records where its time goes, see stats. Off by
+        default, when it costs next to nothing.
+        """
+        return self.tree.stats.enabled
+
+    @collect_stats.setter
+    def collect_stats(self, enabled):
+        self.tree.set_stats(enabled)
+
+    @property
+    def stats(self):
+        """
+        What the tree recorded while collect_stats was on, as a dict:
+
+        phases: the wall time of each phase by name, as a dict of seconds and
+            calls. Phases nest, finalize_lists is part of build_tree
+        test_calls, test_seconds: calls of the refinement function (by cell)
+            and the time spent in them
+        cells_spawned: cells created by refining
+        forced_splits: cells split to keep the 2:1 balance before anything
+            asked for them, which depends on the order they are refined in
+        map_probes: slots looked at in the hash maps of nodes, edges and faces
+        cells, edges, faces, hanging_edges, hanging_faces: how many there are
+            now on each level, the last two are zero in 2D
+        """
+        cdef TreeStats *stats = &self.tree.stats
+        cdef vector[int_t] n_cells, n_edges, n_faces, n_hanging_edges, n_hanging_faces
+        self.tree.count_levels(n_cells, n_edges, n_faces, n_hanging_edges, n_hanging_faces)
+        phases = {}
+        for i in range(stats.phases.size()):
+            phases[stats.phases[i].name.decode()] = {
+                'seconds': stats.phases[i].seconds, 'calls': stats.phases[i].calls}
+        return {'phases': phases, 'test_calls': stats.test_calls,
+                'test_seconds': stats.test_seconds, 'cells_spawned': stats.cells_spawned,
+                'forced_splits': stats.forced_splits, 'map_probes': stats.map_probes,
+                'cells': np.array(n_cells, dtype=np.int64),
+                'edges': np.array(n_edges, dtype=np.int64),
+                'faces': np.array(n_faces, dtype=np.int64),
+                'hanging_edges': np.array(n_hanging_edges, dtype=np.int64),
+                'hanging_faces': np.array(n_hanging_faces, dtype=np.int64)}
+
+    def reset_stats(self):
+        """Clears what stats has recorded so far"""
+        self.tree.stats.clear()
+
+    def set_trace_file(self, fileName):
+        """
+        Writes each phase to fileName as it ends, as a Chrome trace (open it
+        in chrome://tracing or Perfetto), while collect_stats is on. None
+        stops writing it.
+        """
+        path = b'' if fileName is None else fileName
+        if isinstance(path, str):
+            path = path.encode()
+        if not self.tree.stats.set_trace(path):
+            raise IOError('could not open {0}'.format(fileName))
+
     @property
     def xC(self):
         return self._xc
@@ -349,6 +802,138 @@ cdef class _TreeMesh:
         if(self.dim==2): return 0
         return self.tree.hanging_faces_z.size()
 
+    cdef MeshArrays* _arrays(self, int_t parts):
+        cdef MeshArrays *arrays = &self.tree.arrays
+        if arrays.built&parts != parts:
+            with nogil:
+                arrays.build(self.tree[0], parts)
+        return arrays
+
+    def _use_tables(self, info, sections):
+        # Hands out the tables of a mesh file (and what is cached from them)
+        # in place of self.tree.arrays until the mesh is numbered again,
+        # info and sections as read_mesh_file returns them. Only files with
+        # tables, in this build's key order and of these same cells, will do.
+        if not info['flags']&MESH_FILE_TABLES or info['n_cells'] != self.nC:
+            return False
+        if info['flags']&MESH_FILE_MORTON_KEYS != mesh_file_key_order:
+            return False
+        self._clear_cache()
+        self._tables = sections
+        return True
+
+    cdef object _table(self, name, int direction=-1):
+        # The table name (of direction) from the file, see _use_tables
+        if self._tables is None:
+            return None
+        if direction >= 0:
+            name += ('_x', '_y', '_z')[direction]
+        return self._tables.get(name)
+
+    # The tables are handed out as read only views of self.tree.arrays, based
+    # on _arrays_owner. Before anything clears the arrays, _release_arrays
+    # moves their storage into that owner, where it stays for as long as the
+    # views do, and the tree rebuilds into fresh vectors.
+    cdef object _doubles(self, vector[double]& values, int_t n_cols):
+        cdef int_t n = values.size()
+        if n_cols:
+            n = n//n_cols
+        return _array_view(self._viewed_arrays(), values.data(), n, n_cols, np.NPY_FLOAT64)
+
+    cdef object _indices(self, vector[int_t]& values, int_t n_cols):
+        cdef int_t n = values.size()//n_cols
+        return _array_view(self._viewed_arrays(), values.data(), n, n_cols, np.NPY_INTP)
+
+    cdef _MeshArraysOwner _viewed_arrays(self):
+        if self._arrays_owner is None:
+            self._arrays_owner = _MeshArraysOwner()
+        return self._arrays_owner
+
+    cdef void _release_arrays(self):
+        self._tables = None
+        if self._arrays_owner is not None:
+            self._arrays_owner.arrays.swap(self.tree.arrays)
+            self._arrays_owner = None
+
+    @property
+    def cell_nodes(self):
+        """
+        (nC, 2**dim) array with the node indices of each cell's corners
+        """
+        stored = self._table('cell_nodes')
+        if stored is not None:
+            return stored
+        return self._indices(self._arrays(MESH_CELLS).cell_nodes, 1<<self.dim)
+
+    @property
+    def cell_faces(self):
+        """
+        (nC, 2*dim) array with the indices of each cell's -x, +x, -y, +y,
+        -z and +z faces, counted within each face direction (hanging faces
+        after the rest)
+        """
+        stored = self._table('cell_faces')
+        if stored is not None:
+            return stored
+        return self._indices(self._arrays(MESH_CELLS).cell_faces, 2*self.dim)
+
+    @property
+    def cell_edges(self):
+        """
+        (nC, 4) or (nC, 12) array with the indices of each cell's x, y and
+        z edges, counted within each edge direction
+        """
+        stored = self._table('cell_edges')
+        if stored is not None:
+            return stored
+        return self._indices(self._arrays(MESH_CELLS).cell_edges, 4 if self.dim==2 else 12)
+
+    def _edge_nodes(self, int_t direction):
+        stored = self._table('edge_nodes', direction)
+        if stored is not None:
+            return stored
+        return self._indices(self._arrays(MESH_EDGES).edge_nodes[direction], 2)
+
+    def _face_edges(self, int_t direction):
+        stored = self._table('face_edges', direction)
+        if stored is not None:
+            return stored
+        return self._indices(self._arrays(MESH_FACES).face_edges[direction], 4)
+
+    def _edge_lengths(self, int_t direction):
+        stored = self._table('edge_lengths', direction)
+        if stored is not None:
+            return stored
+        return self._doubles(self._arrays(MESH_EDGES).edge_lengths[direction], 0)
+
+    def _face_areas(self, int_t direction):
+        if self.dim==2:
+            return self._edge_lengths(1-direction)
+        stored = self._table('face_areas', direction)
+        if stored is not None:
+            return stored
+        return self._doubles(self._arrays(MESH_FACES).face_areas[direction], 0)
+
+    def _node_locations(self):
+        stored = self._table('node_locations')
+        if stored is not None:
+            return stored
+        return self._doubles(self._arrays(MESH_NODES).node_locations, self.dim)
+
+    def _edge_locations(self, int_t direction):
+        stored = self._table('edge_locations', direction)
+        if stored is not None:
+            return stored
+        return self._doubles(self._arrays(MESH_EDGES).edge_locations[direction], self.dim)
+
+    def _face_locations(self, int_t direction):
+        if self.dim==2:
+            return self._edge_locations(1-direction)
+        stored = self._table('face_locations', direction)
+        if stored is not None:
+            return stored
+        return self._doubles(self._arrays(MESH_FACES).face_locations[direction], self.dim)
+
     @property
     def gridCC(self):
         """
@@ -356,16 +941,10 @@ cdef class _TreeMesh:
         in order. M is the number of cells and N=2,3 is the dimension of the
         mesh.
         """
-        cdef np.float64_t[:, :] gridCC
-        cdef np.int64_t ii, ind, dim
         if self._gridCC is None:
-            dim = self.dim
-            self._gridCC = np.empty((self.nC, dim), dtype=np.float64)
-            gridCC = self._gridCC
-            for cell in self.tree.cells:
-                ind = cell.index
-                for ii in range(dim):
-                    gridCC[ind, ii] = cell.location[ii]
+            self._gridCC = self._table('cell_centers')
+        if self._gridCC is None:
+            self._gridCC = self._doubles(self._arrays(MESH_CELLS).cell_centers, self.dim)
         return self._gridCC
 
     @property
@@ -374,34 +953,14 @@ cdef class _TreeMesh:
         Returns an M by N numpy array with the widths of all cells in order.
         M is the number of nodes and N=2,3 is the dimension of the mesh.
         """
-        cdef np.float64_t[:, :] gridN
-        cdef Node *node
-        cdef np.int64_t ii, ind, dim
         if self._gridN is None:
-            dim = self.dim
-            self._gridN = np.empty((self.nN, dim) ,dtype=np.float64)
-            gridN = self._gridN
-            for it in self.tree.nodes:
-                node = it.second
-                if not node.hanging:
-                    ind = node.index
-                    for ii in range(dim):
-                        gridN[ind, ii] = node.location[ii]
+            self._gridN = self._node_locations()[:self.nN]
         return self._gridN
 
     @property
     def gridhN(self):
-        cdef np.float64_t[:, :] gridN
-        cdef Node *node
-        cdef np.int64_t ii, ind, dim
         if self._gridhN is None:
-            dim = self.dim
-            self._gridhN = np.empty((self.nhN, dim), dtype=np.float64)
-            gridhN = self._gridhN
-            for node in self.tree.hanging_nodes:
-                ind = node.index-self.nN
-                for ii in range(dim):
-                    gridhN[ind, ii] = node.location[ii]
+            self._gridhN = self._node_locations()[self.nN:]
         return self._gridhN
 
     @property
@@ -409,733 +968,178 @@ cdef class _TreeMesh:
         """
         Returns an (nC, dim) numpy array with the widths of all cells in order
         """
-        # TODO
-        cdef np.float64_t[:, :] gridCH
-        cdef np.int64_t ii, ind, dim
-        cdef np.float64_t len
         if self._h_gridded is None:
-            dim = self.dim
-            self._h_gridded = np.empty((self.nC, dim), dtype=np.float64)
-            h_gridded = self._h_gridded
-            for cell in self:
-                ind = cell.index
-                for ii in range(dim):
-                    h_gridded[ind, ii] = cell.h[ii]
-
+            self._h_gridded = self._table('cell_widths')
+        if self._h_gridded is None:
+            self._h_gridded = self._doubles(self._arrays(MESH_CELLS).cell_widths, self.dim)
         return self._h_gridded
 
     @property
     def gridEx(self):
-        cdef np.float64_t[:, :] gridEx
-        cdef Edge *edge
-        cdef np.int64_t ii, ind, dim
         if self._gridEx is None:
-            dim = self.dim
-            self._gridEx = np.empty((self.nEx, dim), dtype=np.float64)
-            gridEx = self._gridEx
-            for it in self.tree.edges_x:
-                edge = it.second
-                if not edge.hanging:
-                    ind = edge.index
-                    for ii in range(dim):
-                        gridEx[ind, ii] = edge.location[ii]
+            self._gridEx = self._edge_locations(0)[:self.nEx]
         return self._gridEx
 
     @property
     def gridhEx(self):
-        cdef np.float64_t[:, :] gridhEx
-        cdef Edge *edge
-        cdef np.int64_t ii, ind, dim
         if self._gridhEx is None:
-            dim = self.dim
-            self._gridhEx = np.empty((self.nhEx, dim), dtype=np.float64)
-            gridhEx = self._gridhEx
-            for edge in self.tree.hanging_edges_x:
-                ind = edge.index-self.nEx
-                for ii in range(dim):
-                    gridhEx[ind,ii] = edge.location[ii]
+            self._gridhEx = self._edge_locations(0)[self.nEx:]
         return self._gridhEx
 
     @property
     def gridEy(self):
-        cdef np.float64_t[:, :] gridEy
-        cdef Edge *edge
-        cdef np.int64_t ii, ind, dim
         if self._gridEy is None:
-            dim = self.dim
-            self._gridEy = np.empty((self.nEy, dim), dtype=np.float64)
-            gridEy = self._gridEy
-            for it in self.tree.edges_y:
-                edge = it.second
-                if not edge.hanging:
-                    ind = edge.index
-                    for ii in range(dim):
-                        gridEy[ind,ii] = edge.location[ii]
+            self._gridEy = self._edge_locations(1)[:self.nEy]
         return self._gridEy
 
     @property
     def gridhEy(self):
-        cdef np.float64_t[:,:] gridhEy
-        cdef Edge *edge
-        cdef np.int64_t ii, ind, dim
         if self._gridhEy is None:
-            dim = self.dim
-            self._gridhEy = np.empty((self.nhEy, dim), dtype=np.float64)
-            gridhEy = self._gridhEy
-            for edge in self.tree.hanging_edges_y:
-                ind = edge.index-self.nEy
-                for ii in range(dim):
-                    gridhEy[ind, ii] = edge.location[ii]
+            self._gridhEy = self._edge_locations(1)[self.nEy:]
         return self._gridhEy
 
     @property
     def gridEz(self):
-        cdef np.float64_t[:, :] gridEz
-        cdef Edge *edge
-        cdef np.int64_t ii, ind, dim
         if self._gridEz is None:
-            dim = self.dim
-            self._gridEz = np.empty((self.nEz, dim), dtype=np.float64)
-            gridEz = self._gridEz
-            for it in self.tree.edges_z:
-                edge = it.second
-                if not edge.hanging:
-                    ind = edge.index
-                    for ii in range(dim):
-                        gridEz[ind,ii] = edge.location[ii]
+            self._gridEz = self._edge_locations(2)[:self.nEz]
         return self._gridEz
 
     @property
     def gridhEz(self):
-        cdef np.float64_t[:,:] gridhEz
-        cdef Edge *edge
-        cdef np.int64_t ii, ind, dim
         if self._gridhEz is None:
-            dim = self.dim
-            self._gridhEz = np.empty((self.nhEz, dim), dtype=np.float64)
-            gridhEz = self._gridhEz
-            for edge in self.tree.hanging_edges_z:
-                ind = edge.index-self.nEz
-                for ii in range(dim):
-                    gridhEz[ind, ii] = edge.location[ii]
+            self._gridhEz = self._edge_locations(2)[self.nEz:]
         return self._gridhEz
 
     @property
     def gridFx(self):
         if(self.dim==2): return self.gridEy
-
-        cdef np.float64_t[:,:] gridFx
-        cdef Face *face
-        cdef np.int64_t ii, ind, dim
         if self._gridFx is None:
-            dim = self.dim
-            self._gridFx = np.empty((self.nFx, dim), dtype=np.float64)
-            gridFx = self._gridFx
-            for it in self.tree.faces_x:
-                face = it.second
-                if not face.hanging:
-                    ind = face.index
-                    for ii in range(dim):
-                        gridFx[ind, ii] = face.location[ii]
+            self._gridFx = self._face_locations(0)[:self.nFx]
         return self._gridFx
 
     @property
     def gridFy(self):
         if(self.dim==2): return self.gridEx
-        cdef np.float64_t[:,:] gridFy
-        cdef Face *face
-        cdef np.int64_t ii, ind, dim
         if self._gridFy is None:
-            dim = self.dim
-            self._gridFy = np.empty((self.nFy, dim), dtype=np.float64)
-            gridFy = self._gridFy
-            for it in self.tree.faces_y:
-                face = it.second
-                if not face.hanging:
-                    ind = face.index
-                    for ii in range(dim):
-                        gridFy[ind, ii] = face.location[ii]
+            self._gridFy = self._face_locations(1)[:self.nFy]
         return self._gridFy
 
     @property
     def gridFz(self):
         if(self.dim==2): return self.gridCC
-
-        cdef np.float64_t[:,:] gridFz
-        cdef Face *face
-        cdef np.int64_t ii, ind, dim
         if self._gridFz is None:
-            dim = self.dim
-            self._gridFz = np.empty((self.nFz, dim), dtype=np.float64)
-            gridFz = self._gridFz
-            for it in self.tree.faces_z:
-                face = it.second
-                if not face.hanging:
-                    ind = face.index
-                    for ii in range(dim):
-                        gridFz[ind, ii] = face.location[ii]
+            self._gridFz = self._face_locations(2)[:self.nFz]
         return self._gridFz
 
     @property
     def gridhFx(self):
         if(self.dim==2): return self.gridhEy
-
-        cdef np.float64_t[:,:] gridFx
-        cdef Face *face
-        cdef np.int64_t ii, ind, dim
         if self._gridhFx is None:
-            dim = self.dim
-            self._gridhFx = np.empty((self.nhFx, dim), dtype=np.float64)
-            gridhFx = self._gridhFx
-            for face in self.tree.hanging_faces_x:
-                ind = face.index-self.nFx
-                for ii in range(dim):
-                    gridhFx[ind, ii] = face.location[ii]
+            self._gridhFx = self._face_locations(0)[self.nFx:]
         return self._gridhFx
 
     @property
     def gridhFy(self):
         if(self.dim==2): return self.gridhEx
-
-        cdef np.float64_t[:,:] gridhFy
-        cdef Face *face
-        cdef np.int64_t ii, ind, dim
         if self._gridhFy is None:
-            dim = self.dim
-            self._gridhFy = np.empty((self.nhFy, dim), dtype=np.float64)
-            gridhFy = self._gridhFy
-            for face in self.tree.hanging_faces_y:
-                ind = face.index-self.nFy
-                for ii in range(dim):
-                    gridhFy[ind, ii] = face.location[ii]
+            self._gridhFy = self._face_locations(1)[self.nFy:]
         return self._gridhFy
 
     @property
     def gridhFz(self):
         if(self.dim==2): return np.array([])
-
-        cdef np.float64_t[:,:] gridhFz
-        cdef Face *face
-        cdef np.int64_t ii, ind, dim
         if self._gridhFz is None:
-            dim = self.dim
-            self._gridhFz = np.empty((self.nhFz, dim), dtype=np.float64)
-            gridhFz = self._gridhFz
-            for face in self.tree.hanging_faces_z:
-                ind = face.index-self.nFz
-                for ii in range(dim):
-                    gridhFz[ind, ii] = face.location[ii]
+            self._gridhFz = self._face_locations(2)[self.nFz:]
         return self._gridhFz
 
     @property
     def vol(self):
-        cdef np.float64_t[:] vol
         if self._vol is None:
-            self._vol = np.empty(self.nC, dtype=np.float64)
-            vol = self._vol
-            for cell in self.tree.cells:
-                vol[cell.index] = cell.volume
+            self._vol = self._table('cell_volumes')
+        if self._vol is None:
+            self._vol = self._doubles(self._arrays(MESH_CELLS).cell_volumes, 0)
         return self._vol
 
     @property
     def area(self):
-        if self.dim == 2 and self._area is None:
-            self._area = np.r_[self.edge[self.nEx:], self.edge[:self.nEx]]
-        cdef np.float64_t[:] area
-        cdef int_t ind, offset = 0
-        cdef Face *face
         if self._area is None:
-            self._area = np.empty(self.nF, dtype=np.float64)
-            area = self._area
-
-            for it in self.tree.faces_x:
-                face = it.second
-                if face.hanging: continue
-                area[face.index] = face.area
-
-            offset = self.nFx
-            for it in self.tree.faces_y:
-                face = it.second
-                if face.hanging: continue
-                area[face.index+offset] = face.area
-
-            offset = self.nFx + self.nFy
-            for it in self.tree.faces_z:
-                face = it.second
-                if face.hanging: continue
-                area[face.index+offset] = face.area
+            n_faces = [self.nFx, self.nFy, self.nFz]
+            self._area = np.concatenate(
+                [self._face_areas(d)[:n_faces[d]] for d in range(self.dim)])
         return self._area
 
     @property
     def edge(self):
-        cdef np.float64_t[:] edge_l
-        cdef Edge *edge
-        cdef int_t ind, offset
         if self._edge is None:
-            self._edge = np.empty(self.nE, dtype=np.float64)
-            edge_l = self._edge
-
-            for it in self.tree.edges_x:
-                edge = it.second
-                if edge.hanging: continue
-                edge_l[edge.index] = edge.length
-
-            offset = self.nEx
-            for it in self.tree.edges_y:
-                edge = it.second
-                if edge.hanging: continue
-                edge_l[edge.index+offset] = edge.length
-
-            if self.dim>2:
-                offset = self.nEx + self.nEy
-                for it in self.tree.edges_z:
-                    edge = it.second
-                    if edge.hanging: continue
-                    edge_l[edge.index+offset] = edge.length
+            n_edges = [self.nEx, self.nEy, self.nEz]
+            self._edge = np.concatenate(
+                [self._edge_lengths(d)[:n_edges[d]] for d in range(self.dim)])
         return self._edge
 
     @property
     def faceDiv(self):
-        if(self._faceDiv is not None):
-            return self._faceDiv
-        if(self.dim==2):
-            D = self._faceDiv2D() # Because it uses edges instead of faces
-        else:
-            D = self._faceDiv3D()
-        R = self._deflate_faces()
-        self._faceDiv = D*R
+        cdef _CSRBuffers D
+        if self._faceDiv is None:
+            D = _CSRBuffers()
+            with nogil:
+                face_divergence(self.tree[0], D.mat[0])
+            self._faceDiv = D.tocsr()
         return self._faceDiv
 
-    @cython.cdivision(True)
-    @cython.boundscheck(False)
-    def _faceDiv2D(self):
-        cdef np.int64_t[:] I = np.empty(self.nC*4, dtype=np.int64)
-        cdef np.int64_t[:] J = np.empty(self.nC*4, dtype=np.int64)
-        cdef np.float64_t[:] V = np.empty(self.nC*4, dtype=np.float64)
-
-        cdef np.int64_t i = 0
-        cdef Edge *edges[4]
-        cdef np.int64_t offset = self.tree.edges_y.size()
-        cdef double volume
-
-        for cell in self.tree.cells:
-            edges = cell.edges
-            i = cell.index
-            I[i*4:i*4+4] = i
-            J[i*4  ] = edges[0].index+offset #x edge, y face (add offset)
-            J[i*4+1] = edges[1].index+offset #x edge, y face (add offset)
-            J[i*4+2] = edges[2].index #y edge, x face
-            J[i*4+3] = edges[3].index #y edge, x face
-
-            volume = cell.volume
-            V[i*4  ] = -(edges[0].length/volume)
-            V[i*4+1] = edges[1].length/volume
-            V[i*4+2] = -(edges[2].length/volume)
-            V[i*4+3] = edges[3].length/volume
-        return sp.csr_matrix((V, (I, J)))
-
-    @cython.cdivision(True)
-    @cython.boundscheck(False)
-    def _faceDiv3D(self):
-        cdef:
-            np.int64_t[:] I = np.empty(self.nC*6, dtype=np.int64)
-            np.int64_t[:] J = np.empty(self.nC*6, dtype=np.int64)
-            np.float64_t[:] V = np.empty(self.nC*6, dtype=np.float64)
-
-            np.int64_t i = 0
-            Face *faces[6]
-            np.int64_t offset1 = self.tree.faces_x.size()
-            np.int64_t offset2 = offset1+self.tree.faces_y.size()
-            double volume, fx_area, fy_area, fz_area
-
-        for cell in self.tree.cells:
-            faces = cell.faces
-            i = cell.index
-            I[i*6:i*6+6] = i
-            J[i*6  ] = faces[0].index #x1 face
-            J[i*6+1] = faces[1].index #x2 face
-            J[i*6+2] = faces[2].index+offset1 #y face (add offset1)
-            J[i*6+3] = faces[3].index+offset1 #y face (add offset1)
-            J[i*6+4] = faces[4].index+offset2 #z face (add offset2)
-            J[i*6+5] = faces[5].index+offset2 #z face (add offset2)
-
-            volume = cell.volume
-            fx_area = faces[0].area
-            fy_area = faces[2].area
-            fz_area = faces[4].area
-            V[i*6  ] = -(fx_area)/volume
-            V[i*6+1] =  (fx_area)/volume
-            V[i*6+2] = -(fy_area)/volume
-            V[i*6+3] =  (fy_area)/volume
-            V[i*6+4] = -(fz_area)/volume
-            V[i*6+5] =  (fz_area)/volume
-        return sp.csr_matrix((V, (I, J)))
-
-    @property
-    @cython.cdivision(True)
-    @cython.boundscheck(False)
+    @property
     def edgeCurl(self):
+        cdef _CSRBuffers C
         if self._edgeCurl is not None:
             return self._edgeCurl
-        cdef:
-            int_t dim = self.dim
-            np.int64_t[:] I = np.empty(4*self.nF, dtype=np.int64)
-            np.int64_t[:] J = np.empty(4*self.nF, dtype=np.int64)
-            np.float64_t[:] V = np.empty(4*self.nF, dtype=np.float64)
-            Face *face
-            int_t ii
-            int_t face_offset_y = self.nFx
-            int_t face_offset_z = self.nFx+self.nFy
-            int_t edge_offset_y = self.ntEx
-            int_t edge_offset_z = self.ntEx+self.ntEy
-            double area
-
-        for it in self.tree.faces_x:
-            face = it.second
-            if face.hanging:
-                continue
-            ii = face.index
-            I[4*ii:4*ii+4] = ii
-            J[4*ii  ] = face.edges[0].index+edge_offset_z
-            J[4*ii+1] = face.edges[1].index+edge_offset_y
-            J[4*ii+2] = face.edges[2].index+edge_offset_z
-            J[4*ii+3] = face.edges[3].index+edge_offset_y
-
-            area = face.area
-            V[4*ii  ] = -(face.edges[0].length/area)
-            V[4*ii+1] = -(face.edges[1].length/area)
-            V[4*ii+2] = (face.edges[2].length/area)
-            V[4*ii+3] = (face.edges[3].length/area)
-
-        for it in self.tree.faces_y:
-            face = it.second
-            if face.hanging:
-                continue
-            ii = face.index+face_offset_y
-            I[4*ii:4*ii+4] = ii
-            J[4*ii  ] = face.edges[0].index+edge_offset_z
-            J[4*ii+1] = face.edges[1].index
-            J[4*ii+2] = face.edges[2].index+edge_offset_z
-            J[4*ii+3] = face.edges[3].index
-
-            area = face.area
-            V[4*ii  ] = (face.edges[0].length/area)
-            V[4*ii+1] = (face.edges[1].length/area)
-            V[4*ii+2] = -(face.edges[2].length/area)
-            V[4*ii+3] = -(face.edges[3].length/area)
-
-        for it in self.tree.faces_z:
-            face = it.second
-            if face.hanging:
-                continue
-            ii = face.index+face_offset_z
-            I[4*ii:4*ii+4] = ii
-            J[4*ii  ] = face.edges[0].index+edge_offset_y
-            J[4*ii+1] = face.edges[1].index
-            J[4*ii+2] = face.edges[2].index+edge_offset_y
-            J[4*ii+3] = face.edges[3].index
-
-            area = face.area
-            V[4*ii  ] = -(face.edges[0].length/area)
-            V[4*ii+1] = -(face.edges[1].length/area)
-            V[4*ii+2] = (face.edges[2].length/area)
-            V[4*ii+3] = (face.edges[3].length/area)
-
-        C = sp.csr_matrix((V, (I, J)),shape=(self.nF, self.ntE))
-        R = self._deflate_edges()
-        self._edgeCurl = C*R
+        if self.dim == 2:
+            raise Exception('edgeCurl is not defined in 2D')
+        C = _CSRBuffers()
+        with nogil:
+            edge_curl(self.tree[0], C.mat[0])
+        self._edgeCurl = C.tocsr()
         return self._edgeCurl
 
     @property
-    @cython.cdivision(True)
-    @cython.boundscheck(False)
     def nodalGrad(self):
-        if self._nodalGrad is not None:
-            return self._nodalGrad
-        cdef:
-            int_t dim = self.dim
-            np.int64_t[:] I = np.empty(2*self.nE, dtype=np.int64)
-            np.int64_t[:] J = np.empty(2*self.nE, dtype=np.int64)
-            np.float64_t[:] V = np.empty(2*self.nE, dtype=np.float64)
-            Edge *edge
-            double length
-            int_t ii
-            np.int64_t offset1 = self.nEx
-            np.int64_t offset2 = offset1+self.nEy
-
-        for it in self.tree.edges_x:
-            edge = it.second
-            if edge.hanging: continue
-            ii = edge.index
-            I[ii*2:ii*2+2] = ii
-            J[ii*2  ] = edge.points[0].index
-            J[ii*2+1] = edge.points[1].index
-
-            length = edge.length
-            V[ii*2  ] = -1.0/length
-            V[ii*2+1] = 1.0/length
-
-        for it in self.tree.edges_y:
-            edge = it.second
-            if edge.hanging: continue
-            ii = edge.index+offset1
-            I[ii*2:ii*2+2] = ii
-            J[ii*2] = edge.points[0].index
-            J[ii*2+1] = edge.points[1].index
-
-            length = edge.length
-            V[ii*2  ] = -1.0/length
-            V[ii*2+1] = 1.0/length
-
-        if(dim>2):
-            for it in self.tree.edges_z:
-                edge = it.second
-                if edge.hanging: continue
-                ii = edge.index+offset2
-                I[ii*2:ii*2+2] = ii
-                J[ii*2  ] = edge.points[0].index
-                J[ii*2+1] = edge.points[1].index
-
-                length = edge.length
-                V[ii*2  ] = -1.0/length
-                V[ii*2+1] = 1.0/length
-
-
-        Rn = self._deflate_nodes()
-        G = sp.csr_matrix((V, (I, J)), shape=(self.nE, self.ntN))
-        self._nodalGrad = G*Rn
+        cdef _CSRBuffers G
+        if self._nodalGrad is None:
+            G = _CSRBuffers()
+            with nogil:
+                nodal_gradient(self.tree[0], G.mat[0])
+            self._nodalGrad = G.tocsr()
         return self._nodalGrad
 
-    @cython.boundscheck(False)
+    def _cellGradStencil_dir(self, int_t direction):
+        cdef _CSRBuffers S = _CSRBuffers()
+        with nogil:
+            cell_gradient_stencil(self.tree[0], direction, S.mat[0])
+        return S.tocsr()
+
     def _cellGradxStencil(self):
-        cdef np.int64_t[:] I = np.zeros(2*self.ntFx, dtype=np.int64)
-        cdef np.int64_t[:] J = np.zeros(2*self.ntFx, dtype=np.int64)
-        cdef np.float64_t[:] V = np.zeros(2*self.ntFx, dtype=np.float64)
-        cdef int dim = self.dim
-        cdef int_t ind
+        return self._cellGradStencil_dir(0)
 
-        for cell in self.tree.cells :
-            next_cell = cell.neighbors[1]
-            if next_cell==NULL:
-                continue
-            if dim==2:
-                if next_cell.is_leaf():
-                    ind = cell.edges[3].index
-                    I[2*ind  ] = ind
-                    I[2*ind+1] = ind
-                    J[2*ind  ] = cell.index
-                    J[2*ind+1] = next_cell.index
-                    V[2*ind  ] = -1.0
-                    V[2*ind+1] = 1.0
-                else:
-                    for i in range(2): # two neighbors in +x direction
-                        ind = next_cell.children[2*i].edges[2].index
-                        I[2*ind  ] = ind
-                        I[2*ind+1] = ind
-                        J[2*ind  ] = cell.index
-                        J[2*ind+1] = next_cell.children[2*i].index
-                        V[2*ind  ] = -1.0
-                        V[2*ind+1] = 1.0
-            else:
-                if cell.neighbors[1].is_leaf():
-                    ind = cell.faces[1].index
-                    I[2*ind  ] = ind
-                    I[2*ind+1] = ind
-                    J[2*ind  ] = cell.index
-                    J[2*ind+1] = next_cell.index
-                    V[2*ind  ] = -1.0
-                    V[2*ind+1] = 1.0
-                else:
-                    for i in range(4): # four neighbors in +x direction
-                        ind = next_cell.children[2*i].faces[0].index
-                        I[2*ind  ] = ind
-                        I[2*ind+1] = ind
-                        J[2*ind  ] = cell.index
-                        J[2*ind+1] = next_cell.children[2*i].index
-                        V[2*ind  ] = -1.0
-                        V[2*ind+1] = 1.0
-
-        return sp.csr_matrix((V, (I,J)), shape=(self.ntFx, self.nC))
-
-    @cython.boundscheck(False)
     def _cellGradyStencil(self):
-        cdef np.int64_t[:] I = np.zeros(2*self.ntFy, dtype=np.int64)
-        cdef np.int64_t[:] J = np.zeros(2*self.ntFy, dtype=np.int64)
-        cdef np.float64_t[:] V = np.zeros(2*self.ntFy, dtype=np.float64)
-        cdef int dim = self.dim
-        cdef int_t ind
+        return self._cellGradStencil_dir(1)
 
-        for cell in self.tree.cells :
-            next_cell = cell.neighbors[3]
-            if next_cell==NULL:
-                continue
-            if dim==2:
-                if next_cell.is_leaf():
-                    ind = cell.edges[1].index
-                    I[2*ind  ] = ind
-                    I[2*ind+1] = ind
-                    J[2*ind  ] = cell.index
-                    J[2*ind+1] = next_cell.index
-                    V[2*ind  ] = -1.0
-                    V[2*ind+1] = 1.0
-                else:
-                    for i in range(2): # two neighbors in +y direction
-                        ind = next_cell.children[i].edges[0].index
-                        I[2*ind  ] = ind
-                        I[2*ind+1] = ind
-                        J[2*ind  ] = cell.index
-                        J[2*ind+1] = next_cell.children[i].index
-                        V[2*ind  ] = -1.0
-                        V[2*ind+1] = 1.0
-            else:
-                if next_cell.is_leaf():
-                    ind = cell.faces[3].index
-                    I[2*ind  ] = ind
-                    I[2*ind+1] = ind
-                    J[2*ind  ] = cell.index
-                    J[2*ind+1] = next_cell.index
-                    V[2*ind  ] = -1.0
-                    V[2*ind+1] = 1.0
-                else:
-                    for i in range(4): # four neighbors in +x direction
-                        ind = next_cell.children[i].faces[2].index
-                        I[2*ind  ] = ind
-                        I[2*ind+1] = ind
-                        J[2*ind  ] = cell.index
-                        J[2*ind+1] = next_cell.children[i].index
-                        V[2*ind  ] = -1.0
-                        V[2*ind+1] = 1.0
-
-        return sp.csr_matrix((V, (I,J)), shape=(self.ntFy, self.nC))
-
-    @cython.boundscheck(False)
     def _cellGradzStencil(self):
-        cdef np.int64_t[:] I = np.zeros(2*self.ntFz, dtype=np.int64)
-        cdef np.int64_t[:] J = np.zeros(2*self.ntFz, dtype=np.int64)
-        cdef np.float64_t[:] V = np.zeros(2*self.ntFz, dtype=np.float64)
-        cdef int_t ind
-
-        for cell in self.tree.cells :
-            next_cell = cell.neighbors[5]
-            if next_cell==NULL:
-                continue
-            if next_cell.is_leaf():
-                ind = cell.faces[5].index
-                I[2*ind  ] = ind
-                I[2*ind+1] = ind
-                J[2*ind  ] = cell.index
-                J[2*ind+1] = next_cell.index
-                V[2*ind  ] = -1.0
-                V[2*ind+1] = 1.0
-            else:
-                for i in range(4): # four neighbors in +z direction
-                    ind = next_cell.children[i].faces[4].index
-                    I[2*ind  ] = ind
-                    I[2*ind+1] = ind
-                    J[2*ind  ] = cell.index
-                    J[2*ind+1] = next_cell.children[i].index
-                    V[2*ind  ] = -1.0
-                    V[2*ind+1] = 1.0
-
-        return sp.csr_matrix((V, (I,J)), shape=(self.ntFz, self.nC))
-
-    @cython.boundscheck(False)
+        return self._cellGradStencil_dir(2)
+
+    def _deflate(self, int_t location, int_t direction):
+        # hanging entities onto their final non hanging parents, see
+        # hanging_projection in operators.h
+        cdef _CSRBuffers R = _CSRBuffers()
+        with nogil:
+            hanging_projection(self.tree[0], location, direction, R.mat[0])
+        return R.tocsr()
+
     def _deflate_edges_x(self):
-        #I is output index (with hanging)
-        #J is input index (without hanging)
-        cdef np.int64_t[:] I = np.empty(2*self.ntEx, dtype=np.int64)
-        cdef np.int64_t[:] J = np.empty(2*self.ntEx, dtype=np.int64)
-        cdef np.float64_t[:] V = np.empty(2*self.ntEx, dtype=np.float64)
-        cdef Edge *edge
-        cdef np.int64_t ii
-        #x edges:
-        for it in self.tree.edges_x:
-            edge = it.second
-            ii = edge.index
-            I[2*ii  ] = ii
-            I[2*ii+1] = ii
-            if edge.hanging:
-                J[2*ii  ] = edge.parents[0].index
-                J[2*ii+1] = edge.parents[1].index
-            else:
-                J[2*ii  ] = ii
-                J[2*ii+1] = ii
-            V[2*ii  ] = 0.5
-            V[2*ii+1] = 0.5
-        Rh = sp.csr_matrix((V, (I, J)), shape=(self.ntEx, self.ntEx))
-        # Test if it needs to be deflated again, (if any parents were also hanging)
-        last_ind = max(np.nonzero(Rh.getnnz(0)>0)[0][-1], self.nEx)
-        while(last_ind > self.nEx):
-            Rh = Rh*Rh
-            last_ind = max(np.nonzero(Rh.getnnz(0)>0)[0][-1], self.nEx)
-        Rh = Rh[:,:last_ind]
-        return Rh
-
-    @cython.boundscheck(False)
+        return self._deflate(AT_EDGES, 0)
+
     def _deflate_edges_y(self):
-        #I is output index (with hanging)
-        #J is input index (without hanging)
-        cdef int_t dim = self.dim
-        cdef np.int64_t[:] I = np.empty(2*self.ntEy, dtype=np.int64)
-        cdef np.int64_t[:] J = np.empty(2*self.ntEy, dtype=np.int64)
-        cdef np.float64_t[:] V = np.empty(2*self.ntEy, dtype=np.float64)
-        cdef Edge *edge
-        cdef np.int64_t ii
-        #x edges:
-        for it in self.tree.edges_y:
-            edge = it.second
-            ii = edge.index
-            I[2*ii  ] = ii
-            I[2*ii+1] = ii
-            if edge.hanging:
-                J[2*ii  ] = edge.parents[0].index
-                J[2*ii+1] = edge.parents[1].index
-            else:
-                J[2*ii  ] = ii
-                J[2*ii+1] = ii
-            V[2*ii  ] = 0.5
-            V[2*ii+1] = 0.5
-        Rh = sp.csr_matrix((V, (I, J)), shape=(self.ntEy, self.ntEy))
-        # Test if it needs to be deflated again, (if any parents were also hanging)
-        last_ind = max(np.nonzero(Rh.getnnz(0)>0)[0][-1], self.nEy)
-        while(last_ind > self.nEy):
-            Rh = Rh*Rh
-            last_ind = max(np.nonzero(Rh.getnnz(0)>0)[0][-1], self.nEy)
-        Rh = Rh[:,:last_ind]
-        return Rh
-
-    @cython.boundscheck(False)
+        return self._deflate(AT_EDGES, 1)
+
     def _deflate_edges_z(self):
-        #I is output index (with hanging)
-        #J is input index (without hanging)
-        cdef int_t dim = self.dim
-        cdef np.int64_t[:] I = np.empty(2*self.ntEz, dtype=np.int64)
-        cdef np.int64_t[:] J = np.empty(2*self.ntEz, dtype=np.int64)
-        cdef np.float64_t[:] V = np.empty(2*self.ntEz, dtype=np.float64)
-        cdef Edge *edge
-        cdef np.int64_t ii
-        #x edges:
-        for it in self.tree.edges_z:
-            edge = it.second
-            ii = edge.index
-            I[2*ii  ] = ii
-            I[2*ii+1] = ii
-            if edge.hanging:
-                J[2*ii  ] = edge.parents[0].index
-                J[2*ii+1] = edge.parents[1].index
-            else:
-                J[2*ii  ] = ii
-                J[2*ii+1] = ii
-            V[2*ii  ] = 0.5
-            V[2*ii+1] = 0.5
-        Rh = sp.csr_matrix((V, (I, J)), shape=(self.ntEz, self.ntEz))
-        # Test if it needs to be deflated again, (if any parents were also hanging)
-        last_ind = max(np.nonzero(Rh.getnnz(0)>0)[0][-1], self.nEz)
-        while(last_ind > self.nEz):
-            Rh = Rh*Rh
-            last_ind = max(np.nonzero(Rh.getnnz(0)>0)[0][-1], self.nEz)
-        Rh = Rh[:,:last_ind]
-        return Rh
+        return self._deflate(AT_EDGES, 2)
 
     def _deflate_edges(self):
         Rx = self._deflate_edges_x()
@@ -1154,182 +1158,49 @@ cdef class _TreeMesh:
             Rz = self._deflate_faces_z()
             return sp.block_diag((Rx, Ry, Rz))
 
-    @cython.boundscheck(False)
     def _deflate_faces_x(self):
-        #I is output index (with hanging)
-        #J is input index (without hanging)
-        cdef np.int64_t[:] I = np.empty(self.ntFx, dtype=np.int64)
-        cdef np.int64_t[:] J = np.empty(self.ntFx, dtype=np.int64)
-        cdef np.float64_t[:] V = np.empty(self.ntFx, dtype=np.float64)
-        cdef Face *face
-        cdef np.int64_t ii;
-
-        for it in self.tree.faces_x:
-            face = it.second
-            ii = face.index
-            I[ii] = ii
-            if face.hanging:
-                J[ii] = face.parent.index
-            else:
-                J[ii] = ii
-            V[ii] = 1.0
-        return sp.csr_matrix((V, (I, J)))
+        return self._deflate(AT_FACES, 0)
 
-    @cython.boundscheck(False)
     def _deflate_faces_y(self):
-        #I is output index (with hanging)
-        #J is input index (without hanging)
-        cdef np.int64_t[:] I = np.empty(self.ntFy, dtype=np.int64)
-        cdef np.int64_t[:] J = np.empty(self.ntFy, dtype=np.int64)
-        cdef np.float64_t[:] V = np.empty(self.ntFy, dtype=np.float64)
-        cdef Face *face
-        cdef np.int64_t ii;
-
-        for it in self.tree.faces_y:
-            face = it.second
-            ii = face.index
-            I[ii] = ii
-            if face.hanging:
-                J[ii] = face.parent.index
-            else:
-                J[ii] = ii
-            V[ii] = 1.0
-        return sp.csr_matrix((V, (I, J)))
+        return self._deflate(AT_FACES, 1)
 
-    @cython.boundscheck(False)
     def _deflate_faces_z(self):
-        #I is output index (with hanging)
-        #J is input index (without hanging)
-        cdef np.int64_t[:] I = np.empty(self.ntFz, dtype=np.int64)
-        cdef np.int64_t[:] J = np.empty(self.ntFz, dtype=np.int64)
-        cdef np.float64_t[:] V = np.empty(self.ntFz, dtype=np.float64)
-        cdef Face *face
-        cdef np.int64_t ii;
-
-        for it in self.tree.faces_z:
-            face = it.second
-            ii = face.index
-            I[ii] = ii
-            if face.hanging:
-                J[ii] = face.parent.index
-            else:
-                J[ii] = ii
-            V[ii] = 1.0
-        return sp.csr_matrix((V, (I, J)))
+        return self._deflate(AT_FACES, 2)
 
-    @cython.boundscheck(False)
     def _deflate_nodes(self):
-        cdef np.int64_t[:] I = np.empty(4*self.ntN, dtype=np.int64)
-        cdef np.int64_t[:] J = np.empty(4*self.ntN, dtype=np.int64)
-        cdef np.float64_t[:] V = np.empty(4*self.ntN, dtype=np.float64)
-
-        # I is output index
-        # J is input index
-        cdef Node *node
-        cdef np.int64_t ii, i, offset
-        offset = self.nN
-        cdef double[4] weights
-
-        for it in self.tree.nodes:
-            node = it.second
-            ii = node.index
-            I[4*ii:4*ii+4] = ii
-            if node.hanging:
-                J[4*ii  ] = node.parents[0].index
-                J[4*ii+1] = node.parents[1].index
-                J[4*ii+2] = node.parents[2].index
-                J[4*ii+3] = node.parents[3].index
-            else:
-                J[4*ii:4*ii+4] = ii
-            V[4*ii:4*ii+4] = 0.25;
+        return self._deflate(AT_NODES, 0)
+
+    def _aveEdges2CC(self, int_t direction):
+        cdef _CSRBuffers A = _CSRBuffers()
+        with nogil:
+            average_edges_to_cells(self.tree[0], direction, A.mat[0])
+        return A.tocsr()
 
-        Rh = sp.csr_matrix((V, (I, J)), shape=(self.ntN, self.ntN))
-        # Test if it needs to be deflated again, (if any parents were also hanging)
-        last_ind = max(np.nonzero(Rh.getnnz(0)>0)[0][-1], self.nN)
-        while(last_ind > self.nN):
-            Rh = Rh*Rh
-            last_ind = max(np.nonzero(Rh.getnnz(0)>0)[0][-1], self.nN)
-        Rh = Rh[:,:last_ind]
-        return Rh
+    def _aveFaces2CC(self, int_t direction):
+        cdef _CSRBuffers A = _CSRBuffers()
+        with nogil:
+            average_faces_to_cells(self.tree[0], direction, A.mat[0])
+        return A.tocsr()
 
     @property
-    @cython.boundscheck(False)
     def aveEx2CC(self):
-        if self._aveEx2CC is not None:
-            return self._aveEx2CC
-        cdef np.int64_t[:] I,J
-        cdef np.float64_t[:] V
-        cdef np.int64_t ind, ii, n_epc
-        cdef double scale
-
-        n_epc = 2*(self.dim-1)
-        I = np.empty(self.nC*n_epc, dtype=np.int64)
-        J = np.empty(self.nC*n_epc, dtype=np.int64)
-        V = np.empty(self.nC*n_epc, dtype=np.float64)
-        scale = 1.0/n_epc
-        for cell in self.tree.cells:
-            ind = cell.index
-            for ii in range(n_epc):
-                I[ind*n_epc+ii] = ind
-                J[ind*n_epc+ii] = cell.edges[ii].index
-                V[ind*n_epc+ii] = scale
-
-        Rex = self._deflate_edges_x()
-        self._aveEx2CC = sp.csr_matrix((V, (I, J)))*Rex
+        if self._aveEx2CC is None:
+            self._aveEx2CC = self._aveEdges2CC(0)
         return self._aveEx2CC
 
     @property
-    @cython.boundscheck(False)
     def aveEy2CC(self):
-        if self._aveEy2CC is not None:
-            return self._aveEy2CC
-        cdef np.int64_t[:] I,J
-        cdef np.float64_t[:] V
-        cdef np.int64_t ind, ii, n_epc
-        cdef double scale
-
-        n_epc = 2*(self.dim-1)
-        I = np.empty(self.nC*n_epc, dtype=np.int64)
-        J = np.empty(self.nC*n_epc, dtype=np.int64)
-        V = np.empty(self.nC*n_epc, dtype=np.float64)
-        scale = 1.0/n_epc
-        for cell in self.tree.cells:
-            ind = cell.index
-            for ii in range(n_epc):
-                I[ind*n_epc+ii] = ind
-                J[ind*n_epc+ii] = cell.edges[n_epc+ii].index #y edges
-                V[ind*n_epc+ii] = scale
-
-        Rey = self._deflate_edges_y()
-        self._aveEy2CC = sp.csr_matrix((V, (I, J)))*Rey
+        if self._aveEy2CC is None:
+            self._aveEy2CC = self._aveEdges2CC(1)
         return self._aveEy2CC
 
     @property
-    @cython.boundscheck(False)
     def aveEz2CC(self):
         if self._aveEz2CC is not None:
             return self._aveEz2CC
         if self.dim == 2:
             raise Exception('There are no z-edges in 2D')
-        cdef np.int64_t[:] I,J
-        cdef np.float64_t[:] V
-        cdef np.int64_t ind, ii, n_epc
-        cdef double scale
-
-        n_epc = 2*(self.dim-1)
-        I = np.empty(self.nC*n_epc, dtype=np.int64)
-        J = np.empty(self.nC*n_epc, dtype=np.int64)
-        V = np.empty(self.nC*n_epc, dtype=np.float64)
-        scale = 1.0/n_epc
-        for cell in self.tree.cells:
-            ind = cell.index
-            for ii in range(n_epc):
-                I[ind*n_epc+ii] = ind
-                J[ind*n_epc+ii] = cell.edges[ii+2*n_epc].index
-                V[ind*n_epc+ii] = scale
-
-        Rez = self._deflate_edges_z()
-        self._aveEz2CC = sp.csr_matrix((V, (I, J)))*Rez
+        self._aveEz2CC = self._aveEdges2CC(2)
         return self._aveEz2CC
 
     @property
@@ -1351,86 +1222,30 @@ cdef class _TreeMesh:
         return self._aveE2CCV
 
     @property
-    @cython.boundscheck(False)
     def aveFx2CC(self):
         if self._aveFx2CC is not None:
             return self._aveFx2CC
         if self.dim == 2:
             return self.aveEy2CC
-
-        cdef np.int64_t[:] I,J
-        cdef np.float64_t[:] V
-        cdef Face *face1
-        cdef Face *face2
-        cdef np.int64_t ii
-        I = np.empty(self.nC*2, dtype=np.int64)
-        J = np.empty(self.nC*2, dtype=np.int64)
-        V = np.empty(self.nC*2, dtype=np.float64)
-        for cell in self.tree.cells:
-            face1 = cell.faces[0] #y edge/ x face
-            face2 = cell.faces[1] #y edge/ x face
-            ii = cell.index
-            I[ii*2:ii*2+2] = ii
-            J[ii*2] = face1.index
-            J[ii*2+1] = face2.index
-            V[ii*2:ii*2+2] = 0.5
-        Rfx = self._deflate_faces_x()
-        self._aveFx2CC = sp.csr_matrix((V, (I, J)))*Rfx
+        self._aveFx2CC = self._aveFaces2CC(0)
         return self._aveFx2CC
 
     @property
-    @cython.boundscheck(False)
     def aveFy2CC(self):
         if self._aveFy2CC is not None:
             return self._aveFy2CC
         if self.dim == 2:
             return self.aveEx2CC
-
-        cdef np.int64_t[:] I,J
-        cdef np.float64_t[:] V
-        cdef Face *face1
-        cdef Face *face2
-        cdef np.int64_t ii
-        I = np.empty(self.nC*2, dtype=np.int64)
-        J = np.empty(self.nC*2, dtype=np.int64)
-        V = np.empty(self.nC*2, dtype=np.float64)
-        for cell in self.tree.cells:
-            face1 = cell.faces[2] #x edge/ y face
-            face2 = cell.faces[3] #x edge/ y face
-            ii = cell.index
-            I[ii*2:ii*2+2] = ii
-            J[ii*2] = face1.index
-            J[ii*2+1] = face2.index
-            V[ii*2:ii*2+2] = 0.5
-        Rfy = self._deflate_faces_y()
-        self._aveFy2CC = sp.csr_matrix((V, (I, J)))*Rfy
+        self._aveFy2CC = self._aveFaces2CC(1)
         return self._aveFy2CC
 
     @property
-    @cython.boundscheck(False)
     def aveFz2CC(self):
         if self._aveFz2CC is not None:
             return self._aveFz2CC
         if self.dim == 2:
             raise Exception('There are no z-faces in 2D')
-        cdef np.int64_t[:] I,J
-        cdef np.float64_t[:] V
-        cdef Face *face1
-        cdef Face *face2
-        cdef np.int64_t ii
-        I = np.empty(self.nC*2, dtype=np.int64)
-        J = np.empty(self.nC*2, dtype=np.int64)
-        V = np.empty(self.nC*2, dtype=np.float64)
-        for cell in self.tree.cells:
-            face1 = cell.faces[4]
-            face2 = cell.faces[5]
-            ii = cell.index
-            I[ii*2:ii*2+2] = ii
-            J[ii*2] = face1.index
-            J[ii*2+1] = face2.index
-            V[ii*2:ii*2+2] = 0.5
-        Rfy = self._deflate_faces_z()
-        self._aveFz2CC = sp.csr_matrix((V, (I, J)))*Rfy
+        self._aveFz2CC = self._aveFaces2CC(2)
         return self._aveFz2CC
 
     @property
@@ -1456,28 +1271,54 @@ cdef class _TreeMesh:
         return self._aveF2CCV
 
     @property
-    @cython.boundscheck(False)
     def aveN2CC(self):
-        cdef np.int64_t[:] I, J
-        cdef np.float64_t[:] V
-        cdef np.int64_t ii, id, n_ppc
-        cdef double scale
+        cdef _CSRBuffers A
         if self._aveN2CC is None:
-            n_ppc = 1<<self.dim
-            scale = 1.0/n_ppc
-            I = np.empty(self.nC*n_ppc, dtype=np.int64)
-            J = np.empty(self.nC*n_ppc, dtype=np.int64)
-            V = np.empty(self.nC*n_ppc, dtype=np.float64)
-            for cell in self.tree.cells:
-                ii = cell.index
-                for id in range(n_ppc):
-                    I[ii*n_ppc+id] = ii
-                    J[ii*n_ppc+id] = cell.points[id].index
-                    V[ii*n_ppc+id] = scale
-            Rn = self._deflate_nodes()
-            self._aveN2CC = sp.csr_matrix((V, (I, J)))*Rn
+            A = _CSRBuffers()
+            with nogil:
+                average_nodes_to_cells(self.tree[0], A.mat[0])
+            self._aveN2CC = A.tocsr()
         return self._aveN2CC
 
+    def apply(self, name, x, transpose=False):
+        """Applies the operator with the given name (faceDiv, edgeCurl,
+        nodalGrad, aveN2CC, aveE2CC, aveEx2CC, ..., aveF2CC, aveFx2CC, ...)
+        to x, or its transpose with transpose=True, without building the
+        matrix. x can hold one vector per column."""
+        if name not in _applied_operators:
+            raise ValueError('{0} can not be applied, use one of {1}'.format(
+                name, ', '.join(sorted(_applied_operators))))
+        if self.dim == 2 and (name == 'edgeCurl' or name[-3:] == 'z2CC'):
+            raise Exception('{0} is not defined in 2D'.format(name))
+        cdef int_t op, direction, n_rows, n_cols
+        op, direction = _applied_operators[name]
+        cdef bint c_transpose = transpose
+        with nogil:
+            operator_shape(self.tree[0], op, direction, n_rows, n_cols)
+        if transpose:
+            n_rows, n_cols = n_cols, n_rows
+
+        x = np.asarray(x, dtype=np.float64)
+        if x.shape[0] != n_cols or x.ndim > 2:
+            raise ValueError('x must have {0} rows for {1}, not {2}'.format(
+                n_cols, name, x.shape[0]))
+        if x.ndim == 2:
+            return np.column_stack([self.apply(name, col, transpose) for col in x.T])
+
+        cdef double[::1] x_view = np.ascontiguousarray(x)
+        out = np.empty(n_rows, dtype=np.float64)
+        cdef double[::1] out_view = out
+        cdef double *c_x = &x_view[0] if n_cols > 0 else NULL
+        cdef double *c_out = &out_view[0] if n_rows > 0 else NULL
+        with nogil:
+            apply_operator(self.tree[0], op, direction, c_transpose, c_x, c_out)
+        return out
+
+    def apply_transpose(self, name, y):
+        """The transpose of the operator with the given name applied to y,
+        see apply."""
+        return self.apply(name, y, transpose=True)
+
     def _get_containing_cell_index(self, loc):
         cdef double x,y,z
         x = loc[0]
@@ -1488,6 +1329,83 @@ cdef class _TreeMesh:
             z = 0
         return self.tree.containing_cell(x, y, z).index
 
+    def _linear_octree(self):
+        """The leaves as Morton codes of their lowest corner (in cells of the
+        finest level) and their levels, in cell order. See linear_tree.h"""
+        cdef LinearTree linear
+        linear.build(self.tree.cells, self.dim, self.max_level)
+        cdef int_t i, n = linear.size()
+        codes = np.empty(n, dtype=np.uint64)
+        levels = np.empty(n, dtype=np.uint8)
+        cdef np.uint64_t[:] codes_view = codes
+        cdef np.uint8_t[:] levels_view = levels
+        for i in range(n):
+            codes_view[i] = linear.codes[i]
+            levels_view[i] = linear.levels[i]
+        return codes, levels
+
+    def _references(self):
+        """The reference counts of the nodes, edges and faces as dicts by
+        key, and how many cells, nodes, edges and faces the pools have handed
+        out. Only meant for checking the in place updates against a fresh
+        build."""
+        cdef node_map_t.iterator it_n = self.tree.nodes.begin()
+        cdef edge_map_t.iterator it_e
+        cdef face_map_t.iterator it_f
+        cdef edge_map_t *edges[3]
+        cdef face_map_t *faces[3]
+        edges[:] = [&self.tree.edges_x, &self.tree.edges_y, &self.tree.edges_z]
+        faces[:] = [&self.tree.faces_x, &self.tree.faces_y, &self.tree.faces_z]
+        out = {'nodes': {}}
+        while it_n != self.tree.nodes.end():
+            out['nodes'][deref(it_n).first] = deref(it_n).second.reference
+            inc(it_n)
+        for d, name in enumerate('xyz'):
+            out['edges_'+name] = {}
+            it_e = edges[d].begin()
+            while it_e != edges[d].end():
+                out['edges_'+name][deref(it_e).first] = deref(it_e).second.reference
+                inc(it_e)
+            out['faces_'+name] = {}
+            it_f = faces[d].begin()
+            while it_f != faces[d].end():
+                out['faces_'+name][deref(it_f).first] = deref(it_f).second.reference
+                inc(it_f)
+        out['pools'] = (self.tree.cell_pool.size(), self.tree.node_pool.size(),
+                        self.tree.edge_pool.size(), self.tree.face_pool.size())
+        return out
+
+    def _neighbor_keys(self):
+        """The key of each cell and of its neighbors on its -x, +x, -y, +y
+        (-z, +z) sides, -1 on the boundary. Only meant for checking the in
+        place updates against a fresh build."""
+        cdef int_t i, j, n_dir = 2*self.dim
+        keys = np.empty(self.nC, dtype=np.int64)
+        neighbors = np.empty((self.nC, n_dir), dtype=np.int64)
+        cdef np.int64_t[:] keys_view = keys
+        cdef np.int64_t[:, :] neighbors_view = neighbors
+        cdef c_Cell *cell
+        for i in range(self.nC):
+            cell = self.tree.cells[i]
+            keys_view[i] = cell.key()
+            for j in range(n_dir):
+                neighbors_view[i, j] = -1 if cell.neighbors()[j] == NULL else cell.neighbors()[j].key()
+        return keys, neighbors
+
+    def _get_containing_cell_indexes(self, locs):
+        cdef double[:, ::1] pts = np.ascontiguousarray(
+            np.atleast_2d(locs)[:, :self.dim], dtype=np.float64)
+        cdef int_t n = pts.shape[0]
+        inds = np.empty(n, dtype=np.int64)
+        if n==0:
+            return inds
+        cdef np.int64_t[:] inds_view = inds
+        #int_t is a 64 bit size_t on the C++ side
+        cdef int_t *out = <int_t *> &inds_view[0]
+        with nogil:
+            self.tree.containing_cells(&pts[0, 0], n, out)
+        return inds
+
     def _getFaceP(self, xFace, yFace, zFace):
         cdef int dim = self.dim
         cdef int_t ind, id
@@ -1518,12 +1436,12 @@ cdef class _TreeMesh:
         for cell in self.tree.cells:
             ind = cell.index
             if dim==2:
-                J1[ind] = cell.edges[2+faces[0]].index
-                J2[ind] = cell.edges[  faces[1]].index + offsets[1]
+                J1[ind] = cell.edges()[2+faces[0]].index
+                J2[ind] = cell.edges()[  faces[1]].index + offsets[1]
             else:
-                J1[ind] = cell.faces[  faces[0]].index
-                J2[ind] = cell.faces[2+faces[1]].index + offsets[1]
-                J3[ind] = cell.faces[4+faces[2]].index + offsets[2]
+                J1[ind] = cell.faces()[  faces[0]].index
+                J2[ind] = cell.faces()[2+faces[1]].index + offsets[1]
+                J3[ind] = cell.faces()[4+faces[2]].index + offsets[2]
 
         I = np.arange(dim*self.nC, dtype=np.int64)
         if dim==2:
@@ -1576,10 +1494,10 @@ cdef class _TreeMesh:
 
         for cell in self.tree.cells:
             ind = cell.index
-            J1[ind] = cell.edges[0*epc + edges[0]].index + offsets[0]
-            J2[ind] = cell.edges[1*epc + edges[1]].index + offsets[1]
+            J1[ind] = cell.edges()[0*epc + edges[0]].index + offsets[0]
+            J2[ind] = cell.edges()[1*epc + edges[1]].index + offsets[1]
             if dim==3:
-                J3[ind] = cell.edges[2*epc + edges[2]].index + offsets[2]
+                J3[ind] = cell.edges()[2*epc + edges[2]].index + offsets[2]
 
         I = np.arange(dim*self.nC, dtype=np.int64)
         if dim==2:
@@ -1602,290 +1520,137 @@ cdef class _TreeMesh:
             return self._getEdgeP(xEdge, yEdge, zEdge)
         return Pxxx
 
-    def _cull_outer_simplices(self, np.float64_t[:,:] points, int[:,:] simplices,
-                       cull_dir='xyz'):
-        cdef int cull_x, cull_y, cull_z
-        cdef int i, ii, id, n_simps, dim
-
-        n_simps = simplices.shape[0]
-        dim = self.dim
-
-        cull_x = 1 if 'x' in cull_dir else 0
-        cull_y = 1 if 'y' in cull_dir else 0
-        cull_z = 1 if (dim==3 and 'z' in cull_dir) else 0
-        cdef np.float64_t[:] center = np.zeros(dim)
-        cdef c_Cell *cell
-        is_inside = np.ones(n_simps, dtype=np.bool)
-        cdef double diff
-
-        for i in range(n_simps):
-            for ii in range(dim+1):
-                for id in range(dim):
-                    center[id] += points[simplices[i,ii],id]
-
-            for id in range(dim):
-                center[id] *= 1.0/(dim+1.0)
-
-            if dim==2:
-                cell = self.tree.containing_cell(center[0], center[1], 0.0)
-                iz = 0
-            else:
-                cell = self.tree.containing_cell(center[0], center[1], center[2])
-
-            if cull_x:
-                diff = center[0]-cell.location[0]
-                if ((diff<0 and cell.neighbors[0]==NULL) or
-                    (diff>0 and cell.neighbors[1]==NULL)):
-                    is_inside[i] = False
-            if cull_y:
-                diff = center[1]-cell.location[1]
-                if ((diff<0 and cell.neighbors[2]==NULL) or
-                    (diff>0 and cell.neighbors[3]==NULL)):
-                    is_inside[i] = False
-            if cull_z:
-                diff = center[2]-cell.location[2]
-                if ((diff<0 and cell.neighbors[4]==NULL) or
-                    (diff>0 and cell.neighbors[5]==NULL)):
-                    is_inside[i] = False
-            center[:] = 0.0
-        return is_inside
-
-    def _get_grid_triang(self, grid='CC', double eps=1E-8):
-
-        if grid=='CC':
-            points = self.gridCC
-            cull = 'xyz'
-        elif grid=='Fx':
-            points = self.gridFx
-            cull = 'yz'
-        elif grid=='Fy':
-            points = self.gridFy
-            cull = 'xz'
-        elif grid=='Fz':
-            points = self.gridFz
-            cull = 'xy'
-        elif grid=='Ex':
-            points = self.gridEx
-            cull = 'x'
-        elif grid=='Ey':
-            points = self.gridEy
-            cull = 'y'
-        elif grid=='Ez':
-            points = self.gridEz
-            cull = 'z'
-
-        triang = Delaunay(points)
-
-        is_inside = self._cull_outer_simplices(points, triang.simplices, cull)
-
-        p = np.full(triang.nsimplex+1,-1, dtype=triang.neighbors.dtype)
-
-        triang.simplices = triang.simplices[is_inside].copy()
-        triang.equations = triang.equations[is_inside].copy()
-        triang.nsimplex = triang.simplices.shape[0]
-
-        p[:-1][is_inside] = np.arange(triang.nsimplex, dtype=p.dtype)
-
-        #neighbors need to be renumbered
-        neighbors = triang.neighbors[is_inside].copy()
-        neighbors = p[neighbors]
-
-        triang.neighbors = neighbors
-        triang._transform = None
-        triang._vertex_to_simplex = None
-        triang._vertex_neighbor_vertices = None
-
-        # Backwards compatibility (Scipy < 0.12.0)
-        triang.vertices = triang.simplices
-
-        return triang
+    def _inner_product_prop(self, prop):
+        #The property as its n_prop values in every cell, stored like
+        #discretize's mkvc: the first value of all cells, then the second...
+        if prop is None:
+            prop = 1.0
+        prop = np.asarray(prop, dtype=np.float64)
+        if prop.size == 1:
+            prop = prop.ravel()[0]*np.ones(self.nC)
+        prop = np.ascontiguousarray(prop.ravel(order='F'))
+        n_prop = prop.size//self.nC
+        if prop.size != n_prop*self.nC or n_prop not in [1, self.dim, 3*(self.dim-1)]:
+            raise Exception('Unexpected shape of tensor')
+        return prop, n_prop
+
+    def _inner_product(self, int_t location, prop, invProp, invMat, doFast):
+        prop, n_prop = self._inner_product_prop(prop)
+        # a full tensor has no fast (diagonal) version
+        cdef bint lumped = doFast and n_prop <= self.dim
+        if invMat and n_prop > self.dim:
+            raise Exception('Solver needed to invert A.')
+        cdef double[::1] prop_view = prop
+        cdef int_t c_n_prop = n_prop
+        cdef bint c_inv_prop = invProp
+        cdef bint c_inv_mat = invMat
+        cdef _CSRBuffers M = _CSRBuffers()
+        with nogil:
+            inner_product(self.tree[0], location, &prop_view[0], c_n_prop, c_inv_prop,
+                          lumped, c_inv_mat, M.mat[0])
+        if invMat and not lumped:
+            # as discretize, the inverse of the diagonal
+            return sp.diags(1.0/M.tocsr().diagonal()).tocsr()
+        return M.tocsr()
+
+    def _inner_product_deriv_matrix(self, int_t location, u, int_t n_prop, bint lumped):
+        cdef double[::1] u_view
+        cdef double *c_u = NULL
+        if u is not None:
+            u_view = np.ascontiguousarray(u, dtype=np.float64)
+            c_u = &u_view[0]
+        cdef _CSRBuffers D = _CSRBuffers()
+        with nogil:
+            inner_product_deriv(self.tree[0], location, c_u, n_prop, lumped, D.mat[0])
+        return D.tocsr()
+
+    def _inner_product_deriv(self, int_t location, prop, doFast, invProp, invMat):
+        scalar = prop is None or np.size(prop) == 1
+        prop, n_prop = self._inner_product_prop(prop)
+        lumped = doFast and n_prop <= self.dim
+        # a scalar property is one value for the whole mesh
+        ones = sp.csr_matrix((np.ones(self.nC), (np.arange(self.nC), np.zeros(self.nC))),
+                             shape=(self.nC, 1))
+        if not lumped:
+            if invProp or invMat:
+                raise NotImplementedError(
+                    'inverting the property or the matrix is not yet implemented '
+                    'for this mesh/tensorType. You should write it!')
+            def innerProductDeriv(v):
+                dMdprop = self._inner_product_deriv_matrix(location, v, n_prop, False)
+                return dMdprop*ones if scalar else dMdprop
+            return innerProductDeriv
+
+        dMdprop = self._inner_product_deriv_matrix(location, None, n_prop, True)
+        if invMat:
+            MI = self._inner_product(location, prop, invProp, True, True)
+        if invMat and invProp:
+            dMdprop = sp.diags(MI.diagonal()**2)*dMdprop*sp.diags(1.0/prop**2)
+        elif invProp:
+            dMdprop = dMdprop*sp.diags(-1.0/prop**2)
+        elif invMat:
+            dMdprop = sp.diags(-MI.diagonal()**2)*dMdprop
+        if scalar:
+            dMdprop = dMdprop*ones
+        def innerProductDeriv(v=None):
+            if v is None:
+                return dMdprop
+            return sp.diags(v)*dMdprop
+        return innerProductDeriv
+
+    def getFaceInnerProduct(self, prop=None, invProp=False, invMat=False, doFast=True):
+        """Face inner product (mass) matrix for a property given per cell as
+        1 (isotropic), dim (anisotropic) or 3/6 (full tensor) values,
+        assembled in C++, see inner_product in operators.h. Isotropic and
+        anisotropic ones give discretize's fast diagonal matrix unless
+        doFast is False."""
+        return self._inner_product(AT_FACES, prop, invProp, invMat, doFast)
+
+    def getEdgeInnerProduct(self, prop=None, invProp=False, invMat=False, doFast=True):
+        """Edge inner product (mass) matrix, see getFaceInnerProduct."""
+        return self._inner_product(AT_EDGES, prop, invProp, invMat, doFast)
+
+    def getFaceInnerProductDeriv(self, prop, doFast=True, invProp=False, invMat=False):
+        """Function of v giving the derivative of getFaceInnerProduct(prop)*v
+        with respect to prop."""
+        return self._inner_product_deriv(AT_FACES, prop, doFast, invProp, invMat)
+
+    def getEdgeInnerProductDeriv(self, prop, doFast=True, invProp=False, invMat=False):
+        """Function of v giving the derivative of getEdgeInnerProduct(prop)*v
+        with respect to prop."""
+        return self._inner_product_deriv(AT_EDGES, prop, doFast, invProp, invMat)
 
     def getInterpolationMat(self, locs, locType, zerosOutside=False):
+        """Interpolation from values at locType (N, CC, Ex, Ey, Ez, Fx, Fy or
+        Fz) to the points locs, built from the cells holding each point. See
+        interpolation_matrix in operators.h for the weights."""
         if locType not in ['N', 'CC', "Ex", "Ey", "Ez", "Fx", "Fy", "Fz"]:
             raise Exception('locType must be one of N, CC, Ex, Ey, Ez, Fx, Fy, or Fz')
-        if locType=='N':
-            return self._getNodeIntMat(locs, zerosOutside)
-        tri = self._get_grid_triang(grid=locType)
-
         if self.dim==2 and locType in ['Ez','Fz']:
             raise Exception('Unable to interpolate from Z edges/face in 2D')
 
-        cdef int[:,:] simplices = tri.simplices
-
-        cdef int i_out, i_p, i, dim, n_points, npi, n_grid
-        cdef int found = 0
-        dim = self.dim
-
-        cdef double[:,:] points = np.atleast_2d(locs).copy()
-        cdef double[:,:] grid_points = tri.points
-        cdef double[:] point, proj_point
-        cdef double *p0
-        cdef double *p1
-        cdef double *p2
-        cdef double d, dsq, inf=np.inf
-        cdef int contains_point
-
-        n_points = points.shape[0]
-        n_grid = grid_points.shape[0]
-        npsimps = tri.find_simplex(locs)
-        cdef int[:] simps = npsimps
-        cdef int[:] simplex
-        cdef int[:, :] hull
-        cdef int[:] hull_points
-        cdef int[:] npis
-
-        proj_point = np.empty_like(points[0])
-        point = np.empty_like(points[0])
-
-        np_outside_points = np.where(npsimps==-1)[0].astype(np.int)
-        cdef int[:] outside_points = np_outside_points
-        n_outside = outside_points.shape[0]
-        cdef double[:] barys = np.empty(dim, dtype=float)
-
-        trans = tri.transform[npsimps]
-        shift = np.array(points)-trans[:, dim]
-        bs = np.einsum('ikj,ij->ik', trans[:, :dim], shift)
-        bs = np.c_[bs, 1-bs.sum(axis=1)]
-
-        I = np.column_stack((dim+1)*[np.arange(n_points)])
-        J = tri.simplices[npsimps]
-        V = bs
-        cdef int[:,:] Js = J
-        cdef double[:, :] Vs = V
-
-        if n_outside > 0 and not zerosOutside:
-            #oh boy got some points that need to be extrapolated
-
-            hull = tri.convex_hull
-            np_hull_points = np.unique(hull)
-            hull_points = np_hull_points
-
-
-            n_hull_simps = hull.shape[0]
-
-            kdtree = cKDTree(tri.points[np_hull_points])
-            npis = kdtree.query(locs[np_outside_points])[1]
-
-            for i_out in range(n_outside):
-                i_p = outside_points[i_out]
-                point[:] = points[i_p]
-                npi = hull_points[npis[i_out]]
-
-                d = inf
-                for i_s in range(n_hull_simps):
-                    simplex = hull[i_s]
-                    contains_point = 0
-                    for i in range(dim):
-                        contains_point = contains_point or simplex[i]==npi
-                    if not contains_point:
-                        continue
-                    p0 = &grid_points[simplex[0], 0]
-                    p1 = &grid_points[simplex[1], 0]
-                    if dim==2:
-                        _project_point_to_edge(&point[0], p0, p1, dim, &proj_point[0])
-                    else:
-                        p2 = &grid_points[simplex[2], 0]
-                        _project_point_to_triangle(&point[0], p0, p1, p2, dim, &proj_point[0])
-
-                    dsq = 0
-                    for i in range(dim):
-                        dsq += (point[i]-proj_point[i])*(point[i]-proj_point[i])
-                    if dsq < d:
-                        d = dsq
-                        if dim==2:
-                            _barycentric_edge(&proj_point[0], p0, p1, &barys[0], dim)
-                        else:
-                            _barycentric_triangle(&proj_point[0], p0, p1, p2, &barys[0], dim)
-                        Js[i_p,0:dim] = simplex[:]
-                        Vs[i_p,0:dim] = barys[:]
-                        Vs[i_p,dim] = 0.0
-
-        if zerosOutside:
-                V[outside_points] = 0.0
-
-        if locType[0] == 'F':
-            n_grid = self.nF
-            if locType[-1] == 'y':
-                J += self.nFx
-            elif locType[-1] == 'z':
-                J += self.nFx + self.nFy
-        elif locType[0] == 'E':
-            n_grid = self.nE
-            if locType[-1] == 'y':
-                J += self.nEx
-            elif locType[-1] == 'z':
-                J += self.nEx + self.nEy
-
-        return sp.csr_matrix((V.reshape(-1), (I.reshape(-1), J.reshape(-1))),
-                             shape=(n_points,n_grid))
-
-    def _getNodeIntMat(self, locs, zerosOutside):
-        cdef:
-            double[:, :] locations = locs
-            int_t dim = self.dim
-            int_t n_loc = locs.shape[0]
-            int_t n_nodes = 1<<dim
-            np.int64_t[:] I = np.empty(n_loc*n_nodes, dtype=np.int64)
-            np.int64_t[:] J = np.empty(n_loc*n_nodes, dtype=np.int64)
-            np.float64_t[:] V = np.empty(n_loc*n_nodes, dtype=np.float64)
-
-            int_t ii,i
-            c_Cell *cell
-            double x, y, z
-            double wx, wy, wz
-            double eps = 100*np.finfo(float).eps
-            int zeros_out = zerosOutside
-
-        for i in range(n_loc):
-            x = locations[i, 0]
-            y = locations[i, 1]
-            if dim==3:
-                z = locations[i, 1]
-            else:
-                z = 0.0
-            #get containing (or closest) cell
-            cell = self.tree.containing_cell(x,y,z)
-            #calculate weights
-            wx = ((cell.points[3].location[0]-x)/
-                  (cell.points[3].location[0]-cell.points[0].location[0]))
-            wy = ((cell.points[3].location[1]-y)/
-                  (cell.points[3].location[1]-cell.points[0].location[1]))
-            if dim==3:
-                wz = ((cell.points[7].location[2]-z)/
-                      (cell.points[7].location[2]-cell.points[0].location[2]))
-            else:
-                wz = 1.0
-
-
-            I[n_nodes*i:n_nodes*i+n_nodes] = i
-
-
-            if zeros_out:
-                if (wx<-eps or wy<-eps or wz<-eps or
-                    wx>1+eps or wy>1+eps or wz>1+eps):
-                    for ii in range(n_nodes):
-                        J[n_nodes*i+ii] = 0
-                        V[n_nodes*i+ii] = 0.0
-                    continue
+        cdef double[:, ::1] pts = np.ascontiguousarray(
+            np.atleast_2d(locs)[:, :self.dim], dtype=np.float64)
+        cdef int_t n = pts.shape[0]
+        cdef double *points = NULL
+        if n > 0:
+            points = &pts[0, 0]
 
-            wx = _clip01(wx)
-            wy = _clip01(wy)
-            wz = _clip01(wz)
-            for ii in range(n_nodes):
-                J[n_nodes*i+ii] = cell.points[ii].index
-
-            V[n_nodes*i  ] = wx*wy*wz
-            V[n_nodes*i+1] = (1-wx)*wy*wz
-            V[n_nodes*i+2] = wx*(1-wy)*wz
-            V[n_nodes*i+3] = (1-wx)*(1-wy)*wz
-            if dim==3:
-                V[n_nodes*i+4] = wx*wy*(1-wz)
-                V[n_nodes*i+5] = (1-wx)*wy*(1-wz)
-                V[n_nodes*i+6] = wx*(1-wy)*(1-wz)
-                V[n_nodes*i+7] = (1-wx)*(1-wy)*(1-wz)
+        cdef int_t location, direction = 0
+        if locType=='N':
+            location = AT_NODES
+        elif locType=='CC':
+            location = AT_CELLS
+        else:
+            location = AT_EDGES if locType[0]=='E' else AT_FACES
+            direction = 'xyz'.index(locType[1])
+        cdef bint zeros_out = zerosOutside
 
-        Rn = self._deflate_nodes()
-        return sp.csr_matrix((V, (I, J)), shape=(locs.shape[0],self.ntN))*Rn
+        cdef _CSRBuffers A = _CSRBuffers()
+        with nogil:
+            interpolation_matrix(self.tree[0], points, n, location, direction,
+                                 zeros_out, A.mat[0])
+        return A.tocsr()
 
     def plotGrid(self, ax=None, showIt=False,
         grid=True,
@@ -1910,8 +1675,8 @@ cdef class _TreeMesh:
 
         cdef:
             int_t i, offset
-            Node *p1
-            Node *p2
+            double p1[3]
+            double p2[3]
             Edge *edge
 
         if grid:
@@ -1922,20 +1687,20 @@ cdef class _TreeMesh:
                     edge = it.second
                     if(edge.hanging): continue
                     i = edge.index*3
-                    p1 = edge.points[0]
-                    p2 = edge.points[1]
-                    X[i:i+3] = [p1.location[0],p2.location[0],np.nan]
-                    Y[i:i+3] = [p1.location[1],p2.location[1],np.nan]
+                    self.tree.location(edge.points[0], p1)
+                    self.tree.location(edge.points[1], p2)
+                    X[i:i+3] = [p1[0],p2[0],np.nan]
+                    Y[i:i+3] = [p1[1],p2[1],np.nan]
 
                 offset = self.nEx
                 for it in self.tree.edges_y:
                     edge = it.second
                     if(edge.hanging): continue
                     i = (edge.index+offset)*3
-                    p1 = edge.points[0]
-                    p2 = edge.points[1]
-                    X[i:i+3] = [p1.location[0],p2.location[0],np.nan]
-                    Y[i:i+3] = [p1.location[1],p2.location[1],np.nan]
+                    self.tree.location(edge.points[0], p1)
+                    self.tree.location(edge.points[1], p2)
+                    X[i:i+3] = [p1[0],p2[0],np.nan]
+                    Y[i:i+3] = [p1[1],p2[1],np.nan]
 
                 ax.plot(X, Y, 'b-')
             else:
@@ -1946,33 +1711,33 @@ cdef class _TreeMesh:
                     edge = it.second
                     if(edge.hanging): continue
                     i = edge.index*3
-                    p1 = edge.points[0]
-                    p2 = edge.points[1]
-                    X[i:i+3] = [p1.location[0], p2.location[0], np.nan]
-                    Y[i:i+3] = [p1.location[1], p2.location[1], np.nan]
-                    Z[i:i+3] = [p1.location[2], p2.location[2], np.nan]
+                    self.tree.location(edge.points[0], p1)
+                    self.tree.location(edge.points[1], p2)
+                    X[i:i+3] = [p1[0], p2[0], np.nan]
+                    Y[i:i+3] = [p1[1], p2[1], np.nan]
+                    Z[i:i+3] = [p1[2], p2[2], np.nan]
 
                 offset = self.nEx
                 for it in self.tree.edges_y:
                     edge = it.second
                     if(edge.hanging): continue
                     i = (edge.index+offset)*3
-                    p1 = edge.points[0]
-                    p2 = edge.points[1]
-                    X[i:i+3] = [p1.location[0], p2.location[0], np.nan]
-                    Y[i:i+3] = [p1.location[1], p2.location[1], np.nan]
-                    Z[i:i+3] = [p1.location[2], p2.location[2], np.nan]
+                    self.tree.location(edge.points[0], p1)
+                    self.tree.location(edge.points[1], p2)
+                    X[i:i+3] = [p1[0], p2[0], np.nan]
+                    Y[i:i+3] = [p1[1], p2[1], np.nan]
+                    Z[i:i+3] = [p1[2], p2[2], np.nan]
 
                 offset += self.nEy
                 for it in self.tree.edges_z:
                     edge = it.second
                     if(edge.hanging): continue
                     i = (edge.index+offset)*3
-                    p1 = edge.points[0]
-                    p2 = edge.points[1]
-                    X[i:i+3] = [p1.location[0], p2.location[0], np.nan]
-                    Y[i:i+3] = [p1.location[1], p2.location[1], np.nan]
-                    Z[i:i+3] = [p1.location[2], p2.location[2], np.nan]
+                    self.tree.location(edge.points[0], p1)
+                    self.tree.location(edge.points[1], p2)
+                    X[i:i+3] = [p1[0], p2[0], np.nan]
+                    Y[i:i+3] = [p1[1], p2[1], np.nan]
+                    Z[i:i+3] = [p1[2], p2[2], np.nan]
 
                 ax.plot(X, Y, 'b-', zs=Z)
 
@@ -2076,120 +1841,8 @@ cdef class _TreeMesh:
         return self.__ubc_order
 
     def __dealloc__(self):
+        # the views handed out may outlive the tree
+        self._release_arrays()
         del self.tree
         del self.wrapper
-
-cdef inline double _clip01(double x) nogil:
-    return min(1, max(x, 0))
-
-cdef inline double _sctp(double *v0, double *v1, double *v2) nogil:
-    #dim = 3
-    return (v0[0]*(v1[1]*v2[2] - v1[2]*v2[1])
-            - v0[1]*(v1[0]*v2[2] - v1[2]*v2[0])
-            + v0[2]*(v1[0]*v2[1] - v1[1]*v2[0]))
-
-@cython.cdivision(True)
-cdef void _project_point_to_edge(double *p, double *p0, double *p1,
-                                 int dim, double *out) nogil:
-    # dim can equal 2 or 3
-    """Projects a point onto a line segment."""
-    # Projects a point onto a line segment
-
-    cdef double v1=0.0, v2=0.0, t = 0.0
-    cdef int i
-
-    for i in range(dim):
-        v1 += (p[i]-p0[i])*(p1[i]-p0[i])
-        v2 += (p1[i]-p0[i])*(p1[i]-p0[i])
-    t = _clip01(v1/v2)
-    for i in range(dim):
-        out[i] = (1.0-t)*p0[i] + t*p1[i]
-
-@cython.cdivision(True)
-cdef void _project_point_to_triangle(double *p, double *p0, double *p1, double *p2,
-                                    int dim, double *out) nogil:
-    #dim can equal 2 or 3
-    cdef double[3] bary
-    cdef int i
-    _barycentric_triangle(p, p0, p1, p2, bary, dim)
-    if bary[0] < 0:
-        _project_point_to_edge(p, p1, p2, dim, out)
-    elif bary[1] < 0:
-        _project_point_to_edge(p, p0, p2, dim, out)
-    elif bary[2] < 0:
-        _project_point_to_edge(p, p0, p1, dim, out)
-    else:
-        for i in range(dim):
-            out[i] = bary[0]*p0[i] + bary[1]*p1[i] + bary[2]*p2[i]
-
-@cython.cdivision(True)
-cdef void _project_point_to_tetrahedron(double *p, double *p0, double *p1,
-                                       double *p2, double *p3, double *out) nogil:
-    cdef double[4] bary
-
-    _barycentric_tetrahedron(p, p0, p1, p2, p3, bary)
-
-    if bary[0] < 0:
-        _project_point_to_triangle(p, p1, p2, p3, 3, out)
-    elif bary[1] < 0:
-        _project_point_to_triangle(p, p0, p2, p3, 3, out)
-    elif bary[2] < 0:
-        _project_point_to_triangle(p, p0, p1, p3, 3, out)
-    elif bary[3] < 0:
-        _project_point_to_triangle(p, p0, p1, p2, 3, out)
-    else:
-        out[0] = p[0]
-        out[1] = p[1]
-        out[2] = p[2]
-
-
-@cython.cdivision(True)
-cdef void _barycentric_edge(double *p, double *p0, double *p1, double *bary, int dim) nogil:
-    cdef double v1=0.0, v2=0.0
-    cdef int i
-
-    for i in range(dim):
-        v1 += (p[i]-p0[i])*(p1[i]-p0[i])
-        v2 += (p1[i]-p0[i])*(p1[i]-p0[i])
-    bary[1] = v1/v2
-    bary[0] = 1-bary[1]
-
-@cython.cdivision(True)
-cdef void _barycentric_triangle(double *p, double *p0, double *p1, double *p2,
-                            double *bary, int dim) nogil:
-    cdef double d00=0, d01=0, d11=0, d20=0, d21=0
-    cdef int i
-    for i in range(dim):
-        bary[0] = p1[i]-p0[i]
-        bary[1] = p2[i]-p0[i]
-        bary[2] = p[i]-p0[i]
-
-        d00 += bary[0]*bary[0]
-        d01 += bary[0]*bary[1]
-        d11 += bary[1]*bary[1]
-        d20 += bary[2]*bary[0]
-        d21 += bary[2]*bary[1]
-
-    bary[0] = 1.0/(d00*d11 - d01*d01)
-    bary[1] = (d11 * d20 - d01 * d21) * bary[0]
-    bary[2] = (d00 * d21 - d01 * d20) * bary[0]
-    bary[0] = 1.0 - bary[1] - bary[2]
-
-@cython.cdivision(True)
-cdef void _barycentric_tetrahedron(double *p, double *p0, double *p1,
-                               double *p2, double *p3, double *bary) nogil:
-    cdef double[3] vap, vab, vac, vad
-    cdef int i
-    for i in range(3):
-        vap[i] = p[i]-p0[i]
-
-        vab[i] = p1[i]-p0[i] #
-        vac[i] = p2[i]-p0[i] #
-        vad[i] = p3[i]-p0[i] #
-
-    bary[0] = 1.0/_sctp(vab, vac, vad)
-
-    bary[1] = _sctp(vap, vac, vad)*bary[0]
-    bary[2] = _sctp(vap, vad, vab)*bary[0]
-    bary[3] = _sctp(vap, vab, vac)*bary[0]
-    bary[0] = 1.0 - bary[1] - bary[2] - bary[3]
+        del self.batch_wrapper
@@ -0,0 +1,271 @@
+#include <vector>
+#include <algorithm>
+#include <utility>
+#include <cstdio>
+#include "ubc_file.h"
+#include "parallel.h"
+
+// A run of whole lines of a chunk and what was parsed from them
+struct Piece{
+    const char *begin, *end;
+    std::vector<int_t> inds, levels;
+    int_t n_lines;
+    int_t bad_line; // counted from the start of the piece, 0 if none
+};
+
+static bool is_space(char c){
+    return c==' ' || c=='\t' || c=='\r' || c=='\v' || c=='\f';
+}
+
+// Moves at past the line it is on. Returns whether the line had anything
+// but spaces and comments.
+static bool skip_line(const char *&at, const char *end){
+    bool content = false;
+    for(; at<end && *at!='\n'; ++at){
+        if(*at=='!'){
+            while(at<end && *at!='\n')
+                ++at;
+            break;
+        }
+        content = content || !is_space(*at);
+    }
+    if(at<end)
+        ++at;
+    return content;
+}
+
+// Parses the integers on the line at at (up to four are kept in values) and
+// moves at past it. Returns how many there were, or -1 if there was anything
+// else on the line.
+static int parse_line(const char *&at, const char *end, long long values[4]){
+    int n = 0;
+    while(at<end && *at!='\n' && *at!='!'){
+        if(is_space(*at)){
+            ++at;
+            continue;
+        }
+        bool negative = *at=='-';
+        if(*at=='-' || *at=='+')
+            ++at;
+        const char *digits = at;
+        long long value = 0;
+        for(; at<end && *at>='0' && *at<='9' && at-digits<18; ++at)
+            value = 10*value+(*at-'0');
+        if(at==digits || (at<end && !is_space(*at) && *at!='\n' && *at!='!')){
+            skip_line(at, end);
+            return -1;
+        }
+        if(n<4)
+            values[n] = negative? -value : value;
+        ++n;
+    }
+    skip_line(at, end);
+    return n;
+}
+
+// Parses the cells of a piece into location_ind of their centers and levels
+static void parse_piece(Piece& piece, int_t max_level){
+    long long n_cells = (long long) 1<<max_level;
+    piece.inds.clear();
+    piece.levels.clear();
+    piece.n_lines = 0;
+    piece.bad_line = 0;
+    const char *at = piece.begin;
+    while(at<piece.end){
+        long long v[4];
+        int n = parse_line(at, piece.end, v);
+        ++piece.n_lines;
+        if(n==0)
+            continue;
+        long long size = v[3];
+        bool ok = n==4 && size>0 && size<=n_cells && (size&(size-1))==0;
+        for(int_t d=0; d<3 && ok; ++d)
+            ok = v[d]>=1 && v[d]-1+size<=n_cells;
+        if(!ok){
+            piece.bad_line = piece.n_lines;
+            return;
+        }
+        int_t level = max_level;
+        while(((long long) 1<<(max_level-level))<size)
+            --level;
+        piece.inds.push_back(2*(v[0]-1)+size);
+        piece.inds.push_back(2*(v[1]-1)+size);
+        piece.inds.push_back(2*n_cells-(2*(v[2]-1)+size));
+        piece.levels.push_back(level);
+    }
+}
+
+// Splits [begin, end) into up to n runs of whole lines
+static void split_lines(const char *begin, const char *end, std::vector<Piece>& pieces){
+    std::size_t n = pieces.size();
+    const char *at = begin;
+    for(std::size_t i=0; i<n; ++i){
+        pieces[i].begin = at;
+        const char *cut = (i+1==n)? end : begin+(end-begin)*(i+1)/n;
+        if(cut<at)
+            cut = at;
+        while(cut<end && cut[-1]!='\n')
+            ++cut;
+        pieces[i].end = cut;
+        at = cut;
+    }
+}
+
+bool read_ubc_cells(Tree& tree, const char *path, int_t chunk_bytes,
+                    int_t& n_read, int_t& bad_line){
+    n_read = 0;
+    bad_line = 0;
+    if(tree.n_dim!=3)
+        return false;
+    FILE *file = std::fopen(path, "rb");
+    if(file==NULL)
+        return false;
+
+    std::vector<char> buffer;
+    std::vector<Piece> pieces(4*std::max(tree.n_threads, (int_t) 1));
+    std::vector<int_t> inds, levels;
+    int_t header_lines = 4, line = 0;
+    std::size_t kept = 0; // the incomplete last line of the previous chunk
+    bool ok = true, done = false;
+    while(ok && !done){
+        buffer.resize(kept+chunk_bytes);
+        std::size_t n_new = std::fread(&buffer[kept], 1, chunk_bytes, file);
+        if(n_new<(std::size_t) chunk_bytes){
+            if(std::ferror(file)){
+                ok = false;
+                break;
+            }
+            done = true;
+        }
+        const char *begin = &buffer[0];
+        const char *end = begin+kept+n_new;
+        // only whole lines, the rest waits for the next chunk
+        const char *last = end;
+        if(!done){
+            while(last>begin && last[-1]!='\n')
+                --last;
+            if(last==begin){
+                // a line longer than a chunk, read more of it
+                kept += n_new;
+                continue;
+            }
+        }
+        for(; header_lines>0 && begin<last; ++line){
+            if(skip_line(begin, last))
+                --header_lines;
+        }
+
+        split_lines(begin, last, pieces);
+        parallel_for(pieces.size(), tree.n_threads,
+            [&](std::size_t b, std::size_t e){
+                for(std::size_t i=b; i<e; ++i)
+                    parse_piece(pieces[i], tree.max_level);
+            }, 1);
+
+        inds.clear();
+        levels.clear();
+        for(std::size_t i=0; i<pieces.size() && ok; ++i){
+            Piece& piece = pieces[i];
+            if(piece.bad_line){
+                bad_line = line+piece.bad_line;
+                ok = false;
+            }
+            line += piece.n_lines;
+            inds.insert(inds.end(), piece.inds.begin(), piece.inds.end());
+            levels.insert(levels.end(), piece.levels.begin(), piece.levels.end());
+        }
+        if(ok && !levels.empty()){
+            tree.insert_cells(&inds[0], &levels[0], levels.size());
+            n_read += levels.size();
+        }
+
+        kept = end-last;
+        std::copy(last, end, buffer.begin());
+    }
+    std::fclose(file);
+    if(ok)
+        tree.finalize_lists();
+    return ok;
+}
+
+static char *write_int(char *out, int_t value){
+    char digits[24];
+    int n = 0;
+    do{
+        digits[n++] = '0'+value%10;
+        value /= 10;
+    }while(value>0);
+    while(n>0)
+        *out++ = digits[--n];
+    return out;
+}
+
+// The one based corner index of a cell, with z counted down from the top,
+// and its width
+static void ubc_row(Cell *cell, int_t max_level, int_t row[4]){
+    int_t size = (int_t) 1<<(max_level-cell->level);
+    row[0] = (cell->location_ind[0]-size)/2+1;
+    row[1] = (cell->location_ind[1]-size)/2+1;
+    row[2] = ((2<<max_level)-cell->location_ind[2]-size)/2+1;
+    row[3] = size;
+}
+
+bool write_ubc_cells(Tree& tree, const char *path, const char *header,
+                     int_t chunk_bytes){
+    int_t max_level = tree.max_level;
+    int_t n = tree.cells.size();
+    std::vector<std::pair<unsigned long long, int_t> > order(n);
+    parallel_for(n, tree.n_threads,
+        [&](std::size_t begin, std::size_t end){
+            for(std::size_t i=begin; i<end; ++i){
+                int_t row[4];
+                ubc_row(tree.cells[i], max_level, row);
+                unsigned long long key = ((unsigned long long) row[2]<<42)
+                                         | ((unsigned long long) row[1]<<21) | row[0];
+                order[i] = std::make_pair(key, (int_t) i);
+            }
+        });
+    std::sort(order.begin(), order.end());
+
+    FILE *file = std::fopen(path, "wb");
+    if(file==NULL)
+        return false;
+    bool ok = std::fputs(header, file)>=0;
+
+    // each row is at most 4 numbers of 20 digits and their separators
+    const int_t row_bytes = 84;
+    int_t chunk_rows = std::max(chunk_bytes/row_bytes, (int_t) 1);
+    std::vector<std::vector<char> > texts(4*std::max(tree.n_threads, (int_t) 1));
+    int_t n_pieces = texts.size();
+    for(int_t start=0; start<n && ok; start+=chunk_rows){
+        int_t stop = std::min(start+chunk_rows, n);
+        parallel_for(n_pieces, tree.n_threads,
+            [&](std::size_t b, std::size_t e){
+                for(std::size_t p=b; p<e; ++p){
+                    int_t first = start+(stop-start)*p/n_pieces;
+                    int_t last = start+(stop-start)*(p+1)/n_pieces;
+                    std::vector<char>& text = texts[p];
+                    text.resize((last-first)*row_bytes);
+                    char *out = text.empty()? NULL : &text[0];
+                    char *at = out;
+                    for(int_t i=first; i<last; ++i){
+                        int_t row[4];
+                        ubc_row(tree.cells[order[i].second], max_level, row);
+                        for(int_t j=0; j<4; ++j){
+                            at = write_int(at, row[j]);
+                            *at++ = (j<3)? ' ' : '\n';
+                        }
+                    }
+                    text.resize(at-out);
+                }
+            }, 1);
+        for(int_t p=0; p<n_pieces && ok; ++p){
+            std::vector<char>& text = texts[p];
+            if(!text.empty())
+                ok = std::fwrite(&text[0], 1, text.size(), file)==text.size();
+        }
+    }
+    if(std::fclose(file)!=0)
+        ok = false;
+    return ok;
+}
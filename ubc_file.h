@@ -0,0 +1,28 @@
+#ifndef __UBC_FILE_H
+#define __UBC_FILE_H
+
+#include "tree.h"
+
+// UBC octree mesh files. After a four line header (cells of the underlying
+// mesh, top south west corner, smallest cell size, number of cells) there is
+// a line "ix iy iz size" per cell: the one based index of the cell's top
+// south west corner, counting z down from the top, and its width, all in
+// cells of the finest level. Anything after a '!' is a comment.
+//
+// Both functions work through the file chunk_bytes at a time, so besides the
+// tree they only need memory for one chunk.
+
+// Reads the cells of a UBC file into tree, which must be 3D with its level
+// and grid set from the header, then finalizes the lists. Lines are parsed in
+// parallel. n_read gets the number of cells read. Returns false if the file
+// could not be read or a line is not a cell of the tree, in which case
+// bad_line gets its (one based) number, or 0 for a read error.
+bool read_ubc_cells(Tree& tree, const char *path, int_t chunk_bytes,
+                    int_t& n_read, int_t& bad_line);
+
+// Writes header (as is) followed by the cells of the tree in UBC order:
+// sorted by iz, then iy, then ix. Returns false if the file could not be
+// written.
+bool write_ubc_cells(Tree& tree, const char *path, const char *header,
+                     int_t chunk_bytes);
+#endif